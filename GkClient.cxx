@@ -954,6 +954,7 @@ H46024Socket::H46024Socket(GkClient * client, bool rtp, const H225_CallIdentifie
 	m_rtp(rtp), m_state(e_notRequired),	m_remPort(0), m_detPort(0), m_pendPort(0), m_altPort(0),
 	m_altMuxID(0), m_probes(0), SSRC(0), m_keepseqno(100)
 {
+	m_useFlowCache = false;	// probes must always reach OnReceiveData()
 }
 
 PBoolean H46024Socket::ReceivedProbePacket(const RTP_ControlFrame & frame, bool & probe, bool & success)
@@ -105,6 +105,12 @@ protected:
 	State m_state;
 };
 
+/// a status port filter, compiled when it is added
+struct StatusFilter {
+	PString m_regex;
+	const RegexCache::Entry * m_compiled;	// NULL if the regex cache is full
+};
+
 /** Class that manages a single status interface client connection.
  */
 class StatusClient : public TelnetSocket, public USocket {
@@ -251,10 +257,12 @@ protected:
 	*/
 	void CommandError(const PString & msg);
 
-	// Adds regular expression filter
-	void AddFilter(
+	/** Adds regular expression filter, compiled once here
+	    @return false if the regex is invalid
+	*/
+	bool AddFilter(
 	// filter vector
-	std::vector<PString> & regexFilters,
+	std::vector<StatusFilter> & regexFilters,
 	// Regex to be matched against messages
 	const PString & regex
 	);
@@ -264,7 +272,7 @@ protected:
 	*/
     void RemoveFilter(
 	// filter vector
-	std::vector<PString> & regexFilters,
+	std::vector<StatusFilter> & regexFilters,
 	// Index of filter to be removed
 	unsigned int index
 	);
@@ -278,7 +286,7 @@ protected:
     // Print a list of all filters in the specified vector
     void PrintFilters(
 	// filter vector
-	std::vector<PString> & regexFilters
+	std::vector<StatusFilter> & regexFilters
 	);
 
     // Checks whether the given string is to be include
@@ -290,7 +298,7 @@ protected:
     // Match the given string against filters held by the specified vector
     bool MatchFilter(
 	// filter vector
-	const std::vector<PString> & regexFilters,
+	const std::vector<StatusFilter> & regexFilters,
 	// String to be matched
 	const PString & msg
 	) const;
@@ -317,8 +325,8 @@ protected:
 	bool m_deleted;
 
 	// vectors of regular expressions to be matched against Status messages
-	std::vector<PString> m_excludeFilterRegex;
-	std::vector<PString> m_includeFilterRegex;
+	std::vector<StatusFilter> m_excludeFilterRegex;
+	std::vector<StatusFilter> m_includeFilterRegex;
 
 	// this flag indicates whether filtering is active or not
 	bool m_isFilteringActive;
@@ -1228,6 +1236,10 @@ void GkStatus::OnStart()
 	m_commands["maintenance"] = e_MaintenanceMode;
 	m_commands["getlicensestatus"] = e_GetLicenseStatus;
 	m_commands["getserverid"] = e_GetServerID;
+	m_commands["printmediaquality"] = e_PrintMediaQuality;
+	m_commands["pmq"] = e_PrintMediaQuality;
+	m_commands["capturemedia"] = e_CaptureMedia;
+	m_commands["capturesignaling"] = e_CaptureSignaling;
 }
 
 void GkStatus::ReadSocket(IPSocket * clientSocket)
@@ -2159,9 +2171,11 @@ void StatusClient::ExecCommand(
 
 	case GkStatus::e_AddIncludeFilter:
 	    if (args.GetSize() == 2) {
-			AddFilter(m_includeFilterRegex, args[1]);
-			PString msg("IncludeFilter added\r\n");
-			WriteData(msg, msg.GetLength());
+			if (AddFilter(m_includeFilterRegex, args[1])) {
+				PString msg("IncludeFilter added\r\n");
+				WriteData(msg, msg.GetLength());
+			} else
+				CommandError("Invalid regex: " + args[1]);
 	    } else
 			CommandError("Syntax Error: addincludefilter REGEX");
 	    break;
@@ -2175,9 +2189,11 @@ void StatusClient::ExecCommand(
 	    break;
 	case GkStatus::e_AddExcludeFilter:
 	    if (args.GetSize() == 2) {
-			AddFilter(m_excludeFilterRegex, args[1]);
-			PString msg("ExcludeFilter added\r\n");
-			WriteData(msg, msg.GetLength());
+			if (AddFilter(m_excludeFilterRegex, args[1])) {
+				PString msg("ExcludeFilter added\r\n");
+				WriteData(msg, msg.GetLength());
+			} else
+				CommandError("Invalid regex: " + args[1]);
 	    } else
 			CommandError("Syntax Error: addexcludefilter REGEX");
 	    break;
@@ -2290,6 +2306,30 @@ void StatusClient::ExecCommand(
 		WriteString(Toolkit::Instance()->GetServerID() + "\r\n");
 		WriteString(";\r\n");
 		break;
+	case GkStatus::e_PrintMediaQuality:
+		// print loss, jitter and MOS for all calls
+		SoftPBX::PrintMediaQuality(this);
+		break;
+	case GkStatus::e_CaptureMedia:
+		if (args.GetSize() == 1)
+			SoftPBX::PrintCaptureStatus(this);
+		else if (args.GetSize() == 2 && PCaselessString(args[1]) == "Stop") {
+			SoftPBX::StopCapture();
+			SoftPBX::PrintCaptureStatus(this);
+		} else if (args.GetSize() <= 3 && SoftPBX::CaptureMedia(args[1], (args.GetSize() == 3) ? args[2] : PString::Empty()))
+			SoftPBX::PrintCaptureStatus(this);
+		else
+			CommandError("Syntax Error: CaptureMedia [All | Call <number> | Alias <alias> | IP <ip/net> | Stop]");
+		break;
+	case GkStatus::e_CaptureSignaling:
+		if (args.GetSize() == 1)
+			SoftPBX::PrintCaptureStatus(this);
+		else if (args.GetSize() == 2 && (PCaselessString(args[1]) == "On" || PCaselessString(args[1]) == "Off")) {
+			SoftPBX::CaptureSignaling(PCaselessString(args[1]) == "On");
+			SoftPBX::PrintCaptureStatus(this);
+		} else
+			CommandError("Syntax Error: CaptureSignaling [On | Off]");
+		break;
 	default:
 		// command not recognized
 		CommandError("Error: Unknown command '" + cmd + "'");
@@ -2299,19 +2339,24 @@ void StatusClient::ExecCommand(
 	--m_numExecutingCommands;
 }
 
-void StatusClient::AddFilter(
+bool StatusClient::AddFilter(
     // vector of filters
-    std::vector<PString> & regexFilters,
+    std::vector<StatusFilter> & regexFilters,
     // Regular expression
     const PString & regex
     )
 {
-    regexFilters.push_back(regex);
+    StatusFilter filter;
+    if (!Toolkit::CompileRegex(regex, &filter.m_compiled))
+		return false;
+    filter.m_regex = regex;
+    regexFilters.push_back(filter);
+    return true;
 }
 
 void StatusClient::RemoveFilter(
     // vector of filters
-    std::vector<PString> & regexFilters,
+    std::vector<StatusFilter> & regexFilters,
     // Index of filter to be removed
     unsigned int index
     )
@@ -2335,15 +2380,15 @@ bool StatusClient::IsExcludeMessage(
 
 bool StatusClient::MatchFilter(
     // filter vector
-    const std::vector<PString>& regexFilters,
+    const std::vector<StatusFilter>& regexFilters,
     // String to be matched against filters
     const PString & msg
     ) const
 {
-    std::vector<PString>::const_iterator it = regexFilters.begin();
+    std::vector<StatusFilter>::const_iterator it = regexFilters.begin();
 
     for(; it != regexFilters.end(); ++it) {
-		if (Toolkit::MatchRegex(msg, *it))
+		if (it->m_compiled ? it->m_compiled->Match(msg) : Toolkit::MatchRegex(msg, it->m_regex))
 			return true;
     }
 
@@ -2360,7 +2405,7 @@ bool StatusClient::IsIncludeMessage(
 
 void StatusClient::PrintFilters(
     // filter vector
-    std::vector<PString> & regexFilters
+    std::vector<StatusFilter> & regexFilters
     )
 {
 	PString msg;
@@ -2374,7 +2419,7 @@ void StatusClient::PrintFilters(
     msg = "Filter List:\r\n";
     WriteData(msg, msg.GetLength());
     for(unsigned int index = 0; index < regexFilters.size(); index++) {
-		msg = PString(index) + ") " + regexFilters[index] + "\r\n";
+		msg = PString(index) + ") " + regexFilters[index].m_regex + "\r\n";
 		WriteData(msg, msg.GetLength());
     }
 
@@ -31,6 +31,7 @@
 #define STATUS_TRACE_LEVEL_CDR 1
 #define STATUS_TRACE_LEVEL_RAS 2
 #define STATUS_TRACE_LEVEL_ROUTEREQ 1
+#define STATUS_TRACE_LEVEL_MEDIAQUALITY 2
 
 class TelnetSocket;
 class StatusClient;
@@ -171,6 +172,9 @@ public:
 		e_MaintenanceMode,             /// switch in or out of maintenance mode
 		e_GetLicenseStatus,            /// get license status
 		e_GetServerID,                 /// get server ID
+		e_PrintMediaQuality,           /// print media quality measured by the RTP relay
+		e_CaptureMedia,                /// capture relayed media of selected calls into pcap files
+		e_CaptureSignaling,            /// capture RAS, Q.931 and H.245 messages into pcapng files
 		e_numCommands
 		/// Number of different strings
 	};
@@ -28,6 +28,7 @@
 #include "cisco.h"
 #include "h323util.h"
 #include "Neighbor.h"
+#include "dnsresolver.h"
 
 #ifdef HAS_H460
 	#include <h460/h4601.h>
@@ -244,19 +245,24 @@ public:
 
 private:
 	struct Request {
-		Request(Neighbor *n) : m_neighbor(n), m_reply(NULL), m_count(1) { }
+		Request(Neighbor *n) : m_neighbor(n), m_reply(NULL), m_count(1), m_lrq(n->GetLRQStatistics()) { }
 
 		Neighbor * m_neighbor;
 		RasMsg * m_reply;
 		int m_count;
+		LRQMeasurement m_lrq;
 	};
 
 	typedef multimap<PrefixInfo, Request> Queue;
 
+	// how long to wait for the neighbors that could still give a better answer
+	int GetRoundTimeout();
+
 	Queue m_requests;
 	PMutex m_rmutex;
 	const LRQFunctor & m_sendto;
 	RasMsg * m_result;
+	int m_neighborTimeout;
 	PString m_neighbor_used;
 	bool m_h46018_client, m_h46018_server;
 	bool m_useTLS;
@@ -553,6 +559,7 @@ bool Neighbor::SetProfile(const PString & id, const PString & type, bool reload)
     m_loopDetection = config->GetBoolean(LRQFeaturesSection, "LoopDetection", false);
 
 	SetForwardedInfo(section);
+	SetAdaptiveTimeout();
 
 	PString info = " of type " + type;
 	if (!sprefix)
@@ -650,6 +657,7 @@ bool Neighbor::SetProfile(const PString & name, const H323TransportAddress & add
 	m_sendPrefixes["*"] = 1;
 
 	SetForwardedInfo(LRQFeaturesSection);
+	SetAdaptiveTimeout();
 
 	return true;
 }
@@ -660,6 +668,10 @@ PrefixInfo Neighbor::GetPrefixInfo(const H225_ArrayOf_AliasAddress & aliases, H2
         PTRACE(3, "NB\tSkipping disabled neighbor " << GetId());
         return nomatch;
     }
+    if (m_lrqStats.IsLossy()) {
+        PTRACE(3, "NB\tSkipping neighbor " << GetId() << " with lost LRQs: " << m_lrqStats.AsString());
+        return nomatch;
+    }
 
 	Prefixes::iterator iter, biter = m_sendPrefixes.begin(), eiter = m_sendPrefixes.end();
 	for (PINDEX i = 0; i < aliases.GetSize(); ++i) {
@@ -708,6 +720,10 @@ PrefixInfo Neighbor::GetIPInfo(const H225_TransportAddress & ip, H225_ArrayOf_Al
         PTRACE(3, "NB\tSkipping disabled neighbor " << GetId());
         return nomatch;
     }
+    if (m_lrqStats.IsLossy()) {
+        PTRACE(3, "NB\tSkipping neighbor " << GetId() << " with lost LRQs: " << m_lrqStats.AsString());
+        return nomatch;
+    }
 
 	PStringArray sendNet(m_sendIPs.Tokenise(","));
 	for (PINDEX i = 0; i < sendNet.GetSize(); ++i) {
@@ -902,6 +918,15 @@ bool Neighbor::IsAcceptable(RasMsg *ras) const
 	return false;
 }
 
+void Neighbor::SetAdaptiveTimeout()
+{
+	PConfig * config = GkConfig();
+	m_lrqStats.SetLimits(config->GetBoolean(LRQFeaturesSection, "AdaptiveNeighborTimeout", false),
+		config->GetInteger(LRQFeaturesSection, "MinNeighborTimeout", 1) * 100,
+		config->GetInteger(LRQFeaturesSection, "SkipLossyNeighbor", 3),
+		config->GetInteger(LRQFeaturesSection, "LossyNeighborHoldoff", 30));
+}
+
 void Neighbor::SetForwardedInfo(const PString & section)
 {
 	PConfig * config = GkConfig();
@@ -940,6 +965,7 @@ bool OldGK::SetProfile(const PString & id, const PString & args)
 		return false;
 
 	SetForwardedInfo(LRQFeaturesSection);
+	SetAdaptiveTimeout();
 	if (Toolkit::AsBool(GkConfig()->GetString(LRQFeaturesSection, "AlwaysForwardLRQ", "0")))
 		m_forwardto = 1;
 
@@ -1415,7 +1441,7 @@ bool GlonetGK::BuildLRQ(H225_LocationRequest & lrq, WORD crv)
 }
 
 
-LRQRequester::LRQRequester(const LRQFunctor & fun) : m_sendto(fun), m_result(NULL), m_h46018_client(false), m_h46018_server(false), m_useTLS(false)
+LRQRequester::LRQRequester(const LRQFunctor & fun) : m_sendto(fun), m_result(NULL), m_neighborTimeout(0), m_h46018_client(false), m_h46018_server(false), m_useTLS(false)
 {
 	AddFilter(H225_RasMessage::e_locationConfirm);
 	AddFilter(H225_RasMessage::e_locationReject);
@@ -1430,12 +1456,13 @@ LRQRequester::~LRQRequester()
 bool LRQRequester::Send(NeighborList::List & neighbors, Neighbor * requester)
 {
 	PWaitAndSignal lock(m_rmutex);
+	m_sentTime = PTime();
 	NeighborList::List::iterator iter = neighbors.begin();
 	while (iter != neighbors.end()) {
 		Neighbor *nb = *iter++;
 		if (nb != requester) {
 			if (PrefixInfo info = m_sendto(nb, m_seqNum)) {
-				m_requests.insert(make_pair(info, nb));
+				m_requests.insert(make_pair(info, nb))->second.m_lrq.OnSent();
 			}
 		}
 	}
@@ -1450,9 +1477,10 @@ bool LRQRequester::Send(NeighborList::List & neighbors, Neighbor * requester)
 bool LRQRequester::Send(Neighbor * nb)
 {
 	PWaitAndSignal lock(m_rmutex);
+	m_sentTime = PTime();
 
 	if (PrefixInfo info = m_sendto(nb, m_seqNum))
-		m_requests.insert(make_pair(info, nb));
+		m_requests.insert(make_pair(info, nb))->second.m_lrq.OnSent();
 
 	if (m_requests.empty()) {
 		PTRACE(2, "SRV\tError sending LRQ to " << nb->GetIP());
@@ -1467,7 +1495,14 @@ bool LRQRequester::Send(Neighbor * nb)
 
 H225_LocationConfirm * LRQRequester::WaitForDestination(int timeout)
 {
-	while (WaitForResponse(timeout)) {
+	{
+		PWaitAndSignal lock(m_rmutex);
+		m_neighborTimeout = timeout;
+		for (Queue::iterator iter = m_requests.begin(); iter != m_requests.end(); ++iter)
+			iter->second.m_lrq.SetTimeout(timeout);
+	}
+
+	while (WaitForResponse(GetRoundTimeout())) {
 		if (m_result) {
 			break;
 		} else {
@@ -1478,6 +1513,12 @@ H225_LocationConfirm * LRQRequester::WaitForDestination(int timeout)
 	return m_result ? &(H225_LocationConfirm &)(*m_result)->m_recvRAS : NULL;
 }
 
+int LRQRequester::GetRoundTimeout()
+{
+	PWaitAndSignal lock(m_rmutex);
+	return GetLRQRoundTimeout(m_requests.begin(), m_requests.end());
+}
+
 bool LRQRequester::IsH46024Supported() const
 {
 	if (!m_result)
@@ -1576,11 +1617,14 @@ void LRQRequester::Process(RasMsg * ras)
 	PWaitAndSignal lock(m_rmutex);
 	for (Queue::iterator iter = m_requests.begin(); iter != m_requests.end(); ++iter) {
 		Request & req = iter->second;
-		if (req.m_neighbor->CheckReply(ras) ||
+		const bool fromNeighbor = req.m_neighbor->CheckReply(ras);
+		if (fromNeighbor ||
 			Toolkit::AsBool(GkConfig()->GetString(LRQFeaturesSection, "AcceptNonNeighborLCF", "0"))) {
 			PTRACE(5, "NB\tReceived " << ras->GetTagName() << " message matched"
 				<< " pending LRQ for neighbor " << req.m_neighbor->GetId()
 				<< ':' << req.m_neighbor->GetIP() );
+			if (fromNeighbor)
+				req.m_lrq.OnAnswer();
 			unsigned tag = ras->GetTag();
 			if (tag == H225_RasMessage::e_requestInProgress) {
 				// TODO: honor the delay specified in the RIP ?
@@ -1599,6 +1643,9 @@ void LRQRequester::Process(RasMsg * ras)
 							req.m_count += ttl[1].AsInteger();
 					}
 				}
+				// the neighbor asked to wait longer
+				const H225_RequestInProgress & rip = (*ras)->m_recvRAS;
+				req.m_lrq.ExtendTimeout(rip.m_delay);
 				RasRequester::Process(ras);
 			} else if (tag == H225_RasMessage::e_locationConfirm) {
 				--req.m_count;
@@ -1618,8 +1665,9 @@ void LRQRequester::Process(RasMsg * ras)
 					H225_LocationConfirm & lcf = (*ras)->m_recvRAS;
 					lcf.m_rasAddress = SocketToH225TransportAddr(req.m_neighbor->GetIP(), req.m_neighbor->GetPort());
 				}
-				if (m_result)
-					m_sync.Signal();
+				// also wake up for a lower priority LCF, from now on
+				// only the neighbors that could beat it are waited for
+				m_sync.Signal();
 			} else { // should be H225_RasMessage::e_locationReject
 				--req.m_count;
 				delete ras;
@@ -1650,6 +1698,12 @@ bool LRQRequester::OnTimeout()
 	if (m_requests.empty())
 		return false;
 	Queue::iterator iter, biter = m_requests.begin(), eiter = m_requests.end();
+	for (iter = biter; iter != eiter; ++iter) {
+		Request & req = iter->second;
+		if (req.m_lrq.CheckLoss())
+			PTRACE(4, "NB\tNo answer from neighbor " << req.m_neighbor->GetId() << " within " << req.m_lrq.GetTimeout()
+				<< " ms: " << req.m_neighbor->GetLRQStatistics().AsString());
+	}
 	for (iter = biter; iter != eiter; ++iter) {
 		m_result = iter->second.m_reply;
 		if (m_result)
@@ -1661,6 +1715,9 @@ bool LRQRequester::OnTimeout()
 	for (iter = biter; iter != eiter; ++iter) {
 		m_sendto(iter->second.m_neighbor, m_seqNum);
 		iter->second.m_count = 1; // reset count
+		// the answers to the same sequence number can't be measured anymore
+		iter->second.m_lrq.OnSent();
+		iter->second.m_lrq.SetTimeout(m_neighborTimeout);
 	}
 	m_sentTime = PTime();
 	PTRACE(2, "NB\t" << m_requests.size() << " LRQ(s) re-sent");
@@ -2288,7 +2345,7 @@ Route * SRVPolicy::LSLookup(RoutingRequest & request, H225_ArrayOf_AliasAddress
 
 		// LS Record lookup
 		PStringList ls;
-		if (PDNS::LookupSRV(number, schema, ls)) {
+		if (DNSResolver::Instance()->LookupSRV(number, schema, ls)) {
 			for (PINDEX i = 0; i < ls.GetSize(); i++) {
 				PINDEX at = ls[i].Find('@');
 				PString ipaddr = ls[i].Mid(at + 1);
@@ -2424,7 +2481,7 @@ Route * SRVPolicy::CSLookup(H225_ArrayOf_AliasAddress & aliases, bool localonly,
 
 		// CS SRV Lookup
 		PStringList cs;
-		if (PDNS::LookupSRV(number, schema, cs)) {
+		if (DNSResolver::Instance()->LookupSRV(number, schema, cs)) {
 			for (PINDEX j = 0; j < cs.GetSize(); j++) {
 				H225_TransportAddress dest;
 				PINDEX in = cs[j].Find('@');
@@ -2610,7 +2667,7 @@ bool RDSPolicy::FindByAliases(RoutingRequest & request, H225_ArrayOf_AliasAddres
 
 		// LS Record lookup
 		PStringList ls;
-		if (PDNS::RDSLookup(number, "H323+D2U", ls)) {
+		if (DNSResolver::Instance()->RDSLookup(number, "H323+D2U", ls)) {
 			for (PINDEX i = 0; i<ls.GetSize(); i++) {
 				PINDEX pos = ls[i].Find('@');
 				PString ipaddr = ls[i].Mid(pos + 1);
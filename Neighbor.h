@@ -19,6 +19,7 @@
 #include <map>
 #include "Routing.h"
 #include "gktimer.h"
+#include "lrqstats.h"
 
 
 class H225_RasMessage;
@@ -123,8 +124,12 @@ public:
 	virtual void SetDisabled(bool val) { m_disabled = val; }
 	virtual bool IsDisabled() const { return m_disabled; }
 
+	// round trip times and losses of the LRQs sent to this neighbor
+	LRQStatistics & GetLRQStatistics() { return m_lrqStats; }
+
 protected:
 	void SetForwardedInfo(const PString &);
+	void SetAdaptiveTimeout();
 
 	typedef std::map<PString, int, pstr_prefix_lesser> Prefixes;
 
@@ -153,6 +158,7 @@ protected:
 	bool m_useTLS;
 	bool m_disabled; // is this neighbor disabled (eg. because of no responses)
 	bool m_loopDetection;
+	LRQStatistics m_lrqStats;
 };
 
 class NeighborList {
@@ -33,6 +33,8 @@
 #include "sigmsg.h"
 #include "ProxyChannel.h"
 #include "GkStatus.h"
+#include "cfgsnapshot.h"
+#include "capture.h"
 #include <queue>
 #include <math.h> // needed for ceil() on Solaris 11, OpenBSD
 #include <algorithm>
@@ -64,6 +66,7 @@
 	#include "h235/h2351.h"
 	#include "h235/h2356.h"
 	#include "h235/h235crypto.h"
+	#include <openssl/rand.h>
 #endif
 
 #ifdef _WIN32
@@ -135,9 +138,12 @@ const WORD RTP_BASE_HEADER_LEN = 12;
 
 enum RTPSessionTypes { Unknown = 0, Audio, Video, Presentation, Data };
 
-// RTCP functions used in UDPProxySocket and H46019Session
-void ParseRTCP(const callptr & call, WORD sessionID, PIPSocket::Address fromIP, BYTE * wbuffer, WORD buflen);
-void BuildReceiverReport(const callptr & call, WORD sessionID, const RTP_ControlFrame & frame, PINDEX offset, bool dst);
+// RTCP functions used by the RTCPStatsAggregator
+// fromStats: statistics of the side that sent the packet, toStats: of the other side (both may be NULL)
+void ParseRTCP(const callptr & call, WORD sessionID, bool fromDST, BYTE * wbuffer, WORD buflen,
+	PInt64 arrival, RTCPDirectionStats * fromStats, const RTCPDirectionStats * toStats);
+void BuildReceiverReport(const callptr & call, WORD sessionID, const RTP_ControlFrame & frame, PINDEX offset, bool dst,
+	PInt64 arrival, RTCPDirectionStats * fromStats, const RTCPDirectionStats * toStats);
 
 H245_H2250LogicalChannelParameters *GetLogicalChannelParameters(H245_OpenLogicalChannel & olc, bool & isReverseLC);
 
@@ -474,9 +480,112 @@ bool IsOldH263(const H245_DataType & type)
 }
 #endif // HAS_H235_MEDIA
 
+ConfigSnapshot<RoutedModeConfig> RoutedConfigSnapshot;
+ConfigSnapshot<ProxyModeConfig> ProxyConfigSnapshot;
+
 } // end of anonymous namespace
 
 
+RoutedModeConfig::RoutedModeConfig()
+	: m_h46018KeepAliveInterval(19), m_gnugkTcpKeepAliveInterval(19), m_enableGnuGkTcpKeepAlive(false),
+	m_disableGnuGkH245TcpKeepAlive(false), m_tcpKeepAlive(-1), m_setupTimeout(DEFAULT_SETUP_TIMEOUT),
+	m_abortOnInvalidTPKT(true), m_disableFastStart(false), m_disableH245Tunneling(false),
+	m_h245TunnelingTranslation(false), m_useProvisionalRespToH245Tunneling(false), m_generateCallProceeding(false),
+	m_enableH46017(false), m_enableH245Multiplexing(false), m_h245MultiplexPort(1722),
+	m_callSignalPort(GK_DEF_CALL_SIGNAL_PORT), m_redirectCallsToGkIP(false), m_alwaysRewriteSourceCallSignalAddress(true),
+	m_removeH460Call(false), m_supportNATedEndpoints(false), m_supportCallingNATedEndpoints(true),
+	m_treatUnregisteredNAT(false), m_translateSorensonSourceInfo(false), m_removeSorensonSourceInfo(false),
+	m_showForwarderNumber(false), m_forwardOnFacility(false), m_rerouteOnFacility(false), m_translateFacility(false),
+	m_filterEmptyFacility(false), m_h225DiffServ(0), m_h245DiffServ(0), m_filterVideoFastUpdatePicture(0)
+{
+}
+
+void RoutedModeConfig::Load(PConfig * cfg)
+{
+	m_h46018KeepAliveInterval = cfg->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19);
+	m_gnugkTcpKeepAliveInterval = cfg->GetInteger(RoutedSec, "GnuGkTcpKeepAliveInterval", 19);
+	m_enableGnuGkTcpKeepAlive = cfg->GetBoolean(RoutedSec, "EnableGnuGkTcpKeepAlive", false);
+	m_disableGnuGkH245TcpKeepAlive = cfg->GetBoolean(RoutedSec, "DisableGnuGkH245TcpKeepAlive", false);
+	m_tcpKeepAlive = cfg->HasKey(RoutedSec, "TcpKeepAlive") ? (Toolkit::AsBool(cfg->GetString(RoutedSec, "TcpKeepAlive", "0")) ? 1 : 0) : -1;
+	m_setupTimeout = PMAX(cfg->GetInteger(RoutedSec, "SetupTimeout", DEFAULT_SETUP_TIMEOUT), (long)1000);
+	m_abortOnInvalidTPKT = cfg->GetBoolean(RoutedSec, "AbortOnInvalidTPKT", true);
+	m_disableFastStart = cfg->GetBoolean(RoutedSec, "DisableFastStart", false);
+	m_disableH245Tunneling = Toolkit::AsBool(cfg->GetString(RoutedSec, "DisableH245Tunneling", "0"));
+	m_h245TunnelingTranslation = cfg->GetBoolean(RoutedSec, "H245TunnelingTranslation", false);
+	m_useProvisionalRespToH245Tunneling = cfg->GetBoolean(RoutedSec, "UseProvisionalRespToH245Tunneling", false);
+	m_generateCallProceeding = Toolkit::AsBool(cfg->GetString(RoutedSec, "GenerateCallProceeding", "0"));
+	m_enableH46017 = cfg->GetBoolean(RoutedSec, "EnableH46017", false);
+	m_enableH245Multiplexing = cfg->GetBoolean(RoutedSec, "EnableH245Multiplexing", false);
+	m_h245MultiplexPort = (WORD)cfg->GetInteger(RoutedSec, "H245MultiplexPort", 1722);
+	m_callSignalPort = (WORD)cfg->GetInteger(RoutedSec, "CallSignalPort", GK_DEF_CALL_SIGNAL_PORT);
+	m_redirectCallsToGkIP = cfg->GetBoolean(RoutedSec, "RedirectCallsToGkIP", false);
+	m_alwaysRewriteSourceCallSignalAddress = cfg->GetBoolean(RoutedSec, "AlwaysRewriteSourceCallSignalAddress", true);
+	m_removeH460Call = cfg->GetBoolean(RoutedSec, "RemoveH460Call", false);
+	m_supportNATedEndpoints = Toolkit::AsBool(cfg->GetString(RoutedSec, "SupportNATedEndpoints", "0"));
+	m_supportCallingNATedEndpoints = Toolkit::AsBool(cfg->GetString(RoutedSec, "SupportCallingNATedEndpoints", "1"));
+	m_treatUnregisteredNAT = Toolkit::AsBool(cfg->GetString(RoutedSec, "TreatUnregisteredNAT", "0"));
+	m_translateSorensonSourceInfo = cfg->GetBoolean(RoutedSec, "TranslateSorensonSourceInfo", false);
+	m_removeSorensonSourceInfo = Toolkit::AsBool(cfg->GetString(RoutedSec, "RemoveSorensonSourceInfo", "0"));
+	m_showForwarderNumber = Toolkit::AsBool(cfg->GetString(RoutedSec, "ShowForwarderNumber", "0"));
+	m_forwardOnFacility = cfg->GetBoolean(RoutedSec, "ForwardOnFacility", false);
+	m_rerouteOnFacility = cfg->GetBoolean(RoutedSec, "RerouteOnFacility", false);
+	m_translateFacility = cfg->GetBoolean(RoutedSec, "TranslateFacility", false);
+	m_filterEmptyFacility = cfg->GetBoolean(RoutedSec, "FilterEmptyFacility", false);
+	m_h225DiffServ = cfg->GetInteger(RoutedSec, "H225DiffServ", 0);
+	m_h245DiffServ = cfg->GetInteger(RoutedSec, "H245DiffServ", 0);
+	m_filterVideoFastUpdatePicture = cfg->GetInteger(RoutedSec, "FilterVideoFastUpdatePicture", 0);
+	m_screenDisplayIE = cfg->GetString(RoutedSec, "ScreenDisplayIE", "");
+	m_appendToDisplayIE = cfg->GetString(RoutedSec, "AppendToDisplayIE", "");
+	// the snapshot may be read concurrently from many threads, don't share string buffers with the PConfig
+	m_screenDisplayIE.MakeUnique();
+	m_appendToDisplayIE.MakeUnique();
+}
+
+ProxyModeConfig::ProxyModeConfig()
+	: m_proxyAlways(false), m_proxyForNAT(false), m_proxyForSameNAT(true), m_rtpMultiplexing(false),
+	m_rtpMultiplexPort(GK_DEF_MULTIPLEX_RTP_PORT), m_rtcpMultiplexPort(GK_DEF_MULTIPLEX_RTCP_PORT),
+	m_rtpMultiplexReaders(1), m_enableRTCPStats(false), m_rtcpStatsSampling(1), m_enableMediaQuality(false),
+	m_mediaQualityFeedInterval(0), m_rtpDiffServ(4)
+{
+}
+
+void ProxyModeConfig::Load(PConfig * cfg)
+{
+	m_proxyAlways = cfg->GetBoolean(ProxySection, "ProxyAlways", false);
+	m_proxyForNAT = cfg->GetBoolean(ProxySection, "ProxyForNAT", false);
+	m_proxyForSameNAT = Toolkit::AsBool(cfg->GetString(ProxySection, "ProxyForSameNAT", "1"));
+	m_rtpMultiplexing = Toolkit::AsBool(cfg->GetString(ProxySection, "RTPMultiplexing", "0"));
+	m_rtpMultiplexPort = (WORD)cfg->GetInteger(ProxySection, "RTPMultiplexPort", GK_DEF_MULTIPLEX_RTP_PORT);
+	m_rtcpMultiplexPort = (WORD)cfg->GetInteger(ProxySection, "RTCPMultiplexPort", GK_DEF_MULTIPLEX_RTCP_PORT);
+	const long readers = cfg->GetInteger(ProxySection, "RTPMultiplexReaders", 1);
+	m_rtpMultiplexReaders = (readers < 1) ? 1 : ((readers > 64) ? 64 : (unsigned)readers);
+	m_enableRTCPStats = cfg->GetBoolean(ProxySection, "EnableRTCPStats", false);
+	const long sampling = cfg->GetInteger(ProxySection, "RTCPStatsSampling", 1);
+	m_rtcpStatsSampling = (sampling < 1) ? 1 : (unsigned)sampling;
+	m_enableMediaQuality = cfg->GetBoolean(ProxySection, "EnableMediaQuality", false);
+	const long feedInterval = cfg->GetInteger(ProxySection, "MediaQualityFeedInterval", 0);
+	m_mediaQualityFeedInterval = (feedInterval < 0) ? 0 : (unsigned)feedInterval;
+	m_rtpDiffServ = cfg->GetInteger(ProxySection, "RTPDiffServ", 4);	// default: IPTOS_LOWDELAY
+}
+
+const RoutedModeConfig * GetRoutedConfig()
+{
+	return RoutedConfigSnapshot.Get();
+}
+
+const ProxyModeConfig * GetProxyConfig()
+{
+	return ProxyConfigSnapshot.Get();
+}
+
+void ReloadProxyConfigSnapshots(PConfig * cfg)
+{
+	RoutedConfigSnapshot.Reload(cfg);
+	ProxyConfigSnapshot.Reload(cfg);
+	PTRACE(4, "Proxy\tPublished new [" << RoutedSec << "] and [" << ProxySection << "] config snapshots");
+}
+
+
 // send a UDP datagram and set the source IP (used only for RTP, RAS is using sockets bound to specific IPs)
 // the method is highly OS specific
 
@@ -817,7 +926,7 @@ bool HasH46024Descriptor(H225_ArrayOf_FeatureDescriptor & supportedFeatures)
 					}
 				}
 				if (!senderSupportsH46019Multiplexing ||
-					!Toolkit::AsBool(GkConfig()->GetString(ProxySection, "RTPMultiplexing", "0"))) {
+					!GetProxyConfig()->m_rtpMultiplexing) {
 						for (PINDEX j = i + 1; j < supportedFeatures.GetSize(); j++) {
 							supportedFeatures[j - 1] = supportedFeatures[j];
 						}
@@ -991,10 +1100,134 @@ void PortRange::LoadConfig(const char *sec, const char *setting, const char *def
 	PTRACE_IF(2, port, setting << ": " << minport << '-' << maxport);
 }
 
+RTPPortAllocator::RTPPortAllocator()
+	: m_minport(0), m_maxport(0), m_inUse(32768, false), m_pairsInUse(0)
+{
+}
+
+void RTPPortAllocator::SetRange(WORD minport, WORD maxport)
+{
+	PWaitAndSignal lock(m_mutex);
+	// RTP uses the even port, RTCP the odd port above it
+	if (minport & 1)
+		++minport;
+	if ((maxport & 1) == 0 && maxport > 0)
+		--maxport;
+	if (minport == 0 || maxport <= minport) {
+		m_minport = m_maxport = 0;
+		m_free.clear();
+		return;
+	}
+	m_minport = minport;
+	m_maxport = maxport;
+	m_free.clear();
+	for (unsigned port = m_minport; port < m_maxport; port += 2)
+		if (!m_inUse[port / 2])
+			m_free.push_back((WORD)port);
+}
+
+void RTPPortAllocator::LoadConfig(const char * sec, const char * setting, const char * def)
+{
+	PStringArray cfgs = GkConfig()->GetString(sec, setting, def).Tokenise(",.:-/'", FALSE);
+	if (cfgs.GetSize() >= 2)
+		SetRange((WORD)cfgs[0].AsUnsigned(), (WORD)cfgs[1].AsUnsigned());
+	else
+		SetRange(0, 0);
+	PTRACE_IF(2, m_minport, setting << ": " << m_minport << '-' << m_maxport << " (" << GetNumPairs() << " port pairs)");
+}
+
+WORD RTPPortAllocator::AllocatePair()
+{
+	PWaitAndSignal lock(m_mutex);
+	if (m_free.empty())
+		return 0;
+	WORD port = m_free.front();
+	m_free.pop_front();
+	m_inUse[port / 2] = true;
+	++m_pairsInUse;
+	return port;
+}
+
+void RTPPortAllocator::ReleasePair(WORD port)
+{
+	if (port == 0)
+		return;
+	PWaitAndSignal lock(m_mutex);
+	if (!m_inUse[port / 2])
+		return;	// not allocated by us or released twice
+	m_inUse[port / 2] = false;
+	--m_pairsInUse;
+	// pairs from a range that was changed on reload are dropped
+	if ((port & 1) == 0 && port >= m_minport && port < m_maxport)
+		m_free.push_back(port);
+}
+
+int RTPPortAllocator::GetNumPorts() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_minport ? (m_maxport - m_minport + 1) : 0;
+}
+
+int RTPPortAllocator::GetNumPairs() const
+{
+	return GetNumPorts() / 2;
+}
+
+int RTPPortAllocator::GetPairsInUse() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_pairsInUse;
+}
+
+PString RTPPortAllocator::PrintStatistics() const
+{
+	const int pairs = GetNumPairs();
+	const int inUse = GetPairsInUse();
+	return PString(PString::Printf, "-- RTP Port Statistics --\r\n"
+		"RTP port pairs in use: %d of %d (%d%%)\r\n",
+		inUse, pairs, pairs ? (inUse * 100 / pairs) : 0);
+}
+
 static PortRange Q931PortRange;
 static PortRange H245PortRange;
 static PortRange T120PortRange;
-static PortRange RTPPortRange;
+static RTPPortAllocator RTPPortRange;
+// last packet times of the flows relayed by UDPProxySockets
+static RTPInactivityTracker RTPSocketActivity;
+
+// pre-opened and bound RTP/RTCP socket pairs, refilled in the background,
+// so opening a logical channel doesn't have to create and bind sockets
+class RTPSocketPool : public Singleton<RTPSocketPool> {
+public:
+	RTPSocketPool();
+	~RTPSocketPool();
+
+	void LoadConfig();
+	// take a bound pair, false if the pool is empty or bound to a different address
+	bool Take(const PIPSocket::Address & laddr, UDPProxySocket * & rtp, UDPProxySocket * & rtcp, WORD & port);
+	PString PrintStatistics() const;
+
+private:
+	struct SocketPair {
+		UDPProxySocket * rtp;
+		UDPProxySocket * rtcp;
+		WORD port;
+	};
+
+	void ScheduleRefill();	// must hold m_mutex
+	void Refill();
+	void Flush();	// must hold m_mutex
+	static void Close(const SocketPair & pair);
+
+	mutable PMutex m_mutex;
+	std::list<SocketPair> m_pairs;
+	PIPSocket::Address m_laddr;
+	unsigned m_generation;	// incremented by each flush, pairs bound before are dropped
+	unsigned m_size;
+	unsigned m_hits;
+	unsigned m_misses;
+	bool m_refilling;
+};
 
 class H245Socket : public TCPProxySocket {
 public:
@@ -1028,6 +1261,7 @@ public:
 	void OnSignalingChannelClosed();
 	void SetSigSocket(CallSignalSocket *socket) { sigSocket = socket; }
 	PString GetCallIdentifierAsString() const;
+	virtual callptr GetCaptureCall() const;
 
 	void SetIgnoreAcceptError() { m_ignoreAcceptError = true; }
 
@@ -1146,6 +1380,18 @@ protected:
 	bool used;
 };
 
+#ifdef HAS_H235_MEDIA
+/// one RTP packet to be en- or decrypted
+struct H235MediaPacket {
+	BYTE * m_buffer;	// the whole RTP packet, must have room for DEFAULT_PACKET_BUFFER_SIZE bytes when encrypting
+	WORD m_len;
+	unsigned char m_ivSequence[6];
+	bool m_rtpPadding;
+	BYTE m_payloadType;
+	bool m_processed;
+};
+#endif
+
 class RTPLogicalChannel : public LogicalChannel {
 public:
 	RTPLogicalChannel(const H225_CallIdentifier & id, WORD flcn, bool nated, WORD sessionID, RTPSessionTypes sessionType);
@@ -1194,6 +1440,8 @@ public:
 	bool UpdateMediaKey(const H245_EncryptionSync & encryptionSync);
 	bool GenerateNewMediaKey(BYTE newPayloadType, H245_EncryptionSync & encryptionSync);
 	bool ProcessH235Media(BYTE * buffer, WORD & len, bool encrypt, unsigned char * ivsequence, bool & rtpPadding, BYTE & payloadType);
+	/// process several packets with one lock, @return the number of packets processed successfully
+	unsigned ProcessH235Media(H235MediaPacket * packets, unsigned count, bool encrypt);
 	void SetPlainPayloadType(BYTE pt) { m_plainPayloadType = pt; }
 	BYTE GetPlainPayloadType() const { return m_plainPayloadType; }
 	void SetCipherPayloadType(BYTE pt) { m_cipherPayloadType = pt; }
@@ -1214,7 +1462,11 @@ private:
 
 private:
 	void SetNAT(bool);
-	static WORD GetPortNumber();	// get a new port number to use
+#ifdef HAS_H235_MEDIA
+	// must hold m_cryptoEngineMutex
+	bool ProcessH235Packet(BYTE * buffer, WORD & len, bool encrypt, unsigned char * ivsequence, bool & rtpPadding, BYTE & payloadType);
+	void CheckMediaKeyUpdate();
+#endif
 
 	bool reversed;
 	RTPLogicalChannel *peer;
@@ -1224,7 +1476,7 @@ private:
 
 #ifdef HAS_H235_MEDIA
 	PMutex m_cryptoEngineMutex;
-	H235CryptoEngine * m_H235CryptoEngine;
+	H235MediaCipher * m_H235Cipher;
 	H235Authenticators * m_auth;
 	bool m_encrypting;
 	BYTE m_plainPayloadType;			// remember in OLC to use in OLCA
@@ -1490,6 +1742,7 @@ inline TCPProxySocket::TPKTV3::TPKTV3(WORD len)
 // class TCPProxySocket
 TCPProxySocket::TCPProxySocket(const char * t, TCPProxySocket * s, WORD p)
       : ServerSocket(p), ProxySocket(this, t), remote(s), bufptr(NULL), tpkt(0), tpktlen(0),
+        m_captureAddrValid(false), m_captureLocalPort(0), m_capturePeerPort(0),
         m_h46018KeepAlive(true), m_keepAliveInterval(19), m_keepAliveTimer(GkTimerManager::INVALID_HANDLE)
 {
     PCaselessString str;
@@ -1660,7 +1913,7 @@ bool TCPProxySocket::ReadTPKT()
 			PTRACE(2, Type() << "\t" << GetName() << " ERROR: NOT A TPKT PACKET!"
 				<< " header=" << (int)tpkt.header << " padding=" << (int)tpkt.padding << " length=" << (int)tpkt.length);
 			tpktlen = 0;
-			if (GkConfig()->GetBoolean(RoutedSec, "AbortOnInvalidTPKT", true)) {
+			if (GetRoutedConfig()->m_abortOnInvalidTPKT) {
     			errno = EINVAL;
 	    		ConvertOSError(-1, PSocket::LastReadError);
 		    	return ErrorHandler(PSocket::LastReadError);
@@ -1701,6 +1954,7 @@ bool TCPProxySocket::ReadTPKT()
 	buflen -= GetLastReadCount();
 	if (buflen == 0) {
 		tpktlen = 0;
+		CaptureMessage(true, buffer.GetPointer(), (WORD)buffer.GetSize());
 		return true;
 	}
 
@@ -1716,7 +1970,43 @@ bool TCPProxySocket::InternalWrite(const PBYTEArray & buf)
 	BYTE *bptr = tbuf.GetPointer();
 	new (bptr) TPKTV3(len); // placement operator
 	memcpy(bptr + sizeof(TPKTV3), buf, len);
-	return WriteData(bptr, tlen);
+	if (!WriteData(bptr, tlen))
+		return false;
+	CaptureMessage(false, buf, len);
+	return true;
+}
+
+void TCPProxySocket::CaptureMessage(bool received, const BYTE * data, WORD len)
+{
+	SignalingCapture * capture = SignalingCapture::Instance();
+	if (!capture->IsActive())
+		return;
+	if (!m_captureAddrValid) {
+		GetLocalAddress(m_captureLocalIP, m_captureLocalPort);
+		GetPeerAddress(m_capturePeerIP, m_capturePeerPort);
+		UnmapIPv4Address(m_captureLocalIP);
+		UnmapIPv4Address(m_capturePeerIP);
+		m_captureAddrValid = true;
+	}
+	CapturedPacketInfo info;
+	info.m_time = PTime().GetTimestamp();
+	info.m_srcIP = received ? m_capturePeerIP : m_captureLocalIP;
+	info.m_srcPort = received ? m_capturePeerPort : m_captureLocalPort;
+	info.m_dstIP = received ? m_captureLocalIP : m_capturePeerIP;
+	info.m_dstPort = received ? m_captureLocalPort : m_capturePeerPort;
+	info.m_origLen = len;
+	info.m_protocol = CapturedPacketInfo::TCP;
+	info.m_tpkt = true;
+	info.m_callNo = 0;
+	const callptr call = GetCaptureCall();
+	if (call) {
+		const PASN_OctetString & guid = call->GetCallIdentifier().m_guid;
+		if (guid.GetSize() == sizeof(info.m_callID)) {
+			info.m_callNo = call->GetCallNumber();
+			memcpy(info.m_callID, guid.GetValue(), sizeof(info.m_callID));
+		}
+	}
+	capture->Capture(info, data);
 }
 
 void TCPProxySocket::SendKeepAlive(GkTimer * timer)
@@ -1805,11 +2095,11 @@ void TCPProxySocket::RegisterKeepAlive(int h46018_interval)
 		m_keepAliveInterval = h46018_interval;
 	} else {
 		m_h46018KeepAlive = false;
-        m_keepAliveInterval = GkConfig()->GetInteger(RoutedSec, "GnuGkTcpKeepAliveInterval", 19);
+        m_keepAliveInterval = GetRoutedConfig()->m_gnugkTcpKeepAliveInterval;
 	}
 	UnregisterKeepAlive();  // make sure old registrations get deleted
 	// enable for H.460.18 or via config
-	if (h46018_interval || GkConfig()->GetBoolean(RoutedSec, "EnableGnuGkTcpKeepAlive", false)) {
+	if (h46018_interval || GetRoutedConfig()->m_enableGnuGkTcpKeepAlive) {
         PTime now;
         m_keepAliveTimer = Toolkit::Instance()->GetTimerManager()->RegisterTimer(
             this, &TCPProxySocket::SendKeepAlive, now + PTimeInterval(0, m_keepAliveInterval), m_keepAliveInterval);
@@ -1872,13 +2162,13 @@ void CallSignalSocket::InternalInit()
 	m_crv = 0;
 	m_h245handler = NULL;
 	m_h245socket = NULL;
-	m_h245TunnelingTranslation = Toolkit::Instance()->Config()->GetBoolean(RoutedSec, "H245TunnelingTranslation", false);
+	m_h245TunnelingTranslation = GetRoutedConfig()->m_h245TunnelingTranslation;
 	m_isnatsocket = false;
 	m_maintainConnection = false;
 	m_result = NoData;
 	m_setupPdu = NULL;
 #ifdef HAS_H46017
-	m_h46017Enabled = GkConfig()->GetBoolean(RoutedSec, "EnableH46017", false);
+	m_h46017Enabled = GetRoutedConfig()->m_enableH46017;
 	rc_remote = NULL;
 #endif
 #ifdef HAS_H46018
@@ -1910,7 +2200,7 @@ void CallSignalSocket::InternalInit()
 void CallSignalSocket::CleanupCall()
 {
 #ifdef HAS_H46018
-	if (m_call && Toolkit::AsBool(GkConfig()->GetString(ProxySection, "RTPMultiplexing", "0")) && !m_socketWasForwarded) {
+	if (m_call && GetProxyConfig()->m_rtpMultiplexing && !m_socketWasForwarded) {
         PTRACE(7, "JW Removing multiplex Channels on Cleanup of CallSignalSocket: call no=" << m_call->GetCallNumber());
 		MultiplexedRTPHandler::Instance()->RemoveChannels(m_call->GetCallNumber());
 	}
@@ -2017,14 +2307,14 @@ void CallSignalSocket::SetRemote(CallSignalSocket * socket)
 
 	if (m_call->GetProxyMode() != CallRec::ProxyEnabled
 		&& nat_type == CallRec::both && calling == called) {
-		if (!Toolkit::AsBool(GkConfig()->GetString(ProxySection, "ProxyForSameNAT", "1"))) {
+		if (!GetProxyConfig()->m_proxyForSameNAT) {
 			PTRACE(3, "GK\tCall " << m_call->GetCallNumber() << " proxy DISABLED. (Same NAT)");
 			m_call->SetProxyMode(CallRec::ProxyDisabled);
 			return;
 		}
 	}
 
-	if (GkConfig()->GetBoolean(ProxySection, "ProxyAlways", false)) {
+	if (GetProxyConfig()->m_proxyAlways) {
 			PTRACE(3, "GK\tCall " << m_call->GetCallNumber() << " proxy enabled. (ProxyAlways)");
 		m_call->SetProxyMode(CallRec::ProxyEnabled);
 		m_call->SetH245Routed(true);
@@ -2032,7 +2322,7 @@ void CallSignalSocket::SetRemote(CallSignalSocket * socket)
 
 	// enable proxy if required, no matter whether H.245 routed
 	if (m_call->GetProxyMode() == CallRec::ProxyDetect) {
-		if ((nat_type != CallRec::none && GkConfig()->GetBoolean(ProxySection, "ProxyForNAT", false)) ) {
+		if ((nat_type != CallRec::none && GetProxyConfig()->m_proxyForNAT) ) {
 			// must proxy
 			PTRACE(3, "GK\tCall " << m_call->GetCallNumber() << " proxy enabled. (ProxyForNAT)");
 			m_call->SetProxyMode(CallRec::ProxyEnabled);
@@ -2118,7 +2408,7 @@ void CallSignalSocket::SetRemote(CallSignalSocket * socket)
 CallSignalSocket::~CallSignalSocket()
 {
 #ifdef HAS_H46018
-	if (m_call && Toolkit::AsBool(GkConfig()->GetString(ProxySection, "RTPMultiplexing", "0")) && !m_socketWasForwarded) {
+	if (m_call && GetProxyConfig()->m_rtpMultiplexing && !m_socketWasForwarded) {
         PTRACE(7, "JW Removing multiplex Channels in CallSignalSocket d'tor: call no=" << m_call->GetCallNumber());
 		MultiplexedRTPHandler::Instance()->RemoveChannels(m_call->GetCallNumber());
 	}
@@ -2445,7 +2735,7 @@ ProxySocket::Result CallSignalSocket::ReceiveData()
 			GetRemote()->m_h245Tunneling = false;
 	}
 
-	bool disableH245Tunneling = Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "DisableH245Tunneling", "0"));
+	bool disableH245Tunneling = GetRoutedConfig()->m_disableH245Tunneling;
 	if (disableH245Tunneling) {
 		m_h245Tunneling = false;
 		if (GetRemote())
@@ -2667,8 +2957,8 @@ ProxySocket::Result CallSignalSocket::ReceiveData()
 
 	if (msg->GetQ931().HasIE(Q931::DisplayIE)) {
 		PString newDisplayIE;
-        PString screenDisplayIE = GkConfig()->GetString(RoutedSec, "ScreenDisplayIE", "");
-        PString appendToDisplayIE = GkConfig()->GetString(RoutedSec, "AppendToDisplayIE", "");
+        PString screenDisplayIE = GetRoutedConfig()->m_screenDisplayIE;
+        PString appendToDisplayIE = GetRoutedConfig()->m_appendToDisplayIE;
 		if (m_crv & 0x8000u) {	// rewrite DisplayIE from caller
             if (m_call) {
                 if (!m_call->GetCallerID().IsEmpty() || !m_call->GetCallerDisplayIE().IsEmpty()) {
@@ -4017,7 +4307,7 @@ void CallSignalSocket::ForwardCall(FacilityMsg * msg)
 	// TODO: also handle the case of forwarding to a H.460.18 endpoint
 #endif
 
-	if (Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "ShowForwarderNumber", "0"))) {
+	if (GetRoutedConfig()->m_showForwarderNumber) {
 		if (endptr fwd = m_call->GetForwarder()) {
 			const H225_ArrayOf_AliasAddress & a = fwd->GetAliases();
 			for (PINDEX n = 0; n < a.GetSize(); ++n)
@@ -4412,9 +4702,9 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 	msg->GetLocalAddr(_localAddr, _localPort);
 
 	// incompatible with 'explicit' routing
-	if (GkConfig()->GetBoolean(RoutedSec, "RedirectCallsToGkIP", false)) {
+	if (GetRoutedConfig()->m_redirectCallsToGkIP) {
         bool redirect = false;
-        WORD signalPort = (WORD)GkConfig()->GetInteger(RoutedSec, "CallSignalPort", GK_DEF_CALL_SIGNAL_PORT);
+        WORD signalPort = GetRoutedConfig()->m_callSignalPort;
         H225_TransportAddress mainIP = SocketToH225TransportAddr(Toolkit::Instance()->GetRouteTable()->GetLocalAddress(_peerAddr), signalPort);
         // check if our main or external IP is being called
         if (setupBody.HasOptionalField(H225_Setup_UUIE::e_destCallSignalAddress)) {
@@ -4456,7 +4746,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
             facility_uuie.m_conferenceID = setupBody.m_conferenceID;
 
             facility_uuie.IncludeOptionalField(H225_Facility_UUIE::e_alternativeAddress);
-            WORD signalPort = (WORD)GkConfig()->GetInteger(RoutedSec, "CallSignalPort", GK_DEF_CALL_SIGNAL_PORT);
+            WORD signalPort = GetRoutedConfig()->m_callSignalPort;
             H225_TransportAddress newIP = SocketToH225TransportAddr(Toolkit::Instance()->GetRouteTable()->GetLocalAddress(_peerAddr), signalPort);
             facility_uuie.m_alternativeAddress = newIP;
             if (setupBody.HasOptionalField(H225_Setup_UUIE::e_destinationAddress) && setupBody.m_destinationAddress.GetSize() > 0) {
@@ -4493,8 +4783,8 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 	}
 
 	// process tunneling flag
-	if (GkConfig()->GetBoolean(RoutedSec, "GenerateCallProceeding", false)
-		&& !GkConfig()->GetBoolean(RoutedSec, "UseProvisionalRespToH245Tunneling", false)
+	if (GetRoutedConfig()->m_generateCallProceeding
+		&& !GetRoutedConfig()->m_useProvisionalRespToH245Tunneling
 		&& !m_h245TunnelingTranslation) {
 
 		// disable H.245 tunneling when the gatekeeper generates the CP
@@ -4523,7 +4813,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 	}
 
 	// Sorenson specific
-	if (GkConfig()->GetBoolean(RoutedSec, "TranslateSorensonSourceInfo", false)) {
+	if (GetRoutedConfig()->m_translateSorensonSourceInfo) {
 		// Viable VPAD (Viable firmware, SBN Tech device), remove the CallingPartyNumber information
 		// (its under the Sorenson switch, even though not Sorenson, can be moved later to own switch)
 		if (setupBody.m_sourceInfo.HasOptionalField(H225_EndpointType::e_vendor)
@@ -4620,7 +4910,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 		if (setupBody.m_sourceInfo.m_terminal.m_nonStandardData.m_nonStandardIdentifier.GetTag() == H225_NonStandardIdentifier::e_h221NonStandard) {
 			H225_H221NonStandard h221nst = setupBody.m_sourceInfo.m_terminal.m_nonStandardData.m_nonStandardIdentifier;
 			if (h221nst.m_manufacturerCode == 21334
-				&& Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "RemoveSorensonSourceInfo", "0"))) {
+				&& GetRoutedConfig()->m_removeSorensonSourceInfo) {
 				setupBody.m_sourceInfo.m_terminal.RemoveOptionalField(H225_TerminalInfo::e_nonStandardData);
 			}
 		}
@@ -4637,7 +4927,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 	m_crv = (WORD)(setup->GetCallReference() | 0x8000u);
 
 	// Make a copy for further FORWARD
-	if (toolkit->Config()->GetBoolean(RoutedSec, "ForwardOnFacility", false) && m_setupPdu == NULL)
+	if (GetRoutedConfig()->m_forwardOnFacility && m_setupPdu == NULL)
 		m_setupPdu = new Q931(q931);
 
 	// Check UUIE for destination and fulfill it from Q.931 CalledPtyNumber if absent
@@ -4837,7 +5127,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 	bool proceedingSent = false;
 #endif
 
-	if (Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "GenerateCallProceeding", "0"))) {
+	if (GetRoutedConfig()->m_generateCallProceeding) {
 		PTRACE(4, "Q931\tGatekeeper generated CallProceeding");
 		Q931 proceedingQ931;
 		PBYTEArray lBuffer;
@@ -4874,7 +5164,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
         bool h46017 = m_call && m_call->GetCallingParty() && m_call->GetCallingParty()->UsesH46017();
         if (!h46017) {
             PTRACE(5, "H46018\tEnable keep-alive for incoming H.460.18 call from traversal server/neighbor");
-            RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+            RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
         }
     }
 #endif
@@ -5307,7 +5597,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 				sourceAddress.GetIpAddress(srcAddr);
 
 				if (_peerAddr != srcAddr) {  // do we have a NAT?
-					if (Toolkit::AsBool(toolkit->Config()->GetString(RoutedSec, "SupportNATedEndpoints", "0"))) {
+					if (GetRoutedConfig()->m_supportNATedEndpoints) {
 						PTRACE(4, Type() << "\tSource address " <<  srcAddr
 							<< " peer address " << _peerAddr << " caller is behind NAT");
 						call->SetSrcNATed(srcAddr);
@@ -5324,8 +5614,8 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 				}
 			} else {
 				   // If the party cannot be determined if behind NAT and we have support then just treat as being NAT
-					 if (Toolkit::AsBool(toolkit->Config()->GetString(RoutedSec, "SupportNATedEndpoints", "0")) &&
-						Toolkit::AsBool(toolkit->Config()->GetString(RoutedSec, "TreatUnregisteredNAT", "0"))) {
+					 if (GetRoutedConfig()->m_supportNATedEndpoints &&
+						GetRoutedConfig()->m_treatUnregisteredNAT) {
 						PTRACE(4, Type() << "\tUnregistered party " << _peerAddr << " cannot detect if NATed. Treated as if NATed");
 						srcAddr = "192.168.1.1";  // just an arbitrary internal address
 						call->SetSrcNATed(srcAddr);
@@ -5736,7 +6026,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 				setupBody.RemoveOptionalField(H225_Setup_UUIE::e_cryptoTokens);
 		}
 	}
-	if (toolkit->Config()->GetBoolean(RoutedSec, "ForwardOnFacility", false)
+	if (GetRoutedConfig()->m_forwardOnFacility
 		&& setupBody.HasOptionalField(H225_Setup_UUIE::e_tokens)) {
 		m_setupClearTokens = new H225_ArrayOf_ClearToken(setupBody.m_tokens);	// save a copy of the tokens in case the call gets forwarded
 	}
@@ -6025,7 +6315,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 		if ( (m_call->GetCalledParty() && m_call->GetCalledParty()->IsTraversalServer())
 			|| (gkClient && gkClient->CheckFrom(m_call->GetDestSignalAddr()) && gkClient->UsesH46018()) ) {
 			H460_FeatureStd feat = H460_FeatureStd(19);
-			if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+			if (GetProxyConfig()->m_rtpMultiplexing) {
 				H460_FeatureID feat_id(1);	// supportTransmitMultiplexedMedia
 				feat.AddParameter(&feat_id);
 			}
@@ -6063,7 +6353,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 				}
 			}
 
-			if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+			if (GetProxyConfig()->m_rtpMultiplexing) {
 				feat_id = H460_FeatureID(1);	// supportTransmitMultiplexedMedia
 				feat.AddParameter(&feat_id);
 			}
@@ -6269,7 +6559,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 		// only rewrite sourceCallSignalAddress if we are proxying,
 		// otherwise leave the receiving endpoint the option to deal with NATed caller itself
 		if (m_call->GetProxyMode() == CallRec::ProxyEnabled
-			|| GkConfig()->GetBoolean(RoutedSec, "AlwaysRewriteSourceCallSignalAddress", true)) {
+			|| GetRoutedConfig()->m_alwaysRewriteSourceCallSignalAddress) {
 			setupBody.IncludeOptionalField(H225_Setup_UUIE::e_sourceCallSignalAddress);
 			setupBody.m_sourceCallSignalAddress = SocketToH225TransportAddr(masqAddr, GetPort());
 		}
@@ -6301,7 +6591,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 				}
 			}
 
-			if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)
+			if (GetProxyConfig()->m_rtpMultiplexing
 #ifdef HAS_H46023
 				&& (m_senderSupportsH46019Multiplexing || (!HasH46024Descriptor(setupBody.m_supportedFeatures) && IsH46024ProxyStrategy(natoffloadsupport)))
 #endif
@@ -6349,7 +6639,7 @@ void CallSignalSocket::OnSetup(SignalingMsg * msg)
 		H46018_IncomingCallIndication incoming;
 		incoming.m_callID = setupBody.m_callIdentifier;
 
-        WORD signalPort = (WORD)GkConfig()->GetInteger(RoutedSec, "CallSignalPort", GK_DEF_CALL_SIGNAL_PORT);
+        WORD signalPort = GetRoutedConfig()->m_callSignalPort;
 		incoming.m_callSignallingAddress = SocketToH225TransportAddr(m_call->GetCalledParty()->GetRasServerIP(), signalPort);
 
 		H460_FeatureStd feat = H460_FeatureStd(18);
@@ -6422,7 +6712,7 @@ bool CallSignalSocket::CreateRemote(H225_Setup_UUIE & setupBody)
 	// only rewrite sourceCallSignalAddress if we are proxying,
 	// otherwise leave the receiving endpoint the option to deal with NATed caller itself
 	if (m_call->GetProxyMode() == CallRec::ProxyEnabled
-		|| GkConfig()->GetBoolean(RoutedSec, "AlwaysRewriteSourceCallSignalAddress", true)) {
+		|| GetRoutedConfig()->m_alwaysRewriteSourceCallSignalAddress) {
 		setupBody.IncludeOptionalField(H225_Setup_UUIE::e_sourceCallSignalAddress);
 		setupBody.m_sourceCallSignalAddress = SocketToH225TransportAddr(masqAddr, GetPort());
 	} else {
@@ -6451,7 +6741,7 @@ bool CallSignalSocket::CreateRemote(H225_Setup_UUIE & setupBody)
 
 	// For compatibility to call pre-H323v4 devices that do not support H.460
 	// This strips the Feature Advertisements from the PDU.
-	if (GkConfig()->GetBoolean(RoutedSec, "RemoveH460Call", false)
+	if (GetRoutedConfig()->m_removeH460Call
 #ifdef HAS_H46023
 		&& (!m_call->GetCalledParty() || (m_call->GetCalledParty()->GetEPNATType() == (int)EndpointRec::NatUnknown))
 #endif
@@ -6735,7 +7025,7 @@ void CallSignalSocket::OnCallProceeding(SignalingMsg * msg)
 				H460_FeatureID feat_id(2);	// mediaTraversalServer
 				feat.AddParameter(&feat_id);
 			}
-			if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+			if (GetProxyConfig()->m_rtpMultiplexing) {
 				H460_FeatureID feat_id(1);	// supportTransmitMultiplexedMedia
 				feat.AddParameter(&feat_id);
 			}
@@ -7154,7 +7444,7 @@ void CallSignalSocket::OnConnect(SignalingMsg *msg)
                 bool h46017 = m_call && m_call->GetCalledParty() && m_call->GetCalledParty()->UsesH46017();
                 if (!h46017) {
                     PTRACE(5, "H46018\tEnable keep-alive for outgoing H.460.18 call to traversal server/neighbor");
-                    RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+                    RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
                 }
             }
 			// ignore if the .19 descriptor isn't from an endpoint that uses H.460.17 or .18
@@ -7201,7 +7491,7 @@ void CallSignalSocket::OnConnect(SignalingMsg *msg)
 				H460_FeatureID feat_id(2);	// mediaTraversalServer
 				feat.AddParameter(&feat_id);
 			}
-			if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+			if (GetProxyConfig()->m_rtpMultiplexing) {
 				H460_FeatureID feat_id(1);	// supportTransmitMultiplexedMedia
 				feat.AddParameter(&feat_id);
 			}
@@ -7409,7 +7699,7 @@ void CallSignalSocket::OnAlerting(SignalingMsg* msg)
 				H460_FeatureID feat_id(2);	// mediaTraversalServer
 				feat.AddParameter(&feat_id);
 			}
-			if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+			if (GetProxyConfig()->m_rtpMultiplexing) {
 				H460_FeatureID feat_id(1);	// supportTransmitMultiplexedMedia
 				feat.AddParameter(&feat_id);
 			}
@@ -7520,49 +7810,48 @@ void CallSignalSocket::OnInformation(SignalingMsg * msg)
 			if (data.m_dataFrame && m_call->IsMediaEncryption()) {
 				H46026Session session = H46026RTPHandler::Instance()->FindSession(m_call->GetCallNumber(), data.m_sessionId.GetValue());
 				if (session.IsValid()) {
-					for (PINDEX i = 0; i < data.m_frame.GetSize(); i++) {
-						PASN_OctetString & bytes = data.m_frame[i];
-						WORD wlen = bytes.GetSize();
-						bool succesful = false;
-						unsigned char ivSequence[6];
-						BYTE payloadType = UNDEFINED_PAYLOAD_TYPE;
-						bool rtpPadding = false;
-						if (wlen >= 1)
-							rtpPadding = bytes[0] & 0x20;
-						if (wlen >= 2)
-							payloadType = bytes[1] & 0x7f;
-						if (wlen >= 8) {
-							memcpy(ivSequence, bytes.GetPointer() + 2, 6);
-						} else {
-							continue; // no data to en-/decrypt
-						}
-
-						bool encrypting = (m_callerSocket && m_call->GetEncryptDirection() == CallRec::callingParty)
-							|| (!m_callerSocket && m_call->GetEncryptDirection() == CallRec::calledParty);
-						if (encrypting) {
-							if (session.m_encryptingLC) {
+					const bool encrypting = (m_callerSocket && m_call->GetEncryptDirection() == CallRec::callingParty)
+						|| (!m_callerSocket && m_call->GetEncryptDirection() == CallRec::calledParty);
+					RTPLogicalChannel * lc = encrypting ? session.m_encryptingLC : session.m_decryptingLC;
+					// process the frames of the message in batches to take the crypto lock only once per batch
+					const unsigned BatchSize = 16;
+					H235MediaPacket packets[BatchSize];
+					PINDEX frameIndex[BatchSize];
+					PINDEX i = 0;
+					while (lc && i < data.m_frame.GetSize()) {
+						unsigned count = 0;
+						for (; i < data.m_frame.GetSize() && count < BatchSize; i++) {
+							PASN_OctetString & bytes = data.m_frame[i];
+							if (bytes.GetSize() < 8)
+								continue; // no data to en-/decrypt
+							H235MediaPacket & packet = packets[count];
+							packet.m_len = (WORD)bytes.GetSize();
+							packet.m_rtpPadding = bytes[0] & 0x20;
+							packet.m_payloadType = bytes[1] & 0x7f;
+							memcpy(packet.m_ivSequence, bytes.GetPointer() + 2, 6);
+							if (encrypting)
 								bytes.SetSize(DEFAULT_PACKET_BUFFER_SIZE);	// data may grow when encrypting
-								succesful = session.m_encryptingLC->ProcessH235Media(bytes.GetPointer(), wlen, true, ivSequence, rtpPadding, payloadType);
-							}
-						} else {
-							if (session.m_decryptingLC) {
-								succesful = session.m_decryptingLC->ProcessH235Media(bytes.GetPointer(), wlen, false, ivSequence, rtpPadding, payloadType);
-							}
+							packet.m_buffer = bytes.GetPointer();
+							frameIndex[count++] = i;
 						}
-						if (!succesful) {
-							PTRACE(1, "H235\t" << (encrypting ? "En" : "De") << "crypting H.460.26 packet failed");
-							continue;
+						lc->ProcessH235Media(packets, count, encrypting);
+
+						for (unsigned j = 0; j < count; ++j) {
+							const H235MediaPacket & packet = packets[j];
+							PASN_OctetString & bytes = data.m_frame[frameIndex[j]];
+							bytes.SetSize(packet.m_len);
+							if (!packet.m_processed) {
+								PTRACE(1, "H235\t" << (encrypting ? "En" : "De") << "crypting H.460.26 packet failed");
+								continue;
+							}
+							// update RTP padding bit
+							if (packet.m_rtpPadding)
+								bytes[0] |= 0x20;
+							else
+								bytes[0] &= 0xdf;
+							// update payload type, preserve marker bit
+							bytes[1] = (bytes[1] & 0x80) | (packet.m_payloadType & 0x7f);
 						}
-
-						// update RTP padding bit
-						if (rtpPadding)
-							bytes[0] |= 0x20;
-						else
-							bytes[0] &= 0xdf;
-						// update payload type, preserve marker bit
-						bytes[1] = (bytes[1] & 0x80) | (payloadType & 0x7f);
-
-						bytes.SetSize(wlen);
 					}
 				}
 				msg->SetChanged();
@@ -7570,16 +7859,17 @@ void CallSignalSocket::OnInformation(SignalingMsg * msg)
 #endif
 
 			// handle RTCP stats
-			if (GkConfig()->GetBoolean(ProxySection, "EnableRTCPStats", false)) {
+			if (GetProxyConfig()->m_enableRTCPStats) {
 				PIPSocket::Address _peerAddr;
 				WORD _peerPort = 0;
 				GetPeerAddress(_peerAddr, _peerPort);
 				UnmapIPv4Address(_peerAddr);
 
+				unsigned sampleCounter = 0;	// tunneled RTCP is rare, don't sample
 				for (PINDEX i = 0; i < data.m_frame.GetSize(); i++) {
 					PASN_OctetString & bytes = data.m_frame[i];
 					if (!data.m_dataFrame) {
-						ParseRTCP(m_call, data.m_sessionId, _peerAddr, bytes.GetPointer(), bytes.GetSize());
+						RTCPStatsAggregator::Instance()->QueueReport(sampleCounter, m_call->GetCallNumber(), (WORD)data.m_sessionId.GetValue(), _peerAddr, bytes.GetPointer(), (WORD)bytes.GetSize());
 					}
 				}
 			}
@@ -7588,7 +7878,7 @@ void CallSignalSocket::OnInformation(SignalingMsg * msg)
 				// convert to RTP or RTP mux
 #ifdef HAS_H46018
 				// check if its a multiplexed RTP destination
-				if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)
+				if (GetProxyConfig()->m_rtpMultiplexing
 					&& MultiplexedRTPHandler::Instance()->HandlePacket(m_call->GetCallNumber(), data)) {
 					m_result = NoData;	// forwarded as RTP
 					return;
@@ -8451,12 +8741,12 @@ void CallSignalSocket::OnInformation(SignalingMsg * msg)
 	m_result = m_call ? Forwarding : NoData;
 
 	// If NAT support disabled then ignore the message.
-	if (!Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "SupportNATedEndpoints", "0")))
+	if (!GetRoutedConfig()->m_supportNATedEndpoints)
 		return;
 
 	// If calling NAT support disabled then ignore the message.
 	// Use this to block errant gateways that don't support NAT mechanism properly.
-	if (!Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "SupportCallingNATedEndpoints", "1")))
+	if (!GetRoutedConfig()->m_supportCallingNATedEndpoints)
 		return;
 
 	// look for GnuGk NAT messages, ignore everything else
@@ -9500,7 +9790,7 @@ void CallSignalSocket::OnFacility(SignalingMsg * msg)
 		facilityBody.RemoveOptionalField(H225_Facility_UUIE::e_featureSet);
 	}
 
-	if (GkConfig()->GetBoolean(RoutedSec, "FilterEmptyFacility", false)) {
+	if (GetRoutedConfig()->m_filterEmptyFacility) {
 		H225_H323_UserInformation * uuie = facility->GetUUIE();
 		if ( uuie && ((uuie->m_h323_uu_pdu.m_h323_message_body.GetTag() == H225_H323_UU_PDU_h323_message_body::e_empty)
 			|| (facilityBody.m_reason.GetTag() == H225_FacilityReason::e_transportedInformation)) ) {
@@ -9545,7 +9835,7 @@ void CallSignalSocket::OnFacility(SignalingMsg * msg)
 	case H225_FacilityReason::e_callForwarded:
 	case H225_FacilityReason::e_routeCallToMC:
 	    // TODO: only if call is connected
-		if (GkConfig()->GetBoolean(RoutedSec, "RerouteOnFacility", false)
+		if (GetRoutedConfig()->m_rerouteOnFacility
             && facilityBody.m_reason.GetTag() != H225_FacilityReason::e_routeCallToGatekeeper) {
             // make sure the call is still active
             if (m_call && CallTable::Instance()->FindCallRec(m_call->GetCallNumber())) {
@@ -9554,7 +9844,7 @@ void CallSignalSocket::OnFacility(SignalingMsg * msg)
                 return;
             }
 		} else {
-            if (!GkConfig()->GetBoolean(RoutedSec, "ForwardOnFacility", false))
+            if (!GetRoutedConfig()->m_forwardOnFacility)
                 break;
 
             // to avoid complicated handling of H.245 channel on forwarding,
@@ -9573,7 +9863,7 @@ void CallSignalSocket::OnFacility(SignalingMsg * msg)
 		break;
 
 	case H225_FacilityReason::e_transportedInformation:
-		if (GkConfig()->GetBoolean(RoutedSec, "TranslateFacility", false)) {
+		if (GetRoutedConfig()->m_translateFacility) {
 			CallSignalSocket * sigSocket = dynamic_cast<CallSignalSocket*>(remote);
 			if (sigSocket != NULL && sigSocket->m_h225Version > 0
 					&& sigSocket->m_h225Version < 4) {
@@ -9710,8 +10000,8 @@ void CallSignalSocket::OnFacility(SignalingMsg * msg)
                     // screen displayIE
                     if (q931pdu->HasIE(Q931::DisplayIE)) {
                         PString newDisplayIE;
-                        PString screenDisplayIE = GkConfig()->GetString(RoutedSec, "ScreenDisplayIE", "");
-                        PString appendToDisplayIE = GkConfig()->GetString(RoutedSec, "AppendToDisplayIE", "");
+                        PString screenDisplayIE = GetRoutedConfig()->m_screenDisplayIE;
+                        PString appendToDisplayIE = GetRoutedConfig()->m_appendToDisplayIE;
                         if (!m_call->GetCallerID().IsEmpty() || !m_call->GetCallerDisplayIE().IsEmpty()) {
                             newDisplayIE = m_call->GetCallerID();
                             if (!m_call->GetCallerDisplayIE().IsEmpty()) {
@@ -10073,8 +10363,8 @@ void CallSignalSocket::BuildFacilityPDU(Q931 & FacilityPDU, int reason, const PO
 			if (m_call && m_call->GetCalledParty() && m_call->H46019Required()
 				&& (m_call->GetCalledParty()->GetTraversalRole() != None) )
 			{
-                if (GkConfig()->GetBoolean(RoutedSec, "EnableH245Multiplexing", false))
-                    SetH225Port(uuie.m_h245Address, (WORD)GkConfig()->GetInteger(RoutedSec, "H245MultiplexPort", 1722));
+                if (GetRoutedConfig()->m_enableH245Multiplexing)
+                    SetH225Port(uuie.m_h245Address, GetRoutedConfig()->m_h245MultiplexPort);
 				m_crv = m_call->GetCallRef();	// make sure m_crv is set
 				uuie.m_protocolIdentifier.SetValue(H225_ProtocolID);
 				uuie.RemoveOptionalField(H225_Facility_UUIE::e_conferenceID);
@@ -10085,7 +10375,7 @@ void CallSignalSocket::BuildFacilityPDU(Q931 & FacilityPDU, int reason, const PO
 					feat.AddParameter(feat_id);
 					delete feat_id;
 				}
-				if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+				if (GetProxyConfig()->m_rtpMultiplexing) {
 					feat_id = new H460_FeatureID(1);	// supportTransmitMultiplexedMedia
 					feat.AddParameter(feat_id);
 					delete feat_id;
@@ -10215,7 +10505,7 @@ void CallSignalSocket::BuildProgressPDU(Q931 & ProgressPDU, PBoolean fromDestina
 	ProgressPDU.BuildProgress(m_crv, fromDestination, Q931::ProgressInbandInformationAvailable);
 
 #ifdef HAS_AVAYA_SUPPORT
-	if (GkConfig()->GetBoolean(RoutedSec, "UseProvisionalRespToH245Tunneling", false)) {
+	if (GetRoutedConfig()->m_useProvisionalRespToH245Tunneling) {
 		signal.m_h323_uu_pdu.RemoveOptionalField(H225_H323_UU_PDU::e_h245Tunneling);
 		signal.m_h323_uu_pdu.IncludeOptionalField(H225_H323_UU_PDU::e_provisionalRespToH245Tunneling);
 	} else {
@@ -10366,7 +10656,7 @@ void CallSignalSocket::BuildProceedingPDU(Q931 & ProceedingPDU, const H225_CallI
 	ProceedingPDU.BuildCallProceeding(crv);
 #endif
 
-	if (GkConfig()->GetBoolean(RoutedSec, "UseProvisionalRespToH245Tunneling", false)) {
+	if (GetRoutedConfig()->m_useProvisionalRespToH245Tunneling) {
 		signal.m_h323_uu_pdu.RemoveOptionalField(H225_H323_UU_PDU::e_h245Tunneling);
 		signal.m_h323_uu_pdu.IncludeOptionalField(H225_H323_UU_PDU::e_provisionalRespToH245Tunneling);
 	} else {
@@ -10477,7 +10767,7 @@ void CallSignalSocket::BuildConnectPDU(Q931 & ConnectPDU, const H225_CallIdentif
 		uuie.m_conferenceID = m_call->GetConferenceIdentifier();
 	}
 
-	if (GkConfig()->GetBoolean(RoutedSec, "UseProvisionalRespToH245Tunneling", false)) {
+	if (GetRoutedConfig()->m_useProvisionalRespToH245Tunneling) {
 		signal.m_h323_uu_pdu.RemoveOptionalField(H225_H323_UU_PDU::e_h245Tunneling);
 		signal.m_h323_uu_pdu.IncludeOptionalField(H225_H323_UU_PDU::e_provisionalRespToH245Tunneling);
 	} else {
@@ -10642,12 +10932,11 @@ void CallSignalSocket::Dispatch()
 	ReadLock lock(ConfigReloadMutex);
 
 	const PTime channelStart;
-	const int setupTimeout = PMAX(GkConfig()->GetInteger(RoutedSec, "SetupTimeout", DEFAULT_SETUP_TIMEOUT), (long)1000);
+	const int setupTimeout = GetRoutedConfig()->m_setupTimeout;
 	int timeout = setupTimeout;
 
-	if (GkConfig()->HasKey(RoutedSec, "TcpKeepAlive"))
-		Self()->SetOption(SO_KEEPALIVE, Toolkit::AsBool(
-			GkConfig()->GetString(RoutedSec, "TcpKeepAlive", "0")) ? 1 : 0,
+	if (GetRoutedConfig()->m_tcpKeepAlive >= 0)
+		Self()->SetOption(SO_KEEPALIVE, GetRoutedConfig()->m_tcpKeepAlive,
 			SOL_SOCKET
 			);
 
@@ -10672,9 +10961,8 @@ void CallSignalSocket::Dispatch()
 
 		case Connecting:
 			if (InternalConnectTo()) {
-				if (GkConfig()->HasKey(RoutedSec, "TcpKeepAlive"))
-					remote->Self()->SetOption(SO_KEEPALIVE, Toolkit::AsBool(
-						GkConfig()->GetString(RoutedSec, "TcpKeepAlive", "0")) ? 1 : 0,
+				if (GetRoutedConfig()->m_tcpKeepAlive >= 0)
+					remote->Self()->SetOption(SO_KEEPALIVE, GetRoutedConfig()->m_tcpKeepAlive,
 						SOL_SOCKET);
 
 
@@ -10769,9 +11057,8 @@ void CallSignalSocket::Dispatch()
 
 		case Forwarding:
 			if (remote && remote->IsConnected()) { // remote is NAT socket
-				if (GkConfig()->HasKey(RoutedSec, "TcpKeepAlive"))
-					remote->Self()->SetOption(SO_KEEPALIVE, Toolkit::AsBool(
-						GkConfig()->GetString(RoutedSec, "TcpKeepAlive", "0")) ? 1 : 0,
+				if (GetRoutedConfig()->m_tcpKeepAlive >= 0)
+					remote->Self()->SetOption(SO_KEEPALIVE, GetRoutedConfig()->m_tcpKeepAlive,
 						SOL_SOCKET
 						);
 				ForwardData();
@@ -10883,8 +11170,8 @@ ProxySocket::Result CallSignalSocket::RetrySetup()
 
 	if (msg->GetQ931().HasIE(Q931::DisplayIE)) {
         PString newDisplayIE;
-        PString screenDisplayIE = GkConfig()->GetString(RoutedSec, "ScreenDisplayIE", "");
-        PString appendToDisplayIE = GkConfig()->GetString(RoutedSec, "AppendToDisplayIE", "");
+        PString screenDisplayIE = GetRoutedConfig()->m_screenDisplayIE;
+        PString appendToDisplayIE = GetRoutedConfig()->m_appendToDisplayIE;
         if (!m_call->GetCallerID().IsEmpty() || !m_call->GetCallerDisplayIE().IsEmpty()) {
             newDisplayIE = m_call->GetCallerID();
             if (!m_call->GetCallerDisplayIE().IsEmpty()) {
@@ -10917,16 +11204,15 @@ ProxySocket::Result CallSignalSocket::RetrySetup()
 void CallSignalSocket::DispatchNextRoute()
 {
 	ReadLock lock(ConfigReloadMutex);
-	const int setupTimeout = PMAX(GkConfig()->GetInteger(RoutedSec, "SetupTimeout", DEFAULT_SETUP_TIMEOUT), (long)1000);
+	const int setupTimeout = GetRoutedConfig()->m_setupTimeout;
 
 	const PTime channelStart;
 
 	switch (RetrySetup()) {
 	case Connecting:
 		if (InternalConnectTo()) {
-			if (GkConfig()->HasKey(RoutedSec, "TcpKeepAlive"))
-				remote->Self()->SetOption(SO_KEEPALIVE, Toolkit::AsBool(
-					GkConfig()->GetString(RoutedSec, "TcpKeepAlive", "0")) ? 1 : 0,
+			if (GetRoutedConfig()->m_tcpKeepAlive >= 0)
+				remote->Self()->SetOption(SO_KEEPALIVE, GetRoutedConfig()->m_tcpKeepAlive,
 					SOL_SOCKET);
 
 			ConfigReloadMutex.EndRead();
@@ -11010,9 +11296,8 @@ void CallSignalSocket::DispatchNextRoute()
 
 	case Forwarding:
 		if (remote && remote->IsConnected()) { // remote is NAT socket
-			if (GkConfig()->HasKey(RoutedSec, "TcpKeepAlive"))
-				remote->Self()->SetOption(SO_KEEPALIVE, Toolkit::AsBool(
-					GkConfig()->GetString(RoutedSec, "TcpKeepAlive", "0")) ? 1 : 0,
+			if (GetRoutedConfig()->m_tcpKeepAlive >= 0)
+				remote->Self()->SetOption(SO_KEEPALIVE, GetRoutedConfig()->m_tcpKeepAlive,
 					SOL_SOCKET);
 			ForwardData();
 // in case of NAT socket, IsReadable cause race condition if the remote socket
@@ -11249,7 +11534,7 @@ bool CallSignalSocket::SetH245Address(H225_TransportAddress & h245addr)
         if (GetRemote() && GetRemote()->m_h245Tunneling && m_h245Tunneling) {
             return false;	// remove H245Address from message if it goes to tunneling H.460.19 endpoint
         }
-		if (GkConfig()->GetBoolean(RoutedSec, "EnableH245Multiplexing", false)) {
+		if (GetRoutedConfig()->m_enableH245Multiplexing) {
 		    setMultiplexPort = true;
 		}
 	}
@@ -11266,7 +11551,7 @@ bool CallSignalSocket::SetH245Address(H225_TransportAddress & h245addr)
 				return false;	// remove H245Address from message if it goes to tunneling side
 			}
             if (setMultiplexPort) {
-                SetH225Port(h245addr, (WORD)GkConfig()->GetInteger(RoutedSec, "H245MultiplexPort", 1722));
+                SetH225Port(h245addr, GetRoutedConfig()->m_h245MultiplexPort);
             }
 			return true;
 		}
@@ -11281,7 +11566,7 @@ bool CallSignalSocket::SetH245Address(H225_TransportAddress & h245addr)
 
 	m_h245socket->SetH245Address(h245addr, masqAddr);
 	if (setMultiplexPort) {
-	    SetH225Port(h245addr, (WORD)GkConfig()->GetInteger(RoutedSec, "H245MultiplexPort", 1722));
+	    SetH225Port(h245addr, GetRoutedConfig()->m_h245MultiplexPort);
 	}
 
 	if (m_h245TunnelingTranslation && !m_h245Tunneling && GetRemote() && GetRemote()->m_h245Tunneling) {
@@ -11321,7 +11606,7 @@ bool CallSignalSocket::InternalConnectTo(
 			SetConnected(true);
 			remote->SetConnected(true);
 			// TOS H.225 outbound - setup, releaseComplete etc.
-			int dscp = GkConfig()->GetInteger(RoutedSec, "H225DiffServ", 0);
+			int dscp = GetRoutedConfig()->m_h225DiffServ;
             if (dscp > 0) {
                 int h225TypeOfService = (dscp << 2);
 #if defined(hasIPV6) && defined(IPV6_TCLASS)
@@ -11609,7 +11894,7 @@ bool H245Handler::HandleCommand(H245_CommandMessage & Command, bool & suppress,
 	if (Command.GetTag() == H245_CommandMessage::e_endSessionCommand)
 		isH245ended = true;
 
-	unsigned filterFastUpdatePeriod = GkConfig()->GetInteger(RoutedSec, "FilterVideoFastUpdatePicture", 0);
+	unsigned filterFastUpdatePeriod = GetRoutedConfig()->m_filterVideoFastUpdatePicture;
 	if (filterFastUpdatePeriod > 0 && Command.GetTag() == H245_CommandMessage::e_miscellaneousCommand) {
 		H245_MiscellaneousCommand miscCommand = Command;
         if (miscCommand.m_type.GetTag() == H245_MiscellaneousCommand_type::e_videoFastUpdatePicture) {
@@ -11647,7 +11932,7 @@ H245Socket::H245Socket(CallSignalSocket *sig)
 				Toolkit::Instance()->PortNotification(H245Port, PortOpen, "tcp", GNUGK_INADDR_ANY, m_port, sig->GetCallNumber());
 
 			// TOS H.245 inbound TCS etc.
-			int dscp = GkConfig()->GetInteger(RoutedSec, "H245DiffServ", 0);
+			int dscp = GetRoutedConfig()->m_h245DiffServ;
             if (dscp > 0) {
                 int h245TypeOfService = (dscp << 2);
                 // set IPv4 and IPv6
@@ -11681,10 +11966,10 @@ H245Socket::H245Socket(CallSignalSocket *sig)
 	}
 	if (sig) {
         SetHandler(sig->GetHandler());
-        if (!GkConfig()->GetBoolean(RoutedSec, "DisableGnuGkH245TcpKeepAlive", false)) {
+        if (!GetRoutedConfig()->m_disableGnuGkH245TcpKeepAlive) {
             if (sig->UsesH460KeepAlive()) {
                 PTRACE(5, "H46018\tEnable keep-alive for H.245 in H.460.18 call");
-                RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+                RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
             } else {
                 RegisterKeepAlive();
             }
@@ -11701,10 +11986,10 @@ H245Socket::H245Socket(H245Socket *socket, CallSignalSocket *sig)
 	m_port = 0;
 	peerH245Addr = NULL;
 	socket->remote = this;
-    if (!GkConfig()->GetBoolean(RoutedSec, "DisableGnuGkH245TcpKeepAlive", false)) {
+    if (!GetRoutedConfig()->m_disableGnuGkH245TcpKeepAlive) {
         if (sig->UsesH460KeepAlive()) {
             PTRACE(5, "H46018\tEnable keep-alive for H.245 in H.460.18 call");
-            RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+            RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
         } else {
             RegisterKeepAlive();
         }
@@ -11729,6 +12014,12 @@ H245Socket::~H245Socket()
 		sigSocket->OnH245ChannelClosed();
 }
 
+callptr H245Socket::GetCaptureCall() const
+{
+	CallSignalSocket * socket = sigSocket; // use a copy to avoid race conditions with OnSignalingChannelClosed
+	return socket ? socket->GetCaptureCall() : callptr();
+}
+
 PString H245Socket::GetCallIdentifierAsString() const
 {
     if (sigSocket) {
@@ -11779,7 +12070,7 @@ void H245Socket::ConnectTo()
 #ifdef HAS_H46018
 			if (sigSocket && (sigSocket->IsCallFromTraversalServer() || sigSocket->IsCallToTraversalServer())) {
 				SendH46018Indication();
-                RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+                RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
 			}
 #endif
 			return;
@@ -12144,7 +12435,7 @@ bool H245Socket::ConnectRemote()
 			PTRACE(3, "H245\tConnect to " << GetName() << " from " << AsString(localAddr, pt) << " successful" << " (CallID: " << GetCallIdentifierAsString() << ")");
 
 			// TOS H.245 outbound - TCS messages etc.
-            int dscp = GkConfig()->GetInteger(RoutedSec, "H245DiffServ", 0);
+            int dscp = GetRoutedConfig()->m_h245DiffServ;
             if (dscp > 0) {
                 int h245TypeOfService = (dscp << 2);
 #if defined(hasIPV6) && defined(IPV6_TCLASS)
@@ -12173,7 +12464,7 @@ bool H245Socket::ConnectRemote()
 #ifdef HAS_H46018
 			if (sigSocket && (sigSocket->IsCallFromTraversalServer() || sigSocket->IsCallToTraversalServer())) {
 				SendH46018Indication();
-                RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+                RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
 			}
 #endif
 
@@ -12248,10 +12539,10 @@ bool H245Socket::Reverting(const H225_TransportAddress & h245addr)
 // class NATH245Socket
 bool NATH245Socket::ConnectRemote()
 {
-    if (!GkConfig()->GetBoolean(RoutedSec, "DisableGnuGkH245TcpKeepAlive", false)) {
+    if (!GetRoutedConfig()->m_disableGnuGkH245TcpKeepAlive) {
         if (sigSocket && sigSocket->UsesH460KeepAlive()) {
             PTRACE(5, "H46018\tEnable keep-alive for H.245 in H.460.18 call");
-            RegisterKeepAlive(GkConfig()->GetInteger(RoutedSec, "H46018KeepAliveInterval", 19));
+            RegisterKeepAlive(GetRoutedConfig()->m_h46018KeepAliveInterval);
         } else {
             RegisterKeepAlive();
         }
@@ -12493,7 +12784,7 @@ MultiplexH245Listener::MultiplexH245Listener(const Address & addr, WORD pt)
 	}
 
 	// TOS H.245 listener
-	int dscp = GkConfig()->GetInteger(RoutedSec, "H245DiffServ", 0);
+	int dscp = GetRoutedConfig()->m_h245DiffServ;
     if (dscp > 0) {
         int h245TypeOfService = (dscp << 2);
 #if defined(hasIPV6) && defined(IPV6_TCLASS)
@@ -12539,7 +12830,7 @@ ServerSocket *MultiplexH245Listener::CreateAcceptor() const
 
 
 // class MultiplexRTPListener
-MultiplexRTPListener::MultiplexRTPListener(WORD pt, WORD buffSize)
+MultiplexRTPListener::MultiplexRTPListener(WORD pt, bool sharedPort, WORD buffSize)
 {
 	wbuffer = new BYTE[buffSize];
 	wbufsize = buffSize;
@@ -12550,7 +12841,7 @@ MultiplexRTPListener::MultiplexRTPListener(WORD pt, WORD buffSize)
 	if (home.size() == 1)
 		localAddr = home[0];
 
-	if (!Listen(localAddr, 0, pt)) {
+	if (!(sharedPort ? ListenShared(localAddr, pt) : Listen(localAddr, 0, pt))) {
 		PTRACE(1, "RTPM\tFATAL Error: Can't open multiplex RTP listener on " << AsString(localAddr, pt));
         cerr << "FATAL Error: Can't open multiplex RTP listener on " << AsString(localAddr, pt) << endl;
         ExitGK();
@@ -12560,7 +12851,7 @@ MultiplexRTPListener::MultiplexRTPListener(WORD pt, WORD buffSize)
 		Toolkit::Instance()->PortNotification(RTPPort, PortOpen, "udp", GNUGK_INADDR_ANY, pt);
 
 	// Set the IP Type Of Service field for prioritization of media UDP / RTP packets
-	int dscp = GkConfig()->GetInteger(ProxySection, "RTPDiffServ", 4);	// default: IPTOS_LOWDELAY
+	int dscp = GetProxyConfig()->m_rtpDiffServ;	// default: IPTOS_LOWDELAY
 	if (dscp > 0) {
 		int rtpIpTypeofService = (dscp << 2);
 #if defined(hasIPV6) && defined(IPV6_TCLASS)
@@ -12591,6 +12882,62 @@ MultiplexRTPListener::MultiplexRTPListener(WORD pt, WORD buffSize)
 	SetWriteTimeout(PTimeInterval(50));
 }
 
+// open the port so several listeners can share it, the kernel picks the socket by a hash of the address 4-tuple
+bool MultiplexRTPListener::ListenShared(const Address & addr, WORD pt)
+{
+#ifdef SO_REUSEPORT
+	os_handle = ::socket((addr.GetVersion() == 6) ? PF_INET6 : PF_INET, SOCK_DGRAM, 0);
+	if (!ConvertOSError(os_handle))
+		return false;
+	if (!ConvertOSError(::fcntl(os_handle, F_SETFL, O_NONBLOCK)))
+		return false;
+	int enable = 1;
+#ifdef hasIPV6
+	if (addr.GetVersion() == 6 && addr.IsAny()) {
+		int v6only = 0;
+		if (::setsockopt(os_handle, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&v6only, sizeof(int)) != 0) {
+			PTRACE(1, "RTPM\tRemoving of IPV6_V6ONLY failed");
+		}
+	}
+#endif
+	if (!ConvertOSError(::setsockopt(os_handle, SOL_SOCKET, SO_REUSEADDR, (char *)&enable, sizeof(int)))
+		|| !ConvertOSError(::setsockopt(os_handle, SOL_SOCKET, SO_REUSEPORT, (char *)&enable, sizeof(int)))) {
+		PTRACE(1, "RTPM\tCan't set SO_REUSEPORT on multiplex socket");
+		return false;
+	}
+#ifdef LARGE_FDSET
+	return Bind(addr, pt);
+#else
+	int result;
+#ifdef hasIPV6
+	if (addr.GetVersion() == 6) {
+		struct sockaddr_in6 bindaddr6;
+		memset(&bindaddr6, 0, sizeof(bindaddr6));
+		bindaddr6.sin6_family = AF_INET6;
+		bindaddr6.sin6_addr = addr;
+		bindaddr6.sin6_port = htons(pt);
+		result = ::bind(os_handle, (struct sockaddr *)&bindaddr6, sizeof(bindaddr6));
+	} else
+#endif
+	{
+		struct sockaddr_in bindaddr;
+		memset(&bindaddr, 0, sizeof(bindaddr));
+		bindaddr.sin_family = AF_INET;
+		bindaddr.sin_addr = addr;
+		bindaddr.sin_port = htons(pt);
+		result = ::bind(os_handle, (struct sockaddr *)&bindaddr, sizeof(bindaddr));
+	}
+	if (!ConvertOSError(result))
+		return false;
+	port = pt;
+	return true;
+#endif // LARGE_FDSET
+#else
+	PTRACE(1, "RTPM\tSO_REUSEPORT not supported, can't share port " << pt);
+	return false;
+#endif // SO_REUSEPORT
+}
+
 MultiplexRTPListener::~MultiplexRTPListener()
 {
 	if (Toolkit::Instance()->IsPortNotificationActive())
@@ -12631,8 +12978,8 @@ H46019Session::H46019Session(PINDEX callno, WORD session, void * openedBy)
 {
     m_deleted = false;
     m_deleteTime = 0;
-    m_lastPacketFromA = time(NULL);
-    m_lastPacketFromB = time(NULL);
+    m_activitySlotA = RTPInactivityTracker::NoSlot;
+    m_activitySlotB = RTPInactivityTracker::NoSlot;
 	m_callno = callno;
 	m_session = session;
 	m_flcn = 0;	// only used for master assigned sessions
@@ -12649,8 +12996,9 @@ H46019Session::H46019Session(PINDEX callno, WORD session, void * openedBy)
 #ifdef UNIT_TEST
     m_EnableRTCPStats = false;
 #else
-	m_EnableRTCPStats = GkConfig()->GetBoolean(ProxySection, "EnableRTCPStats", false);
+	m_EnableRTCPStats = GetProxyConfig()->m_enableRTCPStats;
 #endif
+	m_rtcpSampleCounter = 0;
 #ifdef HAS_H235_MEDIA
 	m_encryptingLC = NULL;
 	m_decryptingLC = NULL;
@@ -12669,8 +13017,8 @@ H46019Session::H46019Session(const H46019Session & other)
 {
     m_deleted = other.m_deleted;
     m_deleteTime = other.m_deleteTime;
-    m_lastPacketFromA = other.m_lastPacketFromA;
-    m_lastPacketFromB = other.m_lastPacketFromB;
+    m_activitySlotA = other.m_activitySlotA;
+    m_activitySlotB = other.m_activitySlotB;
 	m_callno = other.m_callno;
 	m_session = other.m_session;
 	m_flcn = other.m_flcn;
@@ -12689,6 +13037,7 @@ H46019Session::H46019Session(const H46019Session & other)
 	m_osSocketToB = other.m_osSocketToB;
 	m_osSocketToB_RTCP = other.m_osSocketToB_RTCP;
 	m_EnableRTCPStats = other.m_EnableRTCPStats;
+	m_rtcpSampleCounter = other.m_rtcpSampleCounter;
 #ifdef HAS_H235_MEDIA
 	m_encryptingLC = other.m_encryptingLC;
 	m_decryptingLC = other.m_decryptingLC;
@@ -12704,6 +13053,8 @@ H46019Session & H46019Session::operator=(const H46019Session & other)
 
     m_deleted = other.m_deleted;
     m_deleteTime = other.m_deleteTime;
+    m_activitySlotA = other.m_activitySlotA;
+    m_activitySlotB = other.m_activitySlotB;
     m_callno = other.m_callno;
     m_session = other.m_session;
     m_flcn = other.m_flcn;
@@ -12722,6 +13073,7 @@ H46019Session & H46019Session::operator=(const H46019Session & other)
     m_osSocketToB = other.m_osSocketToB;
     m_osSocketToB_RTCP = other.m_osSocketToB_RTCP;
     m_EnableRTCPStats = other.m_EnableRTCPStats;
+    m_rtcpSampleCounter = other.m_rtcpSampleCounter;
 #ifdef HAS_H235_MEDIA
     m_encryptingLC = other.m_encryptingLC;
     m_decryptingLC = other.m_decryptingLC;
@@ -12732,41 +13084,45 @@ H46019Session & H46019Session::operator=(const H46019Session & other)
     return *this;
 }
 
-// merge deleted status and multiplex IDs
-H46019Session & H46019Session::Merge(const H46019Session & other)
-{
-    if (m_callno != other.m_callno || m_session != other.m_session)
-        return *this; // can't merge
-
-    m_deleted = (m_deleted || other.m_deleted);
-    m_deleteTime = (m_deleteTime > other.m_deleteTime) ? m_deleteTime : other.m_deleteTime;
-
-    m_multiplexID_fromA = (m_multiplexID_fromA == INVALID_MULTIPLEX_ID) ? other.m_multiplexID_fromA : m_multiplexID_fromA;
-    m_multiplexID_toA = (m_multiplexID_toA == INVALID_MULTIPLEX_ID) ? other.m_multiplexID_toA : m_multiplexID_toA;
-    m_multiplexID_fromB = (m_multiplexID_fromB == INVALID_MULTIPLEX_ID) ? other.m_multiplexID_fromB : m_multiplexID_fromB;
-    m_multiplexID_toB = (m_multiplexID_toB == INVALID_MULTIPLEX_ID) ? other.m_multiplexID_toB : m_multiplexID_toB;
-
+void H46019Session::Update(const H46019Session & update, bool swapSides)
+{
+	const IPAndPortAddress & addrA = swapSides ? update.m_addrB : update.m_addrA;
+	const IPAndPortAddress & addrA_RTCP = swapSides ? update.m_addrB_RTCP : update.m_addrA_RTCP;
+	const IPAndPortAddress & addrB = swapSides ? update.m_addrA : update.m_addrB;
+	const IPAndPortAddress & addrB_RTCP = swapSides ? update.m_addrA_RTCP : update.m_addrB_RTCP;
+	if (IsSet(addrA))
+		m_addrA = addrA;
+	if (IsSet(addrA_RTCP))
+		m_addrA_RTCP = addrA_RTCP;
+	if (IsSet(addrB))
+		m_addrB = addrB;
+	if (IsSet(addrB_RTCP))
+		m_addrB_RTCP = addrB_RTCP;
+
+	const DWORD ids[4] = { update.m_multiplexID_fromA, update.m_multiplexID_toA, update.m_multiplexID_fromB, update.m_multiplexID_toB };
+	DWORD * mine[4] = { &m_multiplexID_fromA, &m_multiplexID_toA, &m_multiplexID_fromB, &m_multiplexID_toB };
+	const int sockets[4] = { update.m_osSocketToA, update.m_osSocketToA_RTCP, update.m_osSocketToB, update.m_osSocketToB_RTCP };
+	int * mySockets[4] = { &m_osSocketToA, &m_osSocketToA_RTCP, &m_osSocketToB, &m_osSocketToB_RTCP };
+	for (unsigned i = 0; i < 4; ++i) {
+		const unsigned j = swapSides ? (i + 2) % 4 : i;
+		if (ids[i] != INVALID_MULTIPLEX_ID)
+			*mine[j] = ids[i];
+		if (sockets[i] != INVALID_OSSOCKET)
+			*mySockets[j] = sockets[i];
+	}
+
+	if (update.m_flcn != 0)
+		m_flcn = update.m_flcn;
 #ifdef HAS_H235_MEDIA
-    m_encryptMultiplexID = (m_encryptMultiplexID == INVALID_MULTIPLEX_ID) ? other.m_encryptMultiplexID : m_encryptMultiplexID;
-    m_decryptMultiplexID = (m_decryptMultiplexID == INVALID_MULTIPLEX_ID) ? other.m_decryptMultiplexID : INVALID_MULTIPLEX_ID;
+	if (update.m_encryptingLC)
+		m_encryptingLC = update.m_encryptingLC;
+	if (update.m_decryptingLC)
+		m_decryptingLC = update.m_decryptingLC;
+	if (update.m_encryptMultiplexID != INVALID_MULTIPLEX_ID)
+		m_encryptMultiplexID = update.m_encryptMultiplexID;
+	if (update.m_decryptMultiplexID != INVALID_MULTIPLEX_ID)
+		m_decryptMultiplexID = update.m_decryptMultiplexID;
 #endif
-
-    return *this;
-}
-
-// return a copy with side A and B swapped
-H46019Session H46019Session::SwapSides() const
-{
-	H46019Session result = *this;
-	swap(result.m_openedBy, result.m_otherSide);
-	swap(result.m_addrA, result.m_addrB);
-	swap(result.m_addrA_RTCP, result.m_addrB_RTCP);
-	swap(result.m_multiplexID_fromA, result.m_multiplexID_fromB);
-	swap(result.m_multiplexID_toA, result.m_multiplexID_toB);
-	swap(result.m_osSocketToA, result.m_osSocketToB);
-	swap(result.m_osSocketToA_RTCP, result.m_osSocketToB_RTCP);
-
-	return result;
 }
 
 void H46019Session::Dump() const
@@ -12790,93 +13146,97 @@ void H46019Session::Dump() const
 #endif
 }
 
-void H46019Session::HandlePacket(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, void * data, unsigned len, bool isRTCP)
+bool H46019Session::IsNewSource(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, bool isRTCP) const
 {
-    if (m_deleted)
-        return;
+	if (receivedMultiplexID == m_multiplexID_fromA)
+		return (isRTCP ? m_addrA_RTCP : m_addrA) != fromAddress;
+	if (receivedMultiplexID == m_multiplexID_fromB)
+		return (isRTCP ? m_addrB_RTCP : m_addrB) != fromAddress;
+	return false;
+}
 
-    if (PTrace::CanTrace(7)) {
-    	PTRACE(7, "JW RTP DB: multiplexID=" << receivedMultiplexID
-	    				 << " isRTCP=" << isRTCP << " ka=" << IsKeepAlive(len, isRTCP)
-		    			 << " from=" << AsString(fromAddress));
-	    Dump();
-    }
+bool H46019Session::LearnSource(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, bool isRTCP)
+{
+	if (!IsNewSource(receivedMultiplexID, fromAddress, isRTCP))
+		return false;	// another reader was faster
+	// port detection by keepAlive or by the first media packet for channels from client to server that won't have a keepAlive
+	if (receivedMultiplexID == m_multiplexID_fromA) {
+		if (isRTCP)
+			m_addrA_RTCP = fromAddress;
+		else
+			m_addrA = fromAddress;
+	} else {
+		if (isRTCP)
+			m_addrB_RTCP = fromAddress;
+		else
+			m_addrB = fromAddress;
+	}
+	return true;
+}
 
-	// re-check status after waiting for I/O
-    if (m_deleted)
-        return;
+void H46019Session::GetRoute(DWORD receivedMultiplexID, unsigned len, bool isRTCP, H46019PacketRoute & route)
+{
+	route.m_callno = m_callno;
+	route.m_session = m_session;
+	route.m_openedBy = m_openedBy;
+	route.m_fromA = (receivedMultiplexID == m_multiplexID_fromA);
+	route.m_fromB = !route.m_fromA && (receivedMultiplexID == m_multiplexID_fromB);
+	if (route.m_fromA) {
+		route.m_ready = sideBReady(isRTCP);
+		route.m_multiplexID_to = m_multiplexID_toB;
+		route.m_to = isRTCP ? m_addrB_RTCP : m_addrB;
+		route.m_osSocketTo = isRTCP ? m_osSocketToB_RTCP : m_osSocketToB;
+	} else if (route.m_fromB) {
+		route.m_ready = sideAReady(isRTCP);
+		route.m_multiplexID_to = m_multiplexID_toA;
+		route.m_to = isRTCP ? m_addrA_RTCP : m_addrA;
+		route.m_osSocketTo = isRTCP ? m_osSocketToA_RTCP : m_osSocketToA;
+	} else {
+		route.m_ready = false;
+	}
+	route.m_rtcpStats = isRTCP && m_EnableRTCPStats;
+	if (route.m_rtcpStats)
+		route.m_rtcpSampleCounter = GkAtomicIncrement(&m_rtcpSampleCounter) - 1;	// RTCP from both sides may arrive on different readers
+#ifdef HAS_H46024B
+	if (IsKeepAlive(len, isRTCP)) {
+		route.m_addrA = m_addrA;
+		route.m_addrB = m_addrB;
+		route.m_multiplexID_toA = m_multiplexID_toA;
+		route.m_multiplexID_toB = m_multiplexID_toB;
+	}
+#endif
+#ifdef HAS_H235_MEDIA
+	route.m_bothSidesSet = IsSet(m_addrA) && IsSet(m_addrB);
+	route.m_encrypting = (receivedMultiplexID == m_encryptMultiplexID);
+	route.m_cryptoLC = route.m_encrypting ? m_encryptingLC : m_decryptingLC;
+#endif
+}
+
+void H46019Session::Forward(const H46019PacketRoute & route, const IPAndPortAddress & fromAddress, void * data, unsigned len, bool isRTCP)
+{
     // TODO: could we cache the call ptr in the session as a performance optimization ? how to avoid race condition on call shutdown ?
-    callptr call = CallTable::Instance()->FindCallRec(m_callno);
+    callptr call = CallTable::Instance()->FindCallRec(route.m_callno);
     if (!call) {
-        PTRACE(5, "RTPM\tCan't find call " << m_callno);
+        PTRACE(5, "RTPM\tCan't find call " << route.m_callno);
         return;
     }
-    // re-check deleted status after waiting for call table lock
-    if (m_deleted)
-        return;
-    bool isFromA = (receivedMultiplexID == m_multiplexID_fromA);
-    bool isFromB = (receivedMultiplexID == m_multiplexID_fromB);
-    if (isFromA)
-        m_lastPacketFromA = time(NULL);
-    if (isFromB)
-        m_lastPacketFromB = time(NULL);
+    if (route.m_newSource) {
+        call->SetSessionMultiplexDestination(route.m_session, route.m_openedBy, isRTCP, fromAddress, route.m_fromA ? SideA : SideB);
+    }
     if (IsKeepAlive(len, isRTCP)) {
-		if (isFromA) {
-			if (isRTCP) {
-			    if (m_addrA_RTCP != fromAddress) {
-    				m_addrA_RTCP = fromAddress;
-                    call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideA);
-			    };
-			} else if (m_addrA != fromAddress) {
-				m_addrA = fromAddress;
-                call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideA);
-			};
-		} else if (isFromB) {
-			if (isRTCP) {
-                if (m_addrB_RTCP != fromAddress) {
-    				m_addrB_RTCP = fromAddress;
-                    call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideB);
-                };
-			} else if (m_addrB != fromAddress) {
-				m_addrB = fromAddress;
-                call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideB);
-			}
-		}
 		MultiplexedRTPHandler::Instance()->DumpChannels(" keepAlive handled ");
 
 #ifdef HAS_H46024B
 		if (call->GetNATStrategy() == CallRec::e_natAnnexB)
-			call->H46024BInitiate(m_session, m_addrA, m_addrB, m_multiplexID_toA, m_multiplexID_toB);
+			call->H46024BInitiate(route.m_session, route.m_addrA, route.m_addrB, route.m_multiplexID_toA, route.m_multiplexID_toB);
 #endif	// HAS_H46024B
 
 		if (!isRTCP)
 			return;	// don't forward RTP keepalives
 	}
 
-	// port detection by first media packet for channels from client to server that won't have a keepAlive
-	if (isFromA) {
-		if (isRTCP && (m_addrA_RTCP != fromAddress)) {
-			m_addrA_RTCP = fromAddress;
-            call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideA);
-        }
-		if (!isRTCP && (m_addrA != fromAddress)) {
-			m_addrA = fromAddress;
-            call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideA);
-        }
-	}
-	if (isFromB) {
-		if (isRTCP && (m_addrB_RTCP != fromAddress)) {
-			m_addrB_RTCP = fromAddress;
-            call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideB);
-        }
-		if (!isRTCP && (m_addrB != fromAddress)) {
-			m_addrB = fromAddress;
-            call->SetSessionMultiplexDestination(m_session, m_openedBy, isRTCP, fromAddress, SideB);
-        }
-	}
-
 #ifdef HAS_H235_MEDIA
-	if (!isRTCP && call->IsMediaEncryption() && IsSet(m_addrA) && IsSet(m_addrB)) {
+	if (!isRTCP && call->IsMediaEncryption() && route.m_bothSidesSet) {
 		WORD wlen = len;
 		bool succesful = false;
 		unsigned char ivSequence[6];
@@ -12892,14 +13252,8 @@ void H46019Session::HandlePacket(DWORD receivedMultiplexID, const IPAndPortAddre
 		    return; // no data to en-/decrypt
 		}
 
-		if (receivedMultiplexID == m_encryptMultiplexID) {
-			if (m_encryptingLC) {
-				succesful = m_encryptingLC->ProcessH235Media((BYTE*)data, wlen, true, ivSequence, rtpPadding, payloadType);
-			}
-		} else {
-			if (m_decryptingLC) {
-				succesful = m_decryptingLC->ProcessH235Media((BYTE*)data, wlen, false, ivSequence, rtpPadding, payloadType);
-			}
+		if (route.m_cryptoLC) {
+			succesful = route.m_cryptoLC->ProcessH235Media((BYTE*)data, wlen, route.m_encrypting, ivSequence, rtpPadding, payloadType);
 		}
 
 		if (!succesful)
@@ -12922,42 +13276,33 @@ void H46019Session::HandlePacket(DWORD receivedMultiplexID, const IPAndPortAddre
 	if (Toolkit::Instance()->IsH46026Enabled()) {
         if (call->GetCallingParty() && call->GetCallingParty()->UsesH46026()) {
             if (call->GetCallingParty()->GetSocket()) {
-                call->GetCallingParty()->GetSocket()->SendH46026RTP(m_session, !isRTCP, data, len);
+                call->GetCallingParty()->GetSocket()->SendH46026RTP(route.m_session, !isRTCP, data, len);
             }
             return;
         } else if (call->GetCalledParty() && call->GetCalledParty()->UsesH46026()) {
             if (call->GetCalledParty()->GetSocket()) {
-                call->GetCalledParty()->GetSocket()->SendH46026RTP(m_session, !isRTCP, data, len);
+                call->GetCalledParty()->GetSocket()->SendH46026RTP(route.m_session, !isRTCP, data, len);
             }
             return;
         }
 	}
 #endif
 
-    PIPSocket::Address gkIP;
-	if (receivedMultiplexID == m_multiplexID_fromA) {
-		if (sideBReady(isRTCP)) {
-            if (call->GetEndpointIPMapping((isRTCP ? m_addrB_RTCP.GetIP() : m_addrB.GetIP()), gkIP)) {
-    			Send(m_multiplexID_toB, (isRTCP ? m_addrB_RTCP : m_addrB), (isRTCP ? m_osSocketToB_RTCP : m_osSocketToB), data, len, true, &gkIP);
-            } else {
-    			Send(m_multiplexID_toB, (isRTCP ? m_addrB_RTCP : m_addrB), (isRTCP ? m_osSocketToB_RTCP : m_osSocketToB), data, len, true, NULL);
-            }
-		} else {
-			PTRACE(5, "RTPM\tReceiver not ready (session " << m_session << (isRTCP ? " RTCP" : " RTP") << " from " << AsString(fromAddress) << ")");
-		}
-	} else if (receivedMultiplexID == m_multiplexID_fromB) {
-		if (sideAReady(isRTCP)) {
-            if (call->GetEndpointIPMapping((isRTCP ? m_addrA_RTCP.GetIP() : m_addrA.GetIP()), gkIP)) {
-			    Send(m_multiplexID_toA, (isRTCP ? m_addrA_RTCP : m_addrA), (isRTCP ? m_osSocketToA_RTCP : m_osSocketToA), data, len, true, &gkIP);
+	if (route.m_fromA || route.m_fromB) {
+		if (route.m_ready) {
+            PIPSocket::Address gkIP;
+            if (call->GetEndpointIPMapping(route.m_to.GetIP(), gkIP)) {
+    			Send(route.m_multiplexID_to, route.m_to, route.m_osSocketTo, data, len, true, &gkIP);
             } else {
-			    Send(m_multiplexID_toA, (isRTCP ? m_addrA_RTCP : m_addrA), (isRTCP ? m_osSocketToA_RTCP : m_osSocketToA), data, len, true, NULL);
+    			Send(route.m_multiplexID_to, route.m_to, route.m_osSocketTo, data, len, true, NULL);
             }
 		} else {
-			PTRACE(5, "RTPM\tReceiver not ready (session " << m_session << (isRTCP ? " RTCP" : " RTP") << " from " << AsString(fromAddress) << ")");
+			PTRACE(5, "RTPM\tReceiver not ready (session " << route.m_session << (isRTCP ? " RTCP" : " RTP") << " from " << AsString(fromAddress) << ")");
 		}
 	}
-	if (isRTCP && m_EnableRTCPStats) {
-        ParseRTCP(call, m_session, fromAddress.GetIP(), (BYTE*)data, len);
+	if (route.m_rtcpStats) {
+		unsigned sampleCounter = route.m_rtcpSampleCounter;
+        RTCPStatsAggregator::Instance()->QueueReport(sampleCounter, route.m_callno, route.m_session, fromAddress.GetIP(), (const BYTE*)data, len);
     }
 }
 
@@ -13047,11 +13392,12 @@ void H46019Session::Send(DWORD sendMultiplexID, const IPAndPortAddress & toAddre
 }
 
 
-MultiplexedRTPReader::MultiplexedRTPReader()
+MultiplexedRTPReader::MultiplexedRTPReader(unsigned shard, bool sharedPort)
 {
 	m_multiplexRTPListener = NULL;
 	m_multiplexRTCPListener = NULL;
-	SetName("MultiplexedRTPReader");
+	m_sharedPort = sharedPort;
+	SetName(sharedPort ? PString("MultiplexedRTPReader") + PString(shard) : PString("MultiplexedRTPReader"));
 	Execute();
 }
 
@@ -13067,9 +13413,9 @@ MultiplexedRTPReader::~MultiplexedRTPReader()
 
 void MultiplexedRTPReader::OnStart()
 {
-	if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
+	if (GetProxyConfig()->m_rtpMultiplexing) {
 		// create multiplex RTP listeners
-		 m_multiplexRTPListener = new MultiplexRTPListener((WORD)GkConfig()->GetInteger(ProxySection, "RTPMultiplexPort", GK_DEF_MULTIPLEX_RTP_PORT));
+		 m_multiplexRTPListener = new MultiplexRTPListener(GetProxyConfig()->m_rtpMultiplexPort, m_sharedPort);
 		 if (m_multiplexRTPListener->IsOpen()) {
 			PTRACE(1, "RTPM\tMultiplex RTP listener listening on port " << m_multiplexRTPListener->GetPort());
 			AddSocket(m_multiplexRTPListener);
@@ -13080,7 +13426,7 @@ void MultiplexedRTPReader::OnStart()
 			m_multiplexRTPListener = NULL;
 			ExitGK();
 		}
-		 m_multiplexRTCPListener = new MultiplexRTPListener((WORD)GkConfig()->GetInteger(ProxySection, "RTCPMultiplexPort", GK_DEF_MULTIPLEX_RTCP_PORT));
+		 m_multiplexRTCPListener = new MultiplexRTPListener(GetProxyConfig()->m_rtcpMultiplexPort, m_sharedPort);
 		 if (m_multiplexRTCPListener->IsOpen()) {
 			PTRACE(1, "RTPM\tMultiplex RTCP listener listening on port " << m_multiplexRTCPListener->GetPort());
 			AddSocket(m_multiplexRTCPListener);
@@ -13105,6 +13451,70 @@ void MultiplexedRTPReader::ReadSocket(IPSocket * socket)
 	psocket->ReceiveData();
 }
 
+H46019SessionTable::Handle H46019SessionTable::Add(const H46019Session & chan)
+{
+	Handle h = m_sessions.insert(m_sessions.end(), chan);
+	m_byCall.insert(std::make_pair(chan.m_callno, h));
+	IndexMultiplexIDs(h);
+	return h;
+}
+
+void H46019SessionTable::Update(Handle chan, const H46019Session & update, bool swapSides)
+{
+	UnindexMultiplexIDs(chan);
+	chan->Update(update, swapSides);
+	IndexMultiplexIDs(chan);
+}
+
+void H46019SessionTable::Erase(Handle chan)
+{
+	UnindexMultiplexIDs(chan);
+	std::pair<std::multimap<PINDEX, Handle>::iterator, std::multimap<PINDEX, Handle>::iterator> range
+		= m_byCall.equal_range(chan->m_callno);
+	for (std::multimap<PINDEX, Handle>::iterator i = range.first; i != range.second; ++i) {
+		if (i->second == chan) {
+			m_byCall.erase(i);
+			break;
+		}
+	}
+	m_sessions.erase(chan);
+}
+
+H46019SessionTable::Handle H46019SessionTable::Find(PINDEX callno, WORD session) const
+{
+	std::pair<CallIterator, CallIterator> range = FindCall(callno);
+	for (CallIterator i = range.first; i != range.second; ++i) {
+		if (!i->second->m_deleted && i->second->m_session == session)
+			return i->second;
+	}
+	return End();
+}
+
+H46019SessionTable::Handle H46019SessionTable::FindByMultiplexID(DWORD multiplexID) const
+{
+	std::map<DWORD, Handle>::const_iterator i = m_byMultiplexID.find(multiplexID);
+	return (i != m_byMultiplexID.end()) ? i->second : End();
+}
+
+void H46019SessionTable::IndexMultiplexIDs(Handle chan)
+{
+	// a newer session takes over an ID still held by a deleted one
+	if (chan->m_multiplexID_fromA != INVALID_MULTIPLEX_ID)
+		m_byMultiplexID[chan->m_multiplexID_fromA] = chan;
+	if (chan->m_multiplexID_fromB != INVALID_MULTIPLEX_ID)
+		m_byMultiplexID[chan->m_multiplexID_fromB] = chan;
+}
+
+void H46019SessionTable::UnindexMultiplexIDs(Handle chan)
+{
+	const DWORD ids[2] = { chan->m_multiplexID_fromA, chan->m_multiplexID_fromB };
+	for (unsigned i = 0; i < 2; ++i) {
+		std::map<DWORD, Handle>::iterator iter = m_byMultiplexID.find(ids[i]);
+		if (iter != m_byMultiplexID.end() && iter->second == chan)
+			m_byMultiplexID.erase(iter);
+	}
+}
+
 MultiplexedRTPHandler::MultiplexedRTPHandler() : Singleton<MultiplexedRTPHandler>("MultiplexedRTPHandler")
 {
 	m_idCounter = 0;
@@ -13120,12 +13530,21 @@ MultiplexedRTPHandler::MultiplexedRTPHandler() : Singleton<MultiplexedRTPHandler
         PTRACE(1, "RTPM\tError: You can only check audio or video sessions for inactivity");
         m_inactivityCheckSession = 1; // default to audio
     }
-	if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false)) {
-		m_reader = new MultiplexedRTPReader();
+	if (GetProxyConfig()->m_rtpMultiplexing) {
+		unsigned numReaders = GetProxyConfig()->m_rtpMultiplexReaders;
+#ifndef SO_REUSEPORT
+		if (numReaders > 1) {
+			PTRACE(1, "RTPM\tWarning: RTPMultiplexReaders needs SO_REUSEPORT, using a single reader");
+			numReaders = 1;
+		}
+#endif
+		// sessions are shared, a flow always arrives on the same reader, so the readers only contend on the read lock
+		for (unsigned i = 0; i < numReaders; ++i)
+			m_readers.push_back(new MultiplexedRTPReader(i, numReaders > 1));
+		PTRACE(3, "RTPM\tStarted " << numReaders << " multiplex reader(s)");
 		PTime now;
         m_cleanupTimer = Toolkit::Instance()->GetTimerManager()->RegisterTimer(this, &MultiplexedRTPHandler::SessionCleanup, now, 30);
 	} else {
-		m_reader = NULL;
 		m_cleanupTimer = GkTimerManager::INVALID_HANDLE;
 	}
 }
@@ -13141,24 +13560,19 @@ void MultiplexedRTPHandler::AddChannel(const H46019Session & chan)
 {
 	WriteLock lock(m_listLock);
 	if (chan.IsValid()) {
-		bool found = false;
 		// update if we have a channel for this session
-		for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-				iter != m_h46019channels.end() ; ++iter) {
-			if (   (iter->m_callno == chan.m_callno)
-				&& (iter->m_session == chan.m_session)) {
-                H46019Session c = chan;
-				if (iter->m_openedBy != c.m_openedBy) {
-                    c = chan.SwapSides();
-				}
-                c.Merge(*iter);
-                *iter = c;
-				found = true;
+		H46019SessionTable::Handle iter = m_h46019channels.Find(chan.m_callno, chan.m_session);
+		if (iter != m_h46019channels.End()) {
+			m_h46019channels.Update(iter, chan, iter->m_openedBy != chan.m_openedBy);
+		} else {
+			// else add
+			H46019SessionTable::Handle added = m_h46019channels.Add(chan);
+			if (m_inactivityCheck) {
+				const time_t now = time(NULL);
+				added->m_activitySlotA = m_activity.Allocate(added->m_callno, m_inactivityTimeout, now);
+				added->m_activitySlotB = m_activity.Allocate(added->m_callno, m_inactivityTimeout, now);
 			}
 		}
-		// else add
-		if (!found)
-			m_h46019channels.push_back(chan);
 	} else {
 		PTRACE(1, "H46019\tError: Adding invalid H460.19 channel");
 	}
@@ -13168,21 +13582,16 @@ void MultiplexedRTPHandler::AddChannel(const H46019Session & chan)
 void MultiplexedRTPHandler::UpdateChannelSession(PINDEX callno, WORD flcn, void * openedBy, WORD session)
 {
 	WriteLock lock(m_listLock);
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-        if (!iter->m_deleted) {
-            if (   (iter->m_callno == callno)
-                && (iter->m_session == session) ) {
-                return;	// session already in list - all is well
-            }
-            if (   (iter->m_callno == callno)
-                && (iter->m_flcn == flcn)
-                && (iter->m_openedBy == openedBy) ) {
-                    iter->m_session = session;
-                    iter->m_flcn = 0;	// reset
-                DumpChannels(" UpdateChannelSession() done ");
-                return;
-            }
+	if (m_h46019channels.Find(callno, session) != m_h46019channels.End())
+		return;	// session already in list - all is well
+	std::pair<H46019SessionTable::CallIterator, H46019SessionTable::CallIterator> range = m_h46019channels.FindCall(callno);
+	for (H46019SessionTable::CallIterator i = range.first; i != range.second; ++i) {
+		H46019SessionTable::Handle iter = i->second;
+		if (!iter->m_deleted && (iter->m_flcn == flcn) && (iter->m_openedBy == openedBy)) {
+			iter->m_session = session;
+			iter->m_flcn = 0;	// reset
+			DumpChannels(" UpdateChannelSession() done ");
+			return;
 		}
 	}
 	PTRACE(1, "H46019\tError: Updating master assigned RTP session failed: flcn=" << flcn << " openedBy=" << openedBy);
@@ -13191,65 +13600,101 @@ void MultiplexedRTPHandler::UpdateChannelSession(PINDEX callno, WORD flcn, void
 void MultiplexedRTPHandler::UpdateChannel(const H46019Session & chan)
 {
 	WriteLock lock(m_listLock);
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-        if (!iter->m_deleted) {
-            if (   (iter->m_callno == chan.m_callno)
-                && (iter->m_session == chan.m_session)) {
-                H46019Session c = chan;
-                if (iter->m_openedBy != chan.m_openedBy) {
-                    c = chan.SwapSides();
-                }
-                c.Merge(*iter);
-                *iter = c;
-                DumpChannels(" UpdateChannel() done ");
-                return;
-            }
-        }
+	H46019SessionTable::Handle iter = m_h46019channels.Find(chan.m_callno, chan.m_session);
+	if (iter != m_h46019channels.End()) {
+		m_h46019channels.Update(iter, chan, iter->m_openedBy != chan.m_openedBy);
+		DumpChannels(" UpdateChannel() done ");
 	}
 }
 
-H46019Session MultiplexedRTPHandler::GetChannelSwapped(PINDEX callno, WORD session, void * openedBy) const
+void MultiplexedRTPHandler::SetChannelAddress(PINDEX callno, WORD session, H46019Side side, bool isRTCP, const IPAndPortAddress & addr)
 {
-	ReadLock lock(m_listLock);
-	for (list<H46019Session>::const_iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-        if (!iter->m_deleted) {
-            if (iter->m_callno == callno && iter->m_session == session) {
-                if (iter->m_openedBy == openedBy) {
-                    return *iter;
-                } else {
-                    return iter->SwapSides();
-                }
-            }
-        }
+	WriteLock lock(m_listLock);
+	H46019SessionTable::Handle iter = m_h46019channels.Find(callno, session);
+	if (iter == m_h46019channels.End() || !iter->IsValid())
+		return;
+	if (side == SideA)
+		(isRTCP ? iter->m_addrA_RTCP : iter->m_addrA) = addr;
+	else
+		(isRTCP ? iter->m_addrB_RTCP : iter->m_addrB) = addr;
+	PTRACE(7, "JW RTP Set multiplex" << (side == SideA ? "A" : "B") << " to " << AsString(addr) << " based on sessionID=" << session
+		<< " IDfromA=" << iter->m_multiplexID_fromA << " IDfromB=" << iter->m_multiplexID_fromB);
+}
+
+void MultiplexedRTPHandler::SetNonMultiplexedChannelAddress(PINDEX callno, WORD session, bool isRTCP, const IPAndPortAddress & addr)
+{
+	WriteLock lock(m_listLock);
+	H46019SessionTable::Handle iter = m_h46019channels.Find(callno, session);
+	if (iter == m_h46019channels.End() || !iter->IsValid())
+		return;
+	if ((iter->m_multiplexID_fromA != INVALID_MULTIPLEX_ID) && (iter->m_multiplexID_fromB == INVALID_MULTIPLEX_ID)) {
+		(isRTCP ? iter->m_addrB_RTCP : iter->m_addrB) = addr;
+		PTRACE(7, "JW RTP Set multiplexB to " << AsString(addr) << " based on sessionID=" << session);
+	} else if ((iter->m_multiplexID_fromA == INVALID_MULTIPLEX_ID) && (iter->m_multiplexID_fromB != INVALID_MULTIPLEX_ID)) {
+		(isRTCP ? iter->m_addrA_RTCP : iter->m_addrA) = addr;
+		PTRACE(7, "JW RTP Set multiplexA to " << AsString(addr) << " based on sessionID=" << session);
 	}
-	return H46019Session(0, 0, NULL);	// not found
 }
 
-H46019Session MultiplexedRTPHandler::GetChannel(PINDEX callno, WORD session) const
+bool MultiplexedRTPHandler::HasChannel(PINDEX callno, WORD session) const
 {
 	ReadLock lock(m_listLock);
-	for (list<H46019Session>::const_iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-		if (!iter->m_deleted && iter->m_callno == callno && iter->m_session == session) {
-			return *iter;
-		}
+	return m_h46019channels.Find(callno, session) != m_h46019channels.End();
+}
+
+bool MultiplexedRTPHandler::GetChannelSide(PINDEX callno, WORD session, void * openedBy, H46019Side side, H46019SideInfo & info) const
+{
+	ReadLock lock(m_listLock);
+	H46019SessionTable::Handle iter = m_h46019channels.Find(callno, session);
+	if (iter == m_h46019channels.End())
+		return false;
+	if (openedBy != NULL && iter->m_openedBy != openedBy)
+		side = (side == SideA) ? SideB : SideA;
+	if (side == SideA) {
+		info.m_addr = iter->m_addrA;
+		info.m_addrRTCP = iter->m_addrA_RTCP;
+		info.m_multiplexID_from = iter->m_multiplexID_fromA;
+		info.m_multiplexID_to = iter->m_multiplexID_toA;
+		info.m_osSocket = iter->m_osSocketToA;
+		info.m_osSocketRTCP = iter->m_osSocketToA_RTCP;
+	} else {
+		info.m_addr = iter->m_addrB;
+		info.m_addrRTCP = iter->m_addrB_RTCP;
+		info.m_multiplexID_from = iter->m_multiplexID_fromB;
+		info.m_multiplexID_to = iter->m_multiplexID_toB;
+		info.m_osSocket = iter->m_osSocketToB;
+		info.m_osSocketRTCP = iter->m_osSocketToB_RTCP;
+	}
+	return true;
+}
+
+#ifdef HAS_H235_MEDIA
+void MultiplexedRTPHandler::SetChannelMediaEncryption(PINDEX callno, WORD session, bool encrypting, RTPLogicalChannel * lc, DWORD multiplexID)
+{
+	WriteLock lock(m_listLock);
+	H46019SessionTable::Handle iter = m_h46019channels.Find(callno, session);
+	if (iter == m_h46019channels.End())
+		return;
+	if (encrypting) {
+		iter->m_encryptingLC = lc;
+		if (multiplexID != INVALID_MULTIPLEX_ID)
+			iter->m_encryptMultiplexID = multiplexID;
+	} else {
+		iter->m_decryptingLC = lc;
+		if (multiplexID != INVALID_MULTIPLEX_ID)
+			iter->m_decryptMultiplexID = multiplexID;
 	}
-	return H46019Session(0, 0, NULL);	// not found
 }
+#endif
 
 void MultiplexedRTPHandler::RemoveChannels(PINDEX callno)
 {
 	WriteLock lock(m_listLock);
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; /* nothing */ ) {
-		if (!iter->m_deleted && iter->m_callno == callno) {
-            iter->m_deleted = true; // mark as logically deleted
-            iter->m_deleteTime = time(NULL);
-			//m_h46019channels.erase(iter++);
-		} else {
-			++iter;
+	std::pair<H46019SessionTable::CallIterator, H46019SessionTable::CallIterator> range = m_h46019channels.FindCall(callno);
+	for (H46019SessionTable::CallIterator i = range.first; i != range.second; ++i) {
+		if (!i->second->m_deleted) {
+            i->second->m_deleted = true; // mark as logically deleted
+            i->second->m_deleteTime = time(NULL);
 		}
 	}
 	DumpChannels(" RemoveChannels() done ");
@@ -13258,13 +13703,10 @@ void MultiplexedRTPHandler::RemoveChannels(PINDEX callno)
 void MultiplexedRTPHandler::RemoveChannel(PINDEX callno, WORD session)
 {
 	WriteLock lock(m_listLock);
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; /* nothing */ ) {
-		if (!iter->m_deleted && iter->m_callno == callno && iter->m_session == session) {
-            iter->m_deleted = true; // mark as logically deleted
-            iter->m_deleteTime = time(NULL);
-		}
-		++iter;
+	H46019SessionTable::Handle iter;
+	while ((iter = m_h46019channels.Find(callno, session)) != m_h46019channels.End()) {
+		iter->m_deleted = true; // mark as logically deleted
+		iter->m_deleteTime = time(NULL);
 	}
 	DumpChannels(" RemoveChannel() by session ID done ");
 }
@@ -13273,15 +13715,15 @@ void MultiplexedRTPHandler::RemoveChannel(PINDEX callno, WORD session)
 void MultiplexedRTPHandler::RemoveChannel(PINDEX callno, RTPLogicalChannel * rtplc)
 {
 	WriteLock lock(m_listLock);
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; /* nothing */ ) {
-		if (!iter->m_deleted && iter->m_callno == callno) {
+	std::pair<H46019SessionTable::CallIterator, H46019SessionTable::CallIterator> range = m_h46019channels.FindCall(callno);
+	for (H46019SessionTable::CallIterator i = range.first; i != range.second; ++i) {
+		H46019SessionTable::Handle iter = i->second;
+		if (!iter->m_deleted) {
 			if (iter->m_encryptingLC == rtplc)
 				iter->m_encryptingLC = NULL;
 			if (iter->m_decryptingLC == rtplc)
 				iter->m_decryptingLC = NULL;
 		}
-		++iter;
 	}
 	DumpChannels(" RemoveChannel() done ");
 }
@@ -13290,9 +13732,9 @@ void MultiplexedRTPHandler::RemoveChannel(PINDEX callno, RTPLogicalChannel * rtp
 void MultiplexedRTPHandler::DumpChannels(const PString & msg) const
 {
 	if (PTrace::CanTrace(7)) {
-		PTRACE(7, "JW ===" << msg << "=== Dump19Channels Begin (" << m_h46019channels.size() << " channels) ===");
-		for (list<H46019Session>::const_iterator iter = m_h46019channels.begin();
-				iter != m_h46019channels.end() ; ++iter) {
+		PTRACE(7, "JW ===" << msg << "=== Dump19Channels Begin (" << m_h46019channels.Size() << " channels) ===");
+		for (H46019SessionTable::Handle iter = m_h46019channels.Begin();
+				iter != m_h46019channels.End() ; ++iter) {
 			iter->Dump();
 		}
 		PTRACE(7, "JW =================== Dump19Channels End ====================");
@@ -13301,24 +13743,48 @@ void MultiplexedRTPHandler::DumpChannels(const PString & msg) const
 
 bool MultiplexedRTPHandler::HandlePacket(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, void * data, unsigned len, bool isRTCP)
 {
-	ReadLock lock(m_listLock);
-	// find the matching channel for the multiplex ID and let it handle the packet
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-		if ((iter->m_multiplexID_fromA == receivedMultiplexID)
-			|| (iter->m_multiplexID_fromB == receivedMultiplexID)) {
-			if (!iter->m_deleted) {
-                ReadUnlock unlock(m_listLock); // release read lock to avoid possible dead lock
-                iter->HandlePacket(receivedMultiplexID, fromAddress, data, len, isRTCP);
-            }
-            return true;
+	H46019PacketRoute route;
+	route.m_newSource = false;
+	{
+		ReadLock lock(m_listLock);
+		// find the matching channel for the multiplex ID
+		H46019SessionTable::Handle iter = m_h46019channels.FindByMultiplexID(receivedMultiplexID);
+		if (iter == m_h46019channels.End()) {
+			if (!isRTCP) {
+				// no warning for RTCP, probably a Polycom RTCP packet with missing multiplex ID
+				PTRACE(7, "RTP\tWarning: Didn't find a channel for receivedMultiplexID " << receivedMultiplexID << " from " << AsString(fromAddress));
+			}
+			return false;
+		}
+		if (iter->m_deleted)
+			return true;
+		if (m_inactivityCheck)
+			m_activity.Touch((receivedMultiplexID == iter->m_multiplexID_fromA) ? iter->m_activitySlotA : iter->m_activitySlotB, time(NULL));
+		if (PTrace::CanTrace(7)) {
+			PTRACE(7, "JW RTP DB: multiplexID=" << receivedMultiplexID
+				<< " isRTCP=" << isRTCP << " ka=" << H46019Session::IsKeepAlive(len, isRTCP)
+				<< " from=" << AsString(fromAddress));
+			iter->Dump();
+		}
+		if (iter->IsNewSource(receivedMultiplexID, fromAddress, isRTCP)) {
+			// several readers may receive packets for the session, only change it with the write lock
+			{
+				ReadUnlock unlock(m_listLock);
+				WriteLock learnLock(m_listLock);
+				H46019SessionTable::Handle learn = m_h46019channels.FindByMultiplexID(receivedMultiplexID);
+				if (learn != m_h46019channels.End() && !learn->m_deleted)
+					route.m_newSource = learn->LearnSource(receivedMultiplexID, fromAddress, isRTCP);
+			}
+			// the session may have been erased while we didn't hold the lock
+			iter = m_h46019channels.FindByMultiplexID(receivedMultiplexID);
+			if (iter == m_h46019channels.End() || iter->m_deleted)
+				return true;
 		}
+		iter->GetRoute(receivedMultiplexID, len, isRTCP, route);
 	}
-	if (!isRTCP) {
-        // no warning for RTCP, probably a Polycom RTCP packet with missing multiplex ID
-        PTRACE(7, "RTP\tWarning: Didn't find a channel for receivedMultiplexID " << receivedMultiplexID << " from " << AsString(fromAddress));
-    }
-	return false;
+	// forward without the table lock to avoid possible dead locks with the call table and the signaling sockets
+	H46019Session::Forward(route, fromAddress, data, len, isRTCP);
+	return true;
 }
 
 #ifdef HAS_H46026
@@ -13328,41 +13794,39 @@ bool MultiplexedRTPHandler::HandlePacket(PINDEX callno, const H46026_UDPFrame &
     //       get call by callno and check if there is an IPMapping for the destination IP and pass it to Send(), otherwise leave NULL
 	ReadLock lock(m_listLock);
 	// find the matching channel by callID and sessionID
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-		if (!iter->m_deleted && (iter->m_callno == callno) && (iter->m_session == data.m_sessionId)) {
-			// found session, now send all RTP packets
-			for (PINDEX i = 0; i < data.m_frame.GetSize(); i++) {
-				PASN_OctetString & bytes = data.m_frame[i];
-				PTRACE(7, "JW found .19 session, send packet, size=" << bytes.GetSize() << " rtp=" << data.m_dataFrame);
-				if (iter->m_multiplexID_toA != INVALID_MULTIPLEX_ID) {
-					if (!data.m_dataFrame) {
-						if (IsSet(iter->m_addrA_RTCP) && (iter->m_osSocketToA_RTCP != INVALID_OSSOCKET)) {
-							PTRACE(7, "JW send mux packet to " << iter->m_addrA_RTCP << " osSocket=" << iter->m_osSocketToA_RTCP);
-							iter->Send(iter->m_multiplexID_toA, iter->m_addrA_RTCP, iter->m_osSocketToA_RTCP, bytes.GetPointer(), bytes.GetSize(), false, NULL);
-						}
-					} else {
-						if (IsSet(iter->m_addrA) && (iter->m_osSocketToA != INVALID_OSSOCKET)) {
-							PTRACE(7, "JW send mux packet to " << iter->m_addrA << " osSocket=" << iter->m_osSocketToA);
-							iter->Send(iter->m_multiplexID_toA, iter->m_addrA, iter->m_osSocketToA, bytes.GetPointer(), bytes.GetSize(), false, NULL);
-						}
+	H46019SessionTable::Handle iter = m_h46019channels.Find(callno, (WORD)data.m_sessionId.GetValue());
+	if (iter != m_h46019channels.End()) {
+		// found session, now send all RTP packets
+		for (PINDEX i = 0; i < data.m_frame.GetSize(); i++) {
+			PASN_OctetString & bytes = data.m_frame[i];
+			PTRACE(7, "JW found .19 session, send packet, size=" << bytes.GetSize() << " rtp=" << data.m_dataFrame);
+			if (iter->m_multiplexID_toA != INVALID_MULTIPLEX_ID) {
+				if (!data.m_dataFrame) {
+					if (IsSet(iter->m_addrA_RTCP) && (iter->m_osSocketToA_RTCP != INVALID_OSSOCKET)) {
+						PTRACE(7, "JW send mux packet to " << iter->m_addrA_RTCP << " osSocket=" << iter->m_osSocketToA_RTCP);
+						iter->Send(iter->m_multiplexID_toA, iter->m_addrA_RTCP, iter->m_osSocketToA_RTCP, bytes.GetPointer(), bytes.GetSize(), false, NULL);
 					}
-				} else if (iter->m_multiplexID_toB != INVALID_MULTIPLEX_ID) {
-					if (!data.m_dataFrame) {
-						if (IsSet(iter->m_addrB_RTCP) && (iter->m_osSocketToB_RTCP != INVALID_OSSOCKET)) {
-							PTRACE(7, "JW send mux packet to " << iter->m_addrB_RTCP << " osSocket=" << iter->m_osSocketToB_RTCP);
-							iter->Send(iter->m_multiplexID_toB, iter->m_addrB_RTCP, iter->m_osSocketToB_RTCP, bytes.GetPointer(), bytes.GetSize(), false, NULL);
-						}
-					} else {
-						if (IsSet(iter->m_addrB) && (iter->m_osSocketToB != INVALID_OSSOCKET)) {
-							PTRACE(7, "JW send mux packet to " << iter->m_addrB << " osSocket=" << iter->m_osSocketToB);
-							iter->Send(iter->m_multiplexID_toB, iter->m_addrB, iter->m_osSocketToB, bytes.GetPointer(), bytes.GetSize(), false, NULL);
-						}
+				} else {
+					if (IsSet(iter->m_addrA) && (iter->m_osSocketToA != INVALID_OSSOCKET)) {
+						PTRACE(7, "JW send mux packet to " << iter->m_addrA << " osSocket=" << iter->m_osSocketToA);
+						iter->Send(iter->m_multiplexID_toA, iter->m_addrA, iter->m_osSocketToA, bytes.GetPointer(), bytes.GetSize(), false, NULL);
+					}
+				}
+			} else if (iter->m_multiplexID_toB != INVALID_MULTIPLEX_ID) {
+				if (!data.m_dataFrame) {
+					if (IsSet(iter->m_addrB_RTCP) && (iter->m_osSocketToB_RTCP != INVALID_OSSOCKET)) {
+						PTRACE(7, "JW send mux packet to " << iter->m_addrB_RTCP << " osSocket=" << iter->m_osSocketToB_RTCP);
+						iter->Send(iter->m_multiplexID_toB, iter->m_addrB_RTCP, iter->m_osSocketToB_RTCP, bytes.GetPointer(), bytes.GetSize(), false, NULL);
+					}
+				} else {
+					if (IsSet(iter->m_addrB) && (iter->m_osSocketToB != INVALID_OSSOCKET)) {
+						PTRACE(7, "JW send mux packet to " << iter->m_addrB << " osSocket=" << iter->m_osSocketToB);
+						iter->Send(iter->m_multiplexID_toB, iter->m_addrB, iter->m_osSocketToB, bytes.GetPointer(), bytes.GetSize(), false, NULL);
 					}
 				}
 			}
-			return true;
 		}
+		return true;
 	}
 	return false;
 }
@@ -13371,15 +13835,13 @@ bool MultiplexedRTPHandler::HandlePacket(PINDEX callno, const H46026_UDPFrame &
 DWORD MultiplexedRTPHandler::GetMultiplexID(PINDEX callno, WORD session, void * to)
 {
 	ReadLock lock(m_listLock);
-	for (list<H46019Session>::const_iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; ++iter) {
-		if (!iter->m_deleted && iter->m_callno == callno && iter->m_session == session) {
-			if (iter->m_openedBy == to && iter->m_multiplexID_fromA != INVALID_MULTIPLEX_ID) {
-				return iter->m_multiplexID_fromA;
-			}
-			if (iter->m_openedBy != to && iter->m_multiplexID_fromB != INVALID_MULTIPLEX_ID) {
-				return iter->m_multiplexID_fromB;
-			}
+	H46019SessionTable::Handle iter = m_h46019channels.Find(callno, session);
+	if (iter != m_h46019channels.End()) {
+		if (iter->m_openedBy == to && iter->m_multiplexID_fromA != INVALID_MULTIPLEX_ID) {
+			return iter->m_multiplexID_fromA;
+		}
+		if (iter->m_openedBy != to && iter->m_multiplexID_fromB != INVALID_MULTIPLEX_ID) {
+			return iter->m_multiplexID_fromB;
 		}
 	}
 	return INVALID_MULTIPLEX_ID;	// not found
@@ -13399,14 +13861,15 @@ bool MultiplexedRTPHandler::GetDetectedMediaIP(PINDEX callno, WORD sessionID, bo
     if (sessionID == 0)
         return false;
 
-    H46019Session h46019chan = GetChannel(callno, sessionID);
-    if (h46019chan.IsValid()) {
-        H245ProxyHandler * h245handler = (H245ProxyHandler *)h46019chan.m_openedBy;
+    ReadLock lock(m_listLock);
+    H46019SessionTable::Handle h46019chan = m_h46019channels.Find(callno, sessionID);
+    if (h46019chan != m_h46019channels.End() && h46019chan->IsValid()) {
+        H245ProxyHandler * h245handler = (H245ProxyHandler *)h46019chan->m_openedBy;
         if (h245handler) {
             if ((forCaller && h245handler->IsCaller()) || (!forCaller && !h245handler->IsCaller())) {
-                return IsSet(h46019chan.m_addrA) && h46019chan.m_addrA.GetIpAndPort(addr, port);
+                return IsSet(h46019chan->m_addrA) && h46019chan->m_addrA.GetIpAndPort(addr, port);
             } else {
-                return IsSet(h46019chan.m_addrB) && h46019chan.m_addrB.GetIpAndPort(addr, port);
+                return IsSet(h46019chan->m_addrB) && h46019chan->m_addrB.GetIpAndPort(addr, port);
             }
         }
     }
@@ -13414,43 +13877,59 @@ bool MultiplexedRTPHandler::GetDetectedMediaIP(PINDEX callno, WORD sessionID, bo
     return false;
 }
 
-// delete sessions marked as deleted (runs every 30 sec)
+// delete sessions marked as deleted and check inactivity (runs every 30 sec)
 void MultiplexedRTPHandler::SessionCleanup(GkTimer* /* timer */)
 {
 	WriteLock lock(m_listLock);
 	time_t now = time(NULL);
-	for (list<H46019Session>::iterator iter = m_h46019channels.begin();
-			iter != m_h46019channels.end() ; /* nothing */ ) {
+	for (H46019SessionTable::Handle iter = m_h46019channels.Begin();
+			iter != m_h46019channels.End() ; /* nothing */ ) {
 		if (iter->m_deleted && (now - iter->m_deleteTime > m_deleteDelay)) {
-			m_h46019channels.erase(iter++);
+			m_activity.Release(iter->m_activitySlotA);
+			m_activity.Release(iter->m_activitySlotB);
+			m_h46019channels.Erase(iter++);
 		} else {
-            // inactivity check
-            if (m_inactivityCheck && iter->m_session == m_inactivityCheckSession) {
-                bool terminate = false;
-                if (iter->m_multiplexID_fromA != INVALID_MULTIPLEX_ID && (now - iter->m_lastPacketFromA > m_inactivityTimeout) ) {
-                    PTRACE(1, "RTPM\tTerminating call because of RTP inactivity from " << iter->m_addrA << " CallNo " << iter->m_callno);
-                    terminate = true;
-                }
-                if (iter->m_multiplexID_fromB != INVALID_MULTIPLEX_ID && (now - iter->m_lastPacketFromB > m_inactivityTimeout) ) {
-                    PTRACE(1, "RTPM\tTerminating call because of RTP inactivity from " << iter->m_addrB << " CallNo " << iter->m_callno);
-                    terminate = true;
-                }
-                if (terminate) {
-                    callptr call = CallTable::Instance()->FindCallRec(iter->m_callno);
-                    if (call) {
-                        call->Disconnect(true);
-                    } else {
-                        PTRACE(1, "RTPM\tError: Can't find call to terminate");
-                    }
-                }
-            }
-
 			++iter;
 		}
 	}
+	if (m_inactivityCheck)
+		CheckInactivity(now);
 	DumpChannels(" SessionCleanup() done ");
 }
 
+void MultiplexedRTPHandler::CheckInactivity(time_t now)
+{
+	// only the sessions with a flow that went silent are visited
+	std::vector<RTPInactivityTracker::SilentFlow> silent;
+	m_activity.Expire(now, silent);
+	for (unsigned i = 0; i < silent.size(); ++i) {
+		std::pair<H46019SessionTable::CallIterator, H46019SessionTable::CallIterator> range = m_h46019channels.FindCall(silent[i].m_callNo);
+		for (H46019SessionTable::CallIterator c = range.first; c != range.second; ++c) {
+			H46019SessionTable::Handle iter = c->second;
+			if (iter->m_deleted || iter->m_session != m_inactivityCheckSession)
+				continue;
+			bool terminate = false;
+			if (silent[i].m_slot == iter->m_activitySlotA && iter->m_multiplexID_fromA != INVALID_MULTIPLEX_ID) {
+				PTRACE(1, "RTPM\tTerminating call because of RTP inactivity from " << iter->m_addrA << " CallNo " << iter->m_callno);
+				terminate = true;
+			}
+			if (silent[i].m_slot == iter->m_activitySlotB && iter->m_multiplexID_fromB != INVALID_MULTIPLEX_ID) {
+				PTRACE(1, "RTPM\tTerminating call because of RTP inactivity from " << iter->m_addrB << " CallNo " << iter->m_callno);
+				terminate = true;
+			}
+			if (terminate) {
+				callptr call = CallTable::Instance()->FindCallRec(iter->m_callno);
+				if (call) {
+					call->Disconnect(true);
+				} else {
+					PTRACE(1, "RTPM\tError: Can't find call to terminate");
+				}
+				break;
+			}
+		}
+	}
+}
+
 #endif
 
 
@@ -13522,7 +14001,7 @@ H46026RTPHandler::~H46026RTPHandler()
 void H46026RTPHandler::AddChannel(const H46026Session & chan)
 {
 	WriteLock lock(m_listLock);
-	m_h46026channels.push_back(chan);
+	m_h46026channels[std::make_pair(chan.m_callno, chan.m_session)] = chan;
 	DumpChannels(" AddChannel() done ");
 }
 
@@ -13530,12 +14009,9 @@ void H46026RTPHandler::ReplaceChannel(const H46026Session & chan)
 {
 	WriteLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == chan.m_callno) && (iter->m_session == chan.m_session)) {
-			*iter = chan;
-			break;
-		}
+	H46026SessionMap::iterator iter = m_h46026channels.find(std::make_pair(chan.m_callno, chan.m_session));
+	if (iter != m_h46026channels.end()) {
+		iter->second = chan;
 	}
 	DumpChannels(" ReplaceChannel() done ");
 }
@@ -13544,12 +14020,9 @@ void H46026RTPHandler::UpdateChannelRTP(PINDEX callno, WORD session, IPAndPortAd
 {
 	WriteLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == callno) && (iter->m_session == session)) {
-			iter->m_toAddressRTP = toRTP;
-			break;
-		}
+	H46026SessionMap::iterator iter = m_h46026channels.find(std::make_pair(callno, session));
+	if (iter != m_h46026channels.end()) {
+		iter->second.m_toAddressRTP = toRTP;
 	}
 	DumpChannels(" UpdateChannelRTP() done ");
 }
@@ -13558,12 +14031,9 @@ void H46026RTPHandler::UpdateChannelRTCP(PINDEX callno, WORD session, IPAndPortA
 {
 	WriteLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == callno) && (iter->m_session == session)) {
-			iter->m_toAddressRTCP = toRTCP;
-			break;
-		}
+	H46026SessionMap::iterator iter = m_h46026channels.find(std::make_pair(callno, session));
+	if (iter != m_h46026channels.end()) {
+		iter->second.m_toAddressRTCP = toRTCP;
 	}
 	DumpChannels(" UpdateChannelRTCP() done ");
 }
@@ -13573,12 +14043,9 @@ void H46026RTPHandler::UpdateChannelEncryptingLC(PINDEX callno, WORD session, RT
 {
 	WriteLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == callno) && (iter->m_session == session)) {
-			iter->m_encryptingLC = lc;
-			break;
-		}
+	H46026SessionMap::iterator iter = m_h46026channels.find(std::make_pair(callno, session));
+	if (iter != m_h46026channels.end()) {
+		iter->second.m_encryptingLC = lc;
 	}
 }
 
@@ -13586,25 +14053,20 @@ void H46026RTPHandler::UpdateChannelDecryptingLC(PINDEX callno, WORD session, RT
 {
 	WriteLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == callno) && (iter->m_session == session)) {
-			iter->m_decryptingLC = lc;
-			break;
-		}
+	H46026SessionMap::iterator iter = m_h46026channels.find(std::make_pair(callno, session));
+	if (iter != m_h46026channels.end()) {
+		iter->second.m_decryptingLC = lc;
 	}
 }
 #endif
 
 H46026Session H46026RTPHandler::FindSession(PINDEX callno, WORD session) const
 {
-	WriteLock lock(m_listLock);
+	ReadLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::const_iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == callno) && (iter->m_session == session)) {
-			return *iter;
-		}
+	H46026SessionMap::const_iterator iter = m_h46026channels.find(std::make_pair(callno, session));
+	if (iter != m_h46026channels.end()) {
+		return iter->second;
 	}
 	return H46026Session();	// return invalid session
 }
@@ -13612,14 +14074,9 @@ H46026Session H46026RTPHandler::FindSession(PINDEX callno, WORD session) const
 void H46026RTPHandler::RemoveChannels(PINDEX callno)
 {
 	WriteLock lock(m_listLock);
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; /* nothing */ ) {
-		if (iter->m_callno == callno) {
-			m_h46026channels.erase(iter++);
-		} else {
-			++iter;
-		}
-	}
+	// sessions are ordered by call number, so all sessions of a call are adjacent
+	m_h46026channels.erase(m_h46026channels.lower_bound(std::make_pair(callno, (WORD)0)),
+		m_h46026channels.upper_bound(std::make_pair(callno, (WORD)0xffff)));
 	DumpChannels(" RemoveChannels() done ");
 }
 
@@ -13627,9 +14084,9 @@ void H46026RTPHandler::DumpChannels(const PString & msg) const
 {
 	if (PTrace::CanTrace(7) && !m_h46026channels.empty()) {
 		PTRACE(7, "JW ===" << msg << "=== Dump26Channels Begin (" << m_h46026channels.size() << " channels) ===");
-		for (list<H46026Session>::const_iterator iter = m_h46026channels.begin();
+		for (H46026SessionMap::const_iterator iter = m_h46026channels.begin();
 				iter != m_h46026channels.end() ; ++iter) {
-			iter->Dump();
+			iter->second.Dump();
 		}
 		PTRACE(7, "JW =================== Dump26Channels End ====================");
 	}
@@ -13639,16 +14096,14 @@ bool H46026RTPHandler::HandlePacket(PINDEX callno, H46026_UDPFrame & data)
 {
 	ReadLock lock(m_listLock);
 	// find the matching channel by callno and sessionID
-	for (list<H46026Session>::iterator iter = m_h46026channels.begin();
-			iter != m_h46026channels.end() ; ++iter) {
-		if ((iter->m_callno == callno) && (iter->m_session == data.m_sessionId)) {
-			// found session, now send all RTP packets
-			for (PINDEX i = 0; i < data.m_frame.GetSize(); i++) {
-				PASN_OctetString & bytes = data.m_frame[i];
-				iter->Send(bytes.GetPointer(), bytes.GetSize(), !data.m_dataFrame);
-			}
-			return true;
+	H46026SessionMap::iterator iter = m_h46026channels.find(std::make_pair(callno, (WORD)data.m_sessionId.GetValue()));
+	if (iter != m_h46026channels.end()) {
+		// found session, now send all RTP packets
+		for (PINDEX i = 0; i < data.m_frame.GetSize(); i++) {
+			PASN_OctetString & bytes = data.m_frame[i];
+			iter->second.Send(bytes.GetPointer(), bytes.GetSize(), !data.m_dataFrame);
 		}
+		return true;
 	}
 	PTRACE(3, "H46026\tWarning: Didn't find a H.460.26 channel for session " << data.m_sessionId << " of call no. " << callno);
 	return false;
@@ -13657,6 +14112,133 @@ bool H46026RTPHandler::HandlePacket(PINDEX callno, H46026_UDPFrame & data)
 #endif	// HAS_H46026
 
 
+// class RTPInactivityTracker
+RTPInactivityTracker::RTPInactivityTracker()
+	: m_numFlows(0), m_wheelTime((unsigned)time(NULL))
+{
+	for (unsigned i = 0; i < MaxChunks; ++i)
+		m_lastPacket[i] = NULL;
+	for (unsigned i = 0; i < WheelSize; ++i)
+		m_buckets[i] = NoSlot;
+}
+
+RTPInactivityTracker::~RTPInactivityTracker()
+{
+	for (unsigned i = 0; i < MaxChunks; ++i)
+		delete[] m_lastPacket[i];
+}
+
+unsigned RTPInactivityTracker::Allocate(PINDEX callNo, unsigned timeout, time_t now)
+{
+	PWaitAndSignal lock(m_mutex);
+	unsigned slot;
+	if (!m_freeSlots.empty()) {
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	} else {
+		slot = (unsigned)m_flows.size();
+		if (slot / ChunkSize >= MaxChunks) {
+			PTRACE(1, "RTP\tError: Too many flows for inactivity detection");
+			return NoSlot;
+		}
+		if (m_lastPacket[slot / ChunkSize] == NULL) {
+			volatile unsigned * chunk = new unsigned[ChunkSize];
+			GkAtomicExchangePointer((void * volatile *)&m_lastPacket[slot / ChunkSize], (void *)chunk);
+		}
+		m_flows.push_back(FlowInfo());
+	}
+	FlowInfo & flow = m_flows[slot];
+	flow.m_callNo = callNo;
+	flow.m_timeout = timeout;
+	flow.m_bucket = NoSlot;
+	GkAtomicStore(&m_lastPacket[slot / ChunkSize][slot % ChunkSize], (unsigned)now);
+	Schedule(slot, (unsigned)now + timeout + 1);
+	++m_numFlows;
+	return slot;
+}
+
+void RTPInactivityTracker::Release(unsigned slot)
+{
+	if (slot == NoSlot)
+		return;
+	PWaitAndSignal lock(m_mutex);
+	Unschedule(slot);
+	m_freeSlots.push_back(slot);
+	--m_numFlows;
+}
+
+time_t RTPInactivityTracker::GetLastPacket(unsigned slot) const
+{
+	if (slot == NoSlot)
+		return 0;
+	return GkAtomicLoad(&m_lastPacket[slot / ChunkSize][slot % ChunkSize]);
+}
+
+void RTPInactivityTracker::Schedule(unsigned slot, unsigned deadline)
+{
+	FlowInfo & flow = m_flows[slot];
+	flow.m_bucket = deadline % WheelSize;
+	flow.m_prev = NoSlot;
+	flow.m_next = m_buckets[flow.m_bucket];
+	if (flow.m_next != NoSlot)
+		m_flows[flow.m_next].m_prev = slot;
+	m_buckets[flow.m_bucket] = slot;
+}
+
+void RTPInactivityTracker::Unschedule(unsigned slot)
+{
+	FlowInfo & flow = m_flows[slot];
+	if (flow.m_bucket == NoSlot)
+		return;
+	if (flow.m_prev != NoSlot)
+		m_flows[flow.m_prev].m_next = flow.m_next;
+	else
+		m_buckets[flow.m_bucket] = flow.m_next;
+	if (flow.m_next != NoSlot)
+		m_flows[flow.m_next].m_prev = flow.m_prev;
+	flow.m_bucket = NoSlot;
+}
+
+void RTPInactivityTracker::Expire(time_t now, std::vector<SilentFlow> & silent)
+{
+	PWaitAndSignal lock(m_mutex);
+	const unsigned t = (unsigned)now;
+	if ((int)(t - m_wheelTime) < 0)
+		return;	// clock went backwards
+	if (t - m_wheelTime >= WheelSize)
+		m_wheelTime = t - WheelSize + 1;	// visit every bucket once
+	for (; (int)(t - m_wheelTime) >= 0; ++m_wheelTime) {
+		unsigned slot = m_buckets[m_wheelTime % WheelSize];
+		m_buckets[m_wheelTime % WheelSize] = NoSlot;
+		while (slot != NoSlot) {
+			FlowInfo & flow = m_flows[slot];
+			const unsigned next = flow.m_next;
+			flow.m_bucket = NoSlot;
+			const unsigned lastPacket = GkAtomicLoad(&m_lastPacket[slot / ChunkSize][slot % ChunkSize]);
+			if ((int)(t - lastPacket) > (int)flow.m_timeout) {
+				SilentFlow s = { flow.m_callNo, slot, t - lastPacket };
+				silent.push_back(s);
+				Schedule(slot, t + flow.m_timeout);
+			} else {
+				// still active, the new deadline is always after the current second
+				Schedule(slot, std::max(lastPacket + flow.m_timeout + 1, t + 1));
+			}
+			slot = next;
+		}
+	}
+}
+
+void GetRTPInactiveCalls(std::vector<PINDEX> & callNumbers)
+{
+	std::vector<RTPInactivityTracker::SilentFlow> silent;
+	RTPSocketActivity.Expire(time(NULL), silent);
+	for (unsigned i = 0; i < silent.size(); ++i)
+		callNumbers.push_back(silent[i].m_callNo);
+	std::sort(callNumbers.begin(), callNumbers.end());
+	callNumbers.erase(std::unique(callNumbers.begin(), callNumbers.end()), callNumbers.end());
+}
+
+
 // class UDPProxySocket
 UDPProxySocket::UDPProxySocket(const char *t, PINDEX no)
 	: ProxySocket(this, t), m_callNo(no),
@@ -13672,15 +14254,45 @@ UDPProxySocket::UDPProxySocket(const char *t, PINDEX no)
 #ifdef HAS_H235_MEDIA
 	, m_haveShownPTWarning(false)
 #endif
-    , m_portDetectionDone(false), m_forwardAndReverseSeen(false)
+    , m_useFlowCache(true), m_rtcpSampleCounter(0), m_portDetectionDone(false), m_forwardAndReverseSeen(false)
 {
+	m_quality[0] = m_quality[1] = NULL;
+	m_qualityRefused = false;
+	m_activitySlot[0] = m_activitySlot[1] = RTPInactivityTracker::NoSlot;
+	m_captureGeneration = 0;
+	m_capture = false;
+	m_exportSlot[0] = m_exportSlot[1] = IPFIXFlowTable::NoSlot;
 	// set flags for RTP/RTCP to avoid string compares later on
 	m_isRTPType = PString(t) == "RTP";
 	m_isRTCPType = PString(t) == "RTCP";
 	SetReadTimeout(PTimeInterval(50));
 	SetWriteTimeout(PTimeInterval(50));
 	fnat = rnat = mute = false;
-	m_EnableRTCPStats = GkConfig()->GetBoolean(ProxySection, "EnableRTCPStats", false);
+	LoadCallSettings();
+}
+
+void UDPProxySocket::AttachToCall(PINDEX no)
+{
+	ReleaseQuality();
+	m_callNo = no;
+#ifdef HAS_H46018
+	m_channelStartTime = PTime();
+#endif
+	LoadCallSettings();
+	m_flowCache.Invalidate();
+	m_captureGeneration = 0;	// re-check the capture filters for the new call
+	m_capture = false;
+	ReleaseExportedFlows();
+}
+
+void UDPProxySocket::LoadCallSettings()
+{
+	m_ignorePublicH239IPs.clear();
+	m_keepSignaledIPs.clear();
+	m_keepSignaledIPsFrom.clear();
+	m_allowAnyRTPSourcePortForH239.Clear();
+	m_EnableRTCPStats = GetProxyConfig()->m_enableRTCPStats;
+	m_enableMediaQuality = GetProxyConfig()->m_enableMediaQuality;
 	m_legacyPortDetection = GkConfig()->GetBoolean(ProxySection, "LegacyPortDetection", false);
     m_ignoreSignaledIPs = false;
     m_ignoreSignaledPrivateH239IPs = false;
@@ -13746,7 +14358,7 @@ UDPProxySocket::UDPProxySocket(const char *t, PINDEX no)
                 ip += "/128";
             }
         }
-        m_allowAnyRTPSourcePortForH239.push_back(NetworkAddress(ip));
+        m_allowAnyRTPSourcePortForH239.Add(NetworkAddress(ip));
     }
 
     PCaselessString restrictRTP = GkConfig()->GetString(ProxySection, "RestrictRTPSources", "");
@@ -13785,19 +14397,26 @@ UDPProxySocket::UDPProxySocket(const char *t, PINDEX no)
             }
         }
     }
-    m_lastPacketFromForwardSrc = time(NULL);
-    m_lastPacketFromReverseSrc = time(NULL);
     m_inactivityTimeout = GkConfig()->GetInteger(ProxySection, "RTPInactivityTimeout", 300);    // 300 sec = 5 min
+    ReleaseActivitySlots();
+    if (m_isRTPType && m_callNo != 0) {	// pooled sockets aren't attached to a call yet
+        const time_t now = time(NULL);
+        m_activitySlot[0] = RTPSocketActivity.Allocate(m_callNo, m_inactivityTimeout, now);
+        m_activitySlot[1] = RTPSocketActivity.Allocate(m_callNo, m_inactivityTimeout, now);
+    }
     m_portDetectionTimeout = GkConfig()->GetInteger(ProxySection, "PortDetectionTimeout", -1);    // in seconds, -1 is off
     m_firstMedia = 0;
     m_mediaFailDetected = false;
-    m_RTPMultiplexingEnabled = GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false);
+    m_RTPMultiplexingEnabled = GetProxyConfig()->m_rtpMultiplexing;
     m_cachePortDetection = GkConfig()->GetBoolean(ProxySection, "CachePortDetection", false);
     m_cachePortDetectionDuration = GkConfig()->GetInteger(ProxySection, "CachePortDetectionDuration", 30);
 }
 
 UDPProxySocket::~UDPProxySocket()
 {
+	ReleaseQuality();
+	ReleaseActivitySlots();
+	ReleaseExportedFlows();
 	if (Toolkit::Instance()->IsPortNotificationActive())
 		Toolkit::Instance()->PortNotification(RTPPort, PortClose, "udp", GNUGK_INADDR_ANY, GetPort(), m_callNo);
     // TODO: delete OS socket from H.460.19 session table ?
@@ -13813,10 +14432,11 @@ bool UDPProxySocket::Bind(const Address & localAddr, WORD pt)
         PTRACE(1, "Error: UDPProxySocket::Bind failed");
 		return false;
 	}
+	m_localIP = localAddr;
     PTRACE(7, "JW RTP UDPProxySocket::Bind allocated listen socket on port " << pt << " ossocket=" << os_handle);
 
 	// Set the IP Type Of Service field for prioritization of media UDP / RTP packets
-	int dscp = GkConfig()->GetInteger(ProxySection, "RTPDiffServ", 4);	// default: IPTOS_LOWDELAY
+	int dscp = GetProxyConfig()->m_rtpDiffServ;	// default: IPTOS_LOWDELAY
 	if (dscp > 0) {
 		int rtpIpTypeofService = (dscp << 2);
 #if defined(hasIPV6) && defined(IPV6_TCLASS)
@@ -13861,6 +14481,7 @@ void UDPProxySocket::SetNAT(bool rev)
 	// if the handler of lc is NATed,
 	// the destination of reverse direction should be changed
 	(rev ? fnat : rnat) = true;
+	m_flowCache.Invalidate();
 	PTRACE(5, Type() << "\tfnat=" << fnat << " rnat=" << rnat);
 }
 
@@ -13923,6 +14544,7 @@ void UDPProxySocket::SetRTCPDestination(const H245_UnicastAddress & dstAddr, con
         fDestIP = dstIP;
         fDestPort = dstPort;
     }
+    m_flowCache.Invalidate();
 
     PTRACE(7, "JW RTP after SetRTCPDestination on " << localport
             << " fSrc=" << AsString(fSrcIP, fSrcPort) << " fDest=" << AsString(fDestIP, fDestPort)
@@ -13996,8 +14618,12 @@ void UDPProxySocket::SetForwardDestination(const Address & srcIP, WORD srcPort,
 	}
 #endif
 
-	if (call)
+	if (call) {
+		PWaitAndSignal lock(m_callMutex);
 		m_call = &call;
+		UpdateCapture();
+	}
+	m_flowCache.Invalidate();
 }
 
 void UDPProxySocket::SetReverseDestination(const Address & srcIP, WORD srcPort, H245_UnicastAddress * dstAddr, callptr & call, bool onlySetDest, bool onlySetSrc)
@@ -14059,8 +14685,12 @@ void UDPProxySocket::SetReverseDestination(const Address & srcIP, WORD srcPort,
 		<< " fSrc=" << AsString(fSrcIP, fSrcPort) << " fDest=" << AsString(fDestIP, fDestPort)
 		<< " rSrc=" << AsString(rSrcIP, rSrcPort) << " rDest=" << AsString(rDestIP, rDestPort));
 
-    if (call)
+    if (call) {
+        PWaitAndSignal lock(m_callMutex);
         m_call = &call;
+        UpdateCapture();
+    }
+	m_flowCache.Invalidate();
 }
 
 void UDPProxySocket::GetPorts(PIPSocket::Address & _fSrcIP, PIPSocket::Address & _fDestIP, PIPSocket::Address & _rSrcIP, PIPSocket::Address & _rDestIP,
@@ -14094,6 +14724,7 @@ void UDPProxySocket::ZeroAllIPs()
 #ifdef HAS_H46018
     m_portDetectionDone = false;
 #endif
+	m_flowCache.Invalidate();
 }
 
 #ifdef HAS_H46018
@@ -14104,6 +14735,7 @@ void UDPProxySocket::AddKeepAlivePT(BYTE pt)
 		m_keepAlivePT_1 = pt;
 	else
 		m_keepAlivePT_2 = pt;
+	m_flowCache.Invalidate();
 }
 
 void UDPProxySocket::SetMultiplexDestination(const IPAndPortAddress & toAddress, H46019Side side)
@@ -14113,6 +14745,7 @@ void UDPProxySocket::SetMultiplexDestination(const IPAndPortAddress & toAddress,
 		m_multiplexDestination_A = toAddress;
 	else
 		m_multiplexDestination_B = toAddress;
+	m_flowCache.Invalidate();
 	PTRACE(7, "JW after SetMultiplexDestination "
 		<< " fSrc=" << AsString(fSrcIP, fSrcPort) << " fDest=" << AsString(fDestIP, fDestPort)
 		<< " rSrc=" << AsString(rSrcIP, rSrcPort) << " rDest=" << AsString(rDestIP, rDestPort));
@@ -14128,6 +14761,7 @@ void UDPProxySocket::SetMultiplexID(DWORD multiplexID, H46019Side side)
 		m_multiplexID_A = multiplexID;
 	else
 		m_multiplexID_B = multiplexID;
+	m_flowCache.Invalidate();
 }
 
 void UDPProxySocket::SetMultiplexSocket(int multiplexSocket, H46019Side side)
@@ -14137,6 +14771,7 @@ void UDPProxySocket::SetMultiplexSocket(int multiplexSocket, H46019Side side)
 		m_multiplexSocket_A = multiplexSocket;
 	else
 		m_multiplexSocket_B = multiplexSocket;
+	m_flowCache.Invalidate();
 }
 #endif
 
@@ -14157,16 +14792,54 @@ void UDPProxySocket::SetMediaIP(bool isSRC, const Address & ip)
 				(*m_call)->SetDST_media_IP(ip.AsString());
 		}
 	}
+	UpdateCapture();	// an IP filter may match the new address
+}
+
+void UDPProxySocket::UpdateCapture()
+{
+	MediaCapture * capture = MediaCapture::Instance();
+	const unsigned generation = capture->GetGeneration();	// before matching, a later change is picked up by the next packet
+	m_capture = m_call && *m_call && capture->Matches(*m_call->operator->());
+	m_captureGeneration = generation;
+}
+
+void UDPProxySocket::ReleaseActivitySlots()
+{
+	RTPSocketActivity.Release(m_activitySlot[0]);
+	RTPSocketActivity.Release(m_activitySlot[1]);
+	m_activitySlot[0] = m_activitySlot[1] = RTPInactivityTracker::NoSlot;
+}
+
+void UDPProxySocket::ReleaseQuality()
+{
+	for (unsigned i = 0; i < 2; ++i) {
+		if (m_quality[i] != NULL) {
+			MediaQualityMonitor::Instance()->ReleaseStream(m_callNo);
+			m_quality[i] = NULL;
+		}
+	}
+	m_qualityRefused = false;
+}
+
+void UDPProxySocket::ReleaseExportedFlows()
+{
+	if (m_exportSlot[0] == IPFIXFlowTable::NoSlot && m_exportSlot[1] == IPFIXFlowTable::NoSlot)
+		return;
+	IPFIXExporter::Instance()->Release(m_exportSlot[0]);
+	IPFIXExporter::Instance()->Release(m_exportSlot[1]);
+	m_exportSlot[0] = m_exportSlot[1] = IPFIXFlowTable::NoSlot;
 }
 
 bool UDPProxySocket::IsRTPInactive() const
 {
+    if (m_activitySlot[0] == RTPInactivityTracker::NoSlot)
+        return false;	// not attached to a call
     time_t now = time(NULL);
-    if ( (fSrcIP != 0 && fSrcPort != 0) && (now - m_lastPacketFromForwardSrc > m_inactivityTimeout) ) {
+    if ( (fSrcIP != 0 && fSrcPort != 0) && (now - RTPSocketActivity.GetLastPacket(m_activitySlot[0]) > m_inactivityTimeout) ) {
         PTRACE(1, "RTP\tTerminating call because of RTP inactivity from " << AsString(fSrcIP, fSrcPort) << " Call No. " << m_callNo);
         return true;
     }
-    if ( (rSrcIP != 0 && rSrcPort != 0) && (now - m_lastPacketFromReverseSrc > m_inactivityTimeout) ) {
+    if ( (rSrcIP != 0 && rSrcPort != 0) && (now - RTPSocketActivity.GetLastPacket(m_activitySlot[1]) > m_inactivityTimeout) ) {
         PTRACE(1, "RTP\tTerminating call because of RTP inactivity from " << AsString(rSrcIP, rSrcPort) << " Call No. " << m_callNo);
         return true;
     }
@@ -14187,6 +14860,7 @@ void UDPProxySocket::ApplyPortDetectionCache()
             DoPortDetection(0, iter->first.GetIP(), iter->first.GetPort()); // don't bother fetching local port, only used in trace message
         }
     }
+	m_flowCache.Invalidate();
 }
 
 void UDPProxySocket::CachePortDetectionData(Address fromIP, WORD fromPort)
@@ -14246,12 +14920,29 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 		ErrorHandler(PSocket::LastReadError);
 		return NoData;
 	}
-	PWaitAndSignal lockCall(m_callMutex);
 	Address fromIP;
 	WORD fromPort;
 	GetLastReceiveAddress(fromIP, fromPort);
 	buflen = (WORD)GetLastReadCount();
 
+	// the signaling side evaluates the filters when the media addresses change,
+	// here only when the filters changed, the capture itself never blocks
+	MediaCapture * capture = MediaCapture::Instance();
+	if (capture->GetGeneration() != m_captureGeneration) {
+		PWaitAndSignal lock(m_callMutex);
+		UpdateCapture();
+	}
+	if (m_capture)
+		capture->Capture(fromIP, fromPort, m_localIP, GetPort(), wbuffer, buflen);
+
+	// steady state: source already known, no locks needed
+	if (ForwardFastPath(fromIP, fromPort))
+		return NoData;
+
+	PWaitAndSignal lockCall(m_callMutex);
+	// must be read before any state is looked at, a change after this makes the recorded flow stale
+	const unsigned flowGeneration = m_flowCache.GetGeneration();
+
 	if (!OnReceiveData(wbuffer, buflen, fromIP, fromPort))
 		return NoData;
 
@@ -14331,7 +15022,7 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 
     // some endpoint signal an incorrect RTCP port inside the H.239 OLC leads GnuGk to expect a different RTP source port than they actually use
     // ignore the source port for this list of IPs/networks
-    if (m_h46019uni && IsInNetworks(fromIP, m_allowAnyRTPSourcePortForH239)) {
+    if (m_h46019uni && m_allowAnyRTPSourcePortForH239.Contains(fromIP)) {
         // combine IP+port for easier comparison
         IPAndPortAddress fSrcAddr(fSrcIP, fSrcPort);
         IPAndPortAddress fDestAddr(fDestIP, fDestPort);
@@ -14421,50 +15112,14 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 			// set based on addr
 			if (m_RTPMultiplexingEnabled) {
 				if (IsSet(m_multiplexDestination_A) && (m_multiplexDestination_A != fromAddr)) {
-					H46019Session h46019chan = MultiplexedRTPHandler::Instance()->GetChannel(m_callNo, m_sessionID);
-					if (h46019chan.IsValid()) {
-						if (isRTCP)
-							h46019chan.m_addrB_RTCP = fromAddr;
-						else
-							h46019chan.m_addrB = fromAddr;
-                        PTRACE(7, "JW RTP Set multiplexB to " << AsString(fromAddr) << " based on sessionID=" << m_sessionID << " IDfromA=" << h46019chan.m_multiplexID_fromA  << " IDfromB=" << h46019chan.m_multiplexID_fromB);
-						MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
-					}
+					MultiplexedRTPHandler::Instance()->SetChannelAddress(m_callNo, m_sessionID, SideB, isRTCP, fromAddr);
 				}
 				if (IsSet(m_multiplexDestination_B) && (m_multiplexDestination_B != fromAddr)) {
-					H46019Session h46019chan = MultiplexedRTPHandler::Instance()->GetChannel(m_callNo, m_sessionID);
-					if (h46019chan.IsValid()) {
-						if (isRTCP)
-							h46019chan.m_addrA_RTCP = fromAddr;
-						else
-							h46019chan.m_addrA = fromAddr;
-                        PTRACE(7, "JW RTP Set multiplexB to " << AsString(fromAddr) << " based on sessionID=" << m_sessionID << " IDfromA=" << h46019chan.m_multiplexID_fromA  << " IDfromB=" << h46019chan.m_multiplexID_fromB);
-						MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
-					}
+					MultiplexedRTPHandler::Instance()->SetChannelAddress(m_callNo, m_sessionID, SideA, isRTCP, fromAddr);
 				}
 				if (!IsSet(m_multiplexDestination_A) && !IsSet(m_multiplexDestination_B)) {
 					// set if only one side sends multiplexed to GnuGk
-					H46019Session h46019chan = MultiplexedRTPHandler::Instance()->GetChannel(m_callNo, m_sessionID);
-					if ((h46019chan.m_multiplexID_fromA != INVALID_MULTIPLEX_ID) && (h46019chan.m_multiplexID_fromB == INVALID_MULTIPLEX_ID)) {
-						if (h46019chan.IsValid()) {
-							if (isRTCP)
-								h46019chan.m_addrB_RTCP = fromAddr;
-							else
-								h46019chan.m_addrB = fromAddr;
-                            PTRACE(7, "JW RTP Set multiplexB to " << AsString(fromAddr) << " based on sessionID=" << m_sessionID);
-							MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
-						}
-					}
-					if ((h46019chan.m_multiplexID_fromA == INVALID_MULTIPLEX_ID) && (h46019chan.m_multiplexID_fromB != INVALID_MULTIPLEX_ID)) {
-						if (h46019chan.IsValid()) {
-							if (isRTCP)
-								h46019chan.m_addrA_RTCP = fromAddr;
-							else
-								h46019chan.m_addrA = fromAddr;
-                            PTRACE(7, "JW RTP Set multiplexA to " << AsString(fromAddr) << " based on sessionID=" << m_sessionID);
-						    MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
-						}
-					}
+					MultiplexedRTPHandler::Instance()->SetNonMultiplexedChannelAddress(m_callNo, m_sessionID, isRTCP, fromAddr);
 				}
 			}
 
@@ -14497,10 +15152,10 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 	}
     // inactivity checking
     if (fromIP == fSrcIP && fromPort == fSrcPort) {
-        m_lastPacketFromForwardSrc = time(NULL);
+        RTPSocketActivity.Touch(m_activitySlot[0], time(NULL));
     }
     if (fromIP == rSrcIP && fromPort == rSrcPort) {
-        m_lastPacketFromReverseSrc = time(NULL);
+        RTPSocketActivity.Touch(m_activitySlot[1], time(NULL));
     }
 	if (isRTPKeepAlive) {
 		return NoData;	// don't forward RTP keepAlive (RTCP uses first data packet which must be forwarded)
@@ -14637,24 +15292,54 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 	// send packets for a multiplexing destination out through multiplexing socket
 	if (IsSet(m_multiplexDestination_A) && (m_multiplexDestination_A != fromAddr)) {
 		if (isRTCP && m_EnableRTCPStats && m_call && (*m_call))
-			ParseRTCP(*m_call, m_sessionID, fromIP, wbuffer, buflen);
+			RTCPStatsAggregator::Instance()->QueueReport(m_rtcpSampleCounter, m_callNo, m_sessionID, fromIP, wbuffer, buflen);
+        RTPStreamQuality * quality = isRTP ? MeasureQuality(fromIP == fSrcIP && fromPort == fSrcPort) : NULL;
         PIPSocket::Address gkIP;
-        if (m_call && (*m_call) && (*m_call)->GetEndpointIPMapping(m_multiplexDestination_A.GetIP(), gkIP)) {
+        bool haveGkIP = m_call && (*m_call) && (*m_call)->GetEndpointIPMapping(m_multiplexDestination_A.GetIP(), gkIP);
+        const unsigned exportSlot = CountExportedFlow(fromIP == fSrcIP && fromPort == fSrcPort, fromIP, fromPort,
+            m_multiplexDestination_A, haveGkIP ? &gkIP : NULL);
+        if (haveGkIP) {
 		    H46019Session::Send(m_multiplexID_A, m_multiplexDestination_A, m_multiplexSocket_A, wbuffer, buflen, false, &gkIP);
         } else {
 		    H46019Session::Send(m_multiplexID_A, m_multiplexDestination_A, m_multiplexSocket_A, wbuffer, buflen, false, NULL);
         }
+		if (CanUseFastPath()) {
+			RTPFlow flow;
+			flow.forwarder = RTPFlow::Multiplexed;
+			flow.to = m_multiplexDestination_A;
+			flow.sourceIP = haveGkIP ? gkIP : RasServer::Instance()->GetLocalAddress(m_multiplexDestination_A.GetIP());
+			flow.multiplexID = m_multiplexID_A;
+			flow.multiplexSocket = m_multiplexSocket_A;
+			flow.quality = quality;
+			flow.exportSlot = exportSlot;
+			RecordFlow(flow, flowGeneration, fromIP, fromPort);
+		}
 		return NoData;	// already forwarded through multiplex socket
 	}
 	if (IsSet(m_multiplexDestination_B) && (m_multiplexDestination_B != fromAddr)) {
 		if (isRTCP && m_EnableRTCPStats && m_call && (*m_call))
-			ParseRTCP(*m_call, m_sessionID, fromIP, wbuffer, buflen);
+			RTCPStatsAggregator::Instance()->QueueReport(m_rtcpSampleCounter, m_callNo, m_sessionID, fromIP, wbuffer, buflen);
+        RTPStreamQuality * quality = isRTP ? MeasureQuality(fromIP == fSrcIP && fromPort == fSrcPort) : NULL;
         PIPSocket::Address gkIP;
-        if (m_call && (*m_call) && (*m_call)->GetEndpointIPMapping(m_multiplexDestination_B.GetIP(), gkIP)) {
+        bool haveGkIP = m_call && (*m_call) && (*m_call)->GetEndpointIPMapping(m_multiplexDestination_B.GetIP(), gkIP);
+        const unsigned exportSlot = CountExportedFlow(fromIP == fSrcIP && fromPort == fSrcPort, fromIP, fromPort,
+            m_multiplexDestination_B, haveGkIP ? &gkIP : NULL);
+        if (haveGkIP) {
     		H46019Session::Send(m_multiplexID_B, m_multiplexDestination_B, m_multiplexSocket_B, wbuffer, buflen, false, &gkIP);
         } else {
     		H46019Session::Send(m_multiplexID_B, m_multiplexDestination_B, m_multiplexSocket_B, wbuffer, buflen, false, NULL);
         }
+		if (CanUseFastPath()) {
+			RTPFlow flow;
+			flow.forwarder = RTPFlow::Multiplexed;
+			flow.to = m_multiplexDestination_B;
+			flow.sourceIP = haveGkIP ? gkIP : RasServer::Instance()->GetLocalAddress(m_multiplexDestination_B.GetIP());
+			flow.multiplexID = m_multiplexID_B;
+			flow.multiplexSocket = m_multiplexSocket_B;
+			flow.quality = quality;
+			flow.exportSlot = exportSlot;
+			RecordFlow(flow, flowGeneration, fromIP, fromPort);
+		}
 		return NoData;	// already forwarded through multiplex socket
 	}
 
@@ -14675,8 +15360,9 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 	}
 
 	// Workaround: some bad endpoints don't send packets from the specified port
-	if ((fromIP == fSrcIP && fromPort == fSrcPort)
-		|| (fromIP == rDestIP && fromIP != rSrcIP)) {   // TODO: BUG ? (fromIP == rDestIP && fromPort != rDestPort) ?
+	const bool fromForwardSrc = (fromIP == fSrcIP && fromPort == fSrcPort)
+		|| (fromIP == rDestIP && fromIP != rSrcIP);   // TODO: BUG ? (fromIP == rDestIP && fromPort != rDestPort) ?
+	if (fromForwardSrc) {
         if (fDestPort) {
             PTRACE(6, Type() << "\tforward " << fromIP << ':' << fromPort << " to " << AsString(fDestIP, fDestPort));
 #ifdef HAS_H46024B
@@ -14756,32 +15442,202 @@ ProxySocket::Result UDPProxySocket::ReceiveData()
 	}
 
 	if (isRTCP && m_EnableRTCPStats && m_call && (*m_call))
-		ParseRTCP(*m_call, m_sessionID, fromIP, wbuffer, buflen);
+		RTCPStatsAggregator::Instance()->QueueReport(m_rtcpSampleCounter, m_callNo, m_sessionID, fromIP, wbuffer, buflen);
+	RTPStreamQuality * quality = isRTP ? MeasureQuality(fromForwardSrc) : NULL;
 
 	PIPSocket::Address toIP;
 	WORD toPort = 0;
 	GetSendAddress(toIP, toPort);
 	PIPSocket::Address gkIP;
-	if (m_call && (*m_call) && (*m_call)->GetEndpointIPMapping(toIP, gkIP)
-		&& Toolkit::Instance()->GetExternalIP().IsEmpty()) { // let OS/firewall handle setting source IP with ExternalIP
+	bool haveGkIP = m_call && (*m_call) && (*m_call)->GetEndpointIPMapping(toIP, gkIP)
+		&& Toolkit::Instance()->GetExternalIP().IsEmpty(); // let OS/firewall handle setting source IP with ExternalIP
+	if (haveGkIP) {
 	    UDPSendWithSourceIP(os_handle, wbuffer, buflen, toIP, toPort, &gkIP);
 	} else {
 	    UDPSendWithSourceIP(os_handle, wbuffer, buflen, toIP, toPort, NULL);
 	}
+	const unsigned exportSlot = CountExportedFlow(fromForwardSrc, fromIP, fromPort, IPAndPortAddress(toIP, toPort), haveGkIP ? &gkIP : NULL);
+	if (CanUseFastPath()) {
+		RTPFlow flow;
+		flow.forwarder = RTPFlow::Relay;
+		flow.to = IPAndPortAddress(toIP, toPort);
+		flow.sourceIP = haveGkIP ? gkIP : RasServer::Instance()->GetLocalAddress(toIP);
+		flow.quality = quality;
+		flow.exportSlot = exportSlot;
+		RecordFlow(flow, flowGeneration, fromIP, fromPort);
+	}
 	return NoData;	// we just forwarded the data here
 }
 
+RTPStreamQuality * UDPProxySocket::MeasureQuality(bool fromForwardSrc)
+{
+	if (!m_enableMediaQuality || !m_call || !(*m_call))
+		return NULL;
+	if (m_sessionID != RTP_Session::DefaultAudioSessionID && m_sessionID != RTP_Session::DefaultVideoSessionID)
+		return NULL;
+	RTPStreamQuality * & stream = m_quality[fromForwardSrc ? 0 : 1];
+	if (stream == NULL) {
+		if (m_qualityRefused)
+			return NULL;
+		// the forward source is the called party (see SetForwardDestination())
+		stream = MediaQualityMonitor::Instance()->GetStream(m_callNo, m_sessionID, !fromForwardSrc);
+		if (stream == NULL) {
+			m_qualityRefused = true;	// don't ask again for every packet
+			return NULL;
+		}
+	}
+	stream->Update(wbuffer, buflen, PTimer::Tick().GetMilliSeconds());
+	return stream;
+}
+
+unsigned UDPProxySocket::CountExportedFlow(bool fromForwardSrc, const Address & fromIP, WORD fromPort, const IPAndPortAddress & to, const Address * gkIP)
+{
+	IPFIXExporter * exporter = IPFIXExporter::Instance();
+	const int dir = fromForwardSrc ? 0 : 1;
+	unsigned & slot = m_exportSlot[dir];
+	const IPAndPortAddress from(fromIP, fromPort);
+	if (slot != IPFIXFlowTable::NoSlot && (from != m_exportFrom[dir] || to != m_exportTo[dir])) {
+		// port detection or a new channel changed the flow, don't let the fast path count into the old one
+		exporter->Release(slot);
+		slot = IPFIXFlowTable::NoSlot;
+		m_flowCache.Invalidate();
+	}
+	if (slot == IPFIXFlowTable::NoSlot) {
+		if (!exporter->IsEnabled() || !m_call || !(*m_call))
+			return IPFIXFlowTable::NoSlot;
+		IPFIXFlowTable::FlowKey key;
+		key.m_srcIP = fromIP;
+		key.m_srcPort = fromPort;
+		key.m_dstIP = m_localIP.IsAny() ? RasServer::Instance()->GetLocalAddress(fromIP) : m_localIP;
+		key.m_dstPort = GetPort();
+		key.m_postNATSrcIP = gkIP ? *gkIP : RasServer::Instance()->GetLocalAddress(to.GetIP());
+		key.m_postNATSrcPort = GetPort();
+		key.m_postNATDstIP = to.GetIP();
+		key.m_postNATDstPort = to.GetPort();
+		key.m_callNo = m_callNo;
+		memset(key.m_callID, 0, sizeof(key.m_callID));
+		const PASN_OctetString & guid = (*m_call)->GetCallIdentifier().m_guid;
+		if (guid.GetSize() == sizeof(key.m_callID))
+			memcpy(key.m_callID, guid.GetValue(), sizeof(key.m_callID));
+		key.m_sessionID = m_sessionID;
+		slot = exporter->Allocate(key);
+		m_exportFrom[dir] = from;
+		m_exportTo[dir] = to;
+	}
+	exporter->Count(slot, buflen, time(NULL));
+	return slot;
+}
+
+bool UDPProxySocket::CanUseFastPath() const
+{
+	if (!m_useFlowCache || mute || m_cachePortDetection)
+		return false;
+	if ((fnat || rnat) && (!m_portDetectionDone || m_legacyPortDetection))
+		return false;	// destination is still learned from every packet
+#ifdef HAS_H46018
+	if (!m_portDetectionDone)
+		return false;
+#endif
+	if (m_isRTCPType && m_EnableRTCPStats)
+		return false;	// RTCP reports are queued for the statistics on the full path
+#ifdef HAS_H235_MEDIA
+	if (m_encryptingLC || m_decryptingLC)
+		return false;
+	if (m_call && (*m_call) && (*m_call)->IsMediaEncryption())
+		return false;
+#endif
+#ifdef HAS_H46024B
+	if (m_call && (*m_call) && (*m_call)->GetNATStrategy() == CallRec::e_natAnnexB)
+		return false;
+#endif
+#ifdef HAS_H46026
+	if (Toolkit::Instance()->IsH46026Enabled())
+		return false;
+#endif
+	return true;
+}
+
+void UDPProxySocket::RecordFlow(RTPFlow & flow, unsigned generation, const Address & fromIP, WORD fromPort)
+{
+	flow.generation = generation;
+	flow.fromIP = fromIP;
+	flow.fromPort = fromPort;
+	flow.updatesForwardSrc = (fromIP == fSrcIP && fromPort == fSrcPort);
+	flow.updatesReverseSrc = (fromIP == rSrcIP && fromPort == rSrcPort);
+	m_flowCache.Record(flow);
+}
+
+bool UDPProxySocket::ForwardFastPath(Address fromIP, WORD fromPort)
+{
+	// RTP keep-alives and empty packets are never forwarded, leave them to the full path
+	if (!m_useFlowCache || buflen <= RTP_BASE_HEADER_LEN)
+		return false;
+	UnmapIPv4Address(fromIP);
+	const RTPFlow * flow = m_flowCache.Find(fromIP, fromPort);
+	if (flow == NULL)
+		return false;
+
+	if (flow->updatesForwardSrc || flow->updatesReverseSrc || flow->exportSlot != IPFIXFlowTable::NoSlot) {
+		const time_t now = time(NULL);
+		if (flow->updatesForwardSrc)
+			RTPSocketActivity.Touch(m_activitySlot[0], now);
+		if (flow->updatesReverseSrc)
+			RTPSocketActivity.Touch(m_activitySlot[1], now);
+		IPFIXExporter::Instance()->Count(flow->exportSlot, buflen, now);
+	}
+	if (flow->quality)
+		flow->quality->Update(wbuffer, buflen, PTimer::Tick().GetMilliSeconds());
+	PIPSocket::Address sourceIP = flow->sourceIP;
+#ifdef HAS_H46018
+	if (flow->forwarder == RTPFlow::Multiplexed) {
+		H46019Session::Send(flow->multiplexID, flow->to, flow->multiplexSocket, wbuffer, buflen, false, &sourceIP);
+		return true;
+	}
+#endif
+	UDPSendWithSourceIP(os_handle, wbuffer, buflen, flow->to, &sourceIP);
+	return true;
+}
+
+const RTPFlow * RTPFlowCache::Find(const PIPSocket::Address & fromIP, WORD fromPort) const
+{
+	const unsigned generation = GetGeneration();
+	for (unsigned i = 0; i < 2; ++i) {
+		const RTPFlow & flow = m_flows[i];
+		if (flow.forwarder != RTPFlow::None && flow.generation == generation
+			&& flow.fromPort == fromPort && flow.fromIP == fromIP)
+			return &flow;
+	}
+	return NULL;
+}
+
+void RTPFlowCache::Record(const RTPFlow & flow)
+{
+	const unsigned generation = GetGeneration();
+	if (flow.generation != generation)
+		return;	// the socket state changed while the packet was processed
+	// replace the flow for the same source or an outdated one
+	for (unsigned i = 0; i < 2; ++i) {
+		RTPFlow & slot = m_flows[i];
+		if (slot.forwarder == RTPFlow::None || slot.generation != generation
+			|| (slot.fromPort == flow.fromPort && slot.fromIP == flow.fromIP)) {
+			slot = flow;
+			return;
+		}
+	}
+	m_flows[m_next] = flow;
+	m_next = (m_next + 1) % 2;
+}
+
 namespace {
 
-void ParseRTCP(const callptr & call, WORD sessionID, PIPSocket::Address fromIP, BYTE * wbuffer, WORD buflen)
+void ParseRTCP(const callptr & call, WORD sessionID, bool fromDST, BYTE * wbuffer, WORD buflen,
+	PInt64 arrival, RTCPDirectionStats * fromStats, const RTCPDirectionStats * toStats)
 {
 	if (buflen < 4) {
 		PTRACE(1, "RTCP\tInvalid RTCP frame");
 		return;
 	}
 
-	bool fromDST = (call->GetSRC_media_control_IP() == fromIP.AsString());   // TODO: is this still correct in presence of NAT traversal protocols ???
-
 	RTP_ControlFrame frame(2048);
 	frame.Attach(wbuffer, buflen);
 	do {
@@ -14799,6 +15655,12 @@ void ParseRTCP(const callptr & call, WORD sessionID, PIPSocket::Address fromIP,
 			PTRACE(7, "RTCP\tSenderReport packet");
 			if (size >= (sizeof(RTP_ControlFrame::SenderReport) + frame.GetCount() * sizeof(RTP_ControlFrame::ReceiverReport))) {
 				const RTP_ControlFrame::SenderReport & sr = *(const RTP_ControlFrame::SenderReport *)(payload);
+				if (fromStats) {
+					fromStats->m_packetCount = sr.psent;
+					// remember when we saw it, the receiver reports will refer to it
+					fromStats->m_lastSR = ((DWORD)sr.ntp_sec << 16) | ((DWORD)sr.ntp_frac >> 16);
+					fromStats->m_lastSRArrival = arrival;
+				}
 				if (fromDST) {
 					if (sessionID == RTP_Session::DefaultAudioSessionID) {
 						call->SetRTCP_DST_packet_count(sr.psent);
@@ -14818,7 +15680,7 @@ void ParseRTCP(const callptr & call, WORD sessionID, PIPSocket::Address fromIP,
 						PTRACE(7, "RTCP\tSetRTCP_SRC_video_packet_count: " << sr.psent);
 					}
 				}
-				BuildReceiverReport(call, sessionID, frame, sizeof(RTP_ControlFrame::SenderReport), fromDST);
+				BuildReceiverReport(call, sessionID, frame, sizeof(RTP_ControlFrame::SenderReport), fromDST, arrival, fromStats, toStats);
 			} else {
 				PTRACE(5, "RTCP\tSenderReport packet truncated");
 			}
@@ -14826,7 +15688,7 @@ void ParseRTCP(const callptr & call, WORD sessionID, PIPSocket::Address fromIP,
 		case RTP_ControlFrame::e_ReceiverReport:
 			PTRACE(7, "RTCP\tReceiverReport packet");
 			if (size >= (frame.GetCount()*sizeof(RTP_ControlFrame::ReceiverReport))) {
-				BuildReceiverReport(call, sessionID, frame, sizeof(DWORD), fromDST);
+				BuildReceiverReport(call, sessionID, frame, sizeof(DWORD), fromDST, arrival, fromStats, toStats);
 			} else {
 				PTRACE(5, "RTCP\tReceiverReport packet truncated");
 			}
@@ -14894,10 +15756,22 @@ void ParseRTCP(const callptr & call, WORD sessionID, PIPSocket::Address fromIP,
 	} while (frame.ReadNextCompound());
 }
 
-void BuildReceiverReport(const callptr & call, WORD sessionID, const RTP_ControlFrame & frame, PINDEX offset, bool dst)
+void BuildReceiverReport(const callptr & call, WORD sessionID, const RTP_ControlFrame & frame, PINDEX offset, bool dst,
+	PInt64 arrival, RTCPDirectionStats * fromStats, const RTCPDirectionStats * toStats)
 {
 	const RTP_ControlFrame::ReceiverReport * rr = (const RTP_ControlFrame::ReceiverReport *)(frame.GetPayloadPtr()+offset);
 	for (PINDEX repIdx = 0; repIdx < (PINDEX)frame.GetCount(); repIdx++) {
+		if (fromStats) {
+			fromStats->m_packetsLost = rr->GetLostPackets();
+			fromStats->m_jitter = rr->jitter / ((sessionID == RTP_Session::DefaultVideoSessionID) ? 90 : 8);
+			// round trip between us and the sender of this report, based on the sender report we relayed to it
+			if (toStats && rr->lsr != 0 && (DWORD)rr->lsr == toStats->m_lastSR && toStats->m_lastSRArrival != 0) {
+				const PInt64 delaySinceLastSR = (PInt64)(DWORD)rr->dlsr * 1000000 / 65536;	// dlsr is in 1/65536 sec
+				const PInt64 rtt = (arrival - toStats->m_lastSRArrival - delaySinceLastSR) / 1000;
+				if (rtt >= 0)
+					fromStats->m_roundTripTime = (int)rtt;
+			}
+		}
 		if (dst) {
 			if (sessionID == RTP_Session::DefaultAudioSessionID) {
 				call->SetRTCP_DST_packet_lost(rr->GetLostPackets());
@@ -14925,11 +15799,463 @@ void BuildReceiverReport(const callptr & call, WORD sessionID, const RTP_Control
 				PTRACE(7, "RTCP\tSetRTCP_SRC_video_jitter: " << (rr->jitter / 90));
 			}
 		}
-		rr++;
+		rr++;
+	}
+}
+
+}	// end namespace
+
+// class RTCPReportQueue
+RTCPReportQueue::RTCPReportQueue() : m_head(0), m_tail(0), m_dropped(0)
+{
+	for (unsigned i = 0; i < Capacity; ++i)
+		m_slots[i].m_sequence = i;
+}
+
+bool RTCPReportQueue::Push(PINDEX callNo, WORD sessionID, const PIPSocket::Address & fromIP, PInt64 arrival, const BYTE * data, WORD len)
+{
+	// reserve a slot
+	unsigned pos = GkAtomicLoad(&m_head);
+	Slot * slot;
+	for (;;) {
+		slot = &m_slots[pos & (Capacity - 1)];
+		const int diff = (int)(GkAtomicLoad(&slot->m_sequence) - pos);
+		if (diff == 0) {
+			if (GkAtomicCompareAndSwap(&m_head, pos, pos + 1))
+				break;
+			pos = GkAtomicLoad(&m_head);
+		} else if (diff < 0) {
+			GkAtomicIncrement(&m_dropped);	// full, the aggregator didn't consume this slot yet
+			return false;
+		} else {
+			pos = GkAtomicLoad(&m_head);	// another producer took it
+		}
+	}
+	RTCPReport & report = slot->m_report;
+	report.m_callNo = callNo;
+	report.m_sessionID = sessionID;
+	report.m_fromIP = fromIP;
+	report.m_arrival = arrival;
+	report.m_len = (len > RTCPReport::MaxSize) ? (WORD)RTCPReport::MaxSize : len;
+	memcpy(report.m_data, data, report.m_len);
+	GkAtomicStore(&slot->m_sequence, pos + 1);	// publish
+	return true;
+}
+
+bool RTCPReportQueue::Pop(RTCPReport & report)
+{
+	Slot & slot = m_slots[m_tail & (Capacity - 1)];
+	if ((int)(GkAtomicLoad(&slot.m_sequence) - (m_tail + 1)) < 0)
+		return false;	// empty or still being written
+	report = slot.m_report;
+	GkAtomicStore(&slot.m_sequence, m_tail + Capacity);	// free for the next round
+	++m_tail;
+	return true;
+}
+
+namespace {
+
+// drains the RTCP report queue
+class RTCPStatsWorker : public RegularJob {
+public:
+	RTCPStatsWorker() { SetName("RTCPStats"); Execute(); }
+
+	virtual void Exec()
+	{
+		RTCPStatsAggregator::Instance()->ProcessQueue();
+		Wait(50);
+	}
+};
+
+} // end namespace
+
+// class RTCPStatsAggregator
+RTCPStatsAggregator::RTCPStatsAggregator() : Singleton<RTCPStatsAggregator>("RTCPStatsAggregator"),
+	m_workerStarted(false), m_processed(0), m_withoutSlot(0)
+{
+}
+
+void RTCPStatsAggregator::LoadConfig()
+{
+	PWaitAndSignal lock(m_statsMutex);
+	if (GetProxyConfig()->m_enableRTCPStats && !m_workerStarted) {
+		new RTCPStatsWorker();
+		m_workerStarted = true;
+	}
+}
+
+void RTCPStatsAggregator::QueueReport(unsigned & sampleCounter, PINDEX callNo, WORD sessionID, const PIPSocket::Address & fromIP, const BYTE * data, WORD len)
+{
+	const unsigned sampling = GetProxyConfig()->m_rtcpStatsSampling;
+	if (sampling > 1 && (sampleCounter++ % sampling) != 0)
+		return;
+	if (!m_queue.Push(callNo, sessionID, fromIP, PTime().GetTimestamp(), data, len)) {
+		PTRACE(5, "RTCP\tStatistics queue full, report dropped");
+	}
+}
+
+void RTCPStatsAggregator::ProcessQueue()
+{
+	RTCPReport report;
+	while (m_queue.Pop(report))
+		Process(report);
+}
+
+void RTCPStatsAggregator::Process(RTCPReport & report)
+{
+	callptr call = CallTable::Instance()->FindCallRec(report.m_callNo);
+	if (!call)
+		return;	// call is already gone
+	const bool fromDST = (call->GetSRC_media_control_IP() == report.m_fromIP.AsString());   // TODO: is this still correct in presence of NAT traversal protocols ???
+
+	// only this thread changes the slots, so the owner can be checked without the lock
+	const PINDEX owner = m_calls[(unsigned)report.m_callNo % NumCallSlots].m_callNo;
+	const bool slotTaken = (owner != 0 && owner != report.m_callNo && CallTable::Instance()->FindCallRec(owner));
+
+	PWaitAndSignal lock(m_statsMutex);
+	RTCPDirectionStats * fromStats = NULL;
+	const RTCPDirectionStats * toStats = NULL;
+	if (slotTaken) {
+		// call numbers differ by a multiple of the table size, only the CallRec is updated for this call
+		PTRACE(5, "RTCP\tStatistics slot of call " << report.m_callNo << " is used by call " << owner);
+		++m_withoutSlot;
+	} else {
+		fromStats = GetDirectionStats(report.m_callNo, report.m_sessionID, fromDST, true);
+		toStats = GetDirectionStats(report.m_callNo, report.m_sessionID, !fromDST, true);
+	}
+	ParseRTCP(call, report.m_sessionID, fromDST, report.m_data, report.m_len, report.m_arrival, fromStats, toStats);
+	++m_processed;
+}
+
+RTCPDirectionStats * RTCPStatsAggregator::GetDirectionStats(PINDEX callNo, WORD sessionID, bool fromDST, bool create)
+{
+	if (sessionID != RTP_Session::DefaultAudioSessionID && sessionID != RTP_Session::DefaultVideoSessionID)
+		return NULL;
+	CallStats & slot = m_calls[(unsigned)callNo % NumCallSlots];
+	if (slot.m_callNo != callNo) {
+		if (!create)
+			return NULL;
+		slot = CallStats();
+		slot.m_callNo = callNo;
+	}
+	return &slot.m_stats[(sessionID == RTP_Session::DefaultVideoSessionID) ? 1 : 0][fromDST ? 1 : 0];
+}
+
+bool RTCPStatsAggregator::GetStats(PINDEX callNo, WORD sessionID, bool fromDST, RTCPDirectionStats & stats) const
+{
+	PWaitAndSignal lock(m_statsMutex);
+	const RTCPDirectionStats * s = const_cast<RTCPStatsAggregator *>(this)->GetDirectionStats(callNo, sessionID, fromDST, false);
+	if (s == NULL)
+		return false;
+	stats = *s;
+	return true;
+}
+
+PString RTCPStatsAggregator::PrintStatistics() const
+{
+	PWaitAndSignal lock(m_statsMutex);
+	if (!m_workerStarted)
+		return PString::Empty();
+	return PString(PString::Printf, "RTCP reports processed: %u  Dropped: %u  Without statistics slot: %u\r\n",
+		m_processed, m_queue.GetDropped(), m_withoutSlot);
+}
+
+// class RTPStreamQuality
+void RTPStreamQuality::Reset(bool video)
+{
+	m_video = video;
+	m_clockRate = 0;
+	m_maxSeq = 0;
+	m_cycles = 0;
+	m_baseSeq = 0;
+	m_badSeq = SequenceMod + 1;
+	m_probation = 0;
+	m_received = 0;
+	m_haveTransit = false;
+	m_transit = 0;
+	m_jitter = 0;
+	m_lastArrival = 0;
+}
+
+void RTPStreamQuality::InitSequence(WORD seq)
+{
+	m_baseSeq = seq;
+	m_maxSeq = seq;
+	m_badSeq = SequenceMod + 1;	// so seq == m_badSeq is false
+	m_cycles = 0;
+	m_received = 0;
+	m_haveTransit = false;
+}
+
+bool RTPStreamQuality::UpdateSequence(WORD seq)
+{
+	const WORD delta = (WORD)(seq - m_maxSeq);
+
+	// a new source is only valid after MinSequential packets in sequence
+	if (m_probation) {
+		if (seq == (WORD)(m_maxSeq + 1)) {
+			m_probation--;
+			m_maxSeq = seq;
+			if (m_probation == 0) {
+				InitSequence(seq);
+				m_received++;
+				return true;
+			}
+		} else {
+			m_probation = MinSequential - 1;
+			m_maxSeq = seq;
+		}
+		return false;
+	} else if (delta < MaxDropout) {
+		// in order, with permissible gap
+		if (seq < m_maxSeq)
+			m_cycles += SequenceMod;
+		m_maxSeq = seq;
+	} else if (delta <= SequenceMod - MaxMisorder) {
+		// the sequence number made a very large jump
+		if (seq == m_badSeq) {
+			// two sequential packets, assume the other side restarted without telling us
+			InitSequence(seq);
+		} else {
+			m_badSeq = (seq + 1) & (SequenceMod - 1);
+			return false;
+		}
+	} else {
+		// duplicate or reordered packet
+	}
+	m_received++;
+	return true;
+}
+
+void RTPStreamQuality::Update(const BYTE * rtp, WORD len, PInt64 arrival)
+{
+	if (len <= RTP_BASE_HEADER_LEN || (rtp[0] & 0xc0) != 0x80)
+		return;
+	const WORD seq = (WORD)((rtp[2] << 8) | rtp[3]);
+	const DWORD timestamp = ((DWORD)rtp[4] << 24) | ((DWORD)rtp[5] << 16) | ((DWORD)rtp[6] << 8) | (DWORD)rtp[7];
+
+	if (m_clockRate == 0) {
+		m_clockRate = GetClockRate(rtp[1] & 0x7f, m_video);
+		InitSequence(seq);
+		m_maxSeq = seq - 1;
+		m_probation = MinSequential;
+	}
+	if (!UpdateSequence(seq))
+		return;
+	m_lastArrival = arrival;
+
+	// interarrival jitter, in timestamp units scaled by 16 to keep the precision
+	const int transit = (int)((DWORD)(arrival * m_clockRate / 1000) - timestamp);
+	if (m_haveTransit) {
+		int d = transit - m_transit;
+		if (d < 0)
+			d = -d;
+		m_jitter += d - ((m_jitter + 8) >> 4);
+	}
+	m_transit = transit;
+	m_haveTransit = true;
+}
+
+unsigned RTPStreamQuality::GetExpected() const
+{
+	if (m_received == 0)
+		return 0;
+	return m_cycles + m_maxSeq - m_baseSeq + 1;
+}
+
+int RTPStreamQuality::GetLost() const
+{
+	return (int)GetExpected() - (int)m_received;
+}
+
+double RTPStreamQuality::GetLossPercent() const
+{
+	const unsigned expected = GetExpected();
+	const int lost = GetLost();
+	if (expected == 0 || lost <= 0)
+		return 0.0;
+	return lost * 100.0 / expected;
+}
+
+unsigned RTPStreamQuality::GetJitter() const
+{
+	if (m_clockRate == 0)
+		return 0;
+	return (unsigned)(((PUInt64)(m_jitter >> 4) * 1000) / m_clockRate);
+}
+
+double RTPStreamQuality::GetMOS() const
+{
+	if (m_received == 0)
+		return 0.0;
+	// E-model as simplified by Cole and Rosenbluth for G.711, the one way delay isn't known to the relay,
+	// the jitter buffer of the receiver is assumed to add twice the jitter
+	const double effectiveLatency = 2.0 * GetJitter() + 10.0;
+	double r = (effectiveLatency < 160.0) ? 93.2 - effectiveLatency / 40.0 : 93.2 - (effectiveLatency - 120.0) / 10.0;
+	r -= 2.5 * GetLossPercent();
+	if (r < 0.0)
+		return 1.0;
+	const double mos = 1.0 + 0.035 * r + 0.000007 * r * (r - 60.0) * (100.0 - r);
+	return (mos > 4.5) ? 4.5 : ((mos < 1.0) ? 1.0 : mos);
+}
+
+unsigned RTPStreamQuality::GetClockRate(BYTE payloadType, bool video)
+{
+	switch (payloadType) {
+		case 6:	// DVI4 16 kHz
+			return 16000;
+		case 10:	// L16 stereo
+		case 11:	// L16 mono
+			return 44100;
+		case 16:	// DVI4 11 kHz
+			return 11025;
+		case 17:	// DVI4 22 kHz
+			return 22050;
+		case 14:	// MPA
+		case 25:	// CelB
+		case 26:	// JPEG
+		case 28:	// nv
+		case 31:	// H.261
+		case 32:	// MPV
+		case 33:	// MP2T
+		case 34:	// H.263
+			return 90000;
+		default:
+			break;
+	}
+	if (payloadType < 24)
+		return 8000;	// all other static audio payload types, G.722 included
+	return video ? 90000 : 8000;
+}
+
+namespace {
+
+// sends the media quality of the running calls to the status port
+class MediaQualityFeed : public RegularJob {
+public:
+	MediaQualityFeed() { SetName("MediaQualityFeed"); Execute(); }
+
+	virtual void Exec()
+	{
+		const unsigned interval = GetProxyConfig()->m_mediaQualityFeedInterval;
+		Wait((interval > 0) ? interval * 1000 : 1000);
+		if (IsRunning() && interval > 0 && GetProxyConfig()->m_enableMediaQuality)
+			MediaQualityMonitor::Instance()->SendFeed(interval);
+	}
+};
+
+PString PrintQuality(const RTPStreamQuality & quality, bool withMOS)
+{
+	if (!quality.IsActive())
+		return withMOS ? "||" : "|";
+	PString result(PString::Printf, "%.2f%%|%u", quality.GetLossPercent(), quality.GetJitter());
+	if (withMOS)
+		result += PString(PString::Printf, "|%.2f", quality.GetMOS());
+	return result;
+}
+
+} // end namespace
+
+// class MediaQualityMonitor
+MediaQualityMonitor::MediaQualityMonitor() : Singleton<MediaQualityMonitor>("MediaQualityMonitor"), m_feedStarted(false)
+{
+}
+
+void MediaQualityMonitor::LoadConfig()
+{
+	PWaitAndSignal lock(m_slotMutex);
+	if (GetProxyConfig()->m_mediaQualityFeedInterval > 0 && !m_feedStarted) {
+		new MediaQualityFeed();
+		m_feedStarted = true;
+	}
+}
+
+RTPStreamQuality * MediaQualityMonitor::GetStream(PINDEX callNo, WORD sessionID, bool fromCaller)
+{
+	if (sessionID != RTP_Session::DefaultAudioSessionID && sessionID != RTP_Session::DefaultVideoSessionID)
+		return NULL;
+	PWaitAndSignal lock(m_slotMutex);
+	CallQuality & slot = m_calls[(unsigned)callNo % NumCallSlots];
+	if (slot.m_callNo != callNo) {
+		if (slot.m_users > 0) {
+			// a relay thread of the other call may still write into the streams
+			PTRACE(3, "RTP\tMedia quality slot of call " << callNo << " is used by call " << slot.m_callNo);
+			return NULL;
+		}
+		slot.m_callNo = callNo;
+		for (unsigned i = 0; i < 2; ++i) {
+			slot.m_streams[0][i].Reset(false);
+			slot.m_streams[1][i].Reset(true);
+		}
+	}
+	++slot.m_users;
+	return &slot.m_streams[(sessionID == RTP_Session::DefaultVideoSessionID) ? 1 : 0][fromCaller ? 0 : 1];
+}
+
+void MediaQualityMonitor::ReleaseStream(PINDEX callNo)
+{
+	PWaitAndSignal lock(m_slotMutex);
+	CallQuality & slot = m_calls[(unsigned)callNo % NumCallSlots];
+	if (slot.m_callNo == callNo && slot.m_users > 0)
+		--slot.m_users;
+}
+
+bool MediaQualityMonitor::GetQuality(PINDEX callNo, WORD sessionID, bool fromCaller, RTPStreamQuality & quality) const
+{
+	if (sessionID != RTP_Session::DefaultAudioSessionID && sessionID != RTP_Session::DefaultVideoSessionID)
+		return false;
+	PWaitAndSignal lock(m_slotMutex);
+	const CallQuality & slot = m_calls[(unsigned)callNo % NumCallSlots];
+	if (slot.m_callNo != callNo)
+		return false;
+	quality = slot.m_streams[(sessionID == RTP_Session::DefaultVideoSessionID) ? 1 : 0][fromCaller ? 0 : 1];
+	return quality.IsActive();
+}
+
+PString MediaQualityMonitor::PrintCall(PINDEX callNo, const PString & callID) const
+{
+	RTPStreamQuality streams[2][2];
+	bool active = false;
+	for (unsigned i = 0; i < 2; ++i) {
+		active = GetQuality(callNo, RTP_Session::DefaultAudioSessionID, i == 0, streams[0][i]) || active;
+		active = GetQuality(callNo, RTP_Session::DefaultVideoSessionID, i == 0, streams[1][i]) || active;
+	}
+	if (!active)
+		return PString::Empty();
+	return "MediaQuality|" + PString(callNo) + "|" + callID
+		+ "|" + PrintQuality(streams[0][0], true) + "|" + PrintQuality(streams[0][1], true)
+		+ "|" + PrintQuality(streams[1][0], false) + "|" + PrintQuality(streams[1][1], false) + ";";
+}
+
+void MediaQualityMonitor::SendFeed(unsigned interval) const
+{
+	const PInt64 since = PTimer::Tick().GetMilliSeconds() - (PInt64)interval * 1000;
+	std::vector<PINDEX> calls;
+	{
+		PWaitAndSignal lock(m_slotMutex);
+		for (unsigned i = 0; i < NumCallSlots; ++i) {
+			const CallQuality & slot = m_calls[i];
+			if (slot.m_callNo == 0)
+				continue;
+			for (unsigned j = 0; j < 4; ++j) {
+				const RTPStreamQuality & stream = slot.m_streams[j / 2][j % 2];
+				if (stream.IsActive() && stream.GetLastArrival() >= since) {
+					calls.push_back(slot.m_callNo);
+					break;
+				}
+			}
+		}
+	}
+	for (std::vector<PINDEX>::const_iterator i = calls.begin(); i != calls.end(); ++i) {
+		callptr call = CallTable::Instance()->FindCallRec(*i);
+		if (!call)
+			continue;
+		const PString line = PrintCall(*i, AsString(call->GetCallIdentifier()));
+		if (!line.IsEmpty())
+			GkStatus::Instance()->SignalStatus(line + "\r\n", STATUS_TRACE_LEVEL_MEDIAQUALITY);
 	}
 }
 
-}	// end namespace
 
 bool UDPProxySocket::WriteData(const BYTE *buffer, int len)
 {
@@ -15038,6 +16364,176 @@ void T120ProxySocket::Dispatch()
 }
 
 
+// if Home specifies only one local address, RTP sockets are bound only to this address
+static PIPSocket::Address GetRTPBindAddress()
+{
+	PIPSocket::Address laddr(GNUGK_INADDR_ANY);
+	std::vector<PIPSocket::Address> home;
+	Toolkit::Instance()->GetGKHome(home);
+	if (home.size() == 1)
+		laddr = home[0];
+	return laddr;
+}
+
+// bind rtp to an even port from RTPPortRange and rtcp to the next port
+static bool BindRTPSocketPair(UDPProxySocket * rtp, UDPProxySocket * rtcp, const PIPSocket::Address & laddr, WORD & port)
+{
+	int numPorts = min(RTPPortRange.GetNumPorts(), DEFAULT_NUM_SEQ_PORTS*2);
+	for (int i = 0; i < numPorts; i += 2) {
+		port = RTPPortRange.AllocatePair();
+		if (port == 0)
+			break;	// all pairs in use
+		if (rtp && !rtp->Bind(laddr, port)) {
+			PTRACE(1, "RTP\tRTP socket " << AsString(laddr, port) << " not available - error "
+				<< rtp->GetErrorCode(PSocket::LastGeneralError) << '/'
+				<< rtp->GetErrorNumber(PSocket::LastGeneralError) << ": "
+				<< rtp->GetErrorText(PSocket::LastGeneralError));
+			SNMP_TRAP(10, SNMPError, Network, "Can't bind to RTP port " + AsString(laddr, port));
+			rtp->Close();
+			RTPPortRange.ReleasePair(port);	// used by someone else, retry it after all other pairs
+			continue;
+		}
+		if (rtcp && !rtcp->Bind(laddr, port + 1)) {
+			PTRACE(1, "RTP\tRTCP socket " << AsString(laddr, port + 1) << " not available - error "
+				<< rtcp->GetErrorCode(PSocket::LastGeneralError) << '/'
+				<< rtcp->GetErrorNumber(PSocket::LastGeneralError) << ": "
+				<< rtcp->GetErrorText(PSocket::LastGeneralError));
+			SNMP_TRAP(10, SNMPError, Network, "Can't bind to RTCP port " + AsString(laddr, port));
+			rtcp->Close();
+			if (rtp)
+                rtp->Close();
+			RTPPortRange.ReleasePair(port);
+			continue;
+		}
+		return true;
+	}
+	port = 0;
+	return false;
+}
+
+// class RTPSocketPool
+RTPSocketPool::RTPSocketPool() : Singleton<RTPSocketPool>("RTPSocketPool"),
+	m_laddr(GNUGK_INADDR_ANY), m_generation(0), m_size(0), m_hits(0), m_misses(0), m_refilling(false)
+{
+}
+
+RTPSocketPool::~RTPSocketPool()
+{
+	PWaitAndSignal lock(m_mutex);
+	m_size = 0;
+	Flush();
+}
+
+void RTPSocketPool::LoadConfig()
+{
+	PWaitAndSignal lock(m_mutex);
+	m_size = GkConfig()->GetInteger(ProxySection, "RTPSocketPoolSize", 0);
+	// re-create all pairs, the port range, Home= or DiffServ setting may have changed
+	Flush();
+	m_laddr = GetRTPBindAddress();
+	ScheduleRefill();
+}
+
+bool RTPSocketPool::Take(const PIPSocket::Address & laddr, UDPProxySocket * & rtp, UDPProxySocket * & rtcp, WORD & port)
+{
+	PWaitAndSignal lock(m_mutex);
+	if (m_size == 0)
+		return false;
+	if (m_pairs.empty() || laddr != m_laddr) {
+		++m_misses;
+		ScheduleRefill();
+		return false;
+	}
+	const SocketPair & pair = m_pairs.front();
+	rtp = pair.rtp;
+	rtcp = pair.rtcp;
+	port = pair.port;
+	m_pairs.pop_front();
+	++m_hits;
+	if (m_pairs.size() <= m_size / 2)
+		ScheduleRefill();
+	return true;
+}
+
+void RTPSocketPool::ScheduleRefill()
+{
+	if (m_refilling || m_pairs.size() >= m_size)
+		return;
+	m_refilling = true;
+	CreateJob(this, &RTPSocketPool::Refill, "RTPSocketPoolRefill");
+}
+
+void RTPSocketPool::Refill()
+{
+	while (!IsGatekeeperShutdown()) {
+		// new sockets read the config, but a reload mustn't wait for the whole pool
+		ReadLock cfglock(ConfigReloadMutex);
+		PIPSocket::Address laddr;
+		unsigned generation;
+		{
+			PWaitAndSignal lock(m_mutex);
+			if (m_pairs.size() >= m_size)
+				break;
+			laddr = m_laddr;
+			generation = m_generation;
+		}
+		SocketPair pair;
+		pair.rtp = new UDPProxySocket("RTP", 0);
+		pair.rtcp = new UDPProxySocket("RTCP", 0);
+		if (!BindRTPSocketPair(pair.rtp, pair.rtcp, laddr, pair.port)) {
+			PTRACE(2, "RTP\tCan't fill RTP socket pool - out of RTP sockets");
+			delete pair.rtp;
+			delete pair.rtcp;
+			break;
+		}
+		PWaitAndSignal lock(m_mutex);
+		if (generation != m_generation || laddr != m_laddr) {
+			// flushed by a reload while the pair was bound
+			Close(pair);
+			continue;
+		}
+		m_pairs.push_back(pair);
+	}
+	PWaitAndSignal lock(m_mutex);
+	m_refilling = false;
+}
+
+void RTPSocketPool::Flush()
+{
+	++m_generation;
+	while (!m_pairs.empty()) {
+		Close(m_pairs.front());
+		m_pairs.pop_front();
+	}
+}
+
+void RTPSocketPool::Close(const SocketPair & pair)
+{
+	delete pair.rtp;
+	delete pair.rtcp;
+	RTPPortRange.ReleasePair(pair.port);
+}
+
+PString RTPSocketPool::PrintStatistics() const
+{
+	PWaitAndSignal lock(m_mutex);
+	if (m_size == 0)
+		return PString::Empty();
+	return PString(PString::Printf, "RTP socket pool: %u of %u pairs ready  Hits: %u  Misses: %u\r\n",
+		(unsigned)m_pairs.size(), m_size, m_hits, m_misses);
+}
+
+PString PrintRTPPortStatistics()
+{
+	return RTPPortRange.PrintStatistics();
+}
+
+PString PrintRTPRelayStatistics()
+{
+	return RTPSocketPool::Instance()->PrintStatistics() + RTCPStatsAggregator::Instance()->PrintStatistics();
+}
+
+
 // class RTPLogicalChannel
 RTPLogicalChannel::RTPLogicalChannel(const H225_CallIdentifier & id, WORD flcn, bool nated, WORD sessionID, RTPSessionTypes sessionType)
     : LogicalChannel(flcn), reversed(false), peer(NULL), m_sessionType(sessionType)
@@ -15111,60 +16607,36 @@ RTPLogicalChannel::RTPLogicalChannel(const H225_CallIdentifier & id, WORD flcn,
 	rtcp = NULL;
 	m_callID = id;
 #ifdef HAS_H235_MEDIA
-	m_H235CryptoEngine = NULL;
+	m_H235Cipher = NULL;
 	m_auth = NULL;
 	m_encrypting = false;
 	m_plainPayloadType = UNDEFINED_PAYLOAD_TYPE;
 	m_cipherPayloadType = UNDEFINED_PAYLOAD_TYPE;
 #endif
 
+	PIPSocket::Address laddr = GetRTPBindAddress();
+
 #ifdef HAS_H46023
 	// If we have a GKClient check whether to create NAT ports or not.
 	GkClient * gkClient = RasServer::Instance()->GetGkClient();
 	if (gkClient && !gkClient->H46023_CreateSocketPair(id, m_callNo, sessionID, rtp, rtcp, nated))
 #endif
 	{
+		if (RTPSocketPool::Instance()->Take(laddr, rtp, rtcp, port)) {
+			rtp->AttachToCall(m_callNo);
+			rtcp->AttachToCall(m_callNo);
+			SetNAT(nated);
+			return;
+		}
 		rtp = new UDPProxySocket("RTP", m_callNo);
 		rtcp = new UDPProxySocket("RTCP", m_callNo);
 	}
     SetNAT(nated);
 
-	// if Home specifies only one local address, we want to bind
-	// only to this specified local address
-	PIPSocket::Address laddr(GNUGK_INADDR_ANY);
-	std::vector<PIPSocket::Address> home;
-	Toolkit::Instance()->GetGKHome(home);
-	if (home.size() == 1)
-		laddr = home[0];
-
-	int numPorts = min(RTPPortRange.GetNumPorts(), DEFAULT_NUM_SEQ_PORTS*2);
-	for (int i = 0; i < numPorts; i += 2) {
-		port = GetPortNumber();
-		// try to bind rtp to an even port and rtcp to the next one port
-		if (rtp && !rtp->Bind(laddr, port)) {
-			PTRACE(1, "RTP\tRTP socket " << AsString(laddr, port) << " not available - error "
-				<< rtp->GetErrorCode(PSocket::LastGeneralError) << '/'
-				<< rtp->GetErrorNumber(PSocket::LastGeneralError) << ": "
-				<< rtp->GetErrorText(PSocket::LastGeneralError));
-			SNMP_TRAP(10, SNMPError, Network, "Can't bind to RTP port " + AsString(laddr, port));
-			rtp->Close();
-			continue;
-		}
-		if (rtcp && !rtcp->Bind(laddr, port + 1)) {
-			PTRACE(1, "RTP\tRTCP socket " << AsString(laddr, port + 1) << " not available - error "
-				<< rtcp->GetErrorCode(PSocket::LastGeneralError) << '/'
-				<< rtcp->GetErrorNumber(PSocket::LastGeneralError) << ": "
-				<< rtcp->GetErrorText(PSocket::LastGeneralError));
-			SNMP_TRAP(10, SNMPError, Network, "Can't bind to RTCP port " + AsString(laddr, port));
-			rtcp->Close();
-			if (rtp)
-                rtp->Close();
-			continue;
-		}
+	if (BindRTPSocketPair(rtp, rtcp, laddr, port))
 		return;
-	}
 
-	PTRACE(2, "RTP\tLogical channel " << flcn << " could not be established - out of RTP sockets");
+	PTRACE(2, "RTP\tLogical channel " << flcn << " could not be established - out of RTP sockets (" << RTPPortRange.GetPairsInUse() << " port pairs in use)");
 }
 
 RTPLogicalChannel::RTPLogicalChannel(RTPLogicalChannel * flc, WORD flcn, bool nated, RTPSessionTypes sessionType)
@@ -15229,7 +16701,7 @@ RTPLogicalChannel::RTPLogicalChannel(RTPLogicalChannel * flc, WORD flcn, bool na
 #endif
     m_isUnidirectional = false;
 #ifdef HAS_H235_MEDIA
-	m_H235CryptoEngine = NULL;
+	m_H235Cipher = NULL;
 	m_auth = NULL;
 	m_encrypting = false;
 	m_plainPayloadType = UNDEFINED_PAYLOAD_TYPE;
@@ -15255,17 +16727,17 @@ RTPLogicalChannel::~RTPLogicalChannel()
 #ifdef HAS_H235_MEDIA
 #ifdef HAS_H46018
 	// remove crypto engines from the multiplex channel
-	if (GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false))
+	if (GetProxyConfig()->m_rtpMultiplexing)
 		MultiplexedRTPHandler::Instance()->RemoveChannel(m_callNo, this);
 #endif
 	m_cryptoEngineMutex.Wait();
-	if (m_H235CryptoEngine) {
+	if (m_H235Cipher) {
 		if (rtp) {
 			rtp->RemoveEncryptingRTPChannel(this);
 			rtp->RemoveDecryptingRTPChannel(this);
 		}
-		delete m_H235CryptoEngine;
-		m_H235CryptoEngine = NULL;
+		delete m_H235Cipher;
+		m_H235Cipher = NULL;
 	}
 	m_cryptoEngineMutex.Signal();
 #endif
@@ -15278,6 +16750,8 @@ RTPLogicalChannel::~RTPLogicalChannel()
 	if (peer) {
 		peer->peer = NULL;
 	} else {
+		// last channel using the sockets
+		RTPPortRange.ReleasePair(port);
         // skip object cleanup on system shutdown, may have already been deleted by ProxyHandler d'tor (race condition)
         if (!IsGatekeeperShutdown()) {
             if (used) {
@@ -15463,10 +16937,10 @@ bool RTPLogicalChannel::CreateH235Session(H235Authenticators & auth, const H245_
 	}
 
 	// delete old crypto engine (if we are called from UpdateMediaKey()
-	if (m_H235CryptoEngine)
-		delete m_H235CryptoEngine;
+	if (m_H235Cipher)
+		delete m_H235Cipher;
 	// new session with media key after shared key was used to decrypt media key
-	m_H235CryptoEngine = new H235CryptoEngine(algorithmOID, mediaKey);
+	m_H235Cipher = new H235MediaCipher(algorithmOID, mediaKey);
 	PTRACE(3, "H235\tNew crypto engine created: plainPT=" << (int)m_plainPayloadType << " cipherPT=" << (int)m_cipherPayloadType << " rtplc=" << this << " encrypt=" << m_encrypting);
 
 	if (encrypting) {
@@ -15505,8 +16979,10 @@ bool RTPLogicalChannel::CreateH235SessionAndKey(H235Authenticators & auth, H245_
 	// use session key to decrypt the media key
 	H235CryptoEngine H235Session(algorithmOID, shortSessionKey);
 
-	// generate media key
-	PBYTEArray mediaKey = H235Session.GenerateRandomKey(algorithmOID);
+	// generate media key, if possible take a pre-generated one
+	PBYTEArray mediaKey;
+	if (!H235KeyPool::Instance()->GetMediaKey(algorithmOID, mediaKey))
+		mediaKey = H235Session.GenerateRandomKey(algorithmOID);
 	PTRACE(3, "H235\tMedia key generated:" << endl << hex << mediaKey);
 
 	encryptionSync.m_synchFlag = m_cipherPayloadType;
@@ -15522,10 +16998,10 @@ bool RTPLogicalChannel::CreateH235SessionAndKey(H235Authenticators & auth, H245_
 	encryptionSync.m_h235Key.EncodeSubType(h235key);
 
 	// delete old crypto engine (if we are called from UpdateMediaKey()
-	if (m_H235CryptoEngine)
-		delete m_H235CryptoEngine;
+	if (m_H235Cipher)
+		delete m_H235Cipher;
 	// new session with media key after shared key was used to encrypt media key for transmission
-	m_H235CryptoEngine = new H235CryptoEngine(algorithmOID, mediaKey);
+	m_H235Cipher = new H235MediaCipher(algorithmOID, mediaKey);
 	PTRACE(3, "H235\tNew crypto engine created: plainPT=" << (int)m_plainPayloadType << " cipherPT=" << (int)m_cipherPayloadType << " rtplc=" << this << " encrypt=" << m_encrypting);
 
 	if (encrypting) {
@@ -15538,7 +17014,7 @@ bool RTPLogicalChannel::CreateH235SessionAndKey(H235Authenticators & auth, H245_
 
 bool RTPLogicalChannel::UpdateMediaKey(const H245_EncryptionSync & encryptionSync)
 {
-	if (!m_auth || !m_H235CryptoEngine) {
+	if (!m_auth || !m_H235Cipher) {
 		PTRACE(1, "H235\tError: H.235 media key update before session initialization");
 		SNMP_TRAP(10, SNMPError, Authentication, "H.235.6 key update failure");
 		return false;
@@ -15548,7 +17024,7 @@ bool RTPLogicalChannel::UpdateMediaKey(const H245_EncryptionSync & encryptionSyn
 
 bool RTPLogicalChannel::GenerateNewMediaKey(BYTE newPayloadType, H245_EncryptionSync & encryptionSync)
 {
-	if (!m_auth || !m_H235CryptoEngine) {
+	if (!m_auth || !m_H235Cipher) {
 		PTRACE(1, "H235\tError: H.235 media key update before session initialization");
 		SNMP_TRAP(10, SNMPError, Authentication, "H.235.6 key update before session initialization");
 		return false;
@@ -15557,19 +17033,229 @@ bool RTPLogicalChannel::GenerateNewMediaKey(BYTE newPayloadType, H245_Encryption
 	return CreateH235SessionAndKey(*m_auth, encryptionSync, m_encrypting);
 }
 
+// class H235MediaCipher
+H235MediaCipher::H235MediaCipher(const PString & algorithmOID, const PBYTEArray & key)
+	: m_engine(new H235CryptoEngine(algorithmOID, key))
+{
+}
+
+H235MediaCipher::~H235MediaCipher()
+{
+	delete m_engine;
+}
+
+bool H235MediaCipher::Encrypt(BYTE * data, WORD & len, WORD maxLen, unsigned char * ivSequence, bool & rtpPadding)
+{
+#ifdef HAS_H235_INPLACE_CRYPTO
+	const PINDEX resultLen = m_engine->EncryptInPlace(data, len, m_result, ivSequence, rtpPadding);
+	const BYTE * result = m_result;
+#else
+	const PBYTEArray processed = m_engine->Encrypt(PBYTEArray(data, len), ivSequence, rtpPadding);
+	const PINDEX resultLen = processed.GetSize();
+	const BYTE * result = processed;
+#endif
+	if (resultLen <= 0)
+		return false;
+	len = (WORD)resultLen;
+	if (len > maxLen) {
+		PTRACE(1, "H235\tRTP packet too large, truncating");
+		len = maxLen;
+	}
+	memcpy(data, result, len);
+	return true;
+}
+
+bool H235MediaCipher::Decrypt(BYTE * data, WORD & len, unsigned char * ivSequence, bool & rtpPadding)
+{
+#ifdef HAS_H235_INPLACE_CRYPTO
+	const PINDEX resultLen = m_engine->DecryptInPlace(data, len, m_result, ivSequence, rtpPadding);
+	const BYTE * result = m_result;
+#else
+	const PBYTEArray processed = m_engine->Decrypt(PBYTEArray(data, len), ivSequence, rtpPadding);
+	const PINDEX resultLen = processed.GetSize();
+	const BYTE * result = processed;
+#endif
+	if (resultLen <= 0 || resultLen > len)
+		return false;	// the plain text is never longer
+	len = (WORD)resultLen;
+	memcpy(data, result, len);
+	return true;
+}
+
+namespace {
+
+// keeps the H.235 key pools filled
+class H235KeyPoolRefill : public RegularJob {
+public:
+	H235KeyPoolRefill() { SetName("H235KeyPool"); Execute(); }
+
+	virtual void Exec()
+	{
+		// sleep until a key is taken, there is nothing to do while all pools are full
+		if (H235KeyPool::Instance()->Refill() == 0)
+			H235KeyPool::Instance()->WaitForDemand();
+	}
+
+	virtual void Stop()
+	{
+		RegularJob::Stop();
+		H235KeyPool::Instance()->SignalDemand();
+	}
+};
+
+} // end namespace
+
+// class H235KeyPool
+H235KeyPool::H235KeyPool() : Singleton<H235KeyPool>("H235KeyPool"),
+	m_poolSize(0), m_refillStarted(false), m_rateGenerated(0), m_refillRate(0)
+{
+}
+
+void H235KeyPool::LoadConfig()
+{
+	unsigned poolSize = GkConfig()->GetInteger(RoutedSec, "H235KeyPoolSize", 0);
+	if (!Toolkit::Instance()->IsH235HalfCallMediaEnabled())
+		poolSize = 0;
+
+	PWaitAndSignal lock(m_poolMutex);
+	m_poolSize = poolSize;
+	for (KeyPools::iterator pool = m_pools.begin(); pool != m_pools.end(); ++pool) {
+		while (pool->second.m_keys.size() > m_poolSize)
+			pool->second.m_keys.pop_back();
+	}
+
+	if (m_poolSize > 0 && !m_refillStarted) {
+		new H235KeyPoolRefill();
+		m_refillStarted = true;
+	}
+	m_demand.Signal();	// a new size may need more keys
+}
+
+void H235KeyPool::WaitForDemand()
+{
+	m_demand.Wait();
+}
+
+void H235KeyPool::SignalDemand()
+{
+	m_demand.Signal();
+}
+
+bool H235KeyPool::GetMediaKey(const PString & algorithmOID, PBYTEArray & mediaKey)
+{
+	PWaitAndSignal lock(m_poolMutex);
+	if (m_poolSize == 0)
+		return false;
+	m_demand.Signal();	// the pool is taken from or created, either way it needs a refill
+	KeyPools::iterator pool = m_pools.find(algorithmOID);
+	if (pool == m_pools.end()) {
+		// first use of this algorithm, the refill thread picks up the new pool
+		const unsigned keySize = AlgorithmKeySize(algorithmOID);
+		if (keySize == 0)
+			return false;
+		pool = m_pools.insert(std::make_pair(algorithmOID, KeyPool())).first;
+		pool->second.m_keySize = keySize;
+	}
+	if (pool->second.m_keys.empty()) {
+		++pool->second.m_misses;
+		return false;
+	}
+	mediaKey = pool->second.m_keys.front();
+	pool->second.m_keys.pop_front();
+	++pool->second.m_taken;
+	return true;
+}
+
+unsigned H235KeyPool::Refill()
+{
+	// copy what is needed to generate the keys, the lock isn't held while generating them
+	std::map<PString, PINDEX> pending;
+	{
+		PWaitAndSignal lock(m_poolMutex);
+		for (KeyPools::const_iterator pool = m_pools.begin(); pool != m_pools.end(); ++pool) {
+			if (pool->second.m_keys.size() < m_poolSize)
+				pending[pool->first] = pool->second.m_keySize;
+		}
+	}
+
+	unsigned generated = 0;
+	for (std::map<PString, PINDEX>::const_iterator p = pending.begin(); p != pending.end(); ++p) {
+		PBYTEArray key(p->second);
+		if (RAND_bytes(key.GetPointer(), p->second) != 1) {
+			PTRACE(1, "H235\tError: Generating media key for " << p->first << " failed");
+			continue;
+		}
+		PWaitAndSignal lock(m_poolMutex);
+		KeyPools::iterator pool = m_pools.find(p->first);
+		if (pool != m_pools.end() && pool->second.m_keys.size() < m_poolSize) {
+			pool->second.m_keys.push_back(key);
+			++pool->second.m_generated;
+			++generated;
+		}
+	}
+
+	PWaitAndSignal lock(m_poolMutex);
+	m_rateGenerated += generated;
+	const PTime now;
+	const PInt64 elapsed = (now - m_rateStart).GetMilliSeconds();
+	if (elapsed >= 10000) {
+		m_refillRate = m_rateGenerated * 1000.0 / elapsed;
+		m_rateGenerated = 0;
+		m_rateStart = now;
+	}
+	return generated;
+}
+
+PString H235KeyPool::PrintStatistics() const
+{
+	PWaitAndSignal lock(m_poolMutex);
+	if (m_poolSize == 0 || m_pools.empty())
+		return PString::Empty();
+	PString msg(PString::Printf, "H.235 key pool refill rate: %.1f keys/s\r\n", m_refillRate);
+	for (KeyPools::const_iterator pool = m_pools.begin(); pool != m_pools.end(); ++pool) {
+		msg += PString(PString::Printf, "  Media key %s: %u/%u ready  Generated: %u  Taken: %u  Misses: %u\r\n",
+			(const char *)pool->first, (unsigned)pool->second.m_keys.size(), m_poolSize,
+			pool->second.m_generated, pool->second.m_taken, pool->second.m_misses);
+	}
+	return msg;
+}
+
 bool RTPLogicalChannel::ProcessH235Media(BYTE * buffer, WORD & len, bool encrypt, unsigned char * ivsequence, bool & rtpPadding, BYTE & payloadType)
 {
 	PWaitAndSignal lock(m_cryptoEngineMutex);
-	if (!m_H235CryptoEngine)
+	if (!m_H235Cipher)
 		return false;
+	const bool result = ProcessH235Packet(buffer, len, encrypt, ivsequence, rtpPadding, payloadType);
+	CheckMediaKeyUpdate();
+	return result;
+}
 
-	unsigned rtpHeaderLen = RTP_HeaderSize(buffer, len);
-	PBYTEArray data(buffer+rtpHeaderLen, len-rtpHeaderLen);	// skip RTP header
-	PBYTEArray processed;
+unsigned RTPLogicalChannel::ProcessH235Media(H235MediaPacket * packets, unsigned count, bool encrypt)
+{
+	PWaitAndSignal lock(m_cryptoEngineMutex);
+	if (!m_H235Cipher)
+		return 0;
+	unsigned processed = 0;
+	for (unsigned i = 0; i < count; ++i) {
+		H235MediaPacket & packet = packets[i];
+		packet.m_processed = ProcessH235Packet(packet.m_buffer, packet.m_len, encrypt, packet.m_ivSequence, packet.m_rtpPadding, packet.m_payloadType);
+		if (packet.m_processed)
+			++processed;
+	}
+	CheckMediaKeyUpdate();
+	return processed;
+}
+
+bool RTPLogicalChannel::ProcessH235Packet(BYTE * buffer, WORD & len, bool encrypt, unsigned char * ivsequence, bool & rtpPadding, BYTE & payloadType)
+{
+	const WORD rtpHeaderLen = RTP_HeaderSize(buffer, len);
+	BYTE * payload = buffer + rtpHeaderLen;	// skip RTP header
+	WORD payloadLen = len - rtpHeaderLen;
+	bool processed = false;
 
 	if (encrypt) {
 		if (payloadType == m_plainPayloadType) {
-			processed = m_H235CryptoEngine->Encrypt(data, ivsequence, rtpPadding);
+			processed = m_H235Cipher->Encrypt(payload, payloadLen, DEFAULT_PACKET_BUFFER_SIZE - rtpHeaderLen, ivsequence, rtpPadding);
 		} else {
 			PTRACE(1, "H235\tUnexpected plaintext payload type " << (int)payloadType << " expecting " << (int)m_plainPayloadType);
 			SNMP_TRAP(10, SNMPWarning, Authentication, "H.235.6 payload type mismatch");
@@ -15577,27 +17263,26 @@ bool RTPLogicalChannel::ProcessH235Media(BYTE * buffer, WORD & len, bool encrypt
 		payloadType = m_cipherPayloadType;
 	} else {
 		if (payloadType == m_cipherPayloadType) {
-			processed = m_H235CryptoEngine->Decrypt(data, ivsequence, rtpPadding);
+			processed = m_H235Cipher->Decrypt(payload, payloadLen, ivsequence, rtpPadding);
 		} else {
 			PTRACE(1, "H235\tUnexpected cipher payload type " << (int)payloadType << " expecting " << (int)m_cipherPayloadType);
 			SNMP_TRAP(10, SNMPWarning, Authentication, "H.235.6 payload type mismatch");
 		}
 		payloadType = m_plainPayloadType;
 	}
+	if (!processed)
+		return false;
+	len = rtpHeaderLen + payloadLen;
+	return true;
+}
 
-	// check max buffer size
-	len = processed.GetSize() + rtpHeaderLen;
-	if (len > DEFAULT_PACKET_BUFFER_SIZE) {
-		PTRACE(1, "H235\tRTP packet too large, truncating");
-		len = DEFAULT_PACKET_BUFFER_SIZE;
-		processed.SetSize(DEFAULT_PACKET_BUFFER_SIZE - rtpHeaderLen);
-	}
-	memcpy(buffer + rtpHeaderLen, processed.GetPointer(), processed.GetSize());
+void RTPLogicalChannel::CheckMediaKeyUpdate()
+{
 #if (H323PLUS_VER > 1252)
 	if (Toolkit::Instance()->IsH235HalfCallMediaKeyUpdatesEnabled()) {
 		// major endpoints seem to ignore the key updates, thus the switch
-		if (m_H235CryptoEngine->IsMaxBlocksPerKeyReached()) {
-			m_H235CryptoEngine->ResetBlockCount(); // reset count now, so we don't request update multiple times
+		if (m_H235Cipher->GetEngine().IsMaxBlocksPerKeyReached()) {
+			m_H235Cipher->GetEngine().ResetBlockCount(); // reset count now, so we don't request update multiple times
 			PTRACE(1, "H.235.6 media key update needed flcn=" << channelNumber);
 			// find call by CallID, send key update command or request
 			callptr call = CallTable::Instance()->FindCallRec(m_callID);
@@ -15617,7 +17302,6 @@ bool RTPLogicalChannel::ProcessH235Media(BYTE * buffer, WORD & len, bool encrypt
 		}
 	}
 #endif
-	return (processed.GetSize() > 0);
 }
 #endif // HAS_H235_MEDIA
 
@@ -15723,7 +17407,7 @@ void RTPLogicalChannel::HandleMediaChannel(H245_UnicastAddress * mediaControlCha
 			tmpmediacontrol = *mediaChannel;
 			if (useRTPMultiplexing) {
 				// set mediaControlChannel to multiplexed port, LifeSize seems to use that instead of multiplexed port in TraversalParameters
-				SetH245Port(tmpmediacontrol, (WORD)GkConfig()->GetInteger(ProxySection, "RTCPMultiplexPort", GK_DEF_MULTIPLEX_RTCP_PORT));
+				SetH245Port(tmpmediacontrol, GetProxyConfig()->m_rtcpMultiplexPort);
 			} else {
 				SetH245Port(tmpmediacontrol, GetH245Port(tmpmediacontrol) + 1); // old RTP assumption
             	//PTRACE(0, "JW RTPX setting RTCP port based on RTP port to " << GetH245Port(tmpmediacontrol));
@@ -15741,7 +17425,7 @@ void RTPLogicalChannel::HandleMediaChannel(H245_UnicastAddress * mediaControlCha
 			tmpmedia = *mediaControlChannel;
 			if (useRTPMultiplexing) {
 				// set mediaChannel to multiplexed port, LifeSize seems to use that instead of multiplexed port in TraversalParameters
-				SetH245Port(tmpmedia, (WORD)GkConfig()->GetInteger(ProxySection, "RTPMultiplexPort", GK_DEF_MULTIPLEX_RTP_PORT));
+				SetH245Port(tmpmedia, GetProxyConfig()->m_rtpMultiplexPort);
 			} else {
 				if (GetH245Port(tmpmedia) > 0)
 					SetH245Port(tmpmedia, GetH245Port(tmpmedia) - 1);
@@ -15799,7 +17483,7 @@ void RTPLogicalChannel::HandleMediaChannel(H245_UnicastAddress * mediaControlCha
     }
 
 	if (useRTPMultiplexing) {
-		*mediaControlChannel << local << (WORD)GkConfig()->GetInteger(ProxySection, "RTCPMultiplexPort", GK_DEF_MULTIPLEX_RTCP_PORT);
+		*mediaControlChannel << local << GetProxyConfig()->m_rtcpMultiplexPort;
 	} else {
 		*mediaControlChannel << local << (port + 1);    // define our local RTCP port to be next to RTP port as recommended in RFC 3550
 	}
@@ -15818,7 +17502,7 @@ void RTPLogicalChannel::HandleMediaChannel(H245_UnicastAddress * mediaControlCha
            	//PTRACE(0, "JW RTPX setting RTP port based on RTCP port to " << tmpSrcPort);
 		}
 		if (useRTPMultiplexing)
-			tmpSrcPort = (WORD)GkConfig()->GetInteger(ProxySection, "RTPMultiplexPort", GK_DEF_MULTIPLEX_RTP_PORT);
+			tmpSrcPort = GetProxyConfig()->m_rtpMultiplexPort;
 		if (tmpSrcPort > 0) {
             (rtp->*SetDest)(tmpSrcIP, tmpSrcPort, dest, call, false, false);
 		} else {
@@ -15875,7 +17559,7 @@ void RTPLogicalChannel::HandleMediaChannel(H245_UnicastAddress * mediaControlCha
         }
 
 		if (useRTPMultiplexing) {
-			*mediaChannel << local << (WORD)GkConfig()->GetInteger(ProxySection, "RTPMultiplexPort", GK_DEF_MULTIPLEX_RTP_PORT);
+			*mediaChannel << local << GetProxyConfig()->m_rtpMultiplexPort;
 		} else {
 			*mediaChannel << local << port;
 		}
@@ -16005,15 +17689,6 @@ void RTPLogicalChannel::SetNAT(bool nated)
 	}
 }
 
-WORD RTPLogicalChannel::GetPortNumber()
-{
-	WORD port = RTPPortRange.GetPort();
-	if (port & 1) // make sure it is even
-		port = RTPPortRange.GetPort();
-	RTPPortRange.GetPort(); // skip odd port
-	return port;
-}
-
 
 // class T120LogicalChannel
 T120LogicalChannel::T120LogicalChannel(WORD flcn) : LogicalChannel(flcn)
@@ -16197,19 +17872,19 @@ H245ProxyHandler::H245ProxyHandler(const H225_CallIdentifier & id, const PIPSock
         }
     }
 	m_isRTPMultiplexingEnabled = Toolkit::Instance()->IsH46018Enabled()
-								&& GkConfig()->GetBoolean(ProxySection, "RTPMultiplexing", false);
+								&& GetProxyConfig()->m_rtpMultiplexing;
 #else
 	m_isRTPMultiplexingEnabled = false;
 #endif
 	m_requestRTPMultiplexing = false;	// only enable in SetRequestRTPMultiplexing() if endpoint supports it
 	m_remoteRequestsRTPMultiplexing = false;	// set when receiving the multiplexID
-	m_multiplexedRTPPort = (WORD)GkConfig()->GetInteger(ProxySection, "RTPMultiplexPort", GK_DEF_MULTIPLEX_RTP_PORT);
-	m_multiplexedRTCPPort = (WORD)GkConfig()->GetInteger(ProxySection, "RTCPMultiplexPort", GK_DEF_MULTIPLEX_RTCP_PORT);
+	m_multiplexedRTPPort = GetProxyConfig()->m_rtpMultiplexPort;
+	m_multiplexedRTCPPort = GetProxyConfig()->m_rtcpMultiplexPort;
 #ifdef HAS_H235_MEDIA
 	m_isCaller = false;
 #endif
 	m_isH245Master = false;
-    m_filterFastUpdatePeriod = GkConfig()->GetInteger(RoutedSec, "FilterVideoFastUpdatePicture", 0);
+    m_filterFastUpdatePeriod = GetRoutedConfig()->m_filterVideoFastUpdatePicture;
     m_matchH239SessionsByType = GkConfig()->GetBoolean(RoutedSec, "MatchH239SessionsByType", true);
 
     PStringArray matchOnlyIDs = GkConfig()->GetString(RoutedSec, "MatchH239SessionsByIDOnly", "").Tokenise(",", FALSE);
@@ -16602,10 +18277,8 @@ bool H245ProxyHandler::HandleOpenLogicalChannel(H245_OpenLogicalChannel & olc, c
 		if (m_requestRTPMultiplexing || m_remoteRequestsRTPMultiplexing
 			|| (peer && peer->m_requestRTPMultiplexing)
 			|| (peer && peer->m_remoteRequestsRTPMultiplexing) ) {
-			h46019chan = MultiplexedRTPHandler::Instance()->GetChannelSwapped(call->GetCallNumber(), sessionID, this);
-			if (!h46019chan.IsValid()) {
-				h46019chan = H46019Session(call->GetCallNumber(), sessionID, this); // no existing found, create a new one
-			}
+			// collect the changes, AddChannel() creates the session or sets them in the existing one
+			h46019chan = H46019Session(call->GetCallNumber(), sessionID, this);
 			if (sessionID == INVALID_RTP_SESSION) {
 				// master assigned RTP session ID - remember FLCN to help set it later
 				h46019chan.m_flcn = flcn;
@@ -16904,8 +18577,15 @@ bool H245ProxyHandler::HandleOpenLogicalChannel(H245_OpenLogicalChannel & olc, c
 			call->SetRTPKeepAlivePayloadType(flcn, GNUGK_KEEPALIVE_RTP_PAYLOADTYPE + 1);
 		}
 		// start KeepAlives if we are client (will be ignored if we are server and no KeepAlive has been added above)
-		call->StartRTPKeepAlive(flcn, h46019chan.m_osSocketToA);
-		call->StartRTCPKeepAlive(flcn, h46019chan.m_osSocketToA_RTCP);
+		H46019SideInfo sideA;
+		sideA.m_osSocket = h46019chan.m_osSocketToA;
+		sideA.m_osSocketRTCP = h46019chan.m_osSocketToA_RTCP;
+		if (h46019chan.IsValid() && MultiplexedRTPHandler::InstanceExists()) {
+			// the sockets of the session, if not set by this OLC
+			MultiplexedRTPHandler::Instance()->GetChannelSide(call->GetCallNumber(), sessionID, this, SideA, sideA);
+		}
+		call->StartRTPKeepAlive(flcn, sideA.m_osSocket);
+		call->StartRTCPKeepAlive(flcn, sideA.m_osSocketRTCP);
 #endif // HAS_H46018
 
 #ifdef HAS_H235_MEDIA
@@ -16988,14 +18668,7 @@ bool H245ProxyHandler::HandleOpenLogicalChannel(H245_OpenLogicalChannel & olc, c
 #ifdef HAS_H46018
 			if (m_requestRTPMultiplexing || m_remoteRequestsRTPMultiplexing
 				|| peer->m_requestRTPMultiplexing || peer->m_remoteRequestsRTPMultiplexing) {
-				// get the H46019Session object in standard (un-swapped) format
-				H46019Session h46019chan = MultiplexedRTPHandler::Instance()->GetChannel(call->GetCallNumber(), sessionID);
-				if (encrypting) {
-					h46019chan.m_encryptingLC = rtplc;
-				} else {
-					h46019chan.m_decryptingLC = rtplc;
-				}
-				MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
+				MultiplexedRTPHandler::Instance()->SetChannelMediaEncryption(call->GetCallNumber(), sessionID, encrypting, rtplc, INVALID_MULTIPLEX_ID);
 			}
 #endif
 		}
@@ -17073,6 +18746,7 @@ bool H245ProxyHandler::HandleOpenLogicalChannelAck(H245_OpenLogicalChannelAck &
 	}
 	H46019Session h46019chan(0, INVALID_RTP_SESSION, NULL);
 	DWORD assignedMultiplexID = INVALID_MULTIPLEX_ID; // only used when HAS_H235_MEDIA
+	bool haveSession = false;
  	if (m_requestRTPMultiplexing || m_remoteRequestsRTPMultiplexing || peer->m_requestRTPMultiplexing || peer->m_remoteRequestsRTPMultiplexing) {
 		// update session ID if assigned by master
 		if (sessionID > 3) {
@@ -17084,11 +18758,12 @@ bool H245ProxyHandler::HandleOpenLogicalChannelAck(H245_OpenLogicalChannelAck &
                 MultiplexedRTPHandler::Instance()->RemoveChannel(call->GetCallNumber(), (WORD)0);
 			}
 		}
-		h46019chan = MultiplexedRTPHandler::Instance()->GetChannelSwapped(call->GetCallNumber(), sessionID, peer);
-		if (!h46019chan.IsValid()) {
-			MultiplexedRTPHandler::Instance()->DumpChannels(" ERROR: channel not found! ");
+		// collect the changes, UpdateChannel() sets them in the session
+		haveSession = MultiplexedRTPHandler::Instance()->HasChannel(call->GetCallNumber(), sessionID);
+		if (haveSession) {
+			h46019chan = H46019Session(call->GetCallNumber(), sessionID, peer);
 		} else {
-			h46019chan.Dump();
+			MultiplexedRTPHandler::Instance()->DumpChannels(" ERROR: channel not found! ");
 		}
 	}
 	// parse traversal parameters from sender
@@ -17113,11 +18788,11 @@ bool H245ProxyHandler::HandleOpenLogicalChannelAck(H245_OpenLogicalChannelAck &
                                     multiplexedRTPAddr, multiplexedRTCPAddr, multiplexID)) {
                                 m_remoteRequestsRTPMultiplexing = m_isRTPMultiplexingEnabled && (multiplexID != INVALID_MULTIPLEX_ID);
                                 if (m_requestRTPMultiplexing || m_remoteRequestsRTPMultiplexing) {
-                                    if (!h46019chan.IsValid()) {
+                                    if (!haveSession) {
                                         // eg. server requests multiplexing to it, but doesn't support sending multiplexed
                                         h46019chan = H46019Session(call->GetCallNumber(), sessionID, peer); // no existing session, create a new one
                                         MultiplexedRTPHandler::Instance()->AddChannel(h46019chan);
-                                        h46019chan = MultiplexedRTPHandler::Instance()->GetChannelSwapped(call->GetCallNumber(), sessionID, peer);
+                                        haveSession = true;
                                     }
                                     h46019chan.m_multiplexID_toB = multiplexID;
                                     if (IsTraversalServer()) {  // only save multiplex addresses if from server
@@ -17228,31 +18903,25 @@ bool H245ProxyHandler::HandleOpenLogicalChannelAck(H245_OpenLogicalChannelAck &
 		}
 		MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
 
-		// now get the same H46019Session object, but in standard (un-swapped) format to update the RTP LC
-		h46019chan = MultiplexedRTPHandler::Instance()->GetChannel(call->GetCallNumber(), sessionID);
+		// now set the sides of the session in standard (un-swapped) format in the RTP LC,
+		// outside the session lock, the sockets lock their multiplex settings
 		RTPLogicalChannel * rtplc = dynamic_cast<RTPLogicalChannel *>(lc);
 		if (rtplc) {
-			if ((h46019chan.m_multiplexID_toA != INVALID_MULTIPLEX_ID)
-				|| (h46019chan.m_multiplexID_fromA != INVALID_MULTIPLEX_ID)) {
-				if (IsSet(h46019chan.m_addrA)) {
-					rtplc->SetLCMultiplexDestination(false, h46019chan.m_addrA, SideA);
-					rtplc->SetLCMultiplexDestination(true, h46019chan.m_addrA_RTCP, SideA);
-				}
-				rtplc->SetLCMultiplexID(false, h46019chan.m_multiplexID_toA, SideA);
-				rtplc->SetLCMultiplexID(true, h46019chan.m_multiplexID_toA, SideA);
-				rtplc->SetLCMultiplexSocket(false, h46019chan.m_osSocketToA, SideA);
-				rtplc->SetLCMultiplexSocket(true, h46019chan.m_osSocketToA_RTCP, SideA);
-			}
-			if ((h46019chan.m_multiplexID_toB != INVALID_MULTIPLEX_ID)
-				|| (h46019chan.m_multiplexID_fromB != INVALID_MULTIPLEX_ID)) {
-				if (IsSet(h46019chan.m_addrB)) {
-					rtplc->SetLCMultiplexDestination(false, h46019chan.m_addrB, SideB);
-					rtplc->SetLCMultiplexDestination(true, h46019chan.m_addrB_RTCP, SideB);
+			const H46019Side sides[2] = { SideA, SideB };
+			for (unsigned i = 0; i < 2; ++i) {
+				H46019SideInfo info;
+				if (!MultiplexedRTPHandler::Instance()->GetChannelSide(call->GetCallNumber(), sessionID, NULL, sides[i], info))
+					break;
+				if ((info.m_multiplexID_to != INVALID_MULTIPLEX_ID) || (info.m_multiplexID_from != INVALID_MULTIPLEX_ID)) {
+					if (IsSet(info.m_addr)) {
+						rtplc->SetLCMultiplexDestination(false, info.m_addr, sides[i]);
+						rtplc->SetLCMultiplexDestination(true, info.m_addrRTCP, sides[i]);
+					}
+					rtplc->SetLCMultiplexID(false, info.m_multiplexID_to, sides[i]);
+					rtplc->SetLCMultiplexID(true, info.m_multiplexID_to, sides[i]);
+					rtplc->SetLCMultiplexSocket(false, info.m_osSocket, sides[i]);
+					rtplc->SetLCMultiplexSocket(true, info.m_osSocketRTCP, sides[i]);
 				}
-				rtplc->SetLCMultiplexID(false, h46019chan.m_multiplexID_toB, SideB);
-				rtplc->SetLCMultiplexID(true, h46019chan.m_multiplexID_toB, SideB);
-				rtplc->SetLCMultiplexSocket(false, h46019chan.m_osSocketToB, SideB);
-				rtplc->SetLCMultiplexSocket(true, h46019chan.m_osSocketToB_RTCP, SideB);
 			}
 		} else {
             PTRACE(1, "Error: RTPLogicalChannel cast failed");
@@ -17277,16 +18946,7 @@ bool H245ProxyHandler::HandleOpenLogicalChannelAck(H245_OpenLogicalChannelAck &
 #ifdef HAS_H46018
 		if (m_requestRTPMultiplexing || m_remoteRequestsRTPMultiplexing
 			|| peer->m_requestRTPMultiplexing || peer->m_remoteRequestsRTPMultiplexing) {
-			// get the H46019Session object in standard (un-swapped) format
-			H46019Session h46019chan = MultiplexedRTPHandler::Instance()->GetChannel(call->GetCallNumber(), sessionID);
-			if (encrypting) {
-				h46019chan.m_encryptingLC = rtplc;
-				h46019chan.m_encryptMultiplexID = assignedMultiplexID;
-			} else {
-				h46019chan.m_decryptingLC = rtplc;
-				h46019chan.m_decryptMultiplexID = assignedMultiplexID;
-			}
-			MultiplexedRTPHandler::Instance()->UpdateChannel(h46019chan);
+			MultiplexedRTPHandler::Instance()->SetChannelMediaEncryption(call->GetCallNumber(), sessionID, encrypting, rtplc, assignedMultiplexID);
 		}
 #endif // HAS_H46018
 	}
@@ -17930,7 +19590,7 @@ CallSignalListener::CallSignalListener(const Address & addr, WORD pt)
 	}
 
 	// TOS H.225 listener - callProceeding, alerting, connect etc.
-	int dscp = GkConfig()->GetInteger(RoutedSec, "H225DiffServ", 0);
+	int dscp = GetRoutedConfig()->m_h225DiffServ;
     if (dscp > 0) {
         int h225TypeOfService = (dscp << 2);
 #if defined(hasIPV6) && defined(IPV6_TCLASS)
@@ -18555,12 +20215,11 @@ void ProxyHandler::ReadSocket(IPSocket * socket)
 #ifdef HAS_H46018
 void CallSignalSocket::PerformConnecting()
 {
-	const int setupTimeout = PMAX(GkConfig()->GetInteger(RoutedSec, "SetupTimeout", DEFAULT_SETUP_TIMEOUT), (long)1000);
+	const int setupTimeout = GetRoutedConfig()->m_setupTimeout;
 
 	if (InternalConnectTo()) {
-		if (GkConfig()->HasKey(RoutedSec, "TcpKeepAlive"))
-			remote->Self()->SetOption(SO_KEEPALIVE, Toolkit::AsBool(
-				GkConfig()->GetString(RoutedSec, "TcpKeepAlive", "1")) ? 1 : 0,
+		if (GetRoutedConfig()->m_tcpKeepAlive >= 0)
+			remote->Self()->SetOption(SO_KEEPALIVE, GetRoutedConfig()->m_tcpKeepAlive,
 				SOL_SOCKET);
 
 		ConfigReloadMutex.EndRead();
@@ -18859,6 +20518,15 @@ void HandlerList::LoadConfig()
 	H245PortRange.LoadConfig(RoutedSec, "H245PortRange");
 	T120PortRange.LoadConfig(ProxySection, "T120PortRange");
 	RTPPortRange.LoadConfig(ProxySection, "RTPPortRange", "1024-65535");
+	RTPSocketPool::Instance()->LoadConfig();
+	RTCPStatsAggregator::Instance()->LoadConfig();
+#ifdef HAS_H235_MEDIA
+	H235KeyPool::Instance()->LoadConfig();
+#endif
+	if (GetProxyConfig()->m_enableMediaQuality)
+		MediaQualityMonitor::Instance()->LoadConfig();
+	MediaCapture::Instance()->LoadConfig();
+	IPFIXExporter::Instance()->LoadConfig();
 
 	m_numSigHandlers = GkConfig()->GetInteger(RoutedSec, "CallSignalHandlerNumber", 5); // update gk.cxx when changing default
 	if (m_numSigHandlers < 1)
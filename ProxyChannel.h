@@ -19,9 +19,12 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <deque>
 #include "yasocket.h"
 #include "RasTbl.h"
 #include "gktimer.h"
+#include "cfgsnapshot.h"
+#include "ipfix.h"
 #include "config.h"
 
 #ifdef HAS_H46026
@@ -59,6 +62,10 @@ template <class> class H225SignalingMsg;
 typedef H225SignalingMsg<H225_Setup_UUIE> SetupMsg;
 typedef H225SignalingMsg<H225_Facility_UUIE> FacilityMsg;
 struct SetupAuthData;
+#ifdef HAS_H235_MEDIA
+class H235CryptoEngine;
+class H235Authenticators;
+#endif
 
 #ifdef _WIN32
 typedef int ssize_t;
@@ -70,6 +77,446 @@ extern const char *ProxySection;
 
 const WORD DEFAULT_PACKET_BUFFER_SIZE = 2048;
 
+/// [RoutedMode] switches used per call or per message, compiled at (re)load
+struct RoutedModeConfig {
+	RoutedModeConfig();
+	void Load(PConfig * cfg);
+
+	int m_h46018KeepAliveInterval;
+	int m_gnugkTcpKeepAliveInterval;
+	bool m_enableGnuGkTcpKeepAlive;
+	bool m_disableGnuGkH245TcpKeepAlive;
+	int m_tcpKeepAlive;	// -1 = not configured, leave OS default
+	int m_setupTimeout;	// in ms, at least 1000
+	bool m_abortOnInvalidTPKT;
+	bool m_disableFastStart;
+	bool m_disableH245Tunneling;
+	bool m_h245TunnelingTranslation;
+	bool m_useProvisionalRespToH245Tunneling;
+	bool m_generateCallProceeding;
+	bool m_enableH46017;
+	bool m_enableH245Multiplexing;
+	WORD m_h245MultiplexPort;
+	WORD m_callSignalPort;
+	bool m_redirectCallsToGkIP;
+	bool m_alwaysRewriteSourceCallSignalAddress;
+	bool m_removeH460Call;
+	bool m_supportNATedEndpoints;
+	bool m_supportCallingNATedEndpoints;
+	bool m_treatUnregisteredNAT;
+	bool m_translateSorensonSourceInfo;
+	bool m_removeSorensonSourceInfo;
+	bool m_showForwarderNumber;
+	bool m_forwardOnFacility;
+	bool m_rerouteOnFacility;
+	bool m_translateFacility;
+	bool m_filterEmptyFacility;
+	int m_h225DiffServ;
+	int m_h245DiffServ;
+	unsigned m_filterVideoFastUpdatePicture;
+	PString m_screenDisplayIE;
+	PString m_appendToDisplayIE;
+};
+
+/// [Proxy] switches used per call or per channel, compiled at (re)load
+struct ProxyModeConfig {
+	ProxyModeConfig();
+	void Load(PConfig * cfg);
+
+	bool m_proxyAlways;
+	bool m_proxyForNAT;
+	bool m_proxyForSameNAT;
+	bool m_rtpMultiplexing;
+	WORD m_rtpMultiplexPort;
+	WORD m_rtcpMultiplexPort;
+	unsigned m_rtpMultiplexReaders;
+	bool m_enableRTCPStats;
+	unsigned m_rtcpStatsSampling;
+	bool m_enableMediaQuality;
+	unsigned m_mediaQualityFeedInterval;
+	int m_rtpDiffServ;
+};
+
+/// current [RoutedMode] snapshot, may be used without holding ConfigReloadMutex
+const RoutedModeConfig * GetRoutedConfig();
+/// current [Proxy] snapshot, may be used without holding ConfigReloadMutex
+const ProxyModeConfig * GetProxyConfig();
+/// rebuild and publish the snapshots, called on startup and on every reload
+void ReloadProxyConfigSnapshots(PConfig * cfg);
+
+/** Hands out RTP/RTCP port pairs (even port for RTP, next odd one for RTCP)
+    from [Proxy] RTPPortRange and keeps track of the pairs in use.
+    Free pairs are kept in a FIFO, so allocation is O(1) and a released pair
+    is reused as late as possible (late packets from the previous call).
+*/
+class RTPPortAllocator {
+public:
+	RTPPortAllocator();
+
+	/// set a new range, pairs that are in use stay allocated until released
+	void SetRange(WORD minport, WORD maxport);
+	void LoadConfig(const char * sec, const char * setting, const char * def = "");
+
+	/** @return
+	    the RTP port of a free pair, RTCP uses port + 1;
+	    0 if no range is configured or all pairs are in use
+	*/
+	WORD AllocatePair();
+	/// give back a pair returned by AllocatePair()
+	void ReleasePair(WORD port);
+
+	/// number of ports in the range
+	int GetNumPorts() const;
+	int GetNumPairs() const;
+	int GetPairsInUse() const;
+
+	/// occupancy for the status port
+	PString PrintStatistics() const;
+
+private:
+	RTPPortAllocator(const RTPPortAllocator &);
+	RTPPortAllocator & operator=(const RTPPortAllocator &);
+
+	WORD m_minport, m_maxport;
+	std::vector<bool> m_inUse;	// indexed by port / 2
+	std::deque<WORD> m_free;	// free RTP ports in the current range
+	int m_pairsInUse;
+	mutable PMutex m_mutex;
+};
+
+/// occupancy of the RTP port range for the status port
+PString PrintRTPPortStatistics();
+/// the pre-bound socket pool and the RTCP statistics worker for the status port
+PString PrintRTPRelayStatistics();
+
+/// how packets from one RTP/RTCP source are forwarded, learned by the full UDPProxySocket::ReceiveData() path
+class RTPStreamQuality;
+
+struct RTPFlow {
+	enum Forwarder {
+		None,
+		Relay,	// plain UDP relay to a fixed destination
+		Multiplexed	// H.460.19 multiplexed destination
+	};
+
+	RTPFlow() : forwarder(None), generation(0), fromPort(0), updatesForwardSrc(false), updatesReverseSrc(false),
+		quality(NULL), exportSlot(IPFIXFlowTable::NoSlot), multiplexID(0), multiplexSocket(-1) { }
+
+	Forwarder forwarder;
+	unsigned generation;
+	PIPSocket::Address fromIP;
+	WORD fromPort;
+	IPAndPortAddress to;
+	PIPSocket::Address sourceIP;	// GK IP to send from, resolved when the flow is recorded
+	bool updatesForwardSrc;	// packets from this source refresh the forward inactivity timer
+	bool updatesReverseSrc;	// packets from this source refresh the reverse inactivity timer
+	RTPStreamQuality * quality;	// media quality of the packets from this source, NULL if not measured
+	unsigned exportSlot;	// IPFIX counters of the packets from this source, NoSlot if not exported
+	DWORD multiplexID;
+	int multiplexSocket;
+};
+
+/** Forwarding state for both sources of a UDPProxySocket.
+
+    Only the thread reading the socket uses Find() and Record().
+    Signaling threads call Invalidate() after every change of the socket
+    state, which makes all recorded flows stale without taking a lock.
+*/
+class RTPFlowCache {
+public:
+	RTPFlowCache() : m_generation(0), m_next(0) { }
+
+	/// @return	the flow for a source, NULL if unknown or outdated
+	const RTPFlow * Find(const PIPSocket::Address & fromIP, WORD fromPort) const;
+	/// remember a forwarding decision, flow.generation must be read with GetGeneration() before the decision was made
+	void Record(const RTPFlow & flow);
+	void Invalidate() { GkAtomicIncrement(&m_generation); }	// called by signaling and relay threads at the same time
+	unsigned GetGeneration() const { return GkAtomicLoad(&m_generation); }
+
+private:
+	RTPFlow m_flows[2];	// one per direction
+	volatile unsigned m_generation;
+	unsigned m_next;
+};
+
+/// copy of an RTCP packet, queued by the relay for the statistics aggregator
+struct RTCPReport {
+	enum { MaxSize = 256 };	// longer compound packets are truncated
+
+	PINDEX m_callNo;
+	WORD m_sessionID;
+	PIPSocket::Address m_fromIP;
+	PInt64 m_arrival;	// PTime::GetTimestamp() when the packet was received
+	WORD m_len;
+	BYTE m_data[MaxSize];
+};
+
+/** Bounded lock-free queue of RTCP reports.
+
+    Any number of relay threads may call Push() concurrently, it never
+    blocks and drops the report if the queue is full.
+    Only one thread (the aggregator) may call Pop().
+*/
+class RTCPReportQueue {
+public:
+	enum { Capacity = 1024 };	// must be a power of 2
+
+	RTCPReportQueue();
+
+	/// @return	false if the queue was full
+	bool Push(PINDEX callNo, WORD sessionID, const PIPSocket::Address & fromIP, PInt64 arrival, const BYTE * data, WORD len);
+	/// @return	false if the queue is empty
+	bool Pop(RTCPReport & report);
+	unsigned GetDropped() const { return m_dropped; }
+
+private:
+	struct Slot {
+		volatile unsigned m_sequence;	// == position: free for the producer, == position + 1: ready for the consumer
+		RTCPReport m_report;
+	};
+
+	Slot m_slots[Capacity];
+	volatile unsigned m_head;	// next position to write
+	unsigned m_tail;	// next position to read
+	volatile unsigned m_dropped;
+};
+
+/// RTCP statistics reported by one side of one RTP session
+struct RTCPDirectionStats {
+	RTCPDirectionStats() : m_packetCount(0), m_packetsLost(0), m_jitter(0), m_roundTripTime(-1),
+		m_lastSR(0), m_lastSRArrival(0) { }
+
+	long m_packetCount;	// packets sent, from sender reports
+	long m_packetsLost;	// cumulative, from receiver reports
+	int m_jitter;	// ms
+	int m_roundTripTime;	// ms between GnuGk and the sender of the reports, -1 if unknown
+	DWORD m_lastSR;	// middle 32 bits of the NTP timestamp of the last sender report
+	PInt64 m_lastSRArrival;	// when the last sender report was received
+};
+
+/** Parses queued RTCP reports outside the relay threads and keeps
+    per-call statistics in a fixed size table.
+*/
+class RTCPStatsAggregator : public Singleton<RTCPStatsAggregator> {
+public:
+	RTCPStatsAggregator();
+
+	/// start the worker thread if [Proxy] EnableRTCPStats is set
+	void LoadConfig();
+
+	/// called by the relay threads, only copies the packet
+	void QueueReport(unsigned & sampleCounter, PINDEX callNo, WORD sessionID, const PIPSocket::Address & fromIP, const BYTE * data, WORD len);
+	/// parse all queued reports, called by the worker thread
+	void ProcessQueue();
+
+	/** @return
+	    false if there are no statistics for this call and session (only audio and video are kept)
+	*/
+	bool GetStats(PINDEX callNo, WORD sessionID, bool fromDST, RTCPDirectionStats & stats) const;
+	PString PrintStatistics() const;
+
+protected:
+	struct CallStats {
+		CallStats() : m_callNo(0) { }
+		PINDEX m_callNo;
+		RTCPDirectionStats m_stats[2][2];	// [audio, video][from source, from destination]
+	};
+	enum { NumCallSlots = 4096 };
+
+	void Process(RTCPReport & report);
+	// must hold m_statsMutex, NULL for sessions we don't keep statistics for
+	RTCPDirectionStats * GetDirectionStats(PINDEX callNo, WORD sessionID, bool fromDST, bool create);
+
+	RTCPReportQueue m_queue;
+	bool m_workerStarted;
+	unsigned m_processed;
+	unsigned m_withoutSlot;	// reports of calls whose slot is owned by another active call
+	CallStats m_calls[NumCallSlots];	// by call number, a new call takes over the slot when the old call has ended
+	mutable PMutex m_statsMutex;	// never taken by the relay threads
+};
+
+/** Packet loss, interarrival jitter and a MOS estimate for one RTP stream,
+    calculated from the RTP headers like RFC 3550 A.1 and A.8 describe it.
+
+    Uses constant memory and never allocates. Only one thread may call
+    Update(), the getters may be used by other threads at any time and
+    can be slightly inconsistent while the stream is running.
+*/
+class RTPStreamQuality {
+public:
+	RTPStreamQuality() { Reset(false); }
+
+	void Reset(bool video);
+	/** Account for one RTP packet, packets without payload (keep-alives) are ignored
+	    @param arrival	receive time in ms
+	*/
+	void Update(const BYTE * rtp, WORD len, PInt64 arrival);
+
+	bool IsActive() const { return m_received > 0; }
+	PInt64 GetLastArrival() const { return m_lastArrival; }
+	unsigned GetReceived() const { return m_received; }
+	unsigned GetExpected() const;
+	/// packets lost, negative if there were duplicates
+	int GetLost() const;
+	double GetLossPercent() const;
+	/// interarrival jitter in ms
+	unsigned GetJitter() const;
+	/// MOS estimate (1.0 - 4.5) from a simplified ITU-T G.107 E-model, 0 if nothing was received
+	double GetMOS() const;
+
+	/// RTP clock rate for a payload type, dynamic payload types use 8 kHz for audio and 90 kHz for video
+	static unsigned GetClockRate(BYTE payloadType, bool video);
+
+protected:
+	void InitSequence(WORD seq);
+	// @return false if the packet doesn't count (source on probation or after a big jump)
+	bool UpdateSequence(WORD seq);
+
+	enum { MaxDropout = 3000, MaxMisorder = 100, MinSequential = 2, SequenceMod = 1 << 16 };
+
+	bool m_video;
+	unsigned m_clockRate;	// 0 until the first packet was seen
+	WORD m_maxSeq;
+	DWORD m_cycles;	// number of sequence number wrap arounds, shifted by 16
+	DWORD m_baseSeq;
+	DWORD m_badSeq;
+	unsigned m_probation;
+	unsigned m_received;
+	bool m_haveTransit;
+	int m_transit;	// relative transit time of the previous packet, in timestamp units
+	unsigned m_jitter;	// in timestamp units, scaled by 16
+	PInt64 m_lastArrival;
+};
+
+/** Media quality of the proxied calls, measured by the RTP relay.
+    The streams are kept in a fixed size table by call number, like the RTCP statistics,
+    the relay threads update them without any locking.
+*/
+class MediaQualityMonitor : public Singleton<MediaQualityMonitor> {
+public:
+	MediaQualityMonitor();
+
+	/// start the status port feed if [Proxy] MediaQualityFeedInterval is set
+	void LoadConfig();
+
+	/** @return
+	    the stream a relay thread updates for the packets sent by one side of the call,
+	    NULL for sessions other than audio and video or if the slot is still used by another call;
+	    call ReleaseStream() when the relay thread stops updating it
+	*/
+	RTPStreamQuality * GetStream(PINDEX callNo, WORD sessionID, bool fromCaller);
+	/// the streams stay readable until another call takes over the slot
+	void ReleaseStream(PINDEX callNo);
+	/// @return	false if no RTP has been measured for this call and session
+	bool GetQuality(PINDEX callNo, WORD sessionID, bool fromCaller, RTPStreamQuality & quality) const;
+
+	/// status port line for one call, empty if no RTP has been measured
+	PString PrintCall(PINDEX callNo, const PString & callID) const;
+	/// send a line for every call with media in the last #interval# seconds to the status port
+	void SendFeed(unsigned interval) const;
+
+protected:
+	struct CallQuality {
+		CallQuality() : m_callNo(0), m_users(0) { }
+		PINDEX m_callNo;
+		unsigned m_users;	// streams handed out by GetStream() and not released yet
+		RTPStreamQuality m_streams[2][2];	// [audio, video][from caller, from callee]
+	};
+	enum { NumCallSlots = 4096 };
+
+	bool m_feedStarted;
+	CallQuality m_calls[NumCallSlots];	// by call number, a new call takes over the slot when it isn't used anymore
+	mutable PMutex m_slotMutex;	// only for claiming slots and taking copies
+};
+
+#ifdef HAS_H235_MEDIA
+/** H.235.6 en-/decryption of RTP payloads with one media key.
+
+    The cipher contexts are set up once per key by the crypto engine
+    and reused for every packet, with a new enough H323Plus the result
+    is written into a buffer owned by this object instead of allocating
+    new arrays for every packet. Not thread safe, the owner has to
+    serialize the calls.
+*/
+class H235MediaCipher {
+public:
+	H235MediaCipher(const PString & algorithmOID, const PBYTEArray & key);
+	~H235MediaCipher();
+
+	/** Encrypt #len# bytes of payload at #data# in place
+	    @param maxLen	space available at #data#, the payload may grow by up to a cipher block
+	    @return	false if encryption failed
+	*/
+	bool Encrypt(BYTE * data, WORD & len, WORD maxLen, unsigned char * ivSequence, bool & rtpPadding);
+	/// Decrypt #len# bytes of payload at #data# in place
+	bool Decrypt(BYTE * data, WORD & len, unsigned char * ivSequence, bool & rtpPadding);
+
+	H235CryptoEngine & GetEngine() { return *m_engine; }
+
+protected:
+	enum { MaxBlockSize = 32 };
+
+	H235CryptoEngine * m_engine;
+	BYTE m_result[DEFAULT_PACKET_BUFFER_SIZE + MaxBlockSize];
+
+private:
+	H235MediaCipher(const H235MediaCipher &);
+	H235MediaCipher & operator=(const H235MediaCipher &);
+};
+
+/** Pre-generated random media keys for H.235.6.
+
+    Off by default. With [RoutedMode] H235KeyPoolSize set, a background thread
+    keeps up to that many keys ready for every media algorithm, so media key
+    updates only take keys from the pool. The thread sleeps until a key is
+    taken. When a pool runs empty the caller generates the key itself like
+    without the pool.
+    Only the media keys are pooled, the much more costly Diffie-Hellman key
+    pairs are generated by the H323Plus authenticators, they offer no way to
+    hand them pre-generated ones.
+*/
+class H235KeyPool : public Singleton<H235KeyPool> {
+public:
+	H235KeyPool();
+
+	/// read the pool size, start the refill thread if needed
+	void LoadConfig();
+
+	/** @return
+	    false if the pool for this algorithm is empty
+	*/
+	bool GetMediaKey(const PString & algorithmOID, PBYTEArray & mediaKey);
+
+	/** Generate one key for every pool that isn't full, called by the refill thread
+	    @return	number of keys generated
+	*/
+	unsigned Refill();
+	/// block the refill thread until a key was taken or the pool size changed
+	void WaitForDemand();
+	/// wake up the refill thread
+	void SignalDemand();
+	PString PrintStatistics() const;
+
+protected:
+	struct KeyPool {
+		KeyPool() : m_keySize(0), m_generated(0), m_taken(0), m_misses(0) { }
+		PINDEX m_keySize;	// in bytes
+		std::list<PBYTEArray> m_keys;
+		unsigned m_generated, m_taken, m_misses;
+	};
+	typedef std::map<PString, KeyPool> KeyPools;
+
+	unsigned m_poolSize;
+	bool m_refillStarted;
+	KeyPools m_pools;
+	PTime m_rateStart;
+	unsigned m_rateGenerated;
+	double m_refillRate;	// keys per second, over the last measurement interval
+	mutable PMutex m_poolMutex;	// never held while generating keys
+	PSyncPoint m_demand;	// signaled when the pools may need new keys
+};
+#endif
+
 void PrintQ931(int, const char *, const char *, const Q931 *, const H225_H323_UserInformation *);
 
 ssize_t UDPSendWithSourceIP(int fd, void * data, size_t len, const IPAndPortAddress & toAddress, PIPSocket::Address * gkIP);
@@ -151,6 +598,10 @@ public:
     virtual int GetOSSocket() const { return os_handle; }
 	virtual void SetOSSocket(int sock, const PString & name) { os_handle = sock; SetName(name); }
 
+	// new virtual function
+	/// the call whose messages this socket carries, for the signaling capture
+	virtual callptr GetCaptureCall() const { return callptr(); }
+
 private:
 	TCPProxySocket();
 	TCPProxySocket(const TCPProxySocket &);
@@ -180,10 +631,15 @@ public:
 
 protected:
 	bool SetMinBufSize(WORD);
+	/// copy a message without its TPKT header to the SignalingCapture
+	void CaptureMessage(bool received, const BYTE * data, WORD len);
 
 	BYTE *bufptr;
 	TPKTV3 tpkt;
 	unsigned tpktlen;
+	bool m_captureAddrValid;	// socket addresses looked up for the signaling capture
+	Address m_captureLocalIP, m_capturePeerIP;
+	WORD m_captureLocalPort, m_capturePeerPort;
 
 	bool m_h46018KeepAlive;
 	H225KeepAliveMethod m_h460KeepAliveMethodH225;
@@ -194,6 +650,82 @@ protected:
 	GkTimerManager::GkTimerHandle m_keepAliveTimer;
 };
 
+/** Last packet times of RTP flows and a timing wheel of their inactivity deadlines.
+
+    The relay threads only store the arrival time into the slot of a flow
+    with Touch(). Expire() visits the flows whose deadline has passed:
+    silent flows are reported, the others get a new deadline from their
+    last packet, so flows that keep sending are visited once per timeout.
+*/
+class RTPInactivityTracker {
+public:
+	enum { NoSlot = 0xffffffff };
+
+	struct SilentFlow {
+		PINDEX m_callNo;
+		unsigned m_slot;
+		unsigned m_silentFor;	// seconds
+	};
+
+	RTPInactivityTracker();
+	~RTPInactivityTracker();
+
+	/** Start tracking a flow of call #callNo#, it counts as active at #now#
+	    @return	the slot of the flow, NoSlot if the tracker is full
+	*/
+	unsigned Allocate(PINDEX callNo, unsigned timeout, time_t now);
+	/// stop tracking a flow, NoSlot is ignored
+	void Release(unsigned slot);
+
+	/// record a packet, called by the relay threads without any lock
+	void Touch(unsigned slot, time_t now)
+	{
+		if (slot != NoSlot)
+			GkAtomicStoreRelaxed(&m_lastPacket[slot / ChunkSize][slot % ChunkSize], (unsigned)now);
+	}
+	time_t GetLastPacket(unsigned slot) const;
+
+	/** Advance the wheel to #now# and collect the flows that have been silent longer than their timeout,
+	    a flow that stays silent is reported again after another timeout
+	*/
+	void Expire(time_t now, std::vector<SilentFlow> & silent);
+
+	unsigned GetNumFlows() const { PWaitAndSignal lock(m_mutex); return m_numFlows; }
+
+protected:
+	enum {
+		ChunkSize = 4096,
+		MaxChunks = 256,
+		WheelSize = 4096	// seconds, longer timeouts only cost an extra visit per turn
+	};
+
+	struct FlowInfo {
+		PINDEX m_callNo;
+		unsigned m_timeout;
+		unsigned m_bucket;	// NoSlot if not scheduled
+		unsigned m_next, m_prev;	// in the bucket
+	};
+
+	// must hold m_mutex
+	void Schedule(unsigned slot, unsigned deadline);
+	void Unschedule(unsigned slot);
+
+	volatile unsigned * m_lastPacket[MaxChunks];	// allocated on demand, never freed before the tracker
+	std::vector<FlowInfo> m_flows;	// by slot
+	std::vector<unsigned> m_freeSlots;
+	unsigned m_numFlows;
+	unsigned m_buckets[WheelSize];	// first slot with a deadline at this second (modulo WheelSize)
+	unsigned m_wheelTime;	// next second to expire
+	mutable PMutex m_mutex;	// never taken by the relay threads
+
+private:
+	RTPInactivityTracker(const RTPInactivityTracker &);
+	RTPInactivityTracker & operator=(const RTPInactivityTracker &);
+};
+
+/// @return	the numbers of calls with a relayed RTP flow that went silent, each call once
+void GetRTPInactiveCalls(std::vector<PINDEX> & callNumbers);
+
 class RTPLogicalChannel;
 
 class UDPProxySocket : public UDPSocket, public ProxySocket {
@@ -206,7 +738,9 @@ public:
 	~UDPProxySocket();
 
 	void UpdateSocketName();
-	void RemoveCallPtr() { PWaitAndSignal lock(m_callMutex); m_call = NULL; }
+	// hand a socket from the pre-bound pool to a call
+	void AttachToCall(PINDEX no);
+	void RemoveCallPtr() { PWaitAndSignal lock(m_callMutex); m_call = NULL; ReleaseQuality(); m_flowCache.Invalidate(); ReleaseActivitySlots(); ReleaseExportedFlows(); }
 	void SetRTCPDestination(const H245_UnicastAddress & addr, const PIPSocket::Address & sourceIP, bool isUnidirectional);
 	void SetForwardDestination(const Address & srcIP, WORD srcPort, H245_UnicastAddress * dstAddr, callptr & call, bool onlySetDest, bool onlySetSrc);
 	void SetReverseDestination(const Address & srcIP, WORD srcPort, H245_UnicastAddress * dstAddr, callptr & call, bool onlySetDest, bool onlySetSrc);
@@ -216,22 +750,22 @@ public:
 	int GetOSSocket() const { return os_handle; }
 	void SetNAT(bool);
 	bool isMute() { return mute; }
-	void SetMute(bool toMute) { mute = toMute; }
-	void OnHandlerSwapped() { std::swap(fnat, rnat); }
+	void SetMute(bool toMute) { mute = toMute; m_flowCache.Invalidate(); }
+	void OnHandlerSwapped() { std::swap(fnat, rnat); m_flowCache.Invalidate(); }
 	WORD GetRTPSessionID() const { return m_sessionID; }
-	void SetRTPSessionID(WORD id) { m_sessionID = id; }
+	void SetRTPSessionID(WORD id) { PWaitAndSignal lock(m_callMutex); m_sessionID = id; ReleaseQuality(); m_flowCache.Invalidate(); }
 #ifdef HAS_H235_MEDIA
-	void SetEncryptingRTPChannel(RTPLogicalChannel * lc) { m_encryptingLC = lc; }
+	void SetEncryptingRTPChannel(RTPLogicalChannel * lc) { m_encryptingLC = lc; m_flowCache.Invalidate(); }
 	void RemoveEncryptingRTPChannel(RTPLogicalChannel * lc) { if (m_encryptingLC == lc) m_encryptingLC = NULL; }
-	void SetDecryptingRTPChannel(RTPLogicalChannel * lc) { m_decryptingLC = lc; }
+	void SetDecryptingRTPChannel(RTPLogicalChannel * lc) { m_decryptingLC = lc; m_flowCache.Invalidate(); }
 	void RemoveDecryptingRTPChannel(RTPLogicalChannel * lc) { if (m_decryptingLC == lc) m_decryptingLC = NULL; }
 #endif
 #ifdef HAS_H46018
-	void SetUsesH46019fc(bool fc) { m_h46019fc = fc; }
+	void SetUsesH46019fc(bool fc) { m_h46019fc = fc; m_flowCache.Invalidate(); }
 	// same socket is used for all directions; set if at least one side uses H.460.19
-	void SetUsesH46019() { m_useH46019 = true; }
+	void SetUsesH46019() { m_useH46019 = true; m_flowCache.Invalidate(); }
 	bool UsesH46019() const { return m_useH46019; }
-	void SetH46019UniDirectional(bool val) { m_h46019uni = val; }
+	void SetH46019UniDirectional(bool val) { m_h46019uni = val; m_flowCache.Invalidate(); }
 	void AddKeepAlivePT(BYTE pt);
 	void SetMultiplexDestination(const IPAndPortAddress & toAddress, H46019Side side);
 	void SetMultiplexID(DWORD multiplexID, H46019Side side);
@@ -257,10 +791,31 @@ protected:
 	virtual bool ErrorHandler(PSocket::ErrorGroup);
 
 	void SetMediaIP(bool isSRC, const Address & ip);
+	// must hold m_callMutex, evaluate the capture filters for the call
+	void UpdateCapture();
+	// (re)read the settings that depend on config and the call
+	void LoadCallSettings();
+	// stop the inactivity detection for the flows of the current call
+	void ReleaseActivitySlots();
+	// end the IPFIX flows of the current call, their final records are sent by the exporter
+	void ReleaseExportedFlows();
 
 	// RTCP handler
 	void BuildReceiverReport(const RTP_ControlFrame & frame, PINDEX offset, bool dst);
 
+	// forward a packet from a known source without the full ReceiveData() logic
+	bool ForwardFastPath(Address fromIP, WORD fromPort);
+	// may packets from this source skip the full path from now on ?
+	bool CanUseFastPath() const;
+	void RecordFlow(RTPFlow & flow, unsigned generation, const Address & fromIP, WORD fromPort);
+	// must hold m_callMutex, account the received RTP packet in the media quality
+	// @return the updated stream, NULL if the quality isn't measured
+	RTPStreamQuality * MeasureQuality(bool fromForwardSrc);
+	void ReleaseQuality();
+	// must hold m_callMutex, account a forwarded packet in the IPFIX flow of its source and destination
+	// @return the slot of the flow, NoSlot if it isn't exported
+	unsigned CountExportedFlow(bool fromForwardSrc, const Address & fromIP, WORD fromPort, const IPAndPortAddress & to, const Address * gkIP);
+
 	PINDEX m_callNo;
 	callptr * m_call;
 	PMutex m_callMutex;
@@ -303,6 +858,12 @@ protected:
 #ifdef HAS_H235_MEDIA
 	bool m_haveShownPTWarning;	// flag to show the PayloadType warning only once (not for every RTP packet)
 #endif
+	RTPFlowCache m_flowCache;
+	bool m_useFlowCache;	// false for sockets with their own OnReceiveData()
+	unsigned m_rtcpSampleCounter;
+	bool m_enableMediaQuality;
+	RTPStreamQuality * m_quality[2];	// from forward source, from reverse source
+	bool m_qualityRefused;	// the slot of the call is used by another call
     bool m_ignoreSignaledIPs;   // ignore all RTP/RTCP IPs in signaling, do full auto-detect
     bool m_ignoreSignaledPrivateH239IPs;   // also ignore private IPs signaled in H239 streams
     bool m_ignoreSignaledAllH239IPs;   // also ignore all IPs signaled in H239 streams
@@ -316,13 +877,18 @@ protected:
 	bool m_forwardAndReverseSeen;   // did we see logical channels for both directions, yet ?
 	bool m_legacyPortDetection;
 	int m_inactivityTimeout;
-	time_t m_lastPacketFromForwardSrc;
-	time_t m_lastPacketFromReverseSrc;
+	Address m_localIP;	// the address the socket is bound to, may be the any address
+	unsigned m_activitySlot[2];	// in the RTP inactivity tracker, [from forward source, from reverse source]
+	unsigned m_captureGeneration;	// MediaCapture filter generation m_capture was evaluated for
+	bool m_capture;	// copy received packets to the MediaCapture
+	unsigned m_exportSlot[2];	// IPFIX flows, [from forward source, from reverse source]
+	IPAndPortAddress m_exportFrom[2];	// source and destination of the IPFIX flows, a change starts a new flow
+	IPAndPortAddress m_exportTo[2];
 	int m_portDetectionTimeout;
 	time_t m_firstMedia;
 	bool m_mediaFailDetected;
 	bool m_RTPMultiplexingEnabled;
-	list<NetworkAddress> m_allowAnyRTPSourcePortForH239; // list of IPs/networks
+	NetworkTree m_allowAnyRTPSourcePortForH239; // IPs/networks, checked for every packet
 	bool m_cachePortDetection;
 	int m_cachePortDetectionDuration;
 	std::map<IPAndPortAddress, time_t> m_portDetectionCache;
@@ -374,6 +940,7 @@ public:
 	Address GetPeerAddr() const { return peerAddr; }
 	Address GetMasqAddr() const { return masqAddr; }
 	PINDEX GetCallNumber() const { return m_call ? m_call->GetCallNumber() : 0; }
+	virtual callptr GetCaptureCall() const { return m_call; }
 	H225_CallIdentifier GetCallIdentifier() const { return m_call ? m_call->GetCallIdentifier() : 0; }
 	PString GetCallIdentifierAsString() const { return m_call ? AsString(m_call->GetCallIdentifier()) : "unknown"; }
 	void BuildFacilityPDU(Q931 &, int, const PObject * = NULL, bool h46017 = false
@@ -525,7 +1092,7 @@ protected:
 		if (!uu.HasOptionalField(UUIE::e_fastStart))
 			return false;
 
-        if (GkConfig()->GetBoolean(RoutedSec, "DisableFastStart", false)) {
+        if (GetRoutedConfig()->m_disableFastStart) {
             uu.RemoveOptionalField(UUIE::e_fastStart);
             return true;
         }
@@ -715,23 +1282,53 @@ class MultiplexRTPListener : public UDPSocket {
 	PCLASSINFO ( MultiplexRTPListener, UDPSocket )
 #endif
 public:
-	MultiplexRTPListener(WORD pt, WORD buffSize = DEFAULT_PACKET_BUFFER_SIZE);
+	// sharedPort: allow other listeners on the same port (SO_REUSEPORT)
+	MultiplexRTPListener(WORD pt, bool sharedPort = false, WORD buffSize = DEFAULT_PACKET_BUFFER_SIZE);
 	virtual ~MultiplexRTPListener();
 
 	virtual int GetOSSocket() const { return os_handle; }
 
 	virtual void ReceiveData();
 protected:
+	bool ListenShared(const Address & addr, WORD pt);
+
 	BYTE * wbuffer;
 	WORD wbufsize;
 };
 
 class RTPLogicalChannel;
 
+// what forwarding one multiplexed packet needs from its H.460.19 session, copied under the session table lock
+struct H46019PacketRoute {
+	PINDEX m_callno;
+	WORD m_session;
+	void * m_openedBy;
+	bool m_fromA;
+	bool m_fromB;
+	bool m_newSource;	// the address of the sending side was learned from this packet
+	bool m_ready;	// the address of the receiving side is known
+	DWORD m_multiplexID_to;
+	IPAndPortAddress m_to;
+	int m_osSocketTo;
+	bool m_rtcpStats;
+	unsigned m_rtcpSampleCounter;
+#ifdef HAS_H46024B
+	IPAndPortAddress m_addrA;
+	IPAndPortAddress m_addrB;
+	DWORD m_multiplexID_toA;
+	DWORD m_multiplexID_toB;
+#endif
+#ifdef HAS_H235_MEDIA
+	bool m_bothSidesSet;
+	bool m_encrypting;
+	RTPLogicalChannel * m_cryptoLC;
+#endif
+};
+
 // class for a H.460.19 session: it includes both directions (the full RTP session)
 // when stored in the channel list in MultiplexedRTPHandler,
 // side A is the OLC side, side B is the OLCAck side of the first channel in the session
-// when the channel is handed out via GetChannelSwapped(), side A is the OLC side of _that_ channel
+// updates from the other side of the session have their sides swapped, so side A is the OLC side of _that_ channel
 class H46019Session
 {
 public:
@@ -740,18 +1337,25 @@ public:
 
 	H46019Session(const H46019Session & other);
 	H46019Session & operator=(const H46019Session & other);
-	H46019Session & Merge(const H46019Session & other);
+	// copy the addresses, multiplex IDs, sockets and crypto settings that are set in #update#, optionally with swapped sides
+	void Update(const H46019Session & update, bool swapSides);
 
 	void Dump() const;
 
 	bool IsValid() const { return !m_deleted && ((m_session != INVALID_RTP_SESSION) || (m_flcn > 0)); }
 	bool sideAReady(bool isRTCP) const { return isRTCP ? m_addrA_RTCP.IsSet() : m_addrA.IsSet(); }
 	bool sideBReady(bool isRTCP) const { return isRTCP ? m_addrB_RTCP.IsSet() : m_addrB.IsSet(); }
-	H46019Session SwapSides() const; // return a copy with side A and B swapped
 
 	static bool IsKeepAlive(unsigned len, bool isRTCP) { return isRTCP ? true : (len == 12); }
 
-	void HandlePacket(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, void * data, unsigned len, bool isRTCP);
+	// @return true if a packet with this multiplex ID comes from a new address of side A or B
+	bool IsNewSource(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, bool isRTCP) const;
+	// remember the new address, only called with the table write lock held, @return false if it was already set
+	bool LearnSource(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, bool isRTCP);
+	// copy what forwarding the packet needs, called with the table read lock held
+	void GetRoute(DWORD receivedMultiplexID, unsigned len, bool isRTCP, H46019PacketRoute & route);
+	// forward a packet to the other side, called without the table lock
+	static void Forward(const H46019PacketRoute & route, const IPAndPortAddress & fromAddress, void * data, unsigned len, bool isRTCP);
 	static void Send(DWORD sendMultiplexID, const IPAndPortAddress & toAddress, int ossocket, void * data, unsigned len, bool bufferHasRoomForID, PIPSocket::Address * gkIP, bool isRetry = false);
 
 public:
@@ -775,19 +1379,67 @@ public:
 	int m_osSocketToB;
 	int m_osSocketToB_RTCP;
 	bool m_EnableRTCPStats;
+	unsigned m_rtcpSampleCounter;
 #ifdef HAS_H235_MEDIA
 	RTPLogicalChannel * m_encryptingLC;
 	RTPLogicalChannel * m_decryptingLC;
 	DWORD m_encryptMultiplexID;
 	DWORD m_decryptMultiplexID;
 #endif
-    time_t m_lastPacketFromA;   // time stamps for inactivity detection
-    time_t m_lastPacketFromB;
+    unsigned m_activitySlotA;   // inactivity detection, owned by the session in the MultiplexedRTPHandler table
+    unsigned m_activitySlotB;
+};
+
+// the multiplexing parameters of one side of a H.460.19 session, to set up a logical channel without copying the session
+struct H46019SideInfo {
+	IPAndPortAddress m_addr;
+	IPAndPortAddress m_addrRTCP;
+	DWORD m_multiplexID_from;
+	DWORD m_multiplexID_to;
+	int m_osSocket;
+	int m_osSocketRTCP;
+};
+
+/** H.460.19 sessions, indexed by the multiplex IDs they receive and by call.
+
+    A Handle stays valid until the session is erased, logically deleted
+    sessions stay in the table (and keep their multiplex IDs) until then.
+    The table isn't thread safe, the owner has to lock it.
+*/
+class H46019SessionTable {
+public:
+	typedef list<H46019Session>::iterator Handle;
+	typedef std::multimap<PINDEX, Handle>::const_iterator CallIterator;
+
+	Handle Add(const H46019Session & chan);
+	// set the fields that are set in #update#, keeps the indexes up to date
+	void Update(Handle chan, const H46019Session & update, bool swapSides);
+	void Erase(Handle chan);
+
+	// @return	the session that isn't deleted, End() if not found
+	Handle Find(PINDEX callno, WORD session) const;
+	// @return	the session receiving this multiplex ID, may be deleted, End() if not found
+	Handle FindByMultiplexID(DWORD multiplexID) const;
+	// @return	all sessions of a call, including deleted ones
+	std::pair<CallIterator, CallIterator> FindCall(PINDEX callno) const { return m_byCall.equal_range(callno); }
+
+	Handle Begin() const { return const_cast<list<H46019Session> &>(m_sessions).begin(); }
+	Handle End() const { return const_cast<list<H46019Session> &>(m_sessions).end(); }
+	size_t Size() const { return m_sessions.size(); }
+
+protected:
+	void IndexMultiplexIDs(Handle chan);
+	void UnindexMultiplexIDs(Handle chan);
+
+	list<H46019Session> m_sessions;
+	std::map<DWORD, Handle> m_byMultiplexID;	// by m_multiplexID_fromA and m_multiplexID_fromB
+	std::multimap<PINDEX, Handle> m_byCall;
 };
 
 class MultiplexedRTPReader : public SocketsReader {
 public:
-	MultiplexedRTPReader();
+	// sharedPort: one of several readers for the multiplex ports
+	MultiplexedRTPReader(unsigned shard = 0, bool sharedPort = false);
 	virtual ~MultiplexedRTPReader();
 
 	virtual int GetRTPOSSocket() const { return m_multiplexRTPListener ? m_multiplexRTPListener->GetOSSocket() : INVALID_OSSOCKET; }
@@ -799,6 +1451,7 @@ protected:
 
 	MultiplexRTPListener * m_multiplexRTPListener;
 	MultiplexRTPListener * m_multiplexRTCPListener;
+	bool m_sharedPort;
 };
 
 // handles multiplexed RTP and keepAlives
@@ -809,16 +1462,26 @@ public:
 
 	virtual void OnReload() { /* currently not runtime changeable */ }
 
+	// add a session or set the fields that are set in #cha# in the existing one, with sides as seen from cha.m_openedBy
 	virtual void AddChannel(const H46019Session & cha);
 	virtual void UpdateChannelSession(PINDEX callno, WORD flcn, void * openedBy, WORD session);
+	// like AddChannel(), but only if the session exists
 	virtual void UpdateChannel(const H46019Session & cha);
-	virtual H46019Session GetChannel(PINDEX callno, WORD session) const;
-	virtual H46019Session GetChannelSwapped(PINDEX callno, WORD session, void * openedBy) const;
+	virtual bool HasChannel(PINDEX callno, WORD session) const;
+	// the parameters of one side of a session, as seen from #openedBy# (NULL: as stored), false if not found
+	virtual bool GetChannelSide(PINDEX callno, WORD session, void * openedBy, H46019Side side, H46019SideInfo & info) const;
+#ifdef HAS_H235_MEDIA
+	virtual void SetChannelMediaEncryption(PINDEX callno, WORD session, bool encrypting, RTPLogicalChannel * lc, DWORD multiplexID);
+#endif
 	virtual void RemoveChannels(PINDEX callno);
 	virtual void RemoveChannel(PINDEX callno, WORD session);
 #ifdef HAS_H235_MEDIA
 	virtual void RemoveChannel(PINDEX callno, RTPLogicalChannel * rtplc);
 #endif
+	// set a media address learned from received packets, without copying the session
+	virtual void SetChannelAddress(PINDEX callno, WORD session, H46019Side side, bool isRTCP, const IPAndPortAddress & addr);
+	// same, for the side that doesn't send multiplexed if only one side does
+	virtual void SetNonMultiplexedChannelAddress(PINDEX callno, WORD session, bool isRTCP, const IPAndPortAddress & addr);
 	virtual void DumpChannels(const PString & msg = "") const;
 
 	virtual bool HandlePacket(DWORD receivedMultiplexID, const IPAndPortAddress & fromAddress, void * data, unsigned len, bool isRTCP);
@@ -826,27 +1489,34 @@ public:
 	virtual bool HandlePacket(PINDEX callno, const H46026_UDPFrame & data);
 #endif
 
-	virtual int GetRTPOSSocket() const { return m_reader ? m_reader->GetRTPOSSocket() : INVALID_OSSOCKET; }
-	virtual int GetRTCPOSSocket() const { return m_reader ? m_reader->GetRTCPOSSocket() : INVALID_OSSOCKET; }
+	// all readers listen on the same ports, so any of their sockets can be used to send
+	virtual int GetRTPOSSocket() const { return !m_readers.empty() ? m_readers.front()->GetRTPOSSocket() : INVALID_OSSOCKET; }
+	virtual int GetRTCPOSSocket() const { return !m_readers.empty() ? m_readers.front()->GetRTCPOSSocket() : INVALID_OSSOCKET; }
 
 	virtual DWORD GetMultiplexID(PINDEX callno, WORD session, void * to);
 	virtual DWORD GetNewMultiplexID();
 
 	bool GetDetectedMediaIP(PINDEX callno, WORD sessionID, bool forCaller, /* out */ PIPSocket::Address & addr, WORD & port) const;
 
-	// delete sessions marked as deleted
+	// delete sessions marked as deleted, check inactivity
 	void SessionCleanup(GkTimer* timer);
 
+	size_t GetNumChannels() const { ReadLock lock(m_listLock); return m_h46019channels.Size(); }
+
 protected:
-	MultiplexedRTPReader * m_reader;
+	std::vector<MultiplexedRTPReader *> m_readers;
 	mutable PReadWriteMutex m_listLock;
-	list<H46019Session> m_h46019channels;
+	H46019SessionTable m_h46019channels;
 	DWORD m_idCounter; // we should make sure this counter is _not_ reset on reload
 	GkTimerManager::GkTimerHandle m_cleanupTimer;
 	int m_deleteDelay;    // how long to wait before deleting a session marked for delete in sec.
 	bool m_inactivityCheck;
 	int m_inactivityTimeout;
 	short m_inactivityCheckSession;
+	RTPInactivityTracker m_activity;
+
+	// terminate calls with a silent flow in the checked session, must hold m_listLock for writing
+	void CheckInactivity(time_t now);
 };
 #endif
 
@@ -893,6 +1563,7 @@ public:
 	virtual void UpdateChannelRTCP(PINDEX callno, WORD session, IPAndPortAddress toRTCP);
 	virtual void RemoveChannels(PINDEX callno);	// pass by value in case call gets removed
 	H46026Session FindSession(PINDEX callno, WORD session) const;
+	size_t GetNumChannels() const { ReadLock lock(m_listLock); return m_h46026channels.size(); }
 #ifdef HAS_H235_MEDIA
 	virtual void UpdateChannelEncryptingLC(PINDEX callno, WORD session, RTPLogicalChannel * lc);
 	virtual void UpdateChannelDecryptingLC(PINDEX callno, WORD session, RTPLogicalChannel * lc);
@@ -902,8 +1573,10 @@ public:
 	virtual bool HandlePacket(PINDEX callno, H46026_UDPFrame & data);
 
 protected:
+	typedef std::map<std::pair<PINDEX, WORD>, H46026Session> H46026SessionMap;	// by call number and RTP session ID
+
 	mutable PReadWriteMutex m_listLock;
-	list<H46026Session> m_h46026channels;
+	H46026SessionMap m_h46026channels;
 };
 
 #endif
@@ -17,6 +17,11 @@
 #define TEST_MODE
 #include "ProxyChannel.h"
 #include "gtest/gtest.h"
+#ifdef HAS_H235_MEDIA
+#include "h235/h2351.h"
+#include "h235/h2356.h"
+#include "h235/h235crypto.h"
+#endif
 
 namespace {
 
@@ -34,8 +39,646 @@ TEST_F(ProxyChannelTest, H46019Session) {
 
 	s1.m_multiplexID_fromA = 1;
 	s2.m_multiplexID_fromB = 2;
-	s1.Merge(s2);
+	s1.Update(s2, false);
 	EXPECT_TRUE(s1.m_multiplexID_fromA = 1 && s1.m_multiplexID_fromB == 2);
 }
 
+TEST_F(ProxyChannelTest, H46019SessionTable) {
+	H46019SessionTable table;
+	H46019Session s1(1, 1, NULL);
+	s1.m_multiplexID_fromA = 10;
+	H46019Session s2(1, 2, NULL);
+	s2.m_multiplexID_fromA = 20;
+	H46019SessionTable::Handle h1 = table.Add(s1);
+	table.Add(s2);
+	EXPECT_EQ(2u, table.Size());
+	EXPECT_TRUE(table.Find(1, 1) == h1);
+	EXPECT_TRUE(table.Find(1, 3) == table.End());
+	EXPECT_TRUE(table.Find(2, 1) == table.End());
+	EXPECT_TRUE(table.FindByMultiplexID(10) == h1);
+	EXPECT_TRUE(table.FindByMultiplexID(11) == table.End());
+
+	// multiplex IDs learned later are indexed
+	s1.m_multiplexID_fromB = 11;
+	table.Update(h1, s1, false);
+	EXPECT_TRUE(table.FindByMultiplexID(11) == h1);
+	EXPECT_TRUE(table.FindByMultiplexID(10) == h1);
+
+	// deleted sessions are only found by multiplex ID
+	h1->m_deleted = true;
+	EXPECT_TRUE(table.Find(1, 1) == table.End());
+	EXPECT_TRUE(table.FindByMultiplexID(10) == h1);
+
+	table.Erase(h1);
+	EXPECT_EQ(1u, table.Size());
+	EXPECT_TRUE(table.FindByMultiplexID(10) == table.End());
+	EXPECT_TRUE(table.Find(1, 2) != table.End());
+}
+
+TEST_F(ProxyChannelTest, H46019SessionTableUpdate) {
+	H46019SessionTable table;
+	int openedBy = 0, otherSide = 0;
+	H46019Session s(1, 1, &openedBy);
+	s.m_multiplexID_fromA = 10;
+	s.m_osSocketToA = 5;
+	H46019SessionTable::Handle h = table.Add(s);
+
+	// only the fields that are set are copied
+	H46019Session update(1, 1, &openedBy);
+	update.m_multiplexID_fromB = 11;
+	update.m_addrB = IPAndPortAddress(PIPSocket::Address("192.168.1.2"), 5000);
+	table.Update(h, update, false);
+	EXPECT_EQ(10u, h->m_multiplexID_fromA);
+	EXPECT_EQ(11u, h->m_multiplexID_fromB);
+	EXPECT_EQ(5, h->m_osSocketToA);
+	EXPECT_EQ(5000, h->m_addrB.GetPort());
+	EXPECT_FALSE(IsSet(h->m_addrA));
+	EXPECT_TRUE(table.FindByMultiplexID(11) == h);
+
+	// an update from the other side has its sides swapped
+	H46019Session fromOther(1, 1, &otherSide);
+	fromOther.m_multiplexID_toA = 12;
+	fromOther.m_osSocketToB = 7;
+	table.Update(h, fromOther, true);
+	EXPECT_EQ(12u, h->m_multiplexID_toB);
+	EXPECT_EQ(7, h->m_osSocketToA);
+	EXPECT_TRUE(h->m_openedBy == &openedBy);
+}
+
+TEST_F(ProxyChannelTest, H46019SessionTableLookupWith10kSessions) {
+	const unsigned numSessions = 10000;
+	H46019SessionTable table;
+	for (unsigned i = 0; i < numSessions; ++i) {
+		H46019Session s(i / 2, (WORD)(1 + (i % 2)), NULL);
+		s.m_multiplexID_fromA = 2 * i + 1;
+		s.m_multiplexID_fromB = 2 * i + 2;
+		table.Add(s);
+	}
+
+	const unsigned numLookups = 1000000;
+	unsigned found = 0;
+	const PTime start;
+	for (unsigned i = 0; i < numLookups; ++i) {
+		if (table.FindByMultiplexID(1 + (i * 7919) % (2 * numSessions)) != table.End())
+			++found;
+	}
+	const PTimeInterval elapsed = PTime() - start;
+	EXPECT_EQ(numLookups, found);
+	std::cout << "[          ] " << numSessions << " sessions: " << numLookups << " lookups by multiplex ID in "
+		<< elapsed.GetMilliSeconds() << " ms" << std::endl;
+
+	for (unsigned i = 0; i < numSessions; ++i) {
+		H46019SessionTable::Handle h = table.Find(i / 2, (WORD)(1 + (i % 2)));
+		ASSERT_TRUE(h != table.End());
+		EXPECT_EQ(2 * i + 1, h->m_multiplexID_fromA);
+	}
+}
+
+TEST_F(ProxyChannelTest, RTPPortAllocatorPairs) {
+	RTPPortAllocator ports;
+	EXPECT_EQ(0, ports.AllocatePair());	// no range configured
+
+	ports.SetRange(10001, 10010);	// odd start and even end are trimmed
+	EXPECT_EQ(8, ports.GetNumPorts());
+	EXPECT_EQ(10002, ports.AllocatePair());
+	EXPECT_EQ(10004, ports.AllocatePair());
+	ports.ReleasePair(10002);
+	ports.ReleasePair(10002);	// double release is ignored
+	EXPECT_EQ(1, ports.GetPairsInUse());
+	EXPECT_EQ(10006, ports.AllocatePair());
+	EXPECT_EQ(10008, ports.AllocatePair());
+	EXPECT_EQ(10002, ports.AllocatePair());	// released pair comes last
+	EXPECT_EQ(0, ports.AllocatePair());
+	EXPECT_EQ(4, ports.GetPairsInUse());
+}
+
+TEST_F(ProxyChannelTest, RTPPortAllocatorReload) {
+	RTPPortAllocator ports;
+	ports.SetRange(20000, 20003);
+	EXPECT_EQ(20000, ports.AllocatePair());
+	ports.SetRange(20000, 20005);	// pair in use stays allocated
+	EXPECT_EQ(20002, ports.AllocatePair());
+	EXPECT_EQ(20004, ports.AllocatePair());
+	EXPECT_EQ(0, ports.AllocatePair());
+	ports.SetRange(30000, 30001);
+	ports.ReleasePair(20000);	// outside the new range
+	EXPECT_EQ(30000, ports.AllocatePair());
+	EXPECT_EQ(0, ports.AllocatePair());
+}
+
+class PortAllocThread : public PThread {
+public:
+	PortAllocThread(RTPPortAllocator & ports)
+		: PThread(10000, NoAutoDeleteThread), m_ports(ports) { Resume(); }
+
+	virtual void Main() {
+		WORD port;
+		unsigned count = 0;
+		while ((port = m_ports.AllocatePair()) != 0) {
+			m_allocated.push_back(port);
+			if (++count % 3 == 0) {
+				// give some back to create contention on the free list
+				m_ports.ReleasePair(m_allocated.back());
+				m_allocated.pop_back();
+			}
+		}
+	}
+
+	RTPPortAllocator & m_ports;
+	std::vector<WORD> m_allocated;
+};
+
+TEST_F(ProxyChannelTest, RTPPortAllocatorFullRangeUnderContention) {
+	RTPPortAllocator ports;
+	ports.SetRange(1024, 65535);
+	const int numPairs = ports.GetNumPairs();
+	EXPECT_EQ((65536 - 1024) / 2, numPairs);
+
+	PortAllocThread * threads[8];
+	for (unsigned i = 0; i < 8; ++i)
+		threads[i] = new PortAllocThread(ports);
+	std::vector<bool> seen(65536, false);
+	int allocated = 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		threads[i]->WaitForTermination();
+		for (unsigned j = 0; j < threads[i]->m_allocated.size(); ++j) {
+			const WORD port = threads[i]->m_allocated[j];
+			EXPECT_EQ(0, port & 1);
+			EXPECT_FALSE(seen[port]);	// no pair handed out twice
+			seen[port] = true;
+			++allocated;
+		}
+		delete threads[i];
+	}
+	EXPECT_EQ(numPairs, allocated);
+	EXPECT_EQ(numPairs, ports.GetPairsInUse());
+	EXPECT_EQ(0, ports.AllocatePair());
+}
+
+TEST_F(ProxyChannelTest, RTPFlowCache) {
+	RTPFlowCache cache;
+	const PIPSocket::Address src1("10.0.0.1"), src2("10.0.0.2"), src3("10.0.0.3");
+	EXPECT_TRUE(cache.Find(src1, 5000) == NULL);
+
+	RTPFlow flow;
+	flow.forwarder = RTPFlow::Relay;
+	flow.generation = cache.GetGeneration();
+	flow.fromIP = src1;
+	flow.fromPort = 5000;
+	flow.to = IPAndPortAddress(src2, 6000);
+	cache.Record(flow);
+	ASSERT_TRUE(cache.Find(src1, 5000) != NULL);
+	EXPECT_TRUE(cache.Find(src1, 5000)->to == IPAndPortAddress(src2, 6000));
+	EXPECT_TRUE(cache.Find(src1, 5002) == NULL);
+
+	flow.fromIP = src2;
+	flow.fromPort = 6000;
+	flow.to = IPAndPortAddress(src1, 5000);
+	cache.Record(flow);
+	EXPECT_TRUE(cache.Find(src1, 5000) != NULL);
+	EXPECT_TRUE(cache.Find(src2, 6000) != NULL);
+
+	// a third source replaces one of the others
+	flow.fromIP = src3;
+	cache.Record(flow);
+	EXPECT_TRUE(cache.Find(src3, 6000) != NULL);
+	EXPECT_TRUE(cache.Find(src1, 5000) == NULL || cache.Find(src2, 6000) == NULL);
+
+	// a state change makes all flows stale
+	cache.Invalidate();
+	EXPECT_TRUE(cache.Find(src3, 6000) == NULL);
+	// a decision based on the old state isn't recorded
+	cache.Record(flow);
+	EXPECT_TRUE(cache.Find(src3, 6000) == NULL);
+	flow.generation = cache.GetGeneration();
+	cache.Record(flow);
+	EXPECT_TRUE(cache.Find(src3, 6000) != NULL);
+}
+
+// a relay socket with fixed signaled addresses, like after the OLCs of a call without NAT
+class RelayBenchmarkSocket : public UDPProxySocket {
+public:
+	RelayBenchmarkSocket(bool useFlowCache) : UDPProxySocket("RTP", 0) { m_useFlowCache = useFlowCache; }
+
+	void SetRelay(const Address & srcIP, WORD srcPort, const Address & destIP, WORD destPort)
+	{
+		fSrcIP = srcIP, fSrcPort = srcPort;
+		fDestIP = destIP, fDestPort = destPort;
+		m_portDetectionDone = true;
+	}
+};
+
+// relay packets through UDPProxySocket::ReceiveData(), @return packets per second
+unsigned RelayPacketsPerSecond(bool useFlowCache, unsigned numPackets)
+{
+	const PIPSocket::Address localhost("127.0.0.1");
+	PUDPSocket sender, receiver;
+	RelayBenchmarkSocket relay(useFlowCache);
+	if (!sender.Listen(localhost) || !receiver.Listen(localhost) || !relay.Bind(localhost, 0))
+		return 0;
+	relay.SetRelay(localhost, sender.GetPort(), localhost, receiver.GetPort());
+
+	BYTE packet[172];	// G.711 20ms
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 0x80;
+	const PTime start;
+	for (unsigned i = 0; i < numPackets; ++i) {
+		if (!sender.WriteTo(packet, sizeof(packet), localhost, relay.GetPort()))
+			return 0;
+		relay.ReceiveData();
+	}
+	const PTimeInterval elapsed = PTime() - start;
+
+	BYTE relayed[sizeof(packet)];
+	receiver.SetReadTimeout(1000);
+	if (!receiver.Read(relayed, sizeof(relayed)) || receiver.GetLastReadCount() != sizeof(packet))
+		return 0;
+	return (unsigned)(numPackets * 1000.0 / (elapsed.GetMilliSeconds() + 1));
+}
+
+TEST_F(ProxyChannelTest, RTPFastPathPacketsPerSecond) {
+	const unsigned numPackets = 100000;
+	const unsigned fullPath = RelayPacketsPerSecond(false, numPackets);
+	const unsigned fastPath = RelayPacketsPerSecond(true, numPackets);
+	EXPECT_GT(fullPath, 0u);
+	EXPECT_GT(fastPath, 0u);
+	std::cout << "[          ] full path: " << fullPath << " pps, fast path: " << fastPath << " pps" << std::endl;
+}
+
+// G.711 packet, 20ms
+void MakeRTPPacket(BYTE * packet, WORD seq, DWORD timestamp)
+{
+	memset(packet, 0, 172);
+	packet[0] = 0x80;
+	packet[1] = 0;	// PCMU
+	packet[2] = (BYTE)(seq >> 8);
+	packet[3] = (BYTE)seq;
+	packet[4] = (BYTE)(timestamp >> 24);
+	packet[5] = (BYTE)(timestamp >> 16);
+	packet[6] = (BYTE)(timestamp >> 8);
+	packet[7] = (BYTE)timestamp;
+}
+
+TEST_F(ProxyChannelTest, RTPStreamQuality) {
+	BYTE packet[172];
+	RTPStreamQuality quality;
+	EXPECT_FALSE(quality.IsActive());
+	EXPECT_EQ(0.0, quality.GetMOS());
+
+	// perfect stream, starting right before a sequence number wrap around
+	WORD seq = 65500;
+	DWORD timestamp = 1000;
+	PInt64 arrival = 5000;
+	for (unsigned i = 0; i < 500; ++i) {
+		MakeRTPPacket(packet, seq++, timestamp);
+		quality.Update(packet, sizeof(packet), arrival);
+		timestamp += 160;
+		arrival += 20;
+	}
+	EXPECT_TRUE(quality.IsActive());
+	EXPECT_EQ(499u, quality.GetReceived());	// the first packet only validates the source
+	EXPECT_EQ(499u, quality.GetExpected());
+	EXPECT_EQ(0, quality.GetLost());
+	EXPECT_EQ(0u, quality.GetJitter());
+	const double perfectMOS = quality.GetMOS();
+	EXPECT_GT(perfectMOS, 4.3);
+
+	// keep-alives without payload don't count
+	MakeRTPPacket(packet, seq + 10, timestamp);
+	quality.Update(packet, 12, arrival);
+	EXPECT_EQ(499u, quality.GetReceived());
+
+	// lose every 10th packet
+	for (unsigned i = 0; i < 500; ++i) {
+		MakeRTPPacket(packet, seq++, timestamp);
+		if (i % 10 != 0)
+			quality.Update(packet, sizeof(packet), arrival);
+		timestamp += 160;
+		arrival += 20;
+	}
+	EXPECT_EQ(999u, quality.GetExpected());
+	EXPECT_EQ(50, quality.GetLost());
+	EXPECT_NEAR(5.0, quality.GetLossPercent(), 0.1);
+	const double mosWithLoss = quality.GetMOS();
+	EXPECT_LT(mosWithLoss, 4.1);
+	EXPECT_GT(mosWithLoss, 1.0);
+
+	// packets arriving alternately 10ms early and late
+	RTPStreamQuality jittery;
+	for (unsigned i = 0; i < 1000; ++i) {
+		MakeRTPPacket(packet, seq++, timestamp);
+		jittery.Update(packet, sizeof(packet), arrival + ((i % 2) ? 10 : -10));
+		timestamp += 160;
+		arrival += 20;
+	}
+	EXPECT_EQ(0, jittery.GetLost());
+	EXPECT_NEAR(20, (int)jittery.GetJitter(), 2);
+	EXPECT_LT(jittery.GetMOS(), perfectMOS);
+
+	// a restarted sender is accepted after two packets in sequence
+	const unsigned received = jittery.GetReceived();
+	MakeRTPPacket(packet, seq + 20000, timestamp);
+	jittery.Update(packet, sizeof(packet), arrival);
+	EXPECT_EQ(received, jittery.GetReceived());
+	MakeRTPPacket(packet, seq + 20001, timestamp + 160);
+	jittery.Update(packet, sizeof(packet), arrival + 20);
+	EXPECT_EQ(1u, jittery.GetReceived());
+	EXPECT_EQ(1u, jittery.GetExpected());
+}
+
+TEST_F(ProxyChannelTest, RTPStreamQualityClockRate) {
+	EXPECT_EQ(8000u, RTPStreamQuality::GetClockRate(0, false));	// PCMU
+	EXPECT_EQ(8000u, RTPStreamQuality::GetClockRate(9, false));	// G.722
+	EXPECT_EQ(16000u, RTPStreamQuality::GetClockRate(6, false));
+	EXPECT_EQ(90000u, RTPStreamQuality::GetClockRate(34, true));	// H.263
+	EXPECT_EQ(8000u, RTPStreamQuality::GetClockRate(101, false));
+	EXPECT_EQ(90000u, RTPStreamQuality::GetClockRate(109, true));
+}
+
+TEST_F(ProxyChannelTest, MediaQualityMonitorSlots) {
+	MediaQualityMonitor * monitor = MediaQualityMonitor::Instance();
+	const PINDEX callNo = 7, otherCall = 7 + 4096;	// same slot
+	RTPStreamQuality * stream = monitor->GetStream(callNo, RTP_Session::DefaultAudioSessionID, true);
+	ASSERT_TRUE(stream != NULL);
+	EXPECT_TRUE(monitor->GetStream(callNo, 3, true) == NULL);	// only audio and video
+	BYTE packet[172];
+	for (WORD seq = 1; seq <= 3; ++seq) {
+		MakeRTPPacket(packet, seq, seq * 160);
+		stream->Update(packet, sizeof(packet), seq * 20);
+	}
+
+	// the slot isn't taken over while the first call still measures
+	EXPECT_TRUE(monitor->GetStream(otherCall, RTP_Session::DefaultAudioSessionID, true) == NULL);
+	RTPStreamQuality quality;
+	EXPECT_TRUE(monitor->GetQuality(callNo, RTP_Session::DefaultAudioSessionID, true, quality));
+
+	monitor->ReleaseStream(callNo);
+	EXPECT_TRUE(monitor->GetQuality(callNo, RTP_Session::DefaultAudioSessionID, true, quality));
+	EXPECT_TRUE(monitor->GetStream(otherCall, RTP_Session::DefaultAudioSessionID, true) != NULL);
+	EXPECT_FALSE(monitor->GetQuality(callNo, RTP_Session::DefaultAudioSessionID, true, quality));
+	monitor->ReleaseStream(otherCall);
+}
+
+// forward through the fast path with and without measuring the media quality
+unsigned ForwardPackets(PUDPSocket & sender, const RTPFlow & flow, unsigned numPackets)
+{
+	BYTE packet[172];
+	unsigned sent = 0;
+	for (unsigned i = 0; i < numPackets; ++i) {
+		MakeRTPPacket(packet, (WORD)i, i * 160);
+		if (flow.quality)
+			flow.quality->Update(packet, sizeof(packet), PTimer::Tick().GetMilliSeconds());
+		PIPSocket::Address sourceIP = flow.sourceIP;
+		if (UDPSendWithSourceIP(sender.GetHandle(), packet, sizeof(packet), flow.to, &sourceIP) > 0)
+			++sent;
+	}
+	return sent;
+}
+
+TEST_F(ProxyChannelTest, RTPMediaQualityPacketsPerSecond) {
+	PUDPSocket receiver, sender;
+	ASSERT_TRUE(receiver.Listen(PIPSocket::Address("127.0.0.1")));
+	ASSERT_TRUE(sender.Listen(PIPSocket::Address("127.0.0.1")));
+
+	RTPFlow flow;
+	flow.forwarder = RTPFlow::Relay;
+	flow.to = IPAndPortAddress(PIPSocket::Address("127.0.0.1"), receiver.GetPort());
+	flow.sourceIP = PIPSocket::Address("127.0.0.1");
+	const unsigned numPackets = 100000;
+
+	PTime start;
+	unsigned sent = ForwardPackets(sender, flow, numPackets);
+	const PTimeInterval withoutQuality = PTime() - start;
+	EXPECT_GT(sent, 0u);
+
+	RTPStreamQuality quality;
+	flow.quality = &quality;
+	start = PTime();
+	sent = ForwardPackets(sender, flow, numPackets);
+	const PTimeInterval withQuality = PTime() - start;
+	EXPECT_GT(sent, 0u);
+	EXPECT_EQ(numPackets - 1, quality.GetReceived());
+
+	std::cout << "[          ] media quality off: " << (unsigned)(numPackets * 1000.0 / (withoutQuality.GetMilliSeconds() + 1)) << " pps, "
+		<< "on: " << (unsigned)(numPackets * 1000.0 / (withQuality.GetMilliSeconds() + 1)) << " pps" << std::endl;
+}
+
+#ifdef HAS_H235_MEDIA
+// encrypt and decrypt payloads like the relay does and print the throughput
+void H235MediaThroughput(const PString & algorithmOID, unsigned keySize, const char * name)
+{
+	PBYTEArray key(keySize);
+	for (unsigned i = 0; i < keySize; ++i)
+		key[i] = (BYTE)(i * 7 + 1);
+	H235MediaCipher encryptor(algorithmOID, key);
+	H235MediaCipher decryptor(algorithmOID, key);
+
+	const WORD payloadSizes[] = { 160, 163, 1100 };	// G.711 20ms, not a multiple of the block size, video
+	for (unsigned s = 0; s < sizeof(payloadSizes) / sizeof(payloadSizes[0]); ++s) {
+		BYTE plain[DEFAULT_PACKET_BUFFER_SIZE];
+		BYTE buffer[DEFAULT_PACKET_BUFFER_SIZE];
+		for (unsigned i = 0; i < payloadSizes[s]; ++i)
+			plain[i] = (BYTE)i;
+		unsigned char ivSequence[6] = { 0, 1, 0, 0, 0, 160 };
+
+		// round trip
+		memcpy(buffer, plain, payloadSizes[s]);
+		WORD len = payloadSizes[s];
+		bool rtpPadding = false;
+		ASSERT_TRUE(encryptor.Encrypt(buffer, len, sizeof(buffer), ivSequence, rtpPadding));
+		EXPECT_GE(len, payloadSizes[s]);
+		BYTE cipher[DEFAULT_PACKET_BUFFER_SIZE];
+		const WORD cipherLen = len;
+		const bool cipherPadding = rtpPadding;
+		memcpy(cipher, buffer, cipherLen);
+		ASSERT_TRUE(decryptor.Decrypt(buffer, len, ivSequence, rtpPadding));
+		ASSERT_EQ(payloadSizes[s], len);
+		ASSERT_EQ(0, memcmp(buffer, plain, len));
+
+		const unsigned numPackets = 20000;
+		PTime start;
+		for (unsigned i = 0; i < numPackets; ++i) {
+			memcpy(buffer, plain, payloadSizes[s]);
+			len = payloadSizes[s];
+			encryptor.Encrypt(buffer, len, sizeof(buffer), ivSequence, rtpPadding);
+		}
+		const PTimeInterval encryptTime = PTime() - start;
+		start = PTime();
+		for (unsigned i = 0; i < numPackets; ++i) {
+			memcpy(buffer, cipher, cipherLen);
+			len = cipherLen;
+			rtpPadding = cipherPadding;
+			decryptor.Decrypt(buffer, len, ivSequence, rtpPadding);
+		}
+		const PTimeInterval decryptTime = PTime() - start;
+		const double megaBytes = (double)numPackets * payloadSizes[s] / (1024 * 1024);
+		std::cout << "[          ] " << name << " " << payloadSizes[s] << " byte payloads: encrypt "
+			<< (unsigned)(megaBytes * 1000 / (encryptTime.GetMilliSeconds() + 1)) << " MB/s, decrypt "
+			<< (unsigned)(megaBytes * 1000 / (decryptTime.GetMilliSeconds() + 1)) << " MB/s" << std::endl;
+	}
+}
+
+TEST_F(ProxyChannelTest, H235MediaCipherAES128Throughput) {
+	H235MediaThroughput(ID_AES128, 16, "AES-128");
+}
+
+#ifdef H323_H235_AES256
+TEST_F(ProxyChannelTest, H235MediaCipherAES256Throughput) {
+	H235MediaThroughput(ID_AES256, 32, "AES-256");
+}
+#endif
+
+#endif
+
+TEST_F(ProxyChannelTest, RTPInactivityTracker) {
+	RTPInactivityTracker tracker;
+	const time_t start = time(NULL);
+	const unsigned active = tracker.Allocate(1, 10, start);
+	const unsigned quiet = tracker.Allocate(2, 10, start);
+	ASSERT_NE((unsigned)RTPInactivityTracker::NoSlot, active);
+	ASSERT_NE((unsigned)RTPInactivityTracker::NoSlot, quiet);
+	EXPECT_EQ(2u, tracker.GetNumFlows());
+
+	std::vector<RTPInactivityTracker::SilentFlow> silent;
+	for (time_t t = start; t <= start + 10; ++t) {
+		tracker.Touch(active, t);
+		tracker.Expire(t, silent);
+	}
+	EXPECT_TRUE(silent.empty());
+	tracker.Touch(active, start + 11);
+	tracker.Expire(start + 11, silent);
+	ASSERT_EQ(1u, silent.size());
+	EXPECT_EQ(2, silent[0].m_callNo);
+	EXPECT_EQ(quiet, silent[0].m_slot);
+	EXPECT_EQ(11u, silent[0].m_silentFor);
+	EXPECT_EQ(start + 11, tracker.GetLastPacket(active));
+
+	// a flow that stays silent is reported again after another timeout
+	tracker.Release(active);
+	EXPECT_EQ(1u, tracker.GetNumFlows());
+	silent.clear();
+	tracker.Expire(start + 20, silent);
+	EXPECT_TRUE(silent.empty());
+	tracker.Expire(start + 21, silent);
+	ASSERT_EQ(1u, silent.size());
+	EXPECT_EQ(quiet, silent[0].m_slot);
+
+	// a packet makes it active again
+	silent.clear();
+	tracker.Touch(quiet, start + 22);
+	tracker.Expire(start + 32, silent);
+	EXPECT_TRUE(silent.empty());
+	tracker.Expire(start + 33, silent);
+	EXPECT_EQ(1u, silent.size());
+
+	// released slots are reused, the new flow starts active
+	const unsigned reused = tracker.Allocate(3, 10, start + 33);
+	EXPECT_EQ(active, reused);
+	silent.clear();
+	tracker.Release(quiet);
+	tracker.Expire(start + 43, silent);
+	EXPECT_TRUE(silent.empty());
+	// after a long pause every bucket is visited once
+	tracker.Expire(start + 100000, silent);
+	ASSERT_EQ(1u, silent.size());
+	EXPECT_EQ(3, silent[0].m_callNo);
+	tracker.Release(reused);
+	EXPECT_EQ(0u, tracker.GetNumFlows());
+	tracker.Release(RTPInactivityTracker::NoSlot);
+}
+
+TEST_F(ProxyChannelTest, RTCPReportQueue) {
+	RTCPReportQueue * queue = new RTCPReportQueue();	// too big for the stack
+	const PIPSocket::Address ip("10.0.0.1");
+	BYTE data[300];
+	for (unsigned i = 0; i < sizeof(data); ++i)
+		data[i] = (BYTE)i;
+	RTCPReport report;
+	EXPECT_FALSE(queue->Pop(report));
+
+	EXPECT_TRUE(queue->Push(7, 1, ip, 1000, data, 28));
+	ASSERT_TRUE(queue->Pop(report));
+	EXPECT_EQ(7, report.m_callNo);
+	EXPECT_EQ(1, report.m_sessionID);
+	EXPECT_TRUE(report.m_fromIP == ip);
+	EXPECT_EQ(28, report.m_len);
+	EXPECT_EQ(0, memcmp(report.m_data, data, 28));
+	EXPECT_FALSE(queue->Pop(report));
+
+	// long packets are truncated
+	EXPECT_TRUE(queue->Push(7, 1, ip, 1000, data, sizeof(data)));
+	ASSERT_TRUE(queue->Pop(report));
+	EXPECT_EQ(RTCPReport::MaxSize, report.m_len);
+
+	// a full queue drops reports instead of blocking
+	for (unsigned i = 0; i < RTCPReportQueue::Capacity; ++i)
+		EXPECT_TRUE(queue->Push(i, 1, ip, 1000, data, 28));
+	EXPECT_FALSE(queue->Push(9999, 1, ip, 1000, data, 28));
+	EXPECT_EQ(1u, queue->GetDropped());
+	for (unsigned i = 0; i < RTCPReportQueue::Capacity; ++i) {
+		ASSERT_TRUE(queue->Pop(report));
+		EXPECT_EQ((PINDEX)i, report.m_callNo);
+	}
+	EXPECT_FALSE(queue->Pop(report));
+	delete queue;
+}
+
+class RTCPProducerThread : public PThread {
+public:
+	RTCPProducerThread(RTCPReportQueue & queue, PINDEX id)
+		: PThread(1000, NoAutoDeleteThread), m_queue(queue), m_id(id), m_pushed(0)
+	{
+		Resume();
+	}
+
+	virtual void Main()
+	{
+		BYTE data[28];
+		memset(data, 0, sizeof(data));
+		for (unsigned i = 0; i < 10000; ++i) {
+			data[0] = (BYTE)i;
+			if (m_queue.Push(m_id, 1, PIPSocket::Address("10.0.0.1"), i, data, sizeof(data)))
+				++m_pushed;
+		}
+	}
+
+	RTCPReportQueue & m_queue;
+	PINDEX m_id;
+	unsigned m_pushed;
+};
+
+TEST_F(ProxyChannelTest, RTCPReportQueueMultipleProducers) {
+	RTCPReportQueue * queue = new RTCPReportQueue();
+	RTCPProducerThread * threads[4];
+	for (unsigned i = 0; i < 4; ++i)
+		threads[i] = new RTCPProducerThread(*queue, i);
+
+	// consume while the producers are running, reports of one producer must arrive in order
+	PInt64 lastArrival[4] = { -1, -1, -1, -1 };
+	unsigned popped = 0;
+	bool running = true;
+	while (running) {
+		running = false;
+		for (unsigned i = 0; i < 4; ++i)
+			running = running || !threads[i]->IsTerminated();
+		RTCPReport report;
+		while (queue->Pop(report)) {
+			ASSERT_TRUE(report.m_callNo >= 0 && report.m_callNo < 4);
+			EXPECT_GT(report.m_arrival, lastArrival[report.m_callNo]);
+			EXPECT_EQ((BYTE)report.m_arrival, report.m_data[0]);
+			lastArrival[report.m_callNo] = report.m_arrival;
+			++popped;
+		}
+	}
+	unsigned pushed = 0;
+	for (unsigned i = 0; i < 4; ++i) {
+		threads[i]->WaitForTermination();
+		pushed += threads[i]->m_pushed;
+		delete threads[i];
+	}
+	EXPECT_EQ(pushed, popped);
+	EXPECT_EQ(4u * 10000u, pushed + queue->GetDropped());
+	delete queue;
+}
+
 }  // namespace
@@ -36,7 +36,9 @@
 #include "gkauth.h"
 #include "gkacct.h"
 #include "gktimer.h"
+#include "gkconfig.h"
 #include "RasSrv.h"
+#include "capture.h"
 
 #ifdef HAS_AVAYA_SUPPORT
 #include "avaya.h"
@@ -183,6 +185,9 @@ bool GatekeeperMessage::Read(RasListener * socket)
 	socket->GetLastReceiveAddress(m_peerAddr, m_peerPort);
 	UnmapIPv4Address(m_peerAddr);
 	PTRACE(2, "RAS\tRead from " << AsString(m_peerAddr, m_peerPort));
+	SignalingCapture * capture = SignalingCapture::Instance();
+	if (capture->IsActive())
+		capture->Capture(m_peerAddr, m_peerPort, socket->GetLocalAddr(m_peerAddr), socket->GetPort(), buffer, (WORD)socket->GetLastReadCount());
 	m_rasPDU = PPER_Stream(buffer, socket->GetLastReadCount());
 	bool result = m_recvRAS.Decode(m_rasPDU);
 	PTRACE_IF(1, !result, "RAS\tError: Could not decode message from " << AsString(m_peerAddr, m_peerPort));
@@ -290,6 +295,9 @@ bool RasListener::SendRas(H225_RasMessage & rasobj, const Address & addr, WORD p
     // must send PByteArray, with the updated H.235 hash; PPER_Stream doesn't seem to change
 	bool result = WriteTo(wtbuf.GetPointer(), wtbuf.GetSize(), addr, pt);
 	m_wmutex.Signal();
+	SignalingCapture * capture = SignalingCapture::Instance();
+	if (result && capture->IsActive())
+		capture->Capture(GetLocalAddr(addr), GetPort(), addr, pt, wtbuf.GetPointer(), (WORD)wtbuf.GetSize());
 	if (result)
 		PTRACE(5, "RAS\tSent Successful");
 	else {
@@ -970,6 +978,46 @@ bool RasServer::UnregisterHandler(RasHandler *handler)
 }
 
 void RasServer::LoadConfig()
+{
+	ConfigReloader reloader;
+	LoadConfig(reloader);
+}
+
+void RasServer::LoadConfig(ConfigReloader & reloader)
+{
+	// publish typed snapshots of the hot-path switches first, so everything created below sees the new values
+	if (!reloader.IsClaimOnly())
+		ReloadProxyConfigSnapshots(GkConfig());
+
+	reloader.Run("RasInterfaces", "Gatekeeper::Main,RasSrv::AlternateGatekeeper,RoutedMode,Proxy", this, &RasServer::LoadInterfaces);
+	if ((m_socksize == 0) || (interfaces.empty()))
+		return;
+
+	reloader.Run("CallSignalListeners", "Gatekeeper::Main,RoutedMode", listeners, &TCPServer::LoadConfig);
+	reloader.Run("GkClient", "Gatekeeper::Main,Endpoint,Endpoint::*", gkClient, &GkClient::OnReload);
+	reloader.Run("Neighbors", "Gatekeeper::Main,RasSrv::Neighbors,RasSrv::LRQFeatures,Neighbor::*", neighbors, &NeighborList::OnReload);
+
+	// authenticators and accounting modules read a section named after the module
+	PString authSections = "Gatekeeper::Main,Gatekeeper::Auth,Password,RasSrv::RRQAuth";
+	PStringArray authModules = GkConfig()->GetKeys("Gatekeeper::Auth");
+	for (PINDEX i = 0; i < authModules.GetSize(); ++i)
+		authSections += "," + authModules[i] + "*";
+	reloader.Run("Authenticators", authSections, authList, &GkAuthenticatorList::OnReload);
+
+	PString acctSections = "Gatekeeper::Main,Gatekeeper::Acct";
+	PStringArray acctModules = GkConfig()->GetKeys("Gatekeeper::Acct");
+	for (PINDEX i = 0; i < acctModules.GetSize(); ++i)
+		acctSections += "," + acctModules[i] + "*";
+	reloader.Run("Accounting", acctSections, acctList, &GkAcctLoggerList::OnReload);
+
+	reloader.Run("VirtualQueue", "Gatekeeper::Main,CTI::*", vqueue, &VirtualQueue::OnReload);
+	reloader.Run("Routing", "Gatekeeper::Main,RoutingPolicy*,Routing::*", Routing::Analyzer::Instance(), &Routing::Analyzer::OnReload);
+	reloader.Run("ExplicitRouting", "Gatekeeper::Main,Routing::Explicit", &Routing::ExplicitPolicy::OnReload);
+	reloader.Run("RasServerMisc", "Gatekeeper::Main,RoutedMode,ReplyToRasAddress", this, &RasServer::LoadMiscConfig);
+	reloader.Run("SignalingCapture", "Proxy", SignalingCapture::Instance(), &SignalingCapture::LoadConfig);
+}
+
+void RasServer::LoadInterfaces()
 {
 	GetAlternateGK();
 
@@ -1068,22 +1116,10 @@ void RasServer::LoadConfig()
 		H46026RTPHandler::Instance()->OnReload();
 	}
 #endif
+}
 
-	if (listeners)
-		listeners->LoadConfig();
-	if (gkClient)
-		gkClient->OnReload();
-	if (neighbors)
-		neighbors->OnReload();
-	if (authList)
-		authList->OnReload();
-	if (acctList)
-		acctList->OnReload();
-	if (vqueue)
-		vqueue->OnReload();
-	Routing::Analyzer::Instance()->OnReload();
-	Routing::ExplicitPolicy::OnReload();
-
+void RasServer::LoadMiscConfig()
+{
 	bRemoveCallOnDRQ = Toolkit::AsBool(GkConfig()->GetString(RoutedSec, "RemoveCallOnDRQ", "1"));
 
 	// read [ReplyToRasAddress] section
@@ -1665,9 +1701,11 @@ void RasServer::HouseKeeping()
 
 			ReadLock lock(ConfigReloadMutex);
 
+			// cheap, only visits the RTP flows whose inactivity deadline has passed
+			CallTable::Instance()->CheckRTPInactive();
+
 			if (!(count % 60)) { // one minute
 				RegistrationTable::Instance()->CheckEndpoints();
-                CallTable::Instance()->CheckRTPInactive();
 #ifdef __GNU_LIBRARY__
                 // give unused memory back to OS
                 malloc_trim(0);
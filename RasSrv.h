@@ -43,6 +43,7 @@ class GkAcctLoggerList;
 class GkClient;
 class ProxyHandler;
 class HandlerList;
+class ConfigReloader;
 
 namespace Neighbors {
 	class NeighborList;
@@ -89,6 +90,8 @@ public:
 	bool UnregisterHandler(RasHandler *);
 
 	void LoadConfig();
+	// run the reload steps through #reloader#, which may skip the ones with unchanged sections
+	void LoadConfig(ConfigReloader & reloader);
 	void AddListener(RasListener *);
 	void AddListener(TCPListenSocket *);
 	bool CloseListener(TCPListenSocket *);
@@ -261,6 +264,8 @@ private:
 	H225_ArrayOf_AlternateGK GetAltGKForIP(const NetworkAddress & ip) const;
 	void ClearAltGKsTable();
 	void HouseKeeping();
+	void LoadInterfaces();
+	void LoadMiscConfig();
 
 	// override from class SocketsReader
 	virtual void ReadSocket(IPSocket *);
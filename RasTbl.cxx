@@ -5715,11 +5715,16 @@ void CallTable::CheckCalls(RasServer * rassrv)
 
 void CallTable::CheckRTPInactive()
 {
-    WriteLock lock(listLock);
-    for (iterator iter = CallList.begin(); iter != CallList.end(); ++iter) {
-        if (m_inactivityCheck && (*iter)->IsRTPInactive(m_inactivityCheckSession)) {
-            PTRACE(1, "CallTable\tTerminating call because of RTP inactivity CallID " << AsString((*iter)->GetCallIdentifier()));
-            (*iter)->Disconnect(true);
+    if (!m_inactivityCheck)
+        return;
+    // only calls with a flow that went silent are checked
+    std::vector<PINDEX> candidates;
+    GetRTPInactiveCalls(candidates);
+    for (unsigned i = 0; i < candidates.size(); ++i) {
+        callptr call = FindCallRec(candidates[i]);
+        if (call && call->IsRTPInactive(m_inactivityCheckSession)) {
+            PTRACE(1, "CallTable\tTerminating call because of RTP inactivity CallID " << AsString(call->GetCallIdentifier()));
+            call->Disconnect(true);
         }
     }
 }
@@ -6155,6 +6160,27 @@ void CallTable::PrintCurrentCallsPorts(USocket *client) const
 	client->TransmitData(msg);
 }
 
+void CallTable::PrintMediaQuality(USocket *client) const
+{
+	PString msg = "MediaQuality\r\n";
+	unsigned n = 0;
+	if (GetProxyConfig()->m_enableMediaQuality) {
+		ReadLock lock(listLock);
+		for (const_iterator Iter = CallList.begin(); Iter != CallList.end(); ++Iter) {
+			const PString line = MediaQualityMonitor::Instance()->PrintCall((*Iter)->GetCallNumber(), AsString((*Iter)->GetCallIdentifier()));
+			if (!line.IsEmpty()) {
+				msg += line + "\r\n";
+				++n;
+			}
+		}
+		msg += PString(PString::Printf, "Number of Calls: %u\r\n", n);
+	} else {
+		msg += "Media quality is only measured with [Proxy] EnableMediaQuality=1\r\n";
+	}
+	msg += ";\r\n";
+	client->TransmitData(msg);
+}
+
 PString CallTable::PrintStatistics() const
 {
 	PString dumb;
@@ -1838,6 +1838,7 @@ public:
 
 	void PrintCurrentCalls(USocket *client, bool verbose=FALSE) const;
 	void PrintCurrentCallsPorts(USocket *client) const;
+	void PrintMediaQuality(USocket *client) const;
 	PString PrintStatistics() const;
 	void PrintCallInfo(USocket *client, const PString & callid) const;
 
@@ -27,6 +27,9 @@
 #include "Routing.h"
 #include "gksql.h"
 #include "gkauth.h" // for reusing GkAuthenticator::ReplaceAuthParams()
+#include "job.h"
+#include "dnsresolver.h"
+#include <set>
 
 #ifdef HAS_H46023
   #include <h460/h4601.h>
@@ -304,9 +307,17 @@ void Policy::SetInstance(const PString & instance)
 	LoadConfig(instance);
 }
 
+PString Policy::PrintChainStatistics() const
+{
+	PString stats = PrintStatistics();
+	if (m_next)
+		stats += m_next->PrintChainStatistics();
+	return stats;
+}
+
 
 // class Analyzer
-Analyzer::Analyzer() : Singleton<Analyzer>("Routing::Analyzer")
+Analyzer::Analyzer() : Singleton<Analyzer>("Routing::Analyzer"), m_generation(0)
 {
 	// OnReload is called by holder
 }
@@ -321,12 +332,14 @@ Analyzer::~Analyzer()
 void Analyzer::OnReload()
 {
 	WriteLock lock(m_reloadMutex);
+	++m_generation;
 
 	for (int i = 0; i < 4; ++i) {
 		Rules & rules = m_rules[i];
 
 		DeleteObjectsInMap(rules);
 		rules.clear();
+		m_prefixes[i].Clear();
 
 		PStringToString cfgs(GkConfig()->GetAllKeyValues(SectionName[i]));
 		if (cfgs.GetSize() == 0) // no such a section? try default
@@ -344,6 +357,9 @@ void Analyzer::OnReload()
 		// default policy for backward compatibility
 		if (rules.empty())
 			rules["*"] = Create("explicit,internal,parent,neighbor");
+
+		for (Rules::const_iterator it = rules.begin(); it != rules.end(); ++it)
+			m_prefixes[i].Insert(it->first, it->second);
 	}
 }
 
@@ -351,7 +367,7 @@ bool Analyzer::Parse(AdmissionRequest & request)
 {
 	ReadLock lock(m_reloadMutex);
 	request.SetRejectReason(H225_AdmissionRejectReason::e_calledPartyNotRegistered);
-	Policy *policy = ChoosePolicy(request.GetAliases(), m_rules[0]);
+	Policy *policy = ChoosePolicy(request.GetAliases(), 0);
 	bool policyApplied = policy ? policy->HandleRas(request) : false;
 	if (!policyApplied && request.HasRoutes()) {
 		Route fallback;
@@ -369,7 +385,7 @@ bool Analyzer::Parse(LocationRequest & request)
 {
 	ReadLock lock(m_reloadMutex);
 	request.SetRejectReason(H225_LocationRejectReason::e_requestDenied);
-	Policy *policy = ChoosePolicy(request.GetAliases(), m_rules[1]);
+	Policy *policy = ChoosePolicy(request.GetAliases(), 1);
 	bool policyApplied = policy ? policy->HandleRas(request) : false;
 	if (!policyApplied && request.HasRoutes()) {
 		Route fallback;
@@ -387,7 +403,7 @@ bool Analyzer::Parse(SetupRequest & request)
 {
 	ReadLock lock(m_reloadMutex);
 	request.SetRejectReason(H225_ReleaseCompleteReason::e_calledPartyNotRegistered);
-	Policy * policy = ChoosePolicy(request.GetAliases(), m_rules[2]);
+	Policy * policy = ChoosePolicy(request.GetAliases(), 2);
 	bool policyApplied = policy ? policy->Handle(request) : false;
 	if (!policyApplied && request.HasRoutes()) {
 		Route fallback;
@@ -404,7 +420,7 @@ bool Analyzer::Parse(FacilityRequest & request)
 {
 	ReadLock lock(m_reloadMutex);
 	request.SetRejectReason(H225_ReleaseCompleteReason::e_calledPartyNotRegistered);
-	Policy *policy = ChoosePolicy(request.GetAliases(), m_rules[3]);
+	Policy *policy = ChoosePolicy(request.GetAliases(), 3);
 	bool policyApplied = policy ? policy->Handle(request) : false;
 	if (!policyApplied && request.HasRoutes()) {
 		Route fallback;
@@ -417,35 +433,46 @@ bool Analyzer::Parse(FacilityRequest & request)
 	return policyApplied || request.HasRoutes();
 }
 
+PString Analyzer::PrintStatistics()
+{
+	ReadLock lock(m_reloadMutex);
+	PString stats;
+	// the same policy object may be used for several prefixes
+	std::set<Policy *> printed;
+	for (int i = 0; i < 4; ++i)
+		for (Rules::const_iterator it = m_rules[i].begin(); it != m_rules[i].end(); ++it)
+			if (it->second && printed.insert(it->second).second)
+				stats += it->second->PrintChainStatistics();
+	return stats;
+}
+
 Policy *Analyzer::Create(const PString & cfg)
 {
 	return Policy::Create(cfg.ToLower().Tokenise(",;|", false));
 }
 
-Policy *Analyzer::ChoosePolicy(const H225_ArrayOf_AliasAddress *aliases, Rules & rules)
+Policy *Analyzer::ChoosePolicy(const H225_ArrayOf_AliasAddress *aliases, int type)
 {
+	const Rules & rules = m_rules[type];
 	// safeguard if we don't have any rules (eg. not yet initialized on startup)
 	if (rules.empty())
 		return NULL;
 
-	// use rules.begin() as the default policy
-	// since "*" has the minimum key value
-	Rules::iterator iter = rules.begin();
-	if (aliases && aliases->GetSize() > 0) {
+	if (aliases) {
 		for (PINDEX i = 0; i < aliases->GetSize(); ++i) {
 			const H225_AliasAddress & alias = (*aliases)[i];
-			iter = rules.find(alias.GetTagName());
+			Rules::const_iterator iter = rules.find(alias.GetTagName());
 			if (iter != rules.end())
-				break;
-			PString destination(AsString(alias, false));
-			while (iter != rules.begin()) {
-				--iter; // search in reverse order
-				if (MatchPrefix(destination, iter->first) > 0)
-					return iter->second;
-			}
+				return iter->second;
+			// the longest matching prefix, in one walk over the destination
+			Policy *policy = NULL;
+			if (m_prefixes[type].FindLongest(AsString(alias, false), policy))
+				return policy;
 		}
 	}
-	return iter->second;
+	// use rules.begin() as the default policy
+	// since "*" has the minimum key value
+	return rules.begin()->second;
 }
 
 
@@ -783,6 +810,9 @@ void DNSPolicy::LoadConfig(const PString & instance)
 
 bool DNSPolicy::DNSLookup(const PString & hostname, PIPSocket::Address & addr) const
 {
+	if (DNSResolver::Instance()->IsEnabled())
+		return DNSResolver::Instance()->LookupAddress(hostname, addr);
+
 	struct addrinfo hints;
 	struct addrinfo * result = NULL;
 	memset(&hints, 0, sizeof(hints));
@@ -1633,6 +1663,11 @@ void NumberAnalysisPolicy::LoadConfig(const PString & instance)
 
 	stable_sort(m_prefixes.begin(), m_prefixes.end(), PrefixGreater());
 
+	// the '!' prefixes match like the others here, MatchPrefix() != 0
+	m_prefixTrie.Clear();
+	for (unsigned i = 0; i < m_prefixes.size(); i++)
+		m_prefixTrie.Insert(m_prefixes[i].m_prefix.c_str(), &m_prefixes[i]);
+
 	PTRACE(5, "ROUTING\t" << m_name << " policy loaded with " << m_prefixes.size()
 		<< " prefix entries");
 
@@ -1647,6 +1682,12 @@ void NumberAnalysisPolicy::LoadConfig(const PString & instance)
 	}
 }
 
+const NumberAnalysisPolicy::PrefixEntry * NumberAnalysisPolicy::FindPrefix(const PString & number) const
+{
+	const PrefixEntry * entry = NULL;
+	return m_prefixTrie.FindLongest(number, entry, true) ? entry : NULL;
+}
+
 bool NumberAnalysisPolicy::OnRequest(AdmissionRequest & request)
 {
 	H225_ArrayOf_AliasAddress *aliases = request.GetAliases();
@@ -1658,20 +1699,20 @@ bool NumberAnalysisPolicy::OnRequest(AdmissionRequest & request)
 		if (alias.GetTag() == H225_AliasAddress::e_dialedDigits
 				|| alias.GetTag() == H225_AliasAddress::e_partyNumber) {
 			const PString s = AsString(alias, FALSE);
-			for (unsigned i = 0; i < m_prefixes.size(); i++)
-				if (MatchPrefix(s, m_prefixes[i].m_prefix.c_str()) != 0) {
-					if (s.GetLength() < m_prefixes[i].m_minLength) {
-						request.RemoveAllRoutes();
-						request.SetRejectReason(H225_AdmissionRejectReason::e_incompleteAddress);
-						return true;
-					} else if (m_prefixes[i].m_maxLength >= 0
-							&& s.GetLength() > m_prefixes[i].m_maxLength) {
-						request.RemoveAllRoutes();
-						request.SetRejectReason(H225_AdmissionRejectReason::e_undefinedReason);
-						return true;
-					}
-					return false;
+			const PrefixEntry * entry = FindPrefix(s);
+			if (entry) {
+				if (s.GetLength() < entry->m_minLength) {
+					request.RemoveAllRoutes();
+					request.SetRejectReason(H225_AdmissionRejectReason::e_incompleteAddress);
+					return true;
+				} else if (entry->m_maxLength >= 0
+						&& s.GetLength() > entry->m_maxLength) {
+					request.RemoveAllRoutes();
+					request.SetRejectReason(H225_AdmissionRejectReason::e_undefinedReason);
+					return true;
 				}
+				return false;
+			}
 		}
 	}
 	return false;
@@ -1688,20 +1729,20 @@ bool NumberAnalysisPolicy::OnRequest(SetupRequest & request)
 		if (alias.GetTag() == H225_AliasAddress::e_dialedDigits
 				|| alias.GetTag() == H225_AliasAddress::e_partyNumber) {
 			const PString s = AsString(alias, FALSE);
-			for (unsigned i = 0; i < m_prefixes.size(); ++i)
-				if (MatchPrefix(s, m_prefixes[i].m_prefix.c_str()) != 0) {
-					if (s.GetLength() < m_prefixes[i].m_minLength) {
-						request.RemoveAllRoutes();
-						request.SetRejectReason(H225_ReleaseCompleteReason::e_badFormatAddress);
-						return true;
-					} else if (m_prefixes[i].m_maxLength >= 0
-							&& s.GetLength() > m_prefixes[i].m_maxLength) {
-						request.RemoveAllRoutes();
-						request.SetRejectReason(H225_ReleaseCompleteReason::e_badFormatAddress);
-						return true;
-					}
-					return false;
+			const PrefixEntry * entry = FindPrefix(s);
+			if (entry) {
+				if (s.GetLength() < entry->m_minLength) {
+					request.RemoveAllRoutes();
+					request.SetRejectReason(H225_ReleaseCompleteReason::e_badFormatAddress);
+					return true;
+				} else if (entry->m_maxLength >= 0
+						&& s.GetLength() > entry->m_maxLength) {
+					request.RemoveAllRoutes();
+					request.SetRejectReason(H225_ReleaseCompleteReason::e_badFormatAddress);
+					return true;
 				}
+				return false;
+			}
 		}
 	}
 	return false;
@@ -1803,7 +1844,7 @@ bool ENUMPolicy::FindByAliasesInternal(const PString & schema, RoutingRequest &
 
 		if (j >= alias.GetLength()) {
 			PString str;
-			if (PDNS::ENUMLookup(alias, schema, str)) {
+			if (DNSResolver::Instance()->ENUMLookup(alias, schema, str)) {
 				// Remove any + or URI Schema at the front
 				PINDEX at = str.Find('@');
 				PINDEX sch = str.Find(':');
@@ -1867,11 +1908,257 @@ void DestinationRoutes::AddRoute(const Route & route, bool endChain)
 }
 
 
+RouteCache::RouteCache()
+	: m_maxEntries(0), m_ttl(0), m_negativeTTL(0), m_staleTime(0),
+	m_hits(0), m_staleHits(0), m_misses(0), m_evictions(0),
+	m_lookups(0), m_lookupTime(0), m_maxLookupTime(0)
+{
+}
+
+void RouteCache::SetLimits(unsigned maxEntries, unsigned ttl, unsigned negativeTTL, unsigned staleTime)
+{
+	PWaitAndSignal lock(m_mutex);
+	m_maxEntries = maxEntries;
+	m_ttl = ttl;
+	m_negativeTTL = negativeTTL;
+	m_staleTime = staleTime;
+	m_entries.clear();
+	m_lru.clear();
+}
+
+bool RouteCache::IsNegative(const DestinationRoutes & destination)
+{
+	return destination.m_routes.empty() && !destination.RejectCall() && !destination.ChangeAliases();
+}
+
+RouteCache::Result RouteCache::Find(const PString & key, DestinationRoutes & destination, time_t now)
+{
+	PWaitAndSignal lock(m_mutex);
+	std::map<PString, Entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end() || now >= it->second.m_expires + (time_t)m_staleTime) {
+		++m_misses;
+		return Miss;
+	}
+	Entry & entry = it->second;
+	m_lru.splice(m_lru.begin(), m_lru, entry.m_lru);
+	destination = entry.m_destination;
+	Result result = Hit;
+	if (now >= entry.m_expires) {
+		++m_staleHits;
+		if (!entry.m_refreshing) {
+			entry.m_refreshing = true;
+			result = Stale;
+		}
+	} else
+		++m_hits;
+	return result;
+}
+
+void RouteCache::Store(const PString & key, const DestinationRoutes & destination, time_t now)
+{
+	PWaitAndSignal lock(m_mutex);
+	if (m_maxEntries == 0)
+		return;
+	const unsigned ttl = IsNegative(destination) ? m_negativeTTL : m_ttl;
+	std::map<PString, Entry>::iterator it = m_entries.find(key);
+	if (ttl == 0) {
+		if (it != m_entries.end()) {
+			m_lru.erase(it->second.m_lru);
+			m_entries.erase(it);
+		}
+		return;
+	}
+	if (it == m_entries.end()) {
+		while (m_entries.size() >= m_maxEntries && !m_lru.empty()) {
+			m_entries.erase(m_lru.back());
+			m_lru.pop_back();
+			++m_evictions;
+		}
+		it = m_entries.insert(std::make_pair(key, Entry())).first;
+		m_lru.push_front(key);
+		it->second.m_lru = m_lru.begin();
+	} else
+		m_lru.splice(m_lru.begin(), m_lru, it->second.m_lru);
+
+	Entry & entry = it->second;
+	entry.m_destination = destination;
+	// the endpoint records are looked up again on every hit
+	for (std::list<Route>::iterator r = entry.m_destination.m_routes.begin(); r != entry.m_destination.m_routes.end(); ++r) {
+		r->m_destEndpoint = endptr(NULL);
+		r->m_language.MakeUnique();
+	}
+	entry.m_expires = now + ttl;
+	entry.m_refreshing = false;
+}
+
+void RouteCache::RefreshFailed(const PString & key)
+{
+	PWaitAndSignal lock(m_mutex);
+	std::map<PString, Entry>::iterator it = m_entries.find(key);
+	if (it != m_entries.end())
+		it->second.m_refreshing = false;
+}
+
+void RouteCache::AddLookupTime(unsigned ms)
+{
+	PWaitAndSignal lock(m_mutex);
+	++m_lookups;
+	m_lookupTime += ms;
+	if (ms > m_maxLookupTime)
+		m_maxLookupTime = ms;
+}
+
+unsigned RouteCache::GetSize() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_entries.size();
+}
+
+PString RouteCache::PrintStatistics(const PString & name) const
+{
+	PWaitAndSignal lock(m_mutex);
+	PString stats = "Routing " + name + " cache: " + PString(m_entries.size()) + "/" + PString(m_maxEntries)
+		+ " entries, hits " + PString(m_hits) + ", stale hits " + PString(m_staleHits)
+		+ ", misses " + PString(m_misses) + ", evictions " + PString(m_evictions)
+		+ ", lookups " + PString(m_lookups);
+	if (m_lookups > 0)
+		stats += ", lookup time avg " + PString((unsigned)(m_lookupTime / m_lookups)) + " ms max " + PString(m_maxLookupTime) + " ms";
+	return stats + "\r\n";
+}
+
+
+namespace {
+
+const char * const CacheKeyInputs[] = {
+	"s", "c", "p", "r", "Calling-Station-Id", "i", "m", "client-auth-id", "language"
+};
+const PINDEX NumCacheKeyInputs = PARRAYSIZE(CacheKeyInputs);
+
+// runs a dynamic policy again for a stale route cache entry
+class RouteRefreshJob : public Job {
+public:
+	RouteRefreshJob(DynamicPolicy * policy, const PString & key, const PStringArray & inputs)
+		: m_policy(policy), m_generation(Analyzer::Instance()->GetGeneration()), m_key(key), m_inputs(inputs)
+	{
+		m_inputs.MakeUnique();
+		SetName("RouteRefresh");
+	}
+
+	virtual void Run()
+	{
+		Analyzer * analyzer = Analyzer::Instance();
+		ReadLock lock(analyzer->GetReloadMutex());
+		// the policy has been deleted if the routing config was reloaded
+		if (analyzer->GetGeneration() == m_generation)
+			m_policy->RefreshRoute(m_key, m_inputs);
+	}
+
+private:
+	DynamicPolicy * m_policy;
+	unsigned m_generation;
+	PString m_key;
+	PStringArray m_inputs;
+};
+
+} // end of anonymous namespace
+
 DynamicPolicy::DynamicPolicy()
 {
 	m_active = false;
 }
 
+void DynamicPolicy::LoadCacheConfig()
+{
+	// only the configuration knows which inputs the query, URL or script uses, there is no default key
+	const PString cacheKey = GkConfig()->GetString(m_iniSection, "CacheKey", "");
+	m_cacheKey.clear();
+	const PStringArray fields = cacheKey.Tokenise(",; \t", false);
+	for (PINDEX i = 0; i < fields.GetSize(); ++i) {
+		PINDEX input = 0;
+		while (input < NumCacheKeyInputs && fields[i] != CacheKeyInputs[input])
+			++input;
+		if (input < NumCacheKeyInputs)
+			m_cacheKey.push_back(input);
+		else
+			PTRACE(1, m_name << "\tUnknown CacheKey field " << fields[i]);
+	}
+	unsigned cacheSize = GkConfig()->GetInteger(m_iniSection, "CacheSize", 0);
+	if (cacheSize > 0 && m_cacheKey.empty()) {
+		PTRACE(1, m_name << "\tCacheSize is set without a CacheKey, route cache disabled");
+		cacheSize = 0;
+	}
+	m_routeCache.SetLimits(cacheSize,
+		GkConfig()->GetInteger(m_iniSection, "CacheTTL", 60),
+		GkConfig()->GetInteger(m_iniSection, "CacheNegativeTTL", 10),
+		GkConfig()->GetInteger(m_iniSection, "CacheStaleTime", 0));
+	if (m_routeCache.IsEnabled())
+		PTRACE(4, m_name << "\tRoute cache enabled, key " << cacheKey);
+}
+
+PString DynamicPolicy::PrintStatistics() const
+{
+	return m_routeCache.IsEnabled() ? m_routeCache.PrintStatistics(m_name) : PString::Empty();
+}
+
+void DynamicPolicy::RunCachedPolicy(
+	const PString & source,
+	const PString & calledAlias,
+	const PString & calledIP,
+	const PString & caller,
+	const PString & callingStationId,
+	const PString & callid,
+	const PString & messageType,
+	const PString & clientauthid,
+	const PString & language,
+	DestinationRoutes & destination)
+{
+	if (!m_routeCache.IsEnabled()) {
+		RunPolicy(source, calledAlias, calledIP, caller, callingStationId, callid, messageType, clientauthid, language, destination);
+		return;
+	}
+
+	const PString * const inputs[NumCacheKeyInputs] = {
+		&source, &calledAlias, &calledIP, &caller, &callingStationId, &callid, &messageType, &clientauthid, &language
+	};
+	PString key;
+	for (std::vector<PINDEX>::const_iterator i = m_cacheKey.begin(); i != m_cacheKey.end(); ++i)
+		key += inputs[*i]->Trim() + "\n";
+
+	const time_t now = time(NULL);
+	const RouteCache::Result result = m_routeCache.Find(key, destination, now);
+	if (result != RouteCache::Miss) {
+		for (std::list<Route>::iterator r = destination.m_routes.begin(); r != destination.m_routes.end(); ++r)
+			r->m_destEndpoint = RegistrationTable::Instance()->FindBySignalAdr(r->m_destAddr);
+		PTRACE(5, m_name << "\tRoute cache hit for " << calledAlias);
+		if (result == RouteCache::Stale) {
+			PStringArray args(NumCacheKeyInputs);
+			for (PINDEX i = 0; i < NumCacheKeyInputs; ++i)
+				args[i] = *inputs[i];
+			(new RouteRefreshJob(this, key, args))->Execute();
+		}
+		return;
+	}
+
+	const PTime start;
+	RunPolicy(source, calledAlias, calledIP, caller, callingStationId, callid, messageType, clientauthid, language, destination);
+	m_routeCache.AddLookupTime((unsigned)(PTime() - start).GetMilliSeconds());
+	m_routeCache.Store(key, destination, now);
+}
+
+void DynamicPolicy::RefreshRoute(const PString & key, const PStringArray & inputs)
+{
+	if (inputs.GetSize() != NumCacheKeyInputs) {
+		m_routeCache.RefreshFailed(key);
+		return;
+	}
+	DestinationRoutes destination;
+	const PTime start;
+	RunPolicy(inputs[0], inputs[1], inputs[2], inputs[3], inputs[4], inputs[5], inputs[6], inputs[7], inputs[8], destination);
+	m_routeCache.AddLookupTime((unsigned)(PTime() - start).GetMilliSeconds());
+	m_routeCache.Store(key, destination, time(NULL));
+	PTRACE(5, m_name << "\tRoute cache entry refreshed for " << inputs[1]);
+}
+
 bool DynamicPolicy::OnRequest(AdmissionRequest & request)
 {
 	H225_ArrayOf_AliasAddress *aliases = request.GetAliases();
@@ -1891,7 +2178,7 @@ bool DynamicPolicy::OnRequest(AdmissionRequest & request)
 		PString language = ep->GetDefaultLanguage();
 		DestinationRoutes destination;
 
-		RunPolicy(	/* in */ source, calledAlias, calledIP, caller, callingStationId, callid, messageType, clientauthid, language,
+		RunCachedPolicy(	/* in */ source, calledAlias, calledIP, caller, callingStationId, callid, messageType, clientauthid, language,
                     /* out: */ destination);
 
 		if (destination.m_routes.empty() && !ResolveRoute(request,destination))
@@ -1958,7 +2245,7 @@ bool DynamicPolicy::OnRequest(LocationRequest & request)
 #endif
 	DestinationRoutes destination;
 
-	RunPolicy(	/* in */ source, calledAlias, calledIP, caller, callingStationId,callid, messageType, clientauthid, language,
+	RunCachedPolicy(	/* in */ source, calledAlias, calledIP, caller, callingStationId,callid, messageType, clientauthid, language,
 					/* out: */ destination);
 
 	if (destination.m_routes.empty() && !ResolveRoute(request,destination))
@@ -2015,7 +2302,7 @@ bool DynamicPolicy::OnRequest(SetupRequest & request)
 #endif
 	DestinationRoutes destination;
 
-	RunPolicy(	/* in */ source, calledAlias, calledIP, caller, callingStationId, callid, messageType, clientauthid, language,
+	RunCachedPolicy(	/* in */ source, calledAlias, calledIP, caller, callingStationId, callid, messageType, clientauthid, language,
 					/* out: */ destination);
 
 	if (destination.m_routes.empty() && !ResolveRoute(request,destination))
@@ -2101,6 +2388,7 @@ void SqlPolicy::LoadConfig(const PString & instance)
 		SNMP_TRAP(4, SNMPError, Database, PString(m_name) + " creation failed");
 		return;
 	}
+	LoadCacheConfig();
 	m_active = true;
 #endif
 }
@@ -2276,6 +2564,7 @@ void HttpPolicy::LoadConfig(const PString & instance)
 #ifdef HAS_JSON
 	m_JSONResponse = GkConfig()->GetBoolean(m_iniSection, "JSONResponse", false);
 #endif
+	LoadCacheConfig();
 	m_active = true;
 }
 
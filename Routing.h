@@ -23,6 +23,7 @@
 #include "factory.h"
 #include "RasTbl.h"
 #include "stl_supp.h"
+#include "prefixtrie.h"
 
 #ifdef HAS_JSON
 #include <nlohmann/json.hpp>
@@ -273,6 +274,9 @@ public:
 
 	void SetInstance(const PString & instance);
 
+	/// status port statistics of this policy and the rest of the chain
+	PString PrintChainStatistics() const;
+
 protected:
 	// new virtual function
 	// if return false, the policy is disable
@@ -288,6 +292,9 @@ protected:
 
 	virtual void LoadConfig(const PString & /* instance */) { }	// should be used to load config, always called after the policy object is created
 
+	/// status port statistics of the policy, empty if it has none
+	virtual PString PrintStatistics() const { return PString::Empty(); }
+
 protected:
 	/// human readable name for the policy - it should be set inside constructors
 	/// of derived policies, default value is "undefined"
@@ -346,14 +353,24 @@ public:
 	bool Parse(SetupRequest &);
 	bool Parse(FacilityRequest &);
 
+	PString PrintStatistics();
+
+	/// the policies are deleted and created again on every reload
+	unsigned GetGeneration() const { return m_generation; }
+	/// background work of a policy must hold a read lock and check the generation first
+	PReadWriteMutex & GetReloadMutex() { return m_reloadMutex; }
+
 private:
 	typedef std::map<PString, Policy *, pstr_prefix_lesser> Rules;
 
 	Policy *Create(const PString & policy);
-	Policy *ChoosePolicy(const H225_ArrayOf_AliasAddress *, Rules &);
+	Policy *ChoosePolicy(const H225_ArrayOf_AliasAddress *, int type);
 
 	Rules m_rules[4];
+	// the rule keys compiled for the lookup by alias, rebuilt on reload
+	PrefixTrie<Policy *> m_prefixes[4];
 	PReadWriteMutex m_reloadMutex;
+	unsigned m_generation;
 };
 
 
@@ -452,8 +469,13 @@ private:
 private:
 	typedef vector<PrefixEntry> Prefixes;
 
+	/// @return	the longest prefix of the number, NULL if none
+	const PrefixEntry * FindPrefix(const PString & number) const;
+
 	/// list of number prefixes, with min/max number length as values
 	Prefixes m_prefixes;
+	/// the same prefixes for the lookup, pointing into m_prefixes
+	PrefixTrie<const PrefixEntry *> m_prefixTrie;
 };
 
 // a policy to look up the destination from ENUM Name Server
@@ -501,15 +523,94 @@ protected:
 	PStringList m_language;
 };
 
+/** Results of a dynamic policy by the request inputs that affect them.
+
+    Positive and negative results (no route) have their own TTL. An entry
+    that expired less than the stale time ago is still used, the first
+    request that finds it stale triggers a refresh. The least recently
+    used entries are evicted when the cache is full. Thread safe.
+*/
+class RouteCache {
+public:
+	enum Result {
+		Miss,
+		Hit,
+		Stale	// a hit, the caller should refresh the entry (returned once per expiry)
+	};
+
+	RouteCache();
+
+	/// @param maxEntries	0 disables the cache
+	void SetLimits(unsigned maxEntries, unsigned ttl, unsigned negativeTTL, unsigned staleTime);
+	bool IsEnabled() const { return m_maxEntries > 0; }
+
+	Result Find(const PString & key, DestinationRoutes & destination, time_t now);
+	void Store(const PString & key, const DestinationRoutes & destination, time_t now);
+	/// a refresh didn't finish, let the next request try again
+	void RefreshFailed(const PString & key);
+
+	/// account the time the policy needed for a result
+	void AddLookupTime(unsigned ms);
+
+	unsigned GetSize() const;
+	/// one status port line
+	PString PrintStatistics(const PString & name) const;
+
+protected:
+	struct Entry {
+		DestinationRoutes m_destination;
+		time_t m_expires;
+		bool m_refreshing;
+		std::list<PString>::iterator m_lru;
+	};
+
+	static bool IsNegative(const DestinationRoutes & destination);
+
+	unsigned m_maxEntries;
+	unsigned m_ttl;
+	unsigned m_negativeTTL;
+	unsigned m_staleTime;
+	std::map<PString, Entry> m_entries;
+	std::list<PString> m_lru;	// most recently used first
+	unsigned m_hits;
+	unsigned m_staleHits;
+	unsigned m_misses;
+	unsigned m_evictions;
+	unsigned m_lookups;	// calls of the policy
+	PUInt64 m_lookupTime;	// ms
+	unsigned m_maxLookupTime;
+	mutable PMutex m_mutex;
+};
+
 // superclass for dynamic policies like sql and lua scripting
 class DynamicPolicy : public Policy {
 public:
 	DynamicPolicy();
 	virtual ~DynamicPolicy() { }
 
+	/// run the policy again for a stale cache entry, called by a background job
+	void RefreshRoute(const PString & key, const PStringArray & inputs);
+
 protected:
 	virtual bool IsActive() const { return m_active; }
 
+	/// read the route cache settings from the policy section
+	void LoadCacheConfig();
+	virtual PString PrintStatistics() const;
+
+	/// RunPolicy() through the route cache
+	void RunCachedPolicy(
+		const PString & source,
+		const PString & calledAlias,
+		const PString & calledIP,
+		const PString & caller,
+		const PString & callingStationId,
+		const PString & callid,
+		const PString & messageType,
+		const PString & clientauthid,
+		const PString & language,
+		DestinationRoutes & destination);
+
 	virtual bool OnRequest(AdmissionRequest &);
 	virtual bool OnRequest(LocationRequest &);
 	virtual bool OnRequest(SetupRequest &);
@@ -536,6 +637,8 @@ protected:
 protected:
 	// active ?
 	bool m_active;
+	RouteCache m_routeCache;
+	std::vector<PINDEX> m_cacheKey;	// the RunPolicy() inputs the results depend on
 };
 
 // a policy to route calls via an SQL database
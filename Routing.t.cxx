@@ -0,0 +1,291 @@
+/*
+ * Routing.t.cxx
+ *
+ * unit tests for Routing.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include "h323util.h"
+#include "Routing.h"
+#include "gtest/gtest.h"
+#include <cstdlib>
+#include <set>
+#include <iostream>
+
+using namespace Routing;
+
+namespace {
+
+struct CollectMatches {
+	void operator()(const PString & prefix, int, int length) { m_matches[prefix] = length; }
+	std::map<PString, int> m_matches;
+};
+
+class RoutingTest : public ::testing::Test {
+protected:
+	RoutingTest() { }
+
+	static DestinationRoutes MakeRoute(const char * ip)
+	{
+		DestinationRoutes destination;
+		destination.AddRoute(Route("Sql", PIPSocket::Address(ip), 1720));
+		return destination;
+	}
+
+	typedef std::map<PString, int, pstr_prefix_lesser> Rules;
+
+	// the policy selection before the rules were compiled into a trie
+	static int ScanRules(const Rules & rules, const PString & destination)
+	{
+		Rules::const_iterator iter = rules.end();
+		while (iter != rules.begin()) {
+			--iter;
+			if (MatchPrefix(destination, iter->first) > 0)
+				return iter->second;
+		}
+		return -1;
+	}
+
+	// the order of NumberAnalysisPolicy::LoadConfig()
+	struct PrefixGreater {
+		bool operator()(const NumberAnalysisPolicy::PrefixEntry & e1, const NumberAnalysisPolicy::PrefixEntry & e2) const
+		{
+			if (e1.m_prefix.size() == e2.m_prefix.size())
+				return e1.m_prefix > e2.m_prefix;
+			else
+				return e1.m_prefix.size() > e2.m_prefix.size();
+		}
+	};
+
+	static PString RandomNumber(unsigned minLength, unsigned maxLength, bool wildcards)
+	{
+		static const char chars[] = "0123456789.%";
+		PString number;
+		const unsigned len = minLength + rand() % (maxLength - minLength + 1);
+		for (unsigned i = 0; i < len; ++i)
+			number += chars[rand() % (wildcards && i > 0 ? 12 : 10)];
+		return number;
+	}
+};
+
+
+TEST_F(RoutingTest, RouteCacheTTL) {
+	RouteCache cache;
+	DestinationRoutes destination;
+	EXPECT_FALSE(cache.IsEnabled());
+	cache.SetLimits(10, 60, 10, 0);
+	EXPECT_TRUE(cache.IsEnabled());
+
+	EXPECT_EQ(RouteCache::Miss, cache.Find("1234", destination, 1000));
+	cache.Store("1234", MakeRoute("192.168.1.1"), 1000);
+	EXPECT_EQ(RouteCache::Hit, cache.Find("1234", destination, 1059));
+	ASSERT_EQ(1u, destination.m_routes.size());
+	EXPECT_EQ(SocketToH225TransportAddr(PIPSocket::Address("192.168.1.1"), 1720), destination.m_routes.front().m_destAddr);
+	EXPECT_EQ(RouteCache::Miss, cache.Find("1234", destination, 1060));
+
+	// empty results have their own TTL
+	cache.Store("5678", DestinationRoutes(), 1000);
+	EXPECT_EQ(RouteCache::Hit, cache.Find("5678", destination, 1009));
+	EXPECT_TRUE(destination.m_routes.empty());
+	EXPECT_EQ(RouteCache::Miss, cache.Find("5678", destination, 1010));
+
+	// a rejected call isn't an empty result
+	DestinationRoutes reject;
+	reject.SetRejectCall(true);
+	cache.Store("9999", reject, 1000);
+	EXPECT_EQ(RouteCache::Hit, cache.Find("9999", destination, 1059));
+	EXPECT_TRUE(destination.RejectCall());
+}
+
+TEST_F(RoutingTest, RouteCacheStale) {
+	RouteCache cache;
+	DestinationRoutes destination;
+	cache.SetLimits(10, 60, 0, 30);
+	cache.Store("1234", MakeRoute("192.168.1.1"), 1000);
+
+	// only the first request after the expiry refreshes the entry
+	EXPECT_EQ(RouteCache::Stale, cache.Find("1234", destination, 1060));
+	EXPECT_EQ(1u, destination.m_routes.size());
+	EXPECT_EQ(RouteCache::Hit, cache.Find("1234", destination, 1061));
+	cache.RefreshFailed("1234");
+	EXPECT_EQ(RouteCache::Stale, cache.Find("1234", destination, 1062));
+	EXPECT_EQ(RouteCache::Miss, cache.Find("1234", destination, 1090));
+
+	// the refresh makes the entry fresh again
+	cache.Store("1234", MakeRoute("192.168.1.2"), 1070);
+	EXPECT_EQ(RouteCache::Hit, cache.Find("1234", destination, 1090));
+	EXPECT_EQ(SocketToH225TransportAddr(PIPSocket::Address("192.168.1.2"), 1720), destination.m_routes.front().m_destAddr);
+
+	// a negative TTL of 0 doesn't cache empty results
+	cache.Store("1234", DestinationRoutes(), 1100);
+	EXPECT_EQ(RouteCache::Miss, cache.Find("1234", destination, 1100));
+	EXPECT_EQ(0u, cache.GetSize());
+}
+
+TEST_F(RoutingTest, RouteCacheLRU) {
+	RouteCache cache;
+	DestinationRoutes destination;
+	cache.SetLimits(3, 60, 60, 0);
+	cache.Store("1", MakeRoute("192.168.1.1"), 1000);
+	cache.Store("2", MakeRoute("192.168.1.2"), 1000);
+	cache.Store("3", MakeRoute("192.168.1.3"), 1000);
+	EXPECT_EQ(RouteCache::Hit, cache.Find("1", destination, 1001));
+	cache.Store("4", MakeRoute("192.168.1.4"), 1001);
+	EXPECT_EQ(3u, cache.GetSize());
+	// "2" was the least recently used entry
+	EXPECT_EQ(RouteCache::Miss, cache.Find("2", destination, 1002));
+	EXPECT_EQ(RouteCache::Hit, cache.Find("1", destination, 1002));
+	EXPECT_EQ(RouteCache::Hit, cache.Find("3", destination, 1002));
+	EXPECT_EQ(RouteCache::Hit, cache.Find("4", destination, 1002));
+
+	cache.AddLookupTime(10);
+	cache.AddLookupTime(30);
+	const PString stats = cache.PrintStatistics("Sql");
+	EXPECT_NE(P_MAX_INDEX, stats.Find("3/3 entries"));
+	EXPECT_NE(P_MAX_INDEX, stats.Find("evictions 1"));
+	EXPECT_NE(P_MAX_INDEX, stats.Find("avg 20 ms max 30 ms"));
+}
+
+TEST_F(RoutingTest, PrefixTrieMatch) {
+	PrefixTrie<int> trie;
+	EXPECT_TRUE(trie.Insert("49", 1));
+	EXPECT_TRUE(trie.Insert("49..1", 2));
+	EXPECT_TRUE(trie.Insert("4%", 3));
+	EXPECT_TRUE(trie.Insert("!491", 4));
+	EXPECT_TRUE(trie.Insert("*", 5));
+	EXPECT_FALSE(trie.Insert("49", 6));
+	EXPECT_EQ(5u, trie.GetSize());
+
+	int value = 0;
+	EXPECT_TRUE(trie.FindLongest("4977123", value));
+	EXPECT_EQ(2, value);
+	EXPECT_TRUE(trie.FindLongest("4912", value));
+	EXPECT_EQ(1, value);	// "49" is greater than "4%"
+	EXPECT_TRUE(trie.FindLongest("42", value));
+	EXPECT_EQ(3, value);
+	EXPECT_TRUE(trie.FindLongest("*123", value));
+	EXPECT_EQ(5, value);
+	EXPECT_FALSE(trie.FindLongest("1234", value));
+	EXPECT_FALSE(trie.FindLongest("4", value));
+
+	// every match with the result of MatchPrefix()
+	CollectMatches collect;
+	trie.Match("49171", collect);
+	ASSERT_EQ(4u, collect.m_matches.size());
+	EXPECT_EQ(2, collect.m_matches["49"]);
+	EXPECT_EQ(2, collect.m_matches["4%"]);
+	EXPECT_EQ(-3, collect.m_matches["!491"]);
+	EXPECT_EQ(MatchPrefix("49171", "49..1"), collect.m_matches["49..1"]);
+}
+
+TEST_F(RoutingTest, PolicySelection) {
+	srand(4711);
+	const unsigned numRules = 5000;
+	Rules rules;
+	PrefixTrie<int> trie;
+	while (rules.size() < numRules) {
+		const PString prefix = RandomNumber(1, 8, rand() % 4 == 0);
+		if (rules.insert(Rules::value_type(prefix, (int)rules.size())).second)
+			trie.Insert(prefix, rules.find(prefix)->second);
+	}
+
+	const unsigned numLookups = 20000;
+	std::vector<PString> destinations;
+	for (unsigned i = 0; i < numLookups; ++i)
+		destinations.push_back(RandomNumber(3, 12, false));
+
+	std::vector<int> scanned(numLookups), compiled(numLookups);
+	PTime start;
+	for (unsigned i = 0; i < numLookups; ++i)
+		scanned[i] = ScanRules(rules, destinations[i]);
+	const PTimeInterval scanTime = PTime() - start;
+	start = PTime();
+	for (unsigned i = 0; i < numLookups; ++i)
+		if (!trie.FindLongest(destinations[i], compiled[i]))
+			compiled[i] = -1;
+	const PTimeInterval trieTime = PTime() - start;
+
+	unsigned matched = 0;
+	for (unsigned i = 0; i < numLookups; ++i) {
+		EXPECT_EQ(scanned[i], compiled[i]) << destinations[i];
+		if (compiled[i] >= 0)
+			++matched;
+	}
+	EXPECT_GT(matched, numLookups / 2);
+	std::cout << "[          ] " << numRules << " policy rules, " << numLookups << " destinations: scan "
+		<< scanTime.GetMilliSeconds() << " ms, trie " << trieTime.GetMilliSeconds() << " ms" << std::endl;
+}
+
+TEST_F(RoutingTest, NumberAnalysisPrefixes) {
+	srand(815);
+	// a number plan of 40000 prefixes, some of them with wildcards or '!'
+	std::set<PString> plan;
+	while (plan.size() < 40000) {
+		PString prefix = RandomNumber(1, 7, rand() % 8 == 0);
+		if (rand() % 50 == 0)
+			prefix = "!" + prefix;
+		plan.insert(prefix);
+	}
+
+	// the NumberAnalysis policy before: sorted by length and value, the first MatchPrefix() != 0 wins
+	std::vector<NumberAnalysisPolicy::PrefixEntry> sorted;
+	for (std::set<PString>::const_iterator it = plan.begin(); it != plan.end(); ++it) {
+		NumberAnalysisPolicy::PrefixEntry entry;
+		entry.m_prefix = (const char *)*it;
+		entry.m_minLength = 0;
+		entry.m_maxLength = -1;
+		sorted.push_back(entry);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), PrefixGreater());
+
+	PrefixTrie<int> trie;
+	for (unsigned i = 0; i < sorted.size(); ++i)
+		EXPECT_TRUE(trie.Insert(sorted[i].m_prefix.c_str(), i));
+
+	const unsigned numLookups = 5000;
+	std::vector<PString> numbers;
+	for (unsigned i = 0; i < numLookups; ++i)
+		numbers.push_back(RandomNumber(1, 14, false));
+	numbers.push_back("");
+
+	std::vector<int> scanned, compiled;
+	PTime start;
+	for (unsigned n = 0; n < numbers.size(); ++n) {
+		int result = -1;
+		for (unsigned i = 0; i < sorted.size(); ++i)
+			if (MatchPrefix(numbers[n], sorted[i].m_prefix.c_str()) != 0) {
+				result = i;
+				break;
+			}
+		scanned.push_back(result);
+	}
+	const PTimeInterval scanTime = PTime() - start;
+	start = PTime();
+	for (unsigned n = 0; n < numbers.size(); ++n) {
+		int result = -1;
+		trie.FindLongest(numbers[n], result, true);
+		compiled.push_back(result);
+	}
+	const PTimeInterval trieTime = PTime() - start;
+
+	unsigned negative = 0;
+	for (unsigned n = 0; n < numbers.size(); ++n) {
+		EXPECT_EQ(scanned[n], compiled[n]) << numbers[n];
+		if (compiled[n] >= 0 && sorted[compiled[n]].m_prefix[0] == '!')
+			++negative;
+	}
+	EXPECT_GT(negative, 0u);
+	EXPECT_EQ(-1, compiled.back());
+	std::cout << "[          ] " << plan.size() << " number prefixes, " << numbers.size() << " numbers: scan "
+		<< scanTime.GetMilliSeconds() << " ms, trie " << trieTime.GetMilliSeconds() << " ms" << std::endl;
+}
+
+} // namespace
@@ -24,6 +24,8 @@
 #include "h323util.h"
 #include "MakeCall.h"
 #include "Neighbor.h"
+#include "capture.h"
+#include "dnsresolver.h"
 
 int SoftPBX::TimeToLive = -1;
 PTime SoftPBX::StartUp;
@@ -91,7 +93,14 @@ void SoftPBX::PrintStatistics(USocket *client, bool)
 	PTRACE(3, "GK\tSoftPBX: PrintStatistics");
 	PString msg = RegistrationTable::Instance()->PrintStatistics()
 		    + CallTable::Instance()->PrintStatistics()
-		    + SoftPBX::Uptime() + "\r\n;\r\n";
+		    + PrintRTPPortStatistics()
+		    + PrintRTPRelayStatistics()
+		    + Routing::Analyzer::Instance()->PrintStatistics()
+		    + DNSResolver::Instance()->PrintStatistics();
+#ifdef HAS_H235_MEDIA
+	msg += H235KeyPool::Instance()->PrintStatistics();
+#endif
+	msg += SoftPBX::Uptime() + "\r\n;\r\n";
 	client->TransmitData(msg);
 }
 
@@ -550,6 +559,41 @@ void SoftPBX::PrintEndpointQoS(USocket *client)
 	RegistrationTable::Instance()->PrintEndpointQoS(client);
 }
 
+void SoftPBX::PrintMediaQuality(USocket *client)
+{
+	PTRACE(3, "GK\tSoftPBX: PrintMediaQuality");
+	CallTable::Instance()->PrintMediaQuality(client);
+}
+
+bool SoftPBX::CaptureMedia(const PString & filterType, const PString & filter)
+{
+	PTRACE(3, "GK\tSoftPBX: CaptureMedia " << filterType << " " << filter);
+	return MediaCapture::Instance()->AddFilter(filterType, filter);
+}
+
+void SoftPBX::StopCapture()
+{
+	PTRACE(3, "GK\tSoftPBX: StopCapture");
+	MediaCapture::Instance()->ClearFilters();
+}
+
+void SoftPBX::CaptureSignaling(bool on)
+{
+	PTRACE(3, "GK\tSoftPBX: CaptureSignaling " << (on ? "on" : "off"));
+	if (on)
+		SignalingCapture::Instance()->Start();
+	else
+		SignalingCapture::Instance()->Stop();
+}
+
+void SoftPBX::PrintCaptureStatus(USocket *client)
+{
+	PString msg(MediaCapture::Instance()->PrintStatus());
+	msg += SignalingCapture::Instance()->PrintStatus();
+	msg += ";\r\n";
+	client->TransmitData(msg);
+}
+
 void SoftPBX::PrintNeighbors(USocket *client)
 {
 	PTRACE(3, "GK\tSoftPBX: PrintNeighbors");
@@ -53,6 +53,11 @@ namespace SoftPBX
 	void PrintPrefixCapacities(USocket *client, const PString & alias);
 	void PrintCapacityControlRules(USocket *client);
 	void PrintEndpointQoS(USocket *client);
+	void PrintMediaQuality(USocket *client);
+	bool CaptureMedia(const PString & filterType, const PString & filter);
+	void StopCapture();
+	void CaptureSignaling(bool on);
+	void PrintCaptureStatus(USocket *client);
 	void PrintNeighbors(USocket *client);
 	void PrintCallInfo(USocket *client, const PString & callid);
 	void MaintenanceMode(bool on, const PString & alternate = "");
@@ -19,6 +19,7 @@
 #include <h323pdu.h>
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <cstdlib>
 #ifndef _WIN32
 #include <unistd.h>
@@ -255,6 +256,272 @@ bool operator<<(const PIPSocket::Address & addr, const NetworkAddress & net)
 }
 
 
+// class NetworkTree
+struct NetworkTree::Node {
+	Node(const BYTE * key, unsigned len) : m_len(len), m_terminal(false), m_value(0)
+	{
+		memset(m_key, 0, sizeof(m_key));
+		memcpy(m_key, key, (len + 7) / 8);
+		// clear the bits after the prefix
+		if (len % 8)
+			m_key[len / 8] &= (BYTE)(0xff << (8 - len % 8));
+		m_child[0] = m_child[1] = NULL;
+	}
+	~Node() { delete m_child[0]; delete m_child[1]; }
+
+	BYTE m_key[16];
+	unsigned m_len;	// prefix length in bits
+	bool m_terminal;	// a network, not only a branch
+	int m_value;
+	NetworkAddress m_network;
+	Node * m_child[2];
+};
+
+namespace {
+
+inline unsigned GetBit(const BYTE * key, unsigned bit)
+{
+	return (key[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+// number of leading bits #a# and #b# have in common, at most #len#
+unsigned CommonBits(const BYTE * a, const BYTE * b, unsigned len)
+{
+	unsigned bits = 0;
+	while (bits < len) {
+		const BYTE diff = a[bits / 8] ^ b[bits / 8];
+		if (diff == 0) {
+			bits += 8;
+			continue;
+		}
+		for (BYTE mask = 0x80; (diff & mask) == 0; mask >>= 1)
+			++bits;
+		break;
+	}
+	return (bits < len) ? bits : len;
+}
+
+} // namespace
+
+NetworkTree::NetworkTree() : m_size(0)
+{
+	m_root[0] = m_root[1] = NULL;
+}
+
+NetworkTree::~NetworkTree()
+{
+	Clear();
+}
+
+void NetworkTree::Clear()
+{
+	delete m_root[0];
+	delete m_root[1];
+	m_root[0] = m_root[1] = NULL;
+	m_size = 0;
+}
+
+bool NetworkTree::Add(const NetworkAddress & net)
+{
+	return Add(net, m_size);
+}
+
+bool NetworkTree::Add(const NetworkAddress & net, int value)
+{
+	const unsigned sz = net.m_address.GetSize();
+	if (sz != 4 && sz != 16)
+		return false;
+	BYTE key[16];
+	for (unsigned i = 0; i < sz; ++i)
+		key[i] = net.m_address[i];
+	const unsigned len = net.GetNetmaskLen();
+
+	Node ** link = &m_root[sz == 16 ? 1 : 0];
+	Node * node = NULL;
+	while (true) {
+		node = *link;
+		if (node == NULL) {
+			node = *link = new Node(key, len);
+			break;
+		}
+		const unsigned common = CommonBits(key, node->m_key, (len < node->m_len) ? len : node->m_len);
+		if (common < node->m_len) {
+			// the new network branches off or contains this node, insert a node above it
+			Node * branch = new Node(key, common);
+			branch->m_child[GetBit(node->m_key, common)] = node;
+			*link = branch;
+			if (common < len) {
+				node = branch->m_child[GetBit(key, common)] = new Node(key, len);
+			} else
+				node = branch;
+			break;
+		}
+		if (len == node->m_len) {
+			if (node->m_terminal)
+				return false;
+			break;
+		}
+		link = &node->m_child[GetBit(key, node->m_len)];
+	}
+	node->m_terminal = true;
+	node->m_value = value;
+	node->m_network = net;
+	++m_size;
+	return true;
+}
+
+const NetworkTree::Node * NetworkTree::Find(const PIPSocket::Address & addr, bool longest) const
+{
+	const unsigned sz = addr.GetSize();
+	if (sz != 4 && sz != 16)
+		return NULL;
+	BYTE key[16];
+	for (unsigned i = 0; i < sz; ++i)
+		key[i] = addr[i];
+
+	const Node * found = NULL;
+	const Node * node = m_root[sz == 16 ? 1 : 0];
+	while (node && CommonBits(key, node->m_key, node->m_len) == node->m_len) {
+		if (node->m_terminal && (found == NULL || longest || node->m_value < found->m_value))
+			found = node;
+		if (node->m_len >= sz * 8)
+			break;
+		node = node->m_child[GetBit(key, node->m_len)];
+	}
+	return found;
+}
+
+bool NetworkTree::Contains(const PIPSocket::Address & addr) const
+{
+	return Find(addr, true) != NULL;
+}
+
+bool NetworkTree::FindLongest(const PIPSocket::Address & addr, NetworkAddress & net) const
+{
+	const Node * node = Find(addr, true);
+	if (node)
+		net = node->m_network;
+	return node != NULL;
+}
+
+int NetworkTree::FindFirst(const PIPSocket::Address & addr) const
+{
+	const Node * node = Find(addr, false);
+	return node ? node->m_value : -1;
+}
+
+void NetworkTree::FindAll(const PIPSocket::Address & addr, std::vector<int> & values) const
+{
+	values.clear();
+	const unsigned sz = addr.GetSize();
+	if (sz != 4 && sz != 16)
+		return;
+	BYTE key[16];
+	for (unsigned i = 0; i < sz; ++i)
+		key[i] = addr[i];
+
+	const Node * node = m_root[sz == 16 ? 1 : 0];
+	while (node && CommonBits(key, node->m_key, node->m_len) == node->m_len) {
+		if (node->m_terminal)
+			values.push_back(node->m_value);
+		if (node->m_len >= sz * 8)
+			break;
+		node = node->m_child[GetBit(key, node->m_len)];
+	}
+	std::reverse(values.begin(), values.end());
+}
+
+
+// class RegexCache
+RegexCache::Entry::Entry(const PString & pattern) : m_regex(NULL), m_valid(true)
+{
+	if (pattern.FindOneOf("\\^$.[]|()*+?{}") == P_MAX_INDEX) {
+		m_literal = pattern;
+		return;
+	}
+	m_regex = new PRegularExpression(pattern, PRegularExpression::Extended);
+	if (m_regex->GetErrorCode() != PRegularExpression::NoError) {
+		PTRACE(2, "Error '"<< m_regex->GetErrorText() <<"' compiling regex: " << pattern);
+		SNMP_TRAP(7, SNMPError, Configuration, "Invalid RegEx");
+		m_valid = false;
+	}
+}
+
+RegexCache::Entry::~Entry()
+{
+	delete m_regex;
+}
+
+bool RegexCache::Entry::Match(const PString & str) const
+{
+	if (!m_valid)
+		return false;
+	if (m_regex == NULL)
+		return str.Find(m_literal) != P_MAX_INDEX;
+	// Execute() sets the error code of the expression, threads must not run it at the same time
+	PWaitAndSignal lock(m_mutex);
+	PINDEX pos = 0;
+	return m_regex->Execute(str, pos);
+}
+
+bool RegexCache::Entry::Match(const PString & str, PINDEX & offset, PINDEX & len) const
+{
+	if (!m_valid)
+		return false;
+	if (m_regex == NULL) {
+		offset = str.Find(m_literal);
+		len = m_literal.GetLength();
+		return offset != P_MAX_INDEX;
+	}
+	PWaitAndSignal lock(m_mutex);
+	return m_regex->Execute(str, offset, len);
+}
+
+RegexCache::~RegexCache()
+{
+	DeleteObjectsInMap(m_entries);
+}
+
+const RegexCache::Entry * RegexCache::Find(const PString & pattern)
+{
+	PWaitAndSignal lock(m_mutex);
+	std::map<PString, Entry *>::iterator entry = m_entries.find(pattern);
+	if (entry != m_entries.end())
+		return entry->second;
+	if (m_entries.size() >= (unsigned)MaxEntries)
+		return NULL;
+	return m_entries[pattern] = new Entry(pattern);
+}
+
+bool RegexCache::Compile(const PString & pattern, const Entry ** compiled)
+{
+	if (compiled)
+		*compiled = NULL;
+	if (pattern.IsEmpty())
+		return false;
+	const Entry * entry = Find(pattern);
+	if (entry == NULL)
+		return Entry(pattern).IsValid();
+	if (compiled && entry->IsValid())
+		*compiled = entry;
+	return entry->IsValid();
+}
+
+bool RegexCache::Match(const PString & str, const PString & pattern)
+{
+	if (pattern.IsEmpty())
+		return false;	// nothing matches an empty regex and it triggers a PTLib assertion
+	const Entry * entry = Find(pattern);
+	return entry ? entry->Match(str) : Entry(pattern).Match(str);
+}
+
+unsigned RegexCache::GetSize() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_entries.size();
+}
+
+
 // class Toolkit::RouteTable::RouteEntry
 Toolkit::RouteTable::RouteEntry::RouteEntry(const PString & net) : PIPSocket::RouteEntry(0)
 {
@@ -349,6 +616,15 @@ void Toolkit::RouteTable::InitTable()
 	if (!CreateTable())
 		return;
 
+	// index the route entries, the first entry for a network wins as in a scan of the table
+	for (RouteEntry *entry = rtable_begin; entry != rtable_end; ++entry) {
+		const int r = entry - rtable_begin;
+		const NetworkAddress network(entry->GetNetwork(), entry->GetNetMask());
+		m_routesByNetwork.Add(network, r);
+		m_routesByNetworkOrIP.Add(network, r);
+		m_routesByNetworkOrIP.Add(NetworkAddress(entry->GetDestination()), r);
+	}
+
 	// get Home IPs (all detected IPs or set through config file)
 	std::vector<PIPSocket::Address> home;
 	Toolkit::Instance()->GetGKHome(home);
@@ -441,6 +717,8 @@ PIPSocket::Address Toolkit::RouteTable::GetDefaultIP(unsigned version) const
 
 void Toolkit::RouteTable::ClearTable()
 {
+	m_routesByNetwork.Clear();
+	m_routesByNetworkOrIP.Clear();
 	if (rtable_begin) {
 		for (RouteEntry *r = rtable_begin; r != rtable_end; ++r)
 			r->~RouteEntry();
@@ -452,11 +730,12 @@ void Toolkit::RouteTable::ClearTable()
 void Toolkit::RouteTable::ClearInternalNetworks()
 {
     m_internalnetworks.clear();
+    m_internalTree.Clear();
 }
 
 void Toolkit::RouteTable::AddInternalNetwork(const NetworkAddress & network)
 {
-	if (find(m_internalnetworks.begin(), m_internalnetworks.end(), network) == m_internalnetworks.end())
+	if (m_internalTree.Add(network))
 		m_internalnetworks.push_back(network);
 }
 
@@ -472,25 +751,24 @@ PIPSocket::Address Toolkit::RouteTable::GetLocalAddress(unsigned version) const
 PIPSocket::Address Toolkit::RouteTable::GetLocalAddress(const Address & addr) const
 {
 	// look through internal networks and make sure we don't return the external IP for them
-	for (unsigned j = 0; j < m_internalnetworks.size(); ++j) {
-		if (addr << m_internalnetworks[j]) {
-			// check if internal network is in route table, but don't use the default route
-			RouteEntry *entry = find_if(rtable_begin, rtable_end,
-				bind2nd(mem_fun_ref(&RouteEntry::CompareWithoutMask), &addr));
-			if ((entry != rtable_end) && (entry->GetNetMask() != INADDR_ANY)
+	if (m_internalTree.Contains(addr)) {
+		// check if internal network is in route table, but don't use the default route
+		// (the first entry in the table that CompareWithoutMask() would find)
+		const int r = m_routesByNetworkOrIP.FindFirst(addr);
+		RouteEntry *entry = (r >= 0) ? rtable_begin + r : rtable_end;
+		if ((entry != rtable_end) && (entry->GetNetMask() != INADDR_ANY)
 #ifdef hasIPV6
-				&& (entry->GetNetMask() != in6addr_any)
+			&& (entry->GetNetMask() != in6addr_any)
 #endif
-				) {
-				return entry->GetDestination();
-			}
-			else {
+			) {
+			return entry->GetDestination();
+		}
+		else {
 #ifdef hasIPV6
-				if (addr.GetVersion() == 6)
-					return defAddrV6;
+			if (addr.GetVersion() == 6)
+				return defAddrV6;
 #endif
-				return defAddr;
-			}
+			return defAddr;
 		}
 	}
 
@@ -516,10 +794,10 @@ PIPSocket::Address Toolkit::RouteTable::GetLocalAddress(const Address & addr) co
 			}
 		}
 	}
-	RouteEntry *entry = find_if(rtable_begin, rtable_end,
-		bind2nd(mem_fun_ref(&RouteEntry::CompareWithMask), &addr));
-	if (entry != rtable_end) {
-		return entry->GetDestination();
+	// the first entry in the table that CompareWithMask() would find
+	const int r = m_routesByNetwork.FindFirst(addr);
+	if (r >= 0) {
+		return rtable_begin[r].GetDestination();
 	}
 #ifdef hasIPV6
 	if (addr.GetVersion() == 6) {
@@ -568,6 +846,7 @@ bool Toolkit::RouteTable::CreateRouteTable(const PString & extroute)
 				&& (r_table[i].GetNetMask().AsString() != "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff")) {
 				m_internalnetworks.resize( m_internalnetworks.size() + 1);
 				m_internalnetworks[m_internalnetworks.size() - 1] = NetworkAddress(r_table[i].GetNetwork(), r_table[i].GetNetMask());
+				m_internalTree.Add(m_internalnetworks.back());
 				PTRACE(2, "Internal Network Detected " << m_internalnetworks.back().AsString());
 			}
 		}
@@ -706,7 +985,9 @@ void Toolkit::ProxyCriterion::LoadConfig(PConfig *config)
 	}
 
 	m_internalnetworks.clear();
+	m_internalTree.Clear();
 	m_modeselection.clear();
+	m_modeTree.Clear();
 
 	PStringArray networks(config->GetString(ProxySection, "InternalNetwork", "").Tokenise(" ,;\t", FALSE));
 
@@ -741,6 +1022,10 @@ void Toolkit::ProxyCriterion::LoadConfig(PConfig *config)
 		}
 	}
 
+	// the position of the first entry for a network, as a scan of the vector would find it
+	for (unsigned j = 0; j < m_internalnetworks.size(); ++j)
+		m_internalTree.Add(m_internalnetworks[j], j);
+
 	// read [ModeSelection] section
 	PStringToString mode_rules(config->GetAllKeyValues("ModeSelection"));
 	if (mode_rules.GetSize() > 0) {
@@ -773,6 +1058,10 @@ void Toolkit::ProxyCriterion::LoadConfig(PConfig *config)
 			}
 		}
 	}
+
+	std::map<NetworkAddress, NetworkModes>::const_iterator iter = m_modeselection.begin();
+	for (; iter != m_modeselection.end(); ++iter)
+		m_modeTree.Add(iter->first);
 }
 
 int Toolkit::ProxyCriterion::ToRoutingMode(const PCaselessString & mode) const
@@ -791,15 +1080,7 @@ int Toolkit::ProxyCriterion::ToRoutingMode(const PCaselessString & mode) const
 NetworkAddress Toolkit::ProxyCriterion::FindModeRule(const NetworkAddress & ip) const
 {
 	NetworkAddress bestmatch;
-
-	std::map<NetworkAddress, NetworkModes>::const_iterator iter = m_modeselection.begin();
-	while (iter != m_modeselection.end()) {
-		if ((ip << iter->first) && (iter->first.GetNetmaskLen() >= bestmatch.GetNetmaskLen())) {
-			bestmatch = iter->first;
-		}
-		++iter;
-	}
-
+	m_modeTree.FindLongest(ip.m_address, bestmatch);
 	return bestmatch;
 }
 
@@ -859,14 +1140,8 @@ int Toolkit::ProxyCriterion::SelectRoutingMode(const Address & ip1, const Addres
 int Toolkit::ProxyCriterion::IsInternal(const Address & ip) const
 {
 	// Return the network Id. Addresses may be on different internal networks
-	int retval = 0;
-	std::vector<NetworkAddress>::const_iterator i = m_internalnetworks.begin();
-	while (i != m_internalnetworks.end()) {
-		retval++;
-		if (ip << *i++)
-			return retval;
-	}
-	return 0;
+	const int first = m_internalTree.FindFirst(ip);
+	return (first >= 0) ? first + 1 : 0;
 }
 
 // class Toolkit::RewriteTool
@@ -879,6 +1154,67 @@ static const char *AssignedGatekeeperSection = "RasSrv::AssignedGatekeeper";
 #endif
 static const char *ModeVendorSection = "ModeVendorSelection";
 
+namespace {
+
+// the first positive rule and the '!' rules that match, visitor for PrefixTrie::Match()
+struct FirstRewriteRule {
+	FirstRewriteRule() : m_rule(P_MAX_INDEX), m_len(0) { }
+	void operator()(const PString &, PINDEX rule, int len)
+	{
+		if (len < 0)
+			m_negative.push_back(rule);
+		else if (rule < m_rule) {
+			m_rule = rule;
+			m_len = len;
+		}
+	}
+
+	PINDEX m_rule;
+	int m_len;
+	std::vector<PINDEX> m_negative;
+};
+
+} // namespace
+
+void Toolkit::RewriteIndex::Add(const PString & prefix)
+{
+	const PINDEX rule = m_size++;
+	// a later rule with the same prefix is never reached
+	if (m_prefixes.Insert(prefix, rule) && prefix[0] == '!')
+		m_negative.push_back(std::make_pair(rule, prefix));
+}
+
+void Toolkit::RewriteIndex::Clear()
+{
+	m_prefixes.Clear();
+	m_negative.clear();
+	m_size = 0;
+}
+
+PINDEX Toolkit::RewriteIndex::Find(const char * s, int & len, bool equal) const
+{
+	FirstRewriteRule first;
+	m_prefixes.Match(s, first);
+	len = first.m_len;
+	if (m_negative.empty())
+		return first.m_rule;
+
+	// the first '!' rule that doesn't match, only the few that match are skipped
+	std::sort(first.m_negative.begin(), first.m_negative.end());
+	std::vector<PINDEX>::const_iterator matched = first.m_negative.begin();
+	for (std::vector<std::pair<PINDEX, PString> >::const_iterator it = m_negative.begin();
+			it != m_negative.end() && it->first < first.m_rule; ++it) {
+		if (matched != first.m_negative.end() && *matched == it->first) {
+			++matched;
+			if (!(equal && it->second == s))
+				continue;
+		}
+		len = 0;
+		return it->first;
+	}
+	return first.m_rule;
+}
+
 void Toolkit::RewriteData::AddSection(PConfig * config, const PString & section)
 {
 	PStringToString cfgs(config->GetAllKeyValues(section));
@@ -911,6 +1247,10 @@ void Toolkit::RewriteData::AddSection(PConfig * config, const PString & section)
 				::new(m_RewriteKey + i) PString(iter->first);
 				::new(m_RewriteValue + i) PString(iter->second);
 			}
+
+			m_index.Clear();
+			for (PINDEX i = 0; i < m_size; ++i)
+				m_index.Add(m_RewriteKey[i]);
 		}
 	}
 }
@@ -989,38 +1329,34 @@ bool Toolkit::RewriteTool::RewritePString(PString & s) const
 	if (strncmp(s, m_RewriteFastmatch, m_RewriteFastmatch.GetLength()) != 0)
 		return changed;
 
-	PString t;
-	for (PINDEX i = 0; i < m_Rewrite->Size(); ++i) {
+	// the first rule in the order of the keys, the keys are compiled into a trie
+	int len = 0;
+	const PINDEX i = m_Rewrite->Index().Find(s, len, true);
+	if (i != P_MAX_INDEX) {
 		const char *prefix = m_Rewrite->Key(i);
 		if (prefix == s){
 			s = m_Rewrite->Value(i);
 			return true;
 		}
-		const int len = MatchPrefix(s, prefix);
-		// try a prefix match through all keys
-		if (len > 0 || (len == 0 && prefix[0] == '!')) {
-			// Rewrite to #t#. Append the suffix, too.
-			// old:  01901234999
-			//               999 Suffix
-			//       0190        Fastmatch
-			//       01901234    prefix, Config-Rule: 01901234=0521321
-			// new:  0521321999
-
-			const char *newprefix = m_Rewrite->Value(i);
-
-			PString result;
-			if (len > 0) {
-				PString unused;
-				result = RewriteString(s, prefix, newprefix, unused);
-			} else
-				result = newprefix + s;
-
-			PTRACE(2, "\tRewritePString: " << s << " to " << result);
-			s = result;
-			changed = true;
-
-			break;
-		}
+		// Rewrite to #t#. Append the suffix, too.
+		// old:  01901234999
+		//               999 Suffix
+		//       0190        Fastmatch
+		//       01901234    prefix, Config-Rule: 01901234=0521321
+		// new:  0521321999
+
+		const char *newprefix = m_Rewrite->Value(i);
+
+		PString result;
+		if (len > 0) {
+			PString unused;
+			result = RewriteString(s, prefix, newprefix, unused);
+		} else
+			result = newprefix + s;
+
+		PTRACE(2, "\tRewritePString: " << s << " to " << result);
+		s = result;
+		changed = true;
 	}
 
 	return changed;
@@ -1046,49 +1382,35 @@ bool Toolkit::GWRewriteTool::RewritePString(const PString & gw, bool direction,
 	if (gw_entry == NULL)
 		return false;
 
-	std::vector<pair<PString, PString> >::iterator rule_iterator = direction
-		? gw_entry->m_entry_data.first.begin() : gw_entry->m_entry_data.second.begin();
-	std::vector<pair<PString, PString> >::iterator end_iterator = direction
-		? gw_entry->m_entry_data.first.end() : gw_entry->m_entry_data.second.end();
-
-	PString key, value;
-	for (; rule_iterator != end_iterator; ++rule_iterator) {
-		key = (*rule_iterator).first;
+	// the first rule in the order of the keys, the keys are compiled into a trie
+	const int dir = direction ? 0 : 1;
+	int len = 0;
+	const PINDEX i = gw_entry->m_index[dir].Find(data, len, false);
+	if (i == P_MAX_INDEX)
+		return false;
 
-		bool postdialmatch = false;
-		if (key.Find("I") != P_MAX_INDEX) {
-			postdialmatch = true;
-			key.Replace("I", ".", true);
+	const PString & key = gw_entry->m_compiled[dir][i].first;
+	const PString & configKey = direction
+		? gw_entry->m_entry_data.first[i].first : gw_entry->m_entry_data.second[i].first;
+	const bool postdialmatch = (configKey.Find('I') != P_MAX_INDEX);
+
+	// Start rewrite
+	PString value = gw_entry->m_compiled[dir][i].second;
+	PString postdialdigits;
+	if (len > 0) {
+		value = RewriteString(data, key, value, postdialdigits, postdialmatch);
+		if (call && postdialmatch && !postdialdigits.IsEmpty()) {
+			call->SetPostDialDigits(postdialdigits);
 		}
+	} else
+		value = value + data;
 
-		const int len = MatchPrefix(data, key);
-		if (len > 0 || (len == 0 && key[0] == '!')) {
-			// Start rewrite
-			value = (*rule_iterator).second;
-
-			PString postdialdigits;
-			if (postdialmatch) {
-				value.Replace("P", ".", true);
-			}
-
-			if (len > 0) {
-				value = RewriteString(data, key, value, postdialdigits, postdialmatch);
-				if (call && postdialmatch && !postdialdigits.IsEmpty()) {
-					call->SetPostDialDigits(postdialdigits);
-				}
-			} else
-				value = value + data;
-
-			// Log
-			PTRACE(2, "\tGWRewriteTool::RewritePString: " << data << " to " << value << " post dial digits=" << postdialdigits);
-
-			// Finish rewrite
-			data = value;
-			return true;
-		}
-	}
+	// Log
+	PTRACE(2, "\tGWRewriteTool::RewritePString: " << data << " to " << value << " post dial digits=" << postdialdigits);
 
-	return false;
+	// Finish rewrite
+	data = value;
+	return true;
 }
 
 void Toolkit::GWRewriteTool::PrintData()
@@ -1188,6 +1510,21 @@ void Toolkit::GWRewriteTool::LoadConfig(PConfig * config)
 			gw_entry->m_entry_data.first = sorted_in_strings;
 			gw_entry->m_entry_data.second = sorted_out_strings;
 
+			// Compile the rules for the lookup, 'I' marks the post dial digits
+			for (int dir = 0; dir < 2; ++dir) {
+				const std::vector<std::pair<PString, PString> > & rules = dir == 0
+					? gw_entry->m_entry_data.first : gw_entry->m_entry_data.second;
+				for (unsigned j = 0; j < rules.size(); ++j) {
+					rule = rules[j];
+					if (rule.first.Find("I") != P_MAX_INDEX) {
+						rule.first.Replace("I", ".", true);
+						rule.second.Replace("P", ".", true);
+					}
+					gw_entry->m_compiled[dir].push_back(rule);
+					gw_entry->m_index[dir].Add(rule.first);
+				}
+			}
+
 			// Add to PDictionary hash table
 			m_GWRewrite.Insert(key, gw_entry);
 		}
@@ -1919,7 +2256,7 @@ PConfig* Toolkit::ReloadConfig()
 
 	PString removeH235Call = m_Config->GetString(RoutedSec, "RemoveH235Call", "0");
 	m_alwaysRemoveH235Tokens = (removeH235Call.AsUnsigned() == 1);
-	m_removeH235TokensfromNetwork.clear();
+	m_removeH235TokensfromNetwork.Clear();
 	if (removeH235Call.GetLength() >= 7) {
 		PStringArray networks = removeH235Call.Tokenise(",", FALSE);
 		for (PINDEX n = 0; n < networks.GetSize(); ++n) {
@@ -1931,7 +2268,7 @@ PConfig* Toolkit::ReloadConfig()
                 }
             }
 			NetworkAddress net = NetworkAddress(networks[n]);
-			m_removeH235TokensfromNetwork.push_back(net);
+			m_removeH235TokensfromNetwork.Add(net);
 		}
 	}
 #ifdef HAS_H235_MEDIA
@@ -2065,21 +2402,18 @@ void Toolkit::LoadReasonMap(PConfig * cfg)
 
 }
 
+namespace {
+RegexCache g_regexCache;
+}
+
 bool Toolkit::MatchRegex(const PString & str, const PString & regexStr)
 {
-	if (regexStr.IsEmpty())
-		return false;	// nothing matches an empty regex and it triggers a PTLib assertion
-	PINDEX pos = 0;
-	PRegularExpression regex(regexStr, PRegularExpression::Extended);
-	if(regex.GetErrorCode() != PRegularExpression::NoError) {
-		PTRACE(2, "Error '"<< regex.GetErrorText() <<"' compiling regex: " << regexStr);
-		SNMP_TRAP(7, SNMPError, Configuration, "Invalid RegEx");
-		return FALSE;
-	}
-	if(!regex.Execute(str, pos)) {
-		return FALSE;
-	}
-	return TRUE;
+	return g_regexCache.Match(str, regexStr);
+}
+
+bool Toolkit::CompileRegex(const PString & regexStr, const RegexCache::Entry ** compiled)
+{
+	return g_regexCache.Compile(regexStr, compiled);
 }
 
 #if HAS_DATABASE
@@ -3591,11 +3925,7 @@ bool Toolkit::RemoveH235TokensFrom(const PIPSocket::Address & addr) const
 {
 	if (m_alwaysRemoveH235Tokens)
 		return true;
-	for (unsigned i = 0; i < m_removeH235TokensfromNetwork.size(); ++i) {
-		if (addr << m_removeH235TokensfromNetwork[i])
-			return true;
-	}
-	return false;
+	return m_removeH235TokensfromNetwork.Contains(addr);
 }
 
 bool Toolkit::isBehindNAT(PIPSocket::Address & externalIP) const
@@ -21,6 +21,7 @@
 #include "singleton.h"
 #include "config.h"
 #include "RasTbl.h"
+#include "prefixtrie.h"
 #ifdef HAS_H46023
 #include "transports.h"
 #endif
@@ -106,6 +107,100 @@ bool operator==(const PIPSocket::Address & addr, const NetworkAddress & net);
 /// @return	True if the given address is contained withing this network
 bool operator<<(const PIPSocket::Address & addr, const NetworkAddress & net);
 
+/** A set of IPv4 and IPv6 networks, built once when the config is loaded
+    and only read afterwards. The networks are kept in a binary radix tree
+    with path compression per IP version, so a lookup follows the bits of
+    the address instead of testing every network. Each network has a value,
+    by default its position in the order the networks were added.
+*/
+class NetworkTree {
+public:
+	NetworkTree();
+	~NetworkTree();
+
+	/// @return	false if the network is already in the tree, the first value is kept
+	bool Add(const NetworkAddress & net);
+	bool Add(const NetworkAddress & net, int value);
+	void Clear();
+
+	bool IsEmpty() const { return m_size == 0; }
+	unsigned GetSize() const { return m_size; }
+
+	/// @return	True if one of the networks contains the address
+	bool Contains(const PIPSocket::Address & addr) const;
+	/// @return	True if a network contains the address, #net# is the one with the longest netmask
+	bool FindLongest(const PIPSocket::Address & addr, NetworkAddress & net) const;
+	/// @return	the smallest value of the networks that contain the address, -1 if none
+	int FindFirst(const PIPSocket::Address & addr) const;
+	/// the values of all networks that contain the address, the longest netmask first
+	void FindAll(const PIPSocket::Address & addr, std::vector<int> & values) const;
+
+private:
+	NetworkTree(const NetworkTree &);
+	NetworkTree & operator=(const NetworkTree &);
+
+	struct Node;
+	/// @return	the node of the longest match or with the smallest value, NULL if none
+	const Node * Find(const PIPSocket::Address & addr, bool longest) const;
+
+	Node * m_root[2];	// IPv4, IPv6
+	unsigned m_size;
+};
+
+/** Compiled regular expressions shared by all threads, so the patterns from
+    the config and the status port filters are compiled on their first use
+    and not on every match. A pattern without special characters is matched
+    as a plain substring, in linear time. The entries are kept until shutdown,
+    when the cache is full new patterns are compiled for each match again.
+*/
+class RegexCache {
+public:
+	/// a compiled pattern, can be kept by the caller while the cache exists
+	class Entry {
+	public:
+		Entry(const PString & pattern);
+		~Entry();
+
+		bool IsValid() const { return m_valid; }
+		bool Match(const PString & str) const;
+		/// like Match(), also returns the position and length of the first match
+		bool Match(const PString & str, PINDEX & offset, PINDEX & len) const;
+
+	private:
+		Entry(const Entry &);
+		Entry & operator=(const Entry &);
+
+		PString m_literal;	// the pattern if it has no special characters
+		PRegularExpression * m_regex;
+		bool m_valid;
+		mutable PMutex m_mutex;	// Execute() stores its error code in the expression
+	};
+
+	RegexCache() { }
+	~RegexCache();
+
+	/** @param compiled	set to the cached entry, NULL if the cache is full
+	    @return	false if the pattern is empty or doesn't compile
+	*/
+	bool Compile(const PString & pattern, const Entry ** compiled = NULL);
+
+	/// @return	true if the pattern matches #str#, false if not or if it doesn't compile
+	bool Match(const PString & str, const PString & pattern);
+
+	unsigned GetSize() const;
+
+private:
+	RegexCache(const RegexCache &);
+	RegexCache & operator=(const RegexCache &);
+
+	/// @return	the entry of the pattern, NULL if it's new and the cache is full
+	const Entry * Find(const PString & pattern);
+
+	enum { MaxEntries = 10000 };
+	std::map<PString, Entry *> m_entries;
+	mutable PMutex m_mutex;
+};
+
 #ifdef H323_H350
 class H350_Session;
 #endif
@@ -163,6 +258,11 @@ class Toolkit : public Singleton<Toolkit>
 #endif
 
 		std::vector<NetworkAddress> m_internalnetworks;
+		NetworkTree m_internalTree;
+		// the route entries with their position in the table: by network and
+		// for CompareWithoutMask() also by destination IP
+		NetworkTree m_routesByNetwork;
+		NetworkTree m_routesByNetworkOrIP;
     	bool DynExtIP;
 		PString ExtIP;
 	};
@@ -198,8 +298,10 @@ class Toolkit : public Singleton<Toolkit>
 
 		bool m_enable;
 		std::vector<NetworkAddress> m_internalnetworks;
+		NetworkTree m_internalTree;	// the position in m_internalnetworks for each network
 		// mode selection for networks
 		std::map<NetworkAddress, NetworkModes> m_modeselection;
+		NetworkTree m_modeTree;	// the networks of m_modeselection
 	};
 
 	int SelectRoutingMode(const PIPSocket::Address & ip1, const PIPSocket::Address & ip2) const
@@ -208,6 +310,34 @@ class Toolkit : public Singleton<Toolkit>
 	bool IsInternal(const PIPSocket::Address & ip1) const
 	{ return (m_ProxyCriterion.IsInternal(ip1) > 0); }
 
+	/** Finds the first of a list of rewrite rules that applies to a number:
+	    a rule applies if MatchPrefix() finds its prefix, a '!' rule if it
+	    doesn't find it. The prefixes are compiled into a trie when the rules
+	    are loaded, so a lookup doesn't test every rule.
+	*/
+	class RewriteIndex {
+	public:
+		RewriteIndex() : m_size(0) { }
+
+		/// append the prefix of the next rule, rules are numbered from 0
+		void Add(const PString & prefix);
+		void Clear();
+
+		/** @param equal	a '!' rule with a prefix equal to #s# applies as well
+		    @param len	the result of MatchPrefix() for the rule, 0 for a '!' rule
+		    @return	the number of the first rule that applies, P_MAX_INDEX if none
+		*/
+		PINDEX Find(const char * s, int & len, bool equal) const;
+
+	private:
+		RewriteIndex(const RewriteIndex &);
+		RewriteIndex & operator=(const RewriteIndex &);
+
+		PrefixTrie<PINDEX> m_prefixes;
+		std::vector<std::pair<PINDEX, PString> > m_negative;	// the '!' rules in order
+		PINDEX m_size;
+	};
+
 	// Since PStringToString is not thread-safe,
 	// I write this small class to replace that
 	class RewriteData {
@@ -218,10 +348,13 @@ class Toolkit : public Singleton<Toolkit>
 		PINDEX Size() const { return m_size; }
 		const PString & Key(PINDEX i) const { return m_RewriteKey[i]; }
 		const PString & Value(PINDEX i) const { return m_RewriteValue[i]; }
+		/// the keys in the order above, for prefix rewriting
+		const RewriteIndex & Index() const { return m_index; }
 
 	private:
 		PString *m_RewriteKey, *m_RewriteValue;
 		PINDEX m_size;
+		RewriteIndex m_index;
 	};
 
 	class RewriteTool {
@@ -462,6 +595,10 @@ class Toolkit : public Singleton<Toolkit>
 		PCLASSINFO(GWRewriteEntry, PObject);
 		public:
 			std::pair<std::vector<std::pair<PString,PString> >,std::vector<std::pair<PString,PString> > > m_entry_data;
+			// the in and out rules as they are applied, with 'I' in the key and
+			// for post dial rules 'P' in the value replaced by '.'
+			std::vector<std::pair<PString,PString> > m_compiled[2];
+			RewriteIndex m_index[2];
 	};
 
 
@@ -585,6 +722,12 @@ class Toolkit : public Singleton<Toolkit>
 	 */
 	static bool MatchRegex(const PString &str, const PString & regexStr);
 
+	/** compile a regex into the cache used by #MatchRegex#, eg. when a filter is added
+	 * @param compiled set to the cached regex, which the filter can match without a lookup, NULL if the cache is full
+	 * @return FALSE if the regex is empty or invalid
+	 */
+	static bool CompileRegex(const PString & regexStr, const RegexCache::Entry ** compiled = NULL);
+
 	/** returns the #bool# that #str# represents.
 	 * Case insensitive, "t...", "y...", "a...", "1" are #TRUE#, all other values are #FALSE#.
 	 */
@@ -787,7 +930,7 @@ private:
 	std::map<unsigned, unsigned> m_sentCauseMap;
 	bool m_causeCodeTranslationActive;	// globally _or_ per endpoint
 	bool m_alwaysRemoveH235Tokens;
-	std::vector<NetworkAddress> m_removeH235TokensfromNetwork;
+	NetworkTree m_removeH235TokensfromNetwork;
 #ifdef HAS_H235_MEDIA
 	bool m_H235HalfCallMediaEnabled;
 	bool m_H235HalfCallMediaKeyUpdatesEnabled;
@@ -14,7 +14,10 @@
 
 #include "config.h"
 #include "Toolkit.h"
+#include "h323util.h"
 #include "gtest/gtest.h"
+#include <cstdlib>
+#include <iostream>
 
 namespace {
 
@@ -22,6 +25,68 @@ class ToolkitTest : public ::testing::Test {
 protected:
 	ToolkitTest() { }
 
+	// a random rewrite rule, the value has no more dots than the key
+	static std::pair<PString, PString> RandomRewriteRule(bool postDial)
+	{
+		static const char chars[] = "0123456789.%I";
+		// short '!' rules, longer ones would apply to nearly every number
+		PString key = (rand() % 40 == 0) ? "!" : "";
+		unsigned dots = 0;
+		const unsigned len = 1 + rand() % (key.IsEmpty() ? 6 : 2);
+		for (unsigned i = 0; i < len; ++i) {
+			const char c = chars[rand() % ((i > 0 && rand() % 4 == 0) ? (postDial ? 13 : 12) : 10)];
+			if (c == '.' || c == 'I')
+				++dots;
+			key += c;
+		}
+		PString value(PString::Unsigned, rand() % 1000);
+		const bool postDialKey = (key.Find('I') != P_MAX_INDEX);
+		for (unsigned i = 0; i < dots && i < 2 && !(postDialKey && key.Find('.') != P_MAX_INDEX); ++i)
+			value += postDialKey ? "P" : ".";
+		return std::make_pair(key, value);
+	}
+
+	static PString RandomNumber()
+	{
+		PString number;
+		const unsigned len = 1 + rand() % 12;
+		for (unsigned i = 0; i < len; ++i)
+			number += (char)('0' + rand() % 10);
+		return number;
+	}
+
+	// a random network, most of them under a few common prefixes so they nest
+	static NetworkAddress RandomNetwork(bool ipv6)
+	{
+		const unsigned sz = ipv6 ? 16 : 4;
+		const unsigned len = ipv6 ? 16 + rand() % 113 : 8 + rand() % 25;
+		BYTE addr[16], mask[16];
+		for (unsigned i = 0; i < sz; ++i) {
+			addr[i] = (BYTE)rand();
+			const unsigned bits = (len > i * 8) ? len - i * 8 : 0;
+			mask[i] = (bits >= 8) ? 0xff : (BYTE)(0xff << (8 - bits));
+		}
+		addr[0] = ipv6 ? 0x20 : (BYTE)(10 + rand() % 3);
+		if (ipv6)
+			addr[1] = (BYTE)(rand() % 3);
+		return NetworkAddress(PIPSocket::Address(sz, addr), PIPSocket::Address(sz, mask));
+	}
+
+	// a random address, half of them inside one of the networks
+	static PIPSocket::Address RandomAddress(const std::vector<NetworkAddress> & networks)
+	{
+		const NetworkAddress & net = networks[rand() % networks.size()];
+		const unsigned sz = net.m_address.GetSize();
+		BYTE addr[16];
+		for (unsigned i = 0; i < sz; ++i)
+			addr[i] = (i * 8 < net.GetNetmaskLen() && rand() % 2) ? net.m_address[i] : (BYTE)rand();
+		if (rand() % 2) {
+			for (unsigned i = 0; i < net.GetNetmaskLen() / 8; ++i)
+				addr[i] = net.m_address[i];
+		}
+		return PIPSocket::Address(sz, addr);
+	}
+
 	NetworkAddress na;
 	NetworkAddress na2;
 	NetworkAddress na6;
@@ -43,4 +108,292 @@ TEST_F(ToolkitTest, NetworkAddress) {
 	EXPECT_STREQ("2001:db8:85a3:8d3:1319:8a2e:370:7344/128", na6.AsString());
 }
 
+TEST_F(ToolkitTest, RewriteE164) {
+	srand(1234);
+	// [RasSrv::RewriteE164] keys are tried longest first, like RewriteData sorts them
+	std::map<PString, PString, pstr_prefix_lesser> config;
+	while (config.size() < 3000)
+		config.insert(RandomRewriteRule(false));
+	std::vector<std::pair<PString, PString> > rules(config.rbegin(), config.rend());
+	Toolkit::RewriteIndex index;
+	for (unsigned i = 0; i < rules.size(); ++i)
+		index.Add(rules[i].first);
+
+	unsigned positive = 0, negative = 0;
+	for (unsigned n = 0; n < 20000; ++n) {
+		const PString number = (n == 0) ? rules.front().first : RandomNumber();
+
+		// the rewrite before the rules were compiled
+		PString expected = number;
+		for (unsigned i = 0; i < rules.size(); ++i) {
+			const char * prefix = rules[i].first;
+			if (rules[i].first == number) {
+				expected = rules[i].second;
+				break;
+			}
+			const int len = MatchPrefix(number, prefix);
+			if (len > 0 || (len == 0 && prefix[0] == '!')) {
+				PString unused;
+				expected = (len > 0) ? RewriteString(number, prefix, rules[i].second, unused) : rules[i].second + number;
+				break;
+			}
+		}
+
+		PString result = number;
+		int len = 0;
+		const PINDEX i = index.Find(number, len, true);
+		if (i != P_MAX_INDEX) {
+			PString unused;
+			if (rules[i].first == number)
+				result = rules[i].second;
+			else
+				result = (len > 0) ? RewriteString(number, rules[i].first, rules[i].second, unused) : rules[i].second + number;
+			if (len == 0)
+				++negative;
+			else
+				++positive;
+		}
+		EXPECT_EQ(expected, result) << number;
+	}
+	EXPECT_GT(positive, 1000u);
+	EXPECT_GT(negative, 1000u);
+}
+
+TEST_F(ToolkitTest, GWRewriteE164) {
+	srand(5678);
+	// [RasSrv::GWRewriteE164] rules of one direction are tried in reverse alphabetical order
+	std::map<PString, PString> config;
+	while (config.size() < 2000)
+		config.insert(RandomRewriteRule(true));
+	std::vector<std::pair<PString, PString> > rules(config.rbegin(), config.rend());
+	std::vector<std::pair<PString, PString> > compiled;
+	Toolkit::RewriteIndex index;
+	for (unsigned i = 0; i < rules.size(); ++i) {
+		std::pair<PString, PString> rule = rules[i];
+		if (rule.first.Find("I") != P_MAX_INDEX) {
+			rule.first.Replace("I", ".", true);
+			rule.second.Replace("P", ".", true);
+		}
+		compiled.push_back(rule);
+		index.Add(rule.first);
+	}
+
+	unsigned postDial = 0;
+	PTime start;
+	std::vector<PString> numbers;
+	for (unsigned n = 0; n < 20000; ++n)
+		numbers.push_back(RandomNumber());
+
+	// the rewrite before the rules were compiled
+	std::vector<PString> expected, expectedDigits;
+	for (unsigned n = 0; n < numbers.size(); ++n) {
+		PString data = numbers[n], postdialdigits;
+		for (unsigned i = 0; i < rules.size(); ++i) {
+			PString key = rules[i].first;
+			bool postdialmatch = false;
+			if (key.Find("I") != P_MAX_INDEX) {
+				postdialmatch = true;
+				key.Replace("I", ".", true);
+			}
+			const int len = MatchPrefix(data, key);
+			if (len > 0 || (len == 0 && key[0] == '!')) {
+				PString value = rules[i].second;
+				if (postdialmatch)
+					value.Replace("P", ".", true);
+				data = (len > 0) ? RewriteString(data, key, value, postdialdigits, postdialmatch) : value + data;
+				break;
+			}
+		}
+		expected.push_back(data);
+		expectedDigits.push_back(postdialdigits);
+	}
+	const PTimeInterval scanTime = PTime() - start;
+
+	start = PTime();
+	std::vector<PString> results, resultDigits;
+	for (unsigned n = 0; n < numbers.size(); ++n) {
+		PString data = numbers[n], postdialdigits;
+		int len = 0;
+		const PINDEX i = index.Find(data, len, false);
+		if (i != P_MAX_INDEX) {
+			const bool postdialmatch = (rules[i].first.Find('I') != P_MAX_INDEX);
+			data = (len > 0) ? RewriteString(data, compiled[i].first, compiled[i].second, postdialdigits, postdialmatch)
+				: compiled[i].second + data;
+		}
+		results.push_back(data);
+		resultDigits.push_back(postdialdigits);
+	}
+	const PTimeInterval trieTime = PTime() - start;
+
+	for (unsigned n = 0; n < numbers.size(); ++n) {
+		EXPECT_EQ(expected[n], results[n]) << numbers[n];
+		EXPECT_EQ(expectedDigits[n], resultDigits[n]) << numbers[n];
+		if (!resultDigits[n].IsEmpty())
+			++postDial;
+	}
+	EXPECT_GT(postDial, 0u);
+	std::cout << "[          ] " << rules.size() << " gateway rewrite rules, " << numbers.size() << " numbers: scan "
+		<< scanTime.GetMilliSeconds() << " ms, trie " << trieTime.GetMilliSeconds() << " ms" << std::endl;
+}
+
 }  // namespace
+
+TEST_F(ToolkitTest, NetworkTree) {
+	NetworkTree tree;
+	EXPECT_TRUE(tree.IsEmpty());
+	EXPECT_FALSE(tree.Contains(PIPSocket::Address("10.1.2.3")));
+	EXPECT_TRUE(tree.Add(NetworkAddress("10.0.0.0/8")));
+	EXPECT_TRUE(tree.Add(NetworkAddress("10.1.0.0/16")));
+	EXPECT_FALSE(tree.Add(NetworkAddress("10.1.2.3/16")));
+	EXPECT_TRUE(tree.Add(NetworkAddress("2001:db8::/32")));
+	EXPECT_EQ(3u, tree.GetSize());
+	EXPECT_TRUE(tree.Contains(PIPSocket::Address("10.2.3.4")));
+	EXPECT_FALSE(tree.Contains(PIPSocket::Address("11.1.2.3")));
+	EXPECT_TRUE(tree.Contains(PIPSocket::Address("2001:db8::1")));
+	EXPECT_FALSE(tree.Contains(PIPSocket::Address("2001:db9::1")));
+	NetworkAddress net;
+	EXPECT_TRUE(tree.FindLongest(PIPSocket::Address("10.1.2.3"), net));
+	EXPECT_STREQ("10.1.0.0/16", net.AsString());
+	EXPECT_EQ(0, tree.FindFirst(PIPSocket::Address("10.1.2.3")));
+	EXPECT_EQ(-1, tree.FindFirst(PIPSocket::Address("192.168.1.1")));
+	std::vector<int> values;
+	tree.FindAll(PIPSocket::Address("10.1.2.3"), values);
+	ASSERT_EQ(2u, values.size());
+	EXPECT_EQ(1, values[0]);
+	EXPECT_EQ(0, values[1]);
+	tree.FindAll(PIPSocket::Address("192.168.1.1"), values);
+	EXPECT_TRUE(values.empty());
+	tree.Clear();
+	EXPECT_FALSE(tree.Contains(PIPSocket::Address("10.2.3.4")));
+}
+
+TEST_F(ToolkitTest, NetworkTreeLookup) {
+	srand(4321);
+	// compare with a scan of the networks, as the InternalNetwork, ModeSelection and route table lookups did
+	std::vector<NetworkAddress> networks;
+	NetworkTree tree;
+	for (int i = 0; i < 10000; ++i) {
+		networks.push_back(RandomNetwork(rand() % 2 == 0));
+		tree.Add(networks.back(), i);
+	}
+	std::vector<PIPSocket::Address> addresses;
+	for (unsigned n = 0; n < 20000; ++n)
+		addresses.push_back(RandomAddress(networks));
+
+	PTime start;
+	std::vector<int> expectedFirst;
+	std::vector<NetworkAddress> expectedLongest;
+	for (unsigned n = 0; n < addresses.size(); ++n) {
+		int first = -1;
+		NetworkAddress longest;
+		for (unsigned j = 0; j < networks.size(); ++j) {
+			if (addresses[n] << networks[j]) {
+				if (first < 0)
+					first = j;
+				if (networks[j].GetNetmaskLen() > longest.GetNetmaskLen())
+					longest = networks[j];
+			}
+		}
+		expectedFirst.push_back(first);
+		expectedLongest.push_back(longest);
+	}
+	const PTimeInterval scanTime = PTime() - start;
+
+	start = PTime();
+	std::vector<int> first;
+	std::vector<NetworkAddress> longest;
+	for (unsigned n = 0; n < addresses.size(); ++n) {
+		first.push_back(tree.FindFirst(addresses[n]));
+		NetworkAddress net;
+		tree.FindLongest(addresses[n], net);
+		longest.push_back(net);
+	}
+	const PTimeInterval treeTime = PTime() - start;
+
+	unsigned matches = 0;
+	for (unsigned n = 0; n < addresses.size(); ++n) {
+		EXPECT_EQ(expectedFirst[n], first[n]) << addresses[n];
+		EXPECT_EQ(expectedFirst[n] >= 0, tree.Contains(addresses[n])) << addresses[n];
+		if (expectedFirst[n] >= 0) {
+			EXPECT_TRUE(expectedLongest[n] == longest[n]) << addresses[n];
+			++matches;
+		}
+	}
+	EXPECT_GT(matches, addresses.size() / 4);
+
+	std::cout << "[          ] " << addresses.size() << " addresses, " << networks.size() << " networks: scan "
+		<< scanTime.GetMilliSeconds() << " ms, radix tree " << treeTime.GetMilliSeconds() << " ms" << std::endl;
+}
+
+TEST_F(ToolkitTest, RegexCache) {
+	RegexCache cache;
+	EXPECT_TRUE(cache.Match("RCF|10.0.0.1:1719|alias_100;", "alias_100;"));
+	EXPECT_FALSE(cache.Match("RCF|10.0.0.1:1719|alias_101;", "alias_100;"));
+	EXPECT_TRUE(cache.Match("CDR|12|", "^CDR\\|[0-9]+\\|"));
+	EXPECT_FALSE(cache.Match("xCDR|12|", "^CDR\\|[0-9]+\\|"));
+	EXPECT_TRUE(cache.Compile("^RCF"));
+	EXPECT_FALSE(cache.Compile("(RCF"));
+	EXPECT_FALSE(cache.Match("(RCF", "(RCF"));
+	EXPECT_FALSE(cache.Compile(""));
+	EXPECT_FALSE(cache.Match("RCF", ""));
+	const RegexCache::Entry * compiled = NULL;
+	EXPECT_TRUE(cache.Compile("^ACF\\|", &compiled));
+	ASSERT_TRUE(compiled != NULL);
+	EXPECT_TRUE(compiled->Match("ACF|1|"));
+	EXPECT_FALSE(compiled->Match("RCF|1|"));
+	EXPECT_FALSE(cache.Compile("(ACF", &compiled));
+	EXPECT_TRUE(compiled == NULL);
+	EXPECT_EQ(6u, cache.GetSize());
+}
+
+TEST_F(ToolkitTest, StatusFilterRegex) {
+	srand(8642);
+	// 50 status port filters, half of them plain strings
+	std::vector<PString> filters;
+	for (unsigned i = 0; i < 25; ++i) {
+		filters.push_back("alias_" + PString(PString::Unsigned, 100 + i) + ";");
+		filters.push_back("^(RCF|ACF|CDR)\\|.*192\\.168\\.[0-9]+\\." + PString(PString::Unsigned, i) + ":");
+	}
+	// one second of events at 1000 events/s
+	static const char * const types[] = { "RCF", "ACF", "ARJ", "DCF", "CDR", "URQ" };
+	std::vector<PString> events;
+	for (unsigned n = 0; n < 1000; ++n)
+		events.push_back(PString(types[rand() % PARRAYSIZE(types)]) + "|192.168." + PString(PString::Unsigned, rand() % 256)
+			+ "." + PString(PString::Unsigned, rand() % 256) + ":1720|alias_" + PString(PString::Unsigned, rand() % 1000) + ";");
+
+	// a filter is compiled for every message, as Toolkit::MatchRegex() did
+	PTime start;
+	std::vector<bool> expected;
+	for (unsigned n = 0; n < events.size(); ++n) {
+		bool match = false;
+		for (unsigned i = 0; i < filters.size() && !match; ++i) {
+			PINDEX pos = 0;
+			match = PRegularExpression(filters[i], PRegularExpression::Extended).Execute(events[n], pos);
+		}
+		expected.push_back(match);
+	}
+	const PTimeInterval compileTime = PTime() - start;
+
+	// compiled when the filters are added, as StatusClient::AddFilter() does
+	RegexCache cache;
+	std::vector<const RegexCache::Entry *> compiled(filters.size());
+	for (unsigned i = 0; i < filters.size(); ++i)
+		ASSERT_TRUE(cache.Compile(filters[i], &compiled[i]));
+	start = PTime();
+	unsigned matches = 0;
+	for (unsigned n = 0; n < events.size(); ++n) {
+		bool match = false;
+		for (unsigned i = 0; i < compiled.size() && !match; ++i)
+			match = compiled[i]->Match(events[n]);
+		EXPECT_EQ(expected[n], match) << events[n];
+		if (match)
+			++matches;
+	}
+	const PTimeInterval cacheTime = PTime() - start;
+	EXPECT_GT(matches, 0u);
+	EXPECT_LT(matches, events.size());
+	EXPECT_EQ((unsigned)filters.size(), cache.GetSize());
+
+	std::cout << "[          ] " << events.size() << " status events, " << filters.size() << " filters: compiled per match "
+		<< compileTime.GetMilliSeconds() << " ms, cached " << cacheTime.GetMilliSeconds() << " ms" << std::endl;
+}
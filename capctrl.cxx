@@ -26,6 +26,7 @@
 #include "sigmsg.h"
 #include "gkacct.h"
 #include "gkauth.h"
+#include "stl_supp.h"
 #include "capctrl.h"
 
 namespace {
@@ -68,7 +69,7 @@ struct CLIRule_greater : public std::binary_function<CapacityControl::CLICallVol
 } // end of anonymous namespace
 
 CapacityControl::InboundCallVolume::InboundCallVolume()
-	: m_maxVolume(0)
+	: m_maxVolume(0), m_regex(NULL), m_counter(NULL)
 {
 }
 
@@ -78,8 +79,9 @@ CapacityControl::InboundCallVolume::~InboundCallVolume()
 
 PString CapacityControl::InboundCallVolume::AsString() const
 {
+	const unsigned calls = m_counter ? GkAtomicLoad(&m_counter->m_calls) : 0;
 	return PString("pfx: ") + (m_prefix.empty() ? "*" : m_prefix.c_str())
-		+ ", vol (cur/max): " + PString(m_calls.size()) + "/" + PString(m_maxVolume);
+		+ ", vol (cur/max): " + PString(calls) + "/" + PString(m_maxVolume);
 }
 
 bool CapacityControl::InboundCallVolume::operator==(const InboundCallVolume & obj) const
@@ -102,17 +104,149 @@ bool CapacityControl::InboundCLICallVolume::operator==(const InboundCLICallVolum
 	return m_sourceCLI == obj.m_sourceCLI && ((InboundCallVolume &)*this) == ((InboundCallVolume &)obj);
 }
 
+namespace {
+
+RegexCache::Entry * CompilePrefix(CapacityControl::InboundCallVolume & rule)
+{
+	if (rule.m_prefix.empty())
+		return NULL;
+	// the entry serializes the matches, the rules are shared by all signaling threads
+	RegexCache::Entry * regex = new RegexCache::Entry(rule.m_prefix.c_str());
+	if (!regex->IsValid()) {
+		PTRACE(1, "CAPCTRL\tInvalid prefix regex " << rule.m_prefix);
+	}
+	rule.m_regex = regex;
+	return regex;
+}
+
+} // end of anonymous namespace
+
+CapacityControl::Rules::~Rules()
+{
+	DeleteObjectsInContainer(m_regexes);
+}
+
+void CapacityControl::Rules::BuildIndex()
+{
+	// rules for the same network go into one group, in their sorted order
+	std::map<PString, PINDEX> groups;
+	for (PINDEX i = 0; i < (PINDEX)m_ipCallVolumes.size(); ++i) {
+		const NetworkAddress & net = m_ipCallVolumes[i].first;
+		if (RegexCache::Entry * regex = CompilePrefix(m_ipCallVolumes[i].second))
+			m_regexes.push_back(regex);
+		if (net.IsAny()) {
+			m_anyIpRules.push_back(i);
+			continue;
+		}
+		std::map<PString, PINDEX>::const_iterator group = groups.find(net.AsString());
+		if (group == groups.end()) {
+			group = groups.insert(std::make_pair(net.AsString(), (PINDEX)m_ipGroups.size())).first;
+			m_networkIndex.Add(net, group->second);
+			m_ipGroups.resize(m_ipGroups.size() + 1);
+		}
+		m_ipGroups[group->second].push_back(i);
+	}
+
+	for (PINDEX i = 0; i < (PINDEX)m_h323IdCallVolumes.size(); ++i) {
+		if (RegexCache::Entry * regex = CompilePrefix(m_h323IdCallVolumes[i].second))
+			m_regexes.push_back(regex);
+		m_h323IdIndex[H323GetAliasAddressString(m_h323IdCallVolumes[i].first)].push_back(i);
+	}
+
+	for (PINDEX i = 0; i < (PINDEX)m_cliCallVolumes.size(); ++i) {
+		if (RegexCache::Entry * regex = CompilePrefix(m_cliCallVolumes[i].second))
+			m_regexes.push_back(regex);
+		m_cliIndex[m_cliCallVolumes[i].first].push_back(i);
+	}
+}
+
+template <class Volumes>
+PINDEX CapacityControl::Rules::BestMatch(
+	const Volumes & volumes,
+	const std::vector<PINDEX> & candidates,
+	const PString & calledStationId)
+{
+	PINDEX bestMatch = P_MAX_INDEX, matchLen = 0;
+	for (unsigned i = 0; i < candidates.size(); ++i) {
+		const InboundCallVolume & rule = volumes[candidates[i]].second;
+		PINDEX offset, len = 0;
+		if (rule.m_regex != NULL && !rule.m_regex->Match(calledStationId, offset, len))
+			continue;
+		if (bestMatch == P_MAX_INDEX || len > matchLen) {
+			bestMatch = candidates[i];
+			matchLen = len;
+		}
+	}
+	return bestMatch;
+}
+
+const CapacityControl::IpCallVolume * CapacityControl::Rules::FindByIp(
+	const PIPSocket::Address & srcIp,
+	const PString & calledStationId) const
+{
+	// the longest network with a matching prefix wins, the any rules come last
+	std::vector<int> networks;
+	m_networkIndex.FindAll(srcIp, networks);
+	for (unsigned n = 0; n < networks.size(); ++n) {
+		const PINDEX i = BestMatch(m_ipCallVolumes, m_ipGroups[networks[n]], calledStationId);
+		if (i != P_MAX_INDEX)
+			return &m_ipCallVolumes[i];
+	}
+	const PINDEX i = BestMatch(m_ipCallVolumes, m_anyIpRules, calledStationId);
+	return (i != P_MAX_INDEX) ? &m_ipCallVolumes[i] : NULL;
+}
+
+const CapacityControl::H323IdCallVolume * CapacityControl::Rules::FindByH323Id(
+	const PString & h323Id,
+	const PString & calledStationId) const
+{
+	if (h323Id.IsEmpty())
+		return NULL;
+	std::map<PString, std::vector<PINDEX> >::const_iterator rules = m_h323IdIndex.find(h323Id);
+	if (rules == m_h323IdIndex.end())
+		return NULL;
+	const PINDEX i = BestMatch(m_h323IdCallVolumes, rules->second, calledStationId);
+	return (i != P_MAX_INDEX) ? &m_h323IdCallVolumes[i] : NULL;
+}
+
+const CapacityControl::CLICallVolume * CapacityControl::Rules::FindByCli(
+	const std::string & cli,
+	const PString & calledStationId) const
+{
+	if (cli.empty())
+		return NULL;
+	std::map<std::string, std::vector<PINDEX> >::const_iterator rules = m_cliIndex.find(cli);
+	if (rules == m_cliIndex.end())
+		return NULL;
+	const PINDEX i = BestMatch(m_cliCallVolumes, rules->second, calledStationId);
+	return (i != P_MAX_INDEX) ? &m_cliCallVolumes[i] : NULL;
+}
+
 CapacityControl::CapacityControl(
 	) : Singleton<CapacityControl>("CapacityControl")
 {
 	LoadConfig();
 }
 
+CapacityControl::~CapacityControl()
+{
+	DeleteObjectsInMap(m_counters);
+}
+
+CapacityControl::CallCounter * CapacityControl::GetCounter(const PString & key)
+{
+	CallCounter * & counter = m_counters[key];
+	if (counter == NULL)
+		counter = new CallCounter;
+	return counter;
+}
+
 void CapacityControl::LoadConfig()
 {
-	IpCallVolumes ipCallVolumes;
-	H323IdCallVolumes h323IdCallVolumes;
-	CLICallVolumes cliCallVolumes;
+	Rules * rules = new Rules;
+	IpCallVolumes & ipCallVolumes = rules->m_ipCallVolumes;
+	H323IdCallVolumes & h323IdCallVolumes = rules->m_h323IdCallVolumes;
+	CLICallVolumes & cliCallVolumes = rules->m_cliCallVolumes;
 
 	PConfig* cfg = GkConfig();
 	const PString cfgSec("CapacityControl");
@@ -200,58 +334,30 @@ void CapacityControl::LoadConfig()
 	std::stable_sort(ipCallVolumes.begin(), ipCallVolumes.end(), IpRule_greater());
 	std::stable_sort(h323IdCallVolumes.begin(), h323IdCallVolumes.end(), H323IdRule_greater());
 	std::stable_sort(cliCallVolumes.begin(), cliCallVolumes.end(), CLIRule_greater());
+	rules->BuildIndex();
 
 	PWaitAndSignal lock(m_updateMutex);
 
-	// update route entries that have not changed
-	{
-		IpCallVolumes::const_iterator rule = m_ipCallVolumes.begin();
-		while (rule != m_ipCallVolumes.end()) {
-			IpCallVolumes::iterator matchingRule = find(ipCallVolumes.begin(), ipCallVolumes.end(), *rule);
-			if (matchingRule != ipCallVolumes.end() && matchingRule->second == rule->second) {
-				matchingRule->second.m_calls = rule->second.m_calls;
-			}
-			++rule;
-		}
-	}
-
-	{
-		H323IdCallVolumes::const_iterator rule = m_h323IdCallVolumes.begin();
-		while (rule != m_h323IdCallVolumes.end()) {
-			H323IdCallVolumes::iterator matchingRule = find(h323IdCallVolumes.begin(), h323IdCallVolumes.end(), *rule);
-			if (matchingRule != h323IdCallVolumes.end() && matchingRule->second == rule->second) {
-				matchingRule->second.m_calls = rule->second.m_calls;
-			}
-			++rule;
-		}
-	}
-
-	{
-		CLICallVolumes::const_iterator rule = m_cliCallVolumes.begin();
-		while (rule != m_cliCallVolumes.end()) {
-			CLICallVolumes::iterator matchingRule = find(cliCallVolumes.begin(), cliCallVolumes.end(), *rule);
-			if (matchingRule != cliCallVolumes.end() && matchingRule->second == rule->second) {
-				matchingRule->second.m_calls = rule->second.m_calls;
-			}
-			++rule;
-		}
-	}
+	// rules that have not changed keep counting their active calls
+	for (unsigned i = 0; i < ipCallVolumes.size(); ++i)
+		ipCallVolumes[i].second.m_counter = GetCounter("ip:" + ipCallVolumes[i].first.AsString()
+			+ ";" + ipCallVolumes[i].second.m_prefix.c_str());
+	for (unsigned i = 0; i < h323IdCallVolumes.size(); ++i)
+		h323IdCallVolumes[i].second.m_counter = GetCounter("h323id:" + H323GetAliasAddressString(h323IdCallVolumes[i].first)
+			+ ";" + h323IdCallVolumes[i].second.m_prefix.c_str());
+	for (unsigned i = 0; i < cliCallVolumes.size(); ++i)
+		cliCallVolumes[i].second.m_counter = GetCounter(PString("cli:") + cliCallVolumes[i].first.c_str()
+			+ ";" + cliCallVolumes[i].second.m_prefix.c_str());
 
-	m_ipCallVolumes.clear();
-	m_h323IdCallVolumes.clear();
-	m_cliCallVolumes.clear();
-
-	m_ipCallVolumes = ipCallVolumes;
-	m_h323IdCallVolumes = h323IdCallVolumes;
-	m_cliCallVolumes = cliCallVolumes;
+	m_rules.Publish(rules);
 
 	PTRACE(5, "CAPCTRL\t" << ipRules << " IP rules loaded");
 	if (PTrace::CanTrace(6)) {
 		ostream & strm = PTrace::Begin(6, __FILE__, __LINE__);
 		strm << "Per IP call volume rules:" << endl;
-		for (unsigned i = 0; i < m_ipCallVolumes.size(); ++i) {
-			strm << "\tsrc " << m_ipCallVolumes[i].first.AsString() << ":" << endl;
-			strm << "\t\t" << m_ipCallVolumes[i].second.AsString() << endl;
+		for (unsigned i = 0; i < ipCallVolumes.size(); ++i) {
+			strm << "\tsrc " << ipCallVolumes[i].first.AsString() << ":" << endl;
+			strm << "\t\t" << ipCallVolumes[i].second.AsString() << endl;
 		}
 		PTrace::End(strm);
 	}
@@ -260,9 +366,9 @@ void CapacityControl::LoadConfig()
 	if (PTrace::CanTrace(6)) {
 		ostream & strm = PTrace::Begin(6, __FILE__, __LINE__);
 		strm << "Per H.323 ID call volume rules:" << endl;
-		for (unsigned i = 0; i < m_h323IdCallVolumes.size(); i++) {
-			strm << "\tsrc " << H323GetAliasAddressString(m_h323IdCallVolumes[i].first) << ":" << endl;
-			strm << "\t\t" << m_h323IdCallVolumes[i].second.AsString() << endl;
+		for (unsigned i = 0; i < h323IdCallVolumes.size(); i++) {
+			strm << "\tsrc " << H323GetAliasAddressString(h323IdCallVolumes[i].first) << ":" << endl;
+			strm << "\t\t" << h323IdCallVolumes[i].second.AsString() << endl;
 		}
 		PTrace::End(strm);
 	}
@@ -271,9 +377,9 @@ void CapacityControl::LoadConfig()
 	if (PTrace::CanTrace(6)) {
 		ostream & strm = PTrace::Begin(6, __FILE__, __LINE__);
 		strm << "Per CLI call volume rules:" << endl;
-		for (unsigned i = 0; i < m_cliCallVolumes.size(); i++) {
-			strm << "\tsrc " << m_cliCallVolumes[i].first << ":" << endl;
-			strm << "\t\t" << m_cliCallVolumes[i].second.AsString() << endl;
+		for (unsigned i = 0; i < cliCallVolumes.size(); i++) {
+			strm << "\tsrc " << cliCallVolumes[i].first << ":" << endl;
+			strm << "\t\t" << cliCallVolumes[i].second.AsString() << endl;
 		}
 		PTrace::End(strm);
 	}
@@ -281,120 +387,31 @@ void CapacityControl::LoadConfig()
 
 PString CapacityControl::PrintRules()
 {
+	const Rules * rules = m_rules.Get();
 //	std::stringstream strm; // VS2005 version leaks memory!!
 	PStringStream strm;
 
 	strm << "Per IP call volume rules:" << endl;
-	for (unsigned i = 0; i < m_ipCallVolumes.size(); ++i) {
-		strm << "  src " << m_ipCallVolumes[i].first.AsString() << ":" << endl;
-		strm << "    " << m_ipCallVolumes[i].second.AsString() << endl;
+	for (unsigned i = 0; i < rules->m_ipCallVolumes.size(); ++i) {
+		strm << "  src " << rules->m_ipCallVolumes[i].first.AsString() << ":" << endl;
+		strm << "    " << rules->m_ipCallVolumes[i].second.AsString() << endl;
 	}
 
 	strm << "Per H.323 ID call volume rules:" << endl;
-	for (unsigned i = 0; i < m_h323IdCallVolumes.size(); i++) {
-		strm << "  src " << H323GetAliasAddressString(m_h323IdCallVolumes[i].first) << ":" << endl;
-		strm << "    " << m_h323IdCallVolumes[i].second.AsString() << endl;
+	for (unsigned i = 0; i < rules->m_h323IdCallVolumes.size(); i++) {
+		strm << "  src " << H323GetAliasAddressString(rules->m_h323IdCallVolumes[i].first) << ":" << endl;
+		strm << "    " << rules->m_h323IdCallVolumes[i].second.AsString() << endl;
 	}
 
 	strm << "Per CLI call volume rules:" << endl;
-	for (unsigned i = 0; i < m_cliCallVolumes.size(); i++) {
-		strm << "  src " << m_cliCallVolumes[i].first << ":" << endl;
-		strm << "    " << m_cliCallVolumes[i].second.AsString() << endl;
+	for (unsigned i = 0; i < rules->m_cliCallVolumes.size(); i++) {
+		strm << "  src " << rules->m_cliCallVolumes[i].first << ":" << endl;
+		strm << "    " << rules->m_cliCallVolumes[i].second.AsString() << endl;
 	}
 
 	return strm;
 }
 
-CapacityControl::IpCallVolumes::iterator CapacityControl::FindByIp(
-	const NetworkAddress & srcIp,
-	const PString & calledStationId)
-{
-	unsigned netmaskLen = 0;
-	PINDEX matchLen = P_MAX_INDEX;
-
-	const IpCallVolumes::iterator ipEnd = m_ipCallVolumes.end();
-	IpCallVolumes::iterator bestIpMatch = ipEnd, i = m_ipCallVolumes.begin();
-	while (i != ipEnd) {
-		if (bestIpMatch != ipEnd && i->first.GetNetmaskLen() < netmaskLen)
-			break;
-		if (i->first.IsAny() || srcIp << i->first) {
-			PINDEX offset, len;
-			if (i->second.m_prefix.empty())
-				len = 0;
-			else if (!calledStationId.FindRegEx(
-					PRegularExpression(i->second.m_prefix.c_str(), PRegularExpression::Extended), offset, len))
-				len = P_MAX_INDEX;
-			if (len != P_MAX_INDEX && (matchLen == P_MAX_INDEX || len > matchLen)) {
-				bestIpMatch = i;
-				netmaskLen = i->first.GetNetmaskLen();
-				matchLen = len;
-			}
-		}
-		++i;
-	}
-
-	return bestIpMatch;
-}
-
-CapacityControl::H323IdCallVolumes::iterator CapacityControl::FindByH323Id(
-	const PString & h323Id,
-	const PString & calledStationId)
-{
-	PINDEX matchLen = P_MAX_INDEX;
-	const H323IdCallVolumes::iterator h323IdEnd = m_h323IdCallVolumes.end();
-	H323IdCallVolumes::iterator bestH323IdMatch = h323IdEnd, i = m_h323IdCallVolumes.begin();
-	while (i != h323IdEnd) {
-		if (h323Id.IsEmpty())
-			break;
-		PString alias = H323GetAliasAddressString(i->first);
-		if (bestH323IdMatch != h323IdEnd && alias != h323Id)
-			break;
-		if (alias == h323Id) {
-			PINDEX offset, len;
-			if (i->second.m_prefix.empty())
-				len = 0;
-			else if (!calledStationId.FindRegEx(PRegularExpression(i->second.m_prefix.c_str(), PRegularExpression::Extended), offset, len))
-				len = P_MAX_INDEX;
-			if (len != P_MAX_INDEX && (matchLen == P_MAX_INDEX || len > matchLen)) {
-				bestH323IdMatch = i;
-				matchLen = len;
-			}
-		}
-		++i;
-	}
-
-	return bestH323IdMatch;
-}
-
-CapacityControl::CLICallVolumes::iterator CapacityControl::FindByCli(
-	const std::string & cli,
-	const PString & calledStationId)
-{
-	PINDEX matchLen = P_MAX_INDEX;
-	const CLICallVolumes::iterator cliEnd = m_cliCallVolumes.end();
-	CLICallVolumes::iterator bestCliMatch = cliEnd, i = m_cliCallVolumes.begin();
-	while (i != cliEnd) {
-		if (cli.empty())
-			break;
-		if (bestCliMatch != cliEnd && i->first != cli)
-			break;
-		if (i->first == cli) {
-			PINDEX offset, len;
-			if (i->second.m_prefix.empty())
-				len = 0;
-			else if (!calledStationId.FindRegEx(PRegularExpression(i->second.m_prefix.c_str(), PRegularExpression::Extended), offset, len))
-				len = P_MAX_INDEX;
-			if (len != P_MAX_INDEX && (matchLen == P_MAX_INDEX || len > matchLen)) {
-				bestCliMatch = i;
-				matchLen = len;
-			}
-		}
-		++i;
-	}
-
-	return bestCliMatch;
-}
-
 void CapacityControl::LogCall(
 	const NetworkAddress &srcIp,
 	const PString &srcAlias,
@@ -410,67 +427,37 @@ void CapacityControl::LogCall(
 		}
 
 		// find longest matching rule by ip/h323id/cli
-		IpCallVolumes::iterator bestIpMatch = FindByIp(srcIp, calledStationId);
-		if (bestIpMatch != m_ipCallVolumes.end()) {
+		const Rules * rules = m_rules.Get();
+		const InboundCallVolume * rule = NULL;
+		if (const IpCallVolume * bestIpMatch = rules->FindByIp(srcIp.m_address, calledStationId)) {
 			PTRACE(5, "CAPCTRL\tCall #" << callNumber
 				<< " to " << calledStationId << " matched IP rule " << bestIpMatch->first.AsString()
 				<< "\t" << bestIpMatch->second.AsString());
-			PWaitAndSignal lock(m_updateMutex);
-			bestIpMatch->second.m_calls.insert(callNumber);
-			return;
-		}
-
-		H323IdCallVolumes::iterator bestH323IdMatch = FindByH323Id(srcAlias, calledStationId);
-		if (bestH323IdMatch != m_h323IdCallVolumes.end()) {
+			rule = &bestIpMatch->second;
+		} else if (const H323IdCallVolume * bestH323IdMatch = rules->FindByH323Id(srcAlias, calledStationId)) {
 			PTRACE(5, "CAPCTRL\tCall #" << callNumber
 				<< " to " << calledStationId << " matched H323.ID rule " << H323GetAliasAddressString(bestH323IdMatch->first)
 				<< "\t" << bestH323IdMatch->second.AsString());
-			PWaitAndSignal lock(m_updateMutex);
-			bestH323IdMatch->second.m_calls.insert(callNumber);
-			return;
-		}
-
-		CLICallVolumes::iterator bestCliMatch = FindByCli(srcCli, calledStationId);
-		if (bestCliMatch != m_cliCallVolumes.end()) {
+			rule = &bestH323IdMatch->second;
+		} else if (const CLICallVolume * bestCliMatch = rules->FindByCli(srcCli, calledStationId)) {
 			PTRACE(5, "CAPCTRL\tCall #" << callNumber
 				<< " to " << calledStationId << " matched CLI rule " << bestCliMatch->first
 				<< "\t" << bestCliMatch->second.AsString());
-			PWaitAndSignal lock(m_updateMutex);
-			bestCliMatch->second.m_calls.insert(callNumber);
-			return;
+			rule = &bestCliMatch->second;
 		}
-	} else { // call stop
-		PWaitAndSignal lock(m_updateMutex);
+		if (rule == NULL)
+			return;
 
+		PWaitAndSignal lock(m_callsMutex);
+		if (m_activeCalls.insert(std::make_pair(callNumber, rule->m_counter)).second)
+			GkAtomicIncrement(&rule->m_counter->m_calls);
+	} else { // call stop
 		// find the right counter by GnuGk call number
-		IpCallVolumes::iterator bestIpMatch = m_ipCallVolumes.begin();
-		while (bestIpMatch != m_ipCallVolumes.end()) {
-			std::set<PINDEX>::iterator i = find(bestIpMatch->second.m_calls.begin(), bestIpMatch->second.m_calls.end(), callNumber);
-			if (i != bestIpMatch->second.m_calls.end()) {
-				bestIpMatch->second.m_calls.erase(i);
-				return;
-			}
-			++bestIpMatch;
-		}
-
-		H323IdCallVolumes::iterator bestH323IdMatch = m_h323IdCallVolumes.begin();
-		while (bestH323IdMatch != m_h323IdCallVolumes.end()) {
-			std::set<PINDEX>::iterator i = find(bestH323IdMatch->second.m_calls.begin(), bestH323IdMatch->second.m_calls.end(), callNumber);
-			if (i != bestH323IdMatch->second.m_calls.end()) {
-				bestH323IdMatch->second.m_calls.erase(i);
-				return;
-			}
-			++bestH323IdMatch;
-		}
-
-		CLICallVolumes::iterator bestCliMatch = m_cliCallVolumes.begin();
-		while (bestCliMatch != m_cliCallVolumes.end()) {
-			std::set<PINDEX>::iterator i = find(bestCliMatch->second.m_calls.begin(), bestCliMatch->second.m_calls.end(), callNumber);
-			if (i != bestCliMatch->second.m_calls.end()) {
-				bestCliMatch->second.m_calls.erase(i);
-				return;
-			}
-			++bestCliMatch;
+		PWaitAndSignal lock(m_callsMutex);
+		std::map<PINDEX, CallCounter *>::iterator call = m_activeCalls.find(callNumber);
+		if (call != m_activeCalls.end()) {
+			GkAtomicDecrement(&call->second->m_calls);
+			m_activeCalls.erase(call);
 		}
 	}
 }
@@ -478,29 +465,28 @@ void CapacityControl::LogCall(
 bool CapacityControl::CheckCall(const NetworkAddress & srcIp, const PString & srcAlias,
                                 const std::string & srcCli, const PString & calledStationId)
 {
-	IpCallVolumes::iterator bestIpMatch = FindByIp(srcIp, calledStationId);
-	if (bestIpMatch != m_ipCallVolumes.end()) {
+	const Rules * rules = m_rules.Get();
+
+	const IpCallVolume * bestIpMatch = rules->FindByIp(srcIp.m_address, calledStationId);
+	if (bestIpMatch != NULL) {
 		PTRACE(5, "CAPCTRL\tCall from IP " << srcIp.AsString()
 			<< " to " << calledStationId << " matched IP rule " << bestIpMatch->first.AsString()
 			<< "\t" << bestIpMatch->second.AsString());
-		PWaitAndSignal lock(m_updateMutex);
-		return bestIpMatch->second.m_calls.size() < bestIpMatch->second.m_maxVolume;
+		return GkAtomicLoad(&bestIpMatch->second.m_counter->m_calls) < bestIpMatch->second.m_maxVolume;
 	}
 
-	H323IdCallVolumes::iterator bestH323IdMatch = FindByH323Id(srcAlias, calledStationId);
-	if (bestH323IdMatch != m_h323IdCallVolumes.end()) {
+	const H323IdCallVolume * bestH323IdMatch = rules->FindByH323Id(srcAlias, calledStationId);
+	if (bestH323IdMatch != NULL) {
 		PTRACE(5, "CAPCTRL\tCall to " << calledStationId << " matched H323.ID rule "
 			<< H323GetAliasAddressString(bestH323IdMatch->first) << "\t" << bestH323IdMatch->second.AsString());
-		PWaitAndSignal lock(m_updateMutex);
-		return bestH323IdMatch->second.m_calls.size() < bestH323IdMatch->second.m_maxVolume;
+		return GkAtomicLoad(&bestH323IdMatch->second.m_counter->m_calls) < bestH323IdMatch->second.m_maxVolume;
 	}
 
-	CLICallVolumes::iterator bestCliMatch = FindByCli(srcCli, calledStationId);
-	if (bestCliMatch != m_cliCallVolumes.end()) {
+	const CLICallVolume * bestCliMatch = rules->FindByCli(srcCli, calledStationId);
+	if (bestCliMatch != NULL) {
 		PTRACE(5, "CAPCTRL\tCall to " << calledStationId << " matched CLI rule "
 			<< bestCliMatch->first << "\t" << bestCliMatch->second.AsString());
-		PWaitAndSignal lock(m_updateMutex);
-		return bestCliMatch->second.m_calls.size() < bestCliMatch->second.m_maxVolume;
+		return GkAtomicLoad(&bestCliMatch->second.m_counter->m_calls) < bestCliMatch->second.m_maxVolume;
 	}
 
 	return true;
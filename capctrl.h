@@ -18,8 +18,9 @@
 
 #include <string>
 #include <vector>
-#include <set>
+#include <map>
 #include "Toolkit.h"
+#include "cfgsnapshot.h"
 
 class CallRec;
 template<class> class SmartPtr;
@@ -28,6 +29,13 @@ typedef SmartPtr<CallRec> callptr;
 /// Perform per IP/H.323 ID/CLI/prefix inbound call volume accounting/control
 class CapacityControl : public Singleton<CapacityControl> {
 public:
+	/// number of active calls of a rule, updated with atomic operations
+	struct CallCounter {
+		CallCounter() : m_calls(0) { }
+
+		volatile unsigned m_calls;
+	};
+
 	/// a single call volume accounting entry
 	struct InboundCallVolume {
 		InboundCallVolume();
@@ -38,7 +46,8 @@ public:
 
 		std::string m_prefix; /// destination prefix to match (regex)
 		unsigned m_maxVolume; /// maximum allowed call volume
-		std::set<PINDEX> m_calls; /// active calls
+		const RegexCache::Entry * m_regex; /// compiled m_prefix, owned by the Rules it belongs to
+		CallCounter * m_counter; /// active calls, owned by CapacityControl
 	};
 
 	struct InboundIPCallVolume : public InboundCallVolume {
@@ -73,8 +82,46 @@ public:
 	typedef std::pair<std::string, InboundCLICallVolume> CLICallVolume;
 	typedef std::vector<CLICallVolume> CLICallVolumes;
 
+	/** The rules of one configuration load, sorted as before and indexed
+	    by source. It is published as a whole by LoadConfig(), so the
+	    lookups don't need a lock.
+	*/
+	class Rules {
+	public:
+		Rules() { }
+		~Rules();
+
+		/// compile the prefixes and build the indexes, after the rules have been sorted
+		void BuildIndex();
+
+		/// @return	the rule with the longest prefix match of the longest matching network, NULL if none
+		const IpCallVolume * FindByIp(const PIPSocket::Address & srcIp, const PString & calledStationId) const;
+		const H323IdCallVolume * FindByH323Id(const PString & h323Id, const PString & calledStationId) const;
+		const CLICallVolume * FindByCli(const std::string & cli, const PString & calledStationId) const;
+
+		IpCallVolumes m_ipCallVolumes; /// per-IP inbound routes
+		H323IdCallVolumes m_h323IdCallVolumes; /// per-H.323 ID inbound routes
+		CLICallVolumes m_cliCallVolumes; /// per-CLI inbound routes
+
+	private:
+		Rules(const Rules &);
+		Rules & operator=(const Rules &);
+
+		/// @return	the position of the rule with the longest prefix match, P_MAX_INDEX if none
+		template <class Volumes>
+		static PINDEX BestMatch(const Volumes & volumes, const std::vector<PINDEX> & candidates, const PString & calledStationId);
+
+		std::vector<RegexCache::Entry *> m_regexes;
+		NetworkTree m_networkIndex; /// position in m_ipGroups of each network
+		std::vector<std::vector<PINDEX> > m_ipGroups; /// the IP rules of one network
+		std::vector<PINDEX> m_anyIpRules;
+		std::map<PString, std::vector<PINDEX> > m_h323IdIndex;
+		std::map<std::string, std::vector<PINDEX> > m_cliIndex;
+	};
+
 	/// Create object instance and call LoadConfig()
 	CapacityControl();
+	virtual ~CapacityControl();
 
 	/// Load/Update settings from the config
 	void LoadConfig();
@@ -108,16 +155,17 @@ private:
 	CapacityControl(const CapacityControl &);
 	CapacityControl & operator=(const CapacityControl &);
 
-	// helper functions
-	IpCallVolumes::iterator FindByIp(const NetworkAddress & srcIp, const PString & calledStationId);
-	H323IdCallVolumes::iterator FindByH323Id(const PString & h323Id, const PString & calledStationId);
-	CLICallVolumes::iterator FindByCli(const std::string & cli, const PString & calledStationId);
+	/// @return	the counter of a rule, the same one as long as the rule is configured
+	CallCounter * GetCounter(const PString & key);
 
 private:
-	IpCallVolumes m_ipCallVolumes; /// per-IP inbound routes
-	H323IdCallVolumes m_h323IdCallVolumes; /// per-H.323 ID inbound routes
-	CLICallVolumes m_cliCallVolumes; /// per-CLI inbound routes
-	PMutex m_updateMutex; /// for atomic route read/update operations
+	ConfigSnapshot<Rules> m_rules;
+	/// by rule type, source and prefix, kept until shutdown because an old
+	/// snapshot or an active call may still use a counter of a removed rule
+	std::map<PString, CallCounter *> m_counters;
+	PMutex m_updateMutex; /// for config reloads
+	std::map<PINDEX, CallCounter *> m_activeCalls; /// the counter of each call
+	PMutex m_callsMutex; /// for m_activeCalls
 };
 
 #endif /// CAPCTRL_H
@@ -0,0 +1,611 @@
+//////////////////////////////////////////////////////////////////
+//
+// capture.cxx
+//
+// Capture of relayed packets into rotating pcap files
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "config.h"
+#include <ptlib.h>
+#include <ptlib/sockets.h>
+#include "gk_const.h"
+#include "h323util.h"
+#include "Toolkit.h"
+#include "RasSrv.h"
+#include "RasTbl.h"
+#include "ProxyChannel.h"
+#include "job.h"
+#include "capture.h"
+
+namespace {
+
+const unsigned PcapMagic = 0xa1b2c3d4;
+const WORD PcapVersionMajor = 2;
+const WORD PcapVersionMinor = 4;
+const unsigned PcapSnapLen = 65535;
+const unsigned LinkTypeRaw = 101;	// packets start with the IPv4 or IPv6 header
+
+struct PcapFileHeader {
+	unsigned m_magic;
+	WORD m_versionMajor;
+	WORD m_versionMinor;
+	int m_thisZone;
+	unsigned m_sigFigs;
+	unsigned m_snapLen;
+	unsigned m_linkType;
+};
+
+struct PcapRecordHeader {
+	unsigned m_seconds;
+	unsigned m_microseconds;
+	unsigned m_capturedLen;
+	unsigned m_origLen;
+};
+
+// pcapng blocks, all in host byte order and padded to 32 bit
+struct PcapNGSectionHeaderBlock {
+	unsigned m_type;
+	unsigned m_length;
+	unsigned m_byteOrderMagic;
+	WORD m_versionMajor;
+	WORD m_versionMinor;
+	unsigned m_sectionLength[2];
+	unsigned m_trailingLength;
+};
+
+struct PcapNGInterfaceBlock {
+	unsigned m_type;
+	unsigned m_length;
+	WORD m_linkType;
+	WORD m_reserved;
+	unsigned m_snapLen;
+	unsigned m_trailingLength;
+};
+
+const unsigned PcapNGSectionHeader = 0x0a0d0d0a;
+const unsigned PcapNGInterfaceDescription = 1;
+const unsigned PcapNGEnhancedPacket = 6;
+const unsigned PcapNGByteOrderMagic = 0x1a2b3c4d;
+const WORD PcapNGOptionEnd = 0;
+const WORD PcapNGOptionComment = 1;
+
+inline unsigned Pad4(unsigned len)
+{
+	return (len + 3) & ~3u;
+}
+
+inline void PutDWord(BYTE * p, unsigned value)
+{
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+inline void PutWord(BYTE * p, WORD value)
+{
+	p[0] = (BYTE)(value >> 8);
+	p[1] = (BYTE)value;
+}
+
+// one's complement sum in network byte order
+unsigned ChecksumAdd(unsigned sum, const BYTE * data, unsigned len)
+{
+	for (unsigned i = 0; i + 1 < len; i += 2)
+		sum += ((unsigned)data[i] << 8) | data[i + 1];
+	if (len & 1)
+		sum += (unsigned)data[len - 1] << 8;
+	return sum;
+}
+
+WORD ChecksumFinish(unsigned sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (WORD)~sum;
+}
+
+} // end namespace
+
+// class PcapWriter
+PcapWriter::PcapWriter() : m_maxFileSize(0), m_maxFiles(0), m_format(Pcap), m_fileSize(0), m_filesStarted(0)
+{
+}
+
+void PcapWriter::SetLimits(const PString & directory, const PString & prefix, PInt64 maxFileSize, unsigned maxFiles, Format format)
+{
+	m_directory = directory;
+	m_prefix = prefix;
+	m_maxFileSize = maxFileSize;
+	m_maxFiles = maxFiles;
+	m_format = format;
+}
+
+unsigned PcapWriter::BuildHeaders(const CapturedPacketInfo & packet, const BYTE * data, BYTE * header, unsigned seq)
+{
+	PIPSocket::Address srcIP = packet.m_srcIP;
+	PIPSocket::Address dstIP = packet.m_dstIP;
+	UnmapIPv4Address(srcIP);
+	UnmapIPv4Address(dstIP);
+	const bool ipv6 = (srcIP.GetVersion() == 6);
+	if (dstIP.GetVersion() != srcIP.GetVersion())
+		dstIP = ipv6 ? PIPSocket::Address("::") : PIPSocket::Address(0, 0, 0, 0);
+
+	const bool tcp = (packet.m_protocol == CapturedPacketInfo::TCP);
+	const unsigned ipHeaderLen = ipv6 ? 40 : 20;
+	const unsigned transportHeaderLen = tcp ? 20 : 8;
+	const unsigned tpktLen = packet.m_tpkt ? 4 : 0;
+	const WORD transportLen = (WORD)(transportHeaderLen + tpktLen + packet.m_origLen);
+	BYTE * ip = header;
+	BYTE * transport = header + ipHeaderLen;
+	memset(header, 0, ipHeaderLen + transportHeaderLen);
+
+	const unsigned addrLen = ipv6 ? 16 : 4;
+	BYTE * src = ip + (ipv6 ? 8 : 12);
+	BYTE * dst = src + addrLen;
+	for (unsigned i = 0; i < addrLen; ++i) {
+		src[i] = srcIP[i];
+		dst[i] = dstIP[i];
+	}
+
+	if (ipv6) {
+		ip[0] = 0x60;
+		PutWord(ip + 4, transportLen);
+		ip[6] = packet.m_protocol;
+		ip[7] = 64;	// hop limit
+	} else {
+		ip[0] = 0x45;
+		PutWord(ip + 2, (WORD)(ipHeaderLen + transportLen));
+		ip[6] = 0x40;	// don't fragment
+		ip[8] = 64;	// TTL
+		ip[9] = packet.m_protocol;
+		PutWord(ip + 10, ChecksumFinish(ChecksumAdd(0, ip, ipHeaderLen)));
+	}
+
+	PutWord(transport, packet.m_srcPort);
+	PutWord(transport + 2, packet.m_dstPort);
+	BYTE * checksum;
+	if (tcp) {
+		PutDWord(transport + 4, seq);
+		transport[12] = 5 << 4;	// header length in 32 bit words
+		transport[13] = 0x18;	// PSH, ACK
+		PutWord(transport + 14, 65535);	// window
+		checksum = transport + 16;
+	} else {
+		PutWord(transport + 4, transportLen);
+		checksum = transport + 6;
+	}
+	if (packet.m_tpkt) {
+		BYTE * tpkt = transport + transportHeaderLen;
+		tpkt[0] = 3;
+		tpkt[1] = 0;
+		PutWord(tpkt + 2, (WORD)(tpktLen + packet.m_origLen));
+	}
+	// the checksum covers the pseudo header, a truncated payload can't be checksummed
+	if (packet.m_len == packet.m_origLen) {
+		unsigned sum = ChecksumAdd(0, src, 2 * addrLen);
+		sum += packet.m_protocol + transportLen;
+		sum = ChecksumAdd(sum, transport, transportHeaderLen + tpktLen);
+		sum = ChecksumAdd(sum, data, packet.m_len);
+		WORD value = ChecksumFinish(sum);
+		if (value == 0 && !tcp)
+			value = 0xffff;	// 0 means no checksum for UDP
+		PutWord(checksum, value);
+	}
+	return ipHeaderLen + transportHeaderLen + tpktLen;
+}
+
+bool PcapWriter::OpenNext()
+{
+	Close();
+
+	PString dir = m_directory;
+	if (!dir.IsEmpty() && dir[dir.GetLength() - 1] != PDIR_SEPARATOR)
+		dir += PDIR_SEPARATOR;
+	const char * extension = (m_format == PcapNG) ? ".pcapng" : ".pcap";
+	PString name;
+	do {
+		name = dir + m_prefix + PTime().AsString("yyyyMMdd-hhmmss") + "-" + PString(++m_filesStarted) + extension;
+	} while (PFile::Exists(name));
+
+	if (!m_file.Open(name, PFile::WriteOnly, PFile::Create | PFile::Truncate)) {
+		PTRACE(1, "Capture\tCan't open " << name << ": " << m_file.GetErrorText());
+		return false;
+	}
+	m_fileSize = 0;
+	bool ok;
+	if (m_format == PcapNG) {
+		PcapNGSectionHeaderBlock section;
+		section.m_type = PcapNGSectionHeader;
+		section.m_length = section.m_trailingLength = sizeof(section);
+		section.m_byteOrderMagic = PcapNGByteOrderMagic;
+		section.m_versionMajor = 1;
+		section.m_versionMinor = 0;
+		section.m_sectionLength[0] = section.m_sectionLength[1] = 0xffffffff;	// unknown
+		PcapNGInterfaceBlock iface;
+		iface.m_type = PcapNGInterfaceDescription;
+		iface.m_length = iface.m_trailingLength = sizeof(iface);
+		iface.m_linkType = (WORD)LinkTypeRaw;
+		iface.m_reserved = 0;
+		iface.m_snapLen = PcapSnapLen;
+		ok = WriteBlock(&section, sizeof(section)) && WriteBlock(&iface, sizeof(iface));
+	} else {
+		PcapFileHeader fileHeader;
+		fileHeader.m_magic = PcapMagic;
+		fileHeader.m_versionMajor = PcapVersionMajor;
+		fileHeader.m_versionMinor = PcapVersionMinor;
+		fileHeader.m_thisZone = 0;
+		fileHeader.m_sigFigs = 0;
+		fileHeader.m_snapLen = PcapSnapLen;
+		fileHeader.m_linkType = LinkTypeRaw;
+		ok = WriteBlock(&fileHeader, sizeof(fileHeader));
+	}
+	if (!ok)
+		return false;
+	PTRACE(3, "Capture\tWriting " << name);
+
+	m_files.push_back(name);
+	while (m_maxFiles > 0 && m_files.size() > m_maxFiles) {
+		PFile::Remove(m_files.front());
+		m_files.pop_front();
+	}
+	return true;
+}
+
+bool PcapWriter::WriteBlock(const void * data, PINDEX len)
+{
+	if (len > 0 && !m_file.Write(data, len)) {
+		PTRACE(1, "Capture\tError writing " << m_file.GetFilePath() << ": " << m_file.GetErrorText());
+		Close();
+		return false;
+	}
+	m_fileSize += len;
+	return true;
+}
+
+unsigned PcapWriter::NextSequence(const CapturedPacketInfo & packet)
+{
+	if (m_tcpSequence.size() > 10000)
+		m_tcpSequence.clear();	// forget closed streams, Wireshark copes with the jump
+	unsigned & next = m_tcpSequence[AsString(packet.m_srcIP, packet.m_srcPort) + ">" + AsString(packet.m_dstIP, packet.m_dstPort)];
+	if (next == 0)
+		next = 1;
+	const unsigned seq = next;
+	next += (packet.m_tpkt ? 4 : 0) + packet.m_origLen;
+	return seq;
+}
+
+bool PcapWriter::Write(const CapturedPacketInfo & packet, const BYTE * data)
+{
+	if (!m_file.IsOpen() || (m_maxFileSize > 0 && m_fileSize >= m_maxFileSize))
+		if (!OpenNext())
+			return false;
+
+	BYTE header[MaxHeaderSize];
+	const unsigned seq = (packet.m_protocol == CapturedPacketInfo::TCP) ? NextSequence(packet) : 0;
+	const unsigned headerLen = BuildHeaders(packet, data, header, seq);
+	const unsigned capturedLen = headerLen + packet.m_len;
+	const unsigned origLen = headerLen + packet.m_origLen;
+
+	if (m_format == PcapNG) {
+		PString comment;
+		if (packet.m_callNo != 0)
+			comment = "call " + PString(packet.m_callNo) + " " + PString(PString::Printf,
+				"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+				packet.m_callID[0], packet.m_callID[1], packet.m_callID[2], packet.m_callID[3],
+				packet.m_callID[4], packet.m_callID[5], packet.m_callID[6], packet.m_callID[7],
+				packet.m_callID[8], packet.m_callID[9], packet.m_callID[10], packet.m_callID[11],
+				packet.m_callID[12], packet.m_callID[13], packet.m_callID[14], packet.m_callID[15]);
+		const unsigned commentLen = comment.GetLength();
+		const unsigned optionsLen = (commentLen > 0) ? 4 + Pad4(commentLen) + 4 : 0;
+		const unsigned blockLen = 28 + Pad4(capturedLen) + optionsLen + 4;
+		const unsigned block[7] = { PcapNGEnhancedPacket, blockLen, 0,
+			(unsigned)((PUInt64)packet.m_time >> 32), (unsigned)packet.m_time, capturedLen, origLen };
+		const BYTE padding[4] = { 0, 0, 0, 0 };
+		if (!WriteBlock(block, sizeof(block))
+			|| !WriteBlock(header, headerLen)
+			|| !WriteBlock(data, packet.m_len)
+			|| !WriteBlock(padding, Pad4(capturedLen) - capturedLen))
+			return false;
+		if (commentLen > 0) {
+			const WORD option[2] = { PcapNGOptionComment, (WORD)commentLen };
+			const WORD end[2] = { PcapNGOptionEnd, 0 };
+			if (!WriteBlock(option, sizeof(option))
+				|| !WriteBlock((const char *)comment, commentLen)
+				|| !WriteBlock(padding, Pad4(commentLen) - commentLen)
+				|| !WriteBlock(end, sizeof(end)))
+				return false;
+		}
+		return WriteBlock(&blockLen, sizeof(blockLen));
+	}
+
+	PcapRecordHeader record;
+	record.m_seconds = (unsigned)(packet.m_time / 1000000);
+	record.m_microseconds = (unsigned)(packet.m_time % 1000000);
+	record.m_capturedLen = capturedLen;
+	record.m_origLen = origLen;
+	return WriteBlock(&record, sizeof(record))
+		&& WriteBlock(header, headerLen)
+		&& WriteBlock(data, packet.m_len);
+}
+
+void PcapWriter::Close()
+{
+	if (m_file.IsOpen())
+		m_file.Close();
+}
+
+namespace {
+
+// drains the capture queues into the pcap files
+class CaptureWriter : public RegularJob {
+public:
+	CaptureWriter() { SetName("CaptureWriter"); Execute(); }
+
+	virtual void Exec()
+	{
+		MediaCapture::Instance()->WriteQueued();
+		SignalingCapture::Instance()->WriteQueued();
+		Wait(50);
+	}
+};
+
+PMutex CaptureWriterMutex;
+bool CaptureWriterStarted = false;
+
+// the writer is only started when a capture is requested the first time
+void StartCaptureWriter()
+{
+	PWaitAndSignal lock(CaptureWriterMutex);
+	if (!CaptureWriterStarted) {
+		new CaptureWriter();
+		CaptureWriterStarted = true;
+	}
+}
+
+#ifdef _WIN32
+const char * const DefaultCaptureDirectory = ".";
+#else
+const char * const DefaultCaptureDirectory = "/tmp";
+#endif
+
+void SetCaptureLimits(PcapWriter & writer, const PString & prefix, PcapWriter::Format format)
+{
+	PConfig * cfg = GkConfig();
+	writer.SetLimits(cfg->GetString(ProxySection, "CaptureDirectory", DefaultCaptureDirectory), prefix,
+		(PInt64)cfg->GetInteger(ProxySection, "CaptureMaxFileSize", 100) * 1024 * 1024,
+		cfg->GetInteger(ProxySection, "CaptureMaxFiles", 10), format);
+}
+
+} // end namespace
+
+// class MediaCapture
+MediaCapture::MediaCapture() : Singleton<MediaCapture>("MediaCapture"),
+	m_generation(0), m_queue(NULL), m_written(0)
+{
+}
+
+MediaCapture::~MediaCapture()
+{
+	delete m_queue;
+}
+
+void MediaCapture::LoadConfig()
+{
+	PWaitAndSignal lock(m_writerMutex);
+	SetCaptureLimits(m_writer, "gnugk-media-", PcapWriter::Pcap);
+}
+
+bool MediaCapture::AddFilter(const PString & type, const PString & value)
+{
+	Filter filter;
+	filter.m_callNo = 0;
+	const PCaselessString filterType = type;
+	if (filterType == "All") {
+		filter.m_type = AllCalls;
+	} else if (filterType == "Call") {
+		filter.m_type = CallNumber;
+		filter.m_callNo = value.AsInteger();
+		if (filter.m_callNo <= 0)
+			return false;
+	} else if (filterType == "Alias") {
+		filter.m_type = Alias;
+		filter.m_alias = value.Trim();
+		if (filter.m_alias.IsEmpty())
+			return false;
+	} else if (filterType == "IP") {
+		filter.m_type = IP;
+		filter.m_network = NetworkAddress(value.Trim());
+		if (filter.m_network.IsAny())
+			return false;
+	} else {
+		return false;
+	}
+
+	{
+		PWaitAndSignal lock(m_writerMutex);
+		if (m_queue == NULL)
+			GkAtomicExchangePointer((void * volatile *)&m_queue, new CaptureQueue());
+	}
+	StartCaptureWriter();
+	PWaitAndSignal lock(m_filterMutex);
+	m_filters.push_back(filter);
+	GkAtomicIncrement(&m_generation);
+	PTRACE(3, "Capture\tAdded filter " << FilterAsString(filter));
+	return true;
+}
+
+void MediaCapture::ClearFilters()
+{
+	PWaitAndSignal lock(m_filterMutex);
+	m_filters.clear();
+	GkAtomicIncrement(&m_generation);
+	PTRACE(3, "Capture\tStopped");
+}
+
+bool MediaCapture::Matches(CallRec & call) const
+{
+	std::vector<Filter> filters;
+	{
+		PWaitAndSignal lock(m_filterMutex);
+		filters = m_filters;
+	}
+	if (filters.empty())
+		return false;
+
+	for (std::vector<Filter>::const_iterator i = filters.begin(); i != filters.end(); ++i) {
+		if (i->m_type == AllCalls)
+			return true;
+		if (i->m_type == CallNumber) {
+			if (i->m_callNo == call.GetCallNumber())
+				return true;
+		} else if (i->m_type == Alias) {
+			const endptr calling = call.GetCallingParty();
+			const endptr called = call.GetCalledParty();
+			if ((calling && FindAlias(calling->GetAliases(), i->m_alias) != P_MAX_INDEX)
+				|| (called && FindAlias(called->GetAliases(), i->m_alias) != P_MAX_INDEX)
+				|| call.GetCallingStationId() == i->m_alias
+				|| call.GetCalledStationId() == i->m_alias
+				|| call.GetDialedNumber() == i->m_alias)
+				return true;
+		} else if (i->m_type == IP) {
+			PIPSocket::Address addr;
+			WORD port = 0;
+			if ((call.GetSrcSignalAddr(addr, port) && i->m_network >> addr)
+				|| (call.GetDestSignalAddr(addr, port) && i->m_network >> addr))
+				return true;
+			const PString mediaIPs[2] = { call.GetSRC_media_IP(), call.GetDST_media_IP() };
+			for (unsigned m = 0; m < 2; ++m)
+				if (!mediaIPs[m].IsEmpty() && i->m_network >> PIPSocket::Address(mediaIPs[m]))
+					return true;
+		}
+	}
+	return false;
+}
+
+void MediaCapture::WriteQueued()
+{
+	PWaitAndSignal lock(m_writerMutex);
+	if (m_queue == NULL)
+		return;	// nothing was ever captured
+	CapturedPacket packet;
+	while (m_queue->Pop(packet)) {
+		if (packet.m_dstIP.IsAny())
+			packet.m_dstIP = RasServer::Instance()->GetLocalAddress(packet.m_srcIP);
+		if (m_writer.Write(packet))
+			++m_written;
+	}
+	PWaitAndSignal filterLock(m_filterMutex);
+	if (m_filters.empty())
+		m_writer.Close();	// capture stopped and everything written
+}
+
+PString MediaCapture::FilterAsString(const Filter & filter) const
+{
+	switch (filter.m_type) {
+		case AllCalls:
+			return "All";
+		case CallNumber:
+			return "Call " + PString(filter.m_callNo);
+		case Alias:
+			return "Alias " + filter.m_alias;
+		case IP:
+			return "IP " + filter.m_network.AsString();
+	}
+	return PString::Empty();
+}
+
+PString MediaCapture::PrintStatus() const
+{
+	PStringStream strm;
+	{
+		PWaitAndSignal lock(m_filterMutex);
+		strm << "Capture filters: ";
+		if (m_filters.empty())
+			strm << "none";
+		for (std::vector<Filter>::const_iterator i = m_filters.begin(); i != m_filters.end(); ++i)
+			strm << ((i == m_filters.begin()) ? "" : ", ") << FilterAsString(*i);
+		strm << "\r\n";
+	}
+	PWaitAndSignal lock(m_writerMutex);
+	const PString fileName = m_writer.GetFileName();
+	strm << "File: " << (fileName.IsEmpty() ? PString("none") : fileName)
+		<< " Files: " << m_writer.GetFilesStarted()
+		<< " Packets: " << m_written
+		<< " Dropped: " << (m_queue ? m_queue->GetDropped() : 0) << "\r\n";
+	return strm;
+}
+
+// class SignalingCapture
+SignalingCapture::SignalingCapture() : Singleton<SignalingCapture>("SignalingCapture"),
+	m_active(0), m_queue(NULL), m_message(NULL), m_written(0)
+{
+}
+
+SignalingCapture::~SignalingCapture()
+{
+	delete m_queue;
+	delete m_message;
+}
+
+void SignalingCapture::LoadConfig()
+{
+	PWaitAndSignal lock(m_writerMutex);
+	SetCaptureLimits(m_writer, "gnugk-signaling-", PcapWriter::PcapNG);
+}
+
+void SignalingCapture::Start()
+{
+	{
+		PWaitAndSignal lock(m_writerMutex);
+		if (m_queue == NULL) {
+			m_message = new CapturedSignal();
+			GkAtomicExchangePointer((void * volatile *)&m_queue, new SignalCaptureQueue());
+		}
+	}
+	StartCaptureWriter();
+	GkAtomicStore(&m_active, 1);
+	PTRACE(3, "Capture\tSignaling capture started");
+}
+
+void SignalingCapture::Stop()
+{
+	GkAtomicStore(&m_active, 0);
+	PTRACE(3, "Capture\tSignaling capture stopped");
+}
+
+void SignalingCapture::WriteQueued()
+{
+	PWaitAndSignal lock(m_writerMutex);
+	if (m_queue == NULL)
+		return;	// never started
+	while (m_queue->Pop(*m_message)) {
+		if (m_message->m_dstIP.IsAny())
+			m_message->m_dstIP = RasServer::Instance()->GetLocalAddress(m_message->m_srcIP);
+		if (m_writer.Write(*m_message, m_message->m_data))
+			++m_written;
+	}
+	if (!IsActive())
+		m_writer.Close();	// capture stopped and everything written
+}
+
+PString SignalingCapture::PrintStatus() const
+{
+	PStringStream strm;
+	PWaitAndSignal lock(m_writerMutex);
+	const PString fileName = m_writer.GetFileName();
+	strm << "Signaling capture: " << (IsActive() ? "on" : "off") << "\r\n"
+		<< "File: " << (fileName.IsEmpty() ? PString("none") : fileName)
+		<< " Files: " << m_writer.GetFilesStarted()
+		<< " Messages: " << m_written
+		<< " Dropped: " << (m_queue ? m_queue->GetDropped() : 0) << "\r\n";
+	return strm;
+}
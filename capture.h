@@ -0,0 +1,313 @@
+//////////////////////////////////////////////////////////////////
+//
+// capture.h
+//
+// Capture of relayed packets into rotating pcap files
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef CAPTURE_H
+#define CAPTURE_H "@(#) $Id$"
+
+#include <list>
+#include <map>
+#include <vector>
+#include "Toolkit.h"
+#include "cfgsnapshot.h"
+
+class CallRec;
+
+/// where and when a captured packet was seen
+struct CapturedPacketInfo {
+	enum Protocol { TCP = 6, UDP = 17 };
+
+	PInt64 m_time;	// PTime::GetTimestamp() when the packet was received or sent
+	PIPSocket::Address m_srcIP;
+	PIPSocket::Address m_dstIP;	// may be the any address, the writer fills in the interface
+	WORD m_srcPort;
+	WORD m_dstPort;
+	WORD m_origLen;
+	WORD m_len;	// captured length, may be less than m_origLen
+	BYTE m_protocol;
+	bool m_tpkt;	// TCP payload without its TPKT header, the writer adds it
+	PINDEX m_callNo;	// 0 if not known
+	BYTE m_callID[16];	// GUID of the call, only valid if m_callNo is set
+};
+
+/// copy of a packet, with room for up to #Size# bytes
+template<unsigned Size>
+struct CapturedPacketData : public CapturedPacketInfo {
+	enum { MaxSize = Size };	// longer packets are truncated (the snap length)
+
+	BYTE m_data[Size];
+};
+
+typedef CapturedPacketData<1600> CapturedPacket;	// RTP and RAS
+typedef CapturedPacketData<8192> CapturedSignal;	// Q.931 and H.245
+
+/** Bounded lock-free queue of captured packets.
+
+    Any number of threads may call Push() concurrently, it never
+    blocks and drops the packet if the queue is full.
+    Only one thread (the capture writer) may call Pop().
+*/
+template<class Packet, unsigned QueueCapacity>
+class CaptureRing {
+public:
+	enum { Capacity = QueueCapacity };	// must be a power of 2
+
+	CaptureRing() : m_head(0), m_tail(0), m_dropped(0)
+	{
+		for (unsigned i = 0; i < Capacity; ++i)
+			m_slots[i].m_sequence = i;
+	}
+
+	/** Copy a packet into the queue, #info.m_len# is set from #info.m_origLen#.
+	    @return	false if the queue was full
+	*/
+	bool Push(const CapturedPacketInfo & info, const BYTE * data)
+	{
+		// reserve a slot
+		unsigned pos = GkAtomicLoad(&m_head);
+		Slot * slot;
+		for (;;) {
+			slot = &m_slots[pos & (Capacity - 1)];
+			const int diff = (int)(GkAtomicLoad(&slot->m_sequence) - pos);
+			if (diff == 0) {
+				if (GkAtomicCompareAndSwap(&m_head, pos, pos + 1))
+					break;
+				pos = GkAtomicLoad(&m_head);
+			} else if (diff < 0) {
+				GkAtomicIncrement(&m_dropped);	// full, the writer didn't consume this slot yet
+				return false;
+			} else {
+				pos = GkAtomicLoad(&m_head);	// another producer took it
+			}
+		}
+		Packet & packet = slot->m_packet;
+		static_cast<CapturedPacketInfo &>(packet) = info;
+		packet.m_len = (info.m_origLen > Packet::MaxSize) ? (WORD)Packet::MaxSize : info.m_origLen;
+		memcpy(packet.m_data, data, packet.m_len);
+		GkAtomicStore(&slot->m_sequence, pos + 1);	// publish
+		return true;
+	}
+
+	/// push a UDP packet that doesn't belong to a known call
+	bool Push(PInt64 time, const PIPSocket::Address & srcIP, WORD srcPort,
+		const PIPSocket::Address & dstIP, WORD dstPort, const BYTE * data, WORD len)
+	{
+		CapturedPacketInfo info;
+		info.m_time = time;
+		info.m_srcIP = srcIP;
+		info.m_srcPort = srcPort;
+		info.m_dstIP = dstIP;
+		info.m_dstPort = dstPort;
+		info.m_origLen = len;
+		info.m_protocol = CapturedPacketInfo::UDP;
+		info.m_tpkt = false;
+		info.m_callNo = 0;
+		return Push(info, data);
+	}
+
+	/// @return	false if the queue is empty
+	bool Pop(Packet & packet)
+	{
+		Slot & slot = m_slots[m_tail & (Capacity - 1)];
+		if ((int)(GkAtomicLoad(&slot.m_sequence) - (m_tail + 1)) < 0)
+			return false;	// empty or still being written
+		static_cast<CapturedPacketInfo &>(packet) = slot.m_packet;
+		memcpy(packet.m_data, slot.m_packet.m_data, slot.m_packet.m_len);
+		GkAtomicStore(&slot.m_sequence, m_tail + Capacity);	// free for the next round
+		++m_tail;
+		return true;
+	}
+
+	unsigned GetDropped() const { return m_dropped; }
+
+private:
+	struct Slot {
+		volatile unsigned m_sequence;	// == position: free for the producer, == position + 1: ready for the consumer
+		Packet m_packet;
+	};
+
+	Slot m_slots[Capacity];
+	volatile unsigned m_head;	// next position to write
+	unsigned m_tail;	// next position to read
+	volatile unsigned m_dropped;
+};
+
+typedef CaptureRing<CapturedPacket, 4096> CaptureQueue;
+typedef CaptureRing<CapturedSignal, 1024> SignalCaptureQueue;
+
+/** Writes packets with synthesized IP and UDP or TCP headers into pcap
+    or pcapng files. A new file is started when the current one reaches
+    the size limit, only the newest files are kept.
+    Not thread safe, only the capture writer uses it.
+*/
+class PcapWriter {
+public:
+	enum Format { Pcap, PcapNG };	// only pcapng files carry the call of a packet
+	enum { MaxHeaderSize = 40 + 20 + 4 };	// IPv6 + TCP + TPKT
+
+	PcapWriter();
+	~PcapWriter() { Close(); }
+
+	/// @param maxFileSize	in bytes
+	void SetLimits(const PString & directory, const PString & prefix, PInt64 maxFileSize, unsigned maxFiles, Format format = Pcap);
+
+	/// @return	false if the packet couldn't be written
+	bool Write(const CapturedPacketInfo & packet, const BYTE * data);
+	bool Write(const CapturedPacket & packet) { return Write(packet, packet.m_data); }
+	void Close();
+
+	PString GetFileName() const { return m_file.IsOpen() ? PString(m_file.GetFilePath()) : PString::Empty(); }
+	unsigned GetFilesStarted() const { return m_filesStarted; }
+
+	/** Build the IP, UDP or TCP and TPKT headers for a packet, the IP version is the one of the source address.
+	    @param seq	the TCP sequence number
+	    @return	the header length
+	*/
+	static unsigned BuildHeaders(const CapturedPacketInfo & packet, const BYTE * data, BYTE * header, unsigned seq = 0);
+
+protected:
+	bool OpenNext();
+	bool WriteBlock(const void * data, PINDEX len);
+	/// the next TCP sequence number of the stream, the streams start at 1
+	unsigned NextSequence(const CapturedPacketInfo & packet);
+
+	PString m_directory;
+	PString m_prefix;
+	PInt64 m_maxFileSize;
+	unsigned m_maxFiles;
+	Format m_format;
+	PFile m_file;
+	PInt64 m_fileSize;
+	std::list<PFilePath> m_files;	// oldest first
+	unsigned m_filesStarted;
+	std::map<PString, unsigned> m_tcpSequence;	// by stream
+};
+
+/** Capture of the RTP/RTCP relayed for selected calls.
+
+    The relay threads only call Capture() for calls that match one of the
+    filters, which copies the packet into a lock-free queue. The capture
+    writer thread drains the queue into rotating pcap files. Capture never
+    blocks forwarding, packets that don't fit into the queue are counted
+    as dropped.
+*/
+class MediaCapture : public Singleton<MediaCapture> {
+public:
+	MediaCapture();
+	~MediaCapture();
+
+	/// read the file settings from [Proxy]
+	void LoadConfig();
+
+	/** Add a filter, start the writer if needed.
+	    @param type	All, Call, Alias or IP
+	    @return	false if the filter is invalid
+	*/
+	bool AddFilter(const PString & type, const PString & value);
+	/// stop capturing, the writer closes the file when the queue is empty
+	void ClearFilters();
+
+	/// changes whenever the filters change, the relay threads re-check their call then
+	unsigned GetGeneration() const { return GkAtomicLoad(&m_generation); }
+	/** does any filter match the call ? called when the media addresses of the call
+	    are set and when the generation changed, never looks up the call
+	*/
+	bool Matches(CallRec & call) const;
+
+	/// queue a copy of a packet, never blocks
+	void Capture(const PIPSocket::Address & srcIP, WORD srcPort, const PIPSocket::Address & dstIP, WORD dstPort, const BYTE * data, WORD len)
+	{
+		CaptureQueue * queue = static_cast<CaptureQueue *>(GkAtomicLoadPointer((void * volatile const *)&m_queue));
+		if (queue)
+			queue->Push(PTime().GetTimestamp(), srcIP, srcPort, dstIP, dstPort, data, len);
+	}
+
+	/// write all queued packets, called by the writer thread
+	void WriteQueued();
+
+	PString PrintStatus() const;
+
+protected:
+	enum FilterType { AllCalls, CallNumber, Alias, IP };
+	struct Filter {
+		FilterType m_type;
+		PINDEX m_callNo;
+		PString m_alias;
+		NetworkAddress m_network;
+	};
+
+	PString FilterAsString(const Filter & filter) const;
+
+	std::vector<Filter> m_filters;
+	mutable PMutex m_filterMutex;
+	volatile unsigned m_generation;
+	CaptureQueue * volatile m_queue;	// several MB, only allocated by the first AddFilter() and kept until the end
+	PcapWriter m_writer;
+	unsigned m_written;
+	mutable PMutex m_writerMutex;	// never taken by the relay threads
+};
+
+/** Capture of the encoded RAS, Q.931 and H.245 messages received and sent
+    by the gatekeeper, without decoding or tracing them.
+
+    While active, the sockets copy each message with its addresses and call
+    into a lock-free queue, the capture writer thread drains it into rotating
+    pcapng files. Q.931 and H.245 are written as TCP streams with TPKT
+    headers, so Wireshark and contrib/sigcapture can decode them.
+*/
+class SignalingCapture : public Singleton<SignalingCapture> {
+public:
+	SignalingCapture();
+	~SignalingCapture();
+
+	/// read the file settings from [Proxy]
+	void LoadConfig();
+
+	void Start();
+	/// the writer closes the file when the queue is empty
+	void Stop();
+	bool IsActive() const { return GkAtomicLoad(&m_active) != 0; }
+
+	/// queue a copy of a RAS message, never blocks
+	void Capture(const PIPSocket::Address & srcIP, WORD srcPort, const PIPSocket::Address & dstIP, WORD dstPort, const BYTE * data, WORD len)
+	{
+		SignalCaptureQueue * queue = GetQueue();
+		if (queue)
+			queue->Push(PTime().GetTimestamp(), srcIP, srcPort, dstIP, dstPort, data, len);
+	}
+	/// queue a copy of a Q.931 or H.245 message, never blocks
+	void Capture(const CapturedPacketInfo & info, const BYTE * data)
+	{
+		SignalCaptureQueue * queue = GetQueue();
+		if (queue)
+			queue->Push(info, data);
+	}
+
+	/// write all queued messages, called by the writer thread
+	void WriteQueued();
+
+	PString PrintStatus() const;
+
+protected:
+	SignalCaptureQueue * GetQueue() const { return static_cast<SignalCaptureQueue *>(GkAtomicLoadPointer((void * volatile const *)&m_queue)); }
+
+	volatile unsigned m_active;
+	SignalCaptureQueue * volatile m_queue;	// about 8 MB, only allocated by the first Start() and kept until the end
+	CapturedSignal * m_message;	// the writer pops into it, too big for the stack
+	PcapWriter m_writer;
+	unsigned m_written;
+	mutable PMutex m_writerMutex;	// never taken by the signaling threads
+};
+
+#endif // CAPTURE_H
@@ -0,0 +1,290 @@
+/*
+ * capture.t.cxx
+ *
+ * unit tests for capture.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include "capture.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class CaptureTest : public ::testing::Test {
+protected:
+	CaptureTest() { }
+
+	// one's complement sum over a header including its checksum, 0xffff if valid
+	static WORD Sum(const BYTE * data, unsigned len, unsigned sum = 0)
+	{
+		for (unsigned i = 0; i + 1 < len; i += 2)
+			sum += ((unsigned)data[i] << 8) | data[i + 1];
+		if (len & 1)
+			sum += (unsigned)data[len - 1] << 8;
+		while (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		return (WORD)sum;
+	}
+};
+
+
+TEST_F(CaptureTest, Queue) {
+	CaptureQueue * queue = new CaptureQueue();	// too big for the stack
+	const PIPSocket::Address src("10.0.0.1");
+	const PIPSocket::Address dst("10.0.0.2");
+	BYTE data[2000];
+	for (unsigned i = 0; i < sizeof(data); ++i)
+		data[i] = (BYTE)i;
+	CapturedPacket packet;
+	EXPECT_FALSE(queue->Pop(packet));
+
+	EXPECT_TRUE(queue->Push(1000, src, 5000, dst, 6000, data, 172));
+	ASSERT_TRUE(queue->Pop(packet));
+	EXPECT_EQ(1000, packet.m_time);
+	EXPECT_TRUE(packet.m_srcIP == src);
+	EXPECT_TRUE(packet.m_dstIP == dst);
+	EXPECT_EQ(5000, packet.m_srcPort);
+	EXPECT_EQ(6000, packet.m_dstPort);
+	EXPECT_EQ(172, packet.m_len);
+	EXPECT_EQ(172, packet.m_origLen);
+	EXPECT_EQ(0, memcmp(packet.m_data, data, 172));
+
+	// long packets are truncated to the snap length
+	EXPECT_TRUE(queue->Push(1000, src, 5000, dst, 6000, data, sizeof(data)));
+	ASSERT_TRUE(queue->Pop(packet));
+	EXPECT_EQ(CapturedPacket::MaxSize, packet.m_len);
+	EXPECT_EQ(sizeof(data), packet.m_origLen);
+
+	// a full queue drops packets instead of blocking
+	for (unsigned i = 0; i < CaptureQueue::Capacity; ++i)
+		EXPECT_TRUE(queue->Push(i, src, 5000, dst, 6000, data, 20));
+	EXPECT_FALSE(queue->Push(9999, src, 5000, dst, 6000, data, 20));
+	EXPECT_EQ(1u, queue->GetDropped());
+	for (unsigned i = 0; i < CaptureQueue::Capacity; ++i) {
+		ASSERT_TRUE(queue->Pop(packet));
+		EXPECT_EQ((PInt64)i, packet.m_time);
+	}
+	EXPECT_FALSE(queue->Pop(packet));
+	delete queue;
+}
+
+TEST_F(CaptureTest, IPv4Headers) {
+	CapturedPacket packet;
+	packet.m_protocol = CapturedPacketInfo::UDP;
+	packet.m_tpkt = false;
+	packet.m_srcIP = PIPSocket::Address("192.168.1.10");
+	packet.m_dstIP = PIPSocket::Address("10.0.0.2");
+	packet.m_srcPort = 40000;
+	packet.m_dstPort = 50002;
+	packet.m_len = packet.m_origLen = 21;	// odd length
+	for (unsigned i = 0; i < packet.m_len; ++i)
+		packet.m_data[i] = (BYTE)(0x80 + i);
+
+	BYTE header[PcapWriter::MaxHeaderSize];
+	ASSERT_EQ(28u, PcapWriter::BuildHeaders(packet, packet.m_data, header));
+	EXPECT_EQ(0x45, header[0]);
+	EXPECT_EQ(0, header[2]);
+	EXPECT_EQ(20 + 8 + 21, header[3]);
+	EXPECT_EQ(17, header[9]);
+	EXPECT_EQ(192, header[12]);
+	EXPECT_EQ(10, header[15]);
+	EXPECT_EQ(10, header[16]);
+	EXPECT_EQ(2, header[19]);
+	EXPECT_EQ(0xffff, Sum(header, 20));	// IP header checksum
+
+	const BYTE * udp = header + 20;
+	EXPECT_EQ(40000, (udp[0] << 8) | udp[1]);
+	EXPECT_EQ(50002, (udp[2] << 8) | udp[3]);
+	EXPECT_EQ(8 + 21, (udp[4] << 8) | udp[5]);
+	// UDP checksum over pseudo header, header and payload
+	unsigned sum = Sum(header + 12, 8);
+	sum += 17 + 8 + 21;
+	sum = Sum(udp, 8, sum);
+	EXPECT_EQ(0xffff, Sum(packet.m_data, packet.m_len, sum));
+
+	// no checksum for truncated packets
+	packet.m_origLen = 1500;
+	PcapWriter::BuildHeaders(packet, packet.m_data, header);
+	EXPECT_EQ(0, udp[6]);
+	EXPECT_EQ(0, udp[7]);
+	EXPECT_EQ(8 + 1500, (udp[4] << 8) | udp[5]);
+}
+
+TEST_F(CaptureTest, TCPHeaders) {
+	CapturedSignal * message = new CapturedSignal();
+	message->m_srcIP = PIPSocket::Address("10.0.0.1");
+	message->m_dstIP = PIPSocket::Address("10.0.0.2");
+	message->m_srcPort = 1720;
+	message->m_dstPort = 40001;
+	message->m_protocol = CapturedPacketInfo::TCP;
+	message->m_tpkt = true;
+	message->m_len = message->m_origLen = 3001;
+	for (unsigned i = 0; i < message->m_len; ++i)
+		message->m_data[i] = (BYTE)(i * 7);
+
+	BYTE header[PcapWriter::MaxHeaderSize];
+	ASSERT_EQ(20u + 20u + 4u, PcapWriter::BuildHeaders(*message, message->m_data, header, 0x01020304));
+	EXPECT_EQ(6, header[9]);
+	EXPECT_EQ(20 + 20 + 4 + 3001, (header[2] << 8) | header[3]);
+	EXPECT_EQ(0xffff, Sum(header, 20));
+
+	const BYTE * tcp = header + 20;
+	EXPECT_EQ(1720, (tcp[0] << 8) | tcp[1]);
+	EXPECT_EQ(40001, (tcp[2] << 8) | tcp[3]);
+	EXPECT_EQ(0x01, tcp[4]);
+	EXPECT_EQ(0x04, tcp[7]);
+	EXPECT_EQ(0x50, tcp[12]);
+	const BYTE * tpkt = tcp + 20;
+	EXPECT_EQ(3, tpkt[0]);
+	EXPECT_EQ(4 + 3001, (tpkt[2] << 8) | tpkt[3]);
+	// TCP checksum over pseudo header, header, TPKT and payload
+	unsigned sum = Sum(header + 12, 8);
+	sum += 6 + 20 + 4 + 3001;
+	sum = Sum(tcp, 24, sum);
+	EXPECT_EQ(0xffff, Sum(message->m_data, message->m_len, sum));
+	delete message;
+}
+
+TEST_F(CaptureTest, SignalQueue) {
+	SignalCaptureQueue * queue = new SignalCaptureQueue();
+	BYTE data[10000];
+	for (unsigned i = 0; i < sizeof(data); ++i)
+		data[i] = (BYTE)i;
+	CapturedPacketInfo info;
+	info.m_time = 5;
+	info.m_srcIP = PIPSocket::Address("10.0.0.1");
+	info.m_dstIP = PIPSocket::Address("10.0.0.2");
+	info.m_srcPort = 1720;
+	info.m_dstPort = 40001;
+	info.m_origLen = 5000;
+	info.m_protocol = CapturedPacketInfo::TCP;
+	info.m_tpkt = true;
+	info.m_callNo = 12;
+	memset(info.m_callID, 0xab, sizeof(info.m_callID));
+
+	CapturedSignal * message = new CapturedSignal();
+	EXPECT_TRUE(queue->Push(info, data));
+	ASSERT_TRUE(queue->Pop(*message));
+	EXPECT_EQ(5000, message->m_len);
+	EXPECT_EQ(12, message->m_callNo);
+	EXPECT_EQ(0xab, message->m_callID[15]);
+	EXPECT_TRUE(message->m_tpkt);
+	EXPECT_EQ(0, memcmp(message->m_data, data, 5000));
+
+	info.m_origLen = sizeof(data);
+	EXPECT_TRUE(queue->Push(info, data));
+	ASSERT_TRUE(queue->Pop(*message));
+	EXPECT_EQ(CapturedSignal::MaxSize, message->m_len);
+	EXPECT_EQ(sizeof(data), message->m_origLen);
+	delete message;
+	delete queue;
+}
+
+TEST_F(CaptureTest, PcapNG) {
+	const PDirectory dir = PDirectory().GetPath() + "capturetest";
+	dir.Create();
+	PcapWriter * writer = new PcapWriter();
+	writer->SetLimits(dir, "testng-", 0, 0, PcapWriter::PcapNG);
+
+	CapturedPacket packet;
+	packet.m_time = 1000000;
+	packet.m_srcIP = PIPSocket::Address("10.0.0.1");
+	packet.m_dstIP = PIPSocket::Address("10.0.0.2");
+	packet.m_srcPort = 1720;
+	packet.m_dstPort = 40001;
+	packet.m_protocol = CapturedPacketInfo::TCP;
+	packet.m_tpkt = true;
+	packet.m_len = packet.m_origLen = 101;
+	memset(packet.m_data, 0x08, packet.m_len);
+	packet.m_callNo = 0;
+	EXPECT_TRUE(writer->Write(packet));
+	packet.m_callNo = 3;
+	memset(packet.m_callID, 0x11, sizeof(packet.m_callID));
+	EXPECT_TRUE(writer->Write(packet));
+	const PFilePath name = writer->GetFileName();
+	delete writer;
+
+	PFile file(name, PFile::ReadOnly);
+	PBYTEArray content((PINDEX)file.GetLength());
+	ASSERT_TRUE(file.Read(content.GetPointer(), content.GetSize()));
+	file.Close();
+	PFile::Remove(name);
+	PDirectory::Remove(dir);
+
+	// section header, interface description and two enhanced packet blocks, each with matching trailing length
+	const unsigned expectedTypes[4] = { 0x0a0d0d0a, 1, 6, 6 };
+	unsigned lengths[4];
+	PINDEX pos = 0;
+	for (unsigned i = 0; i < 4; ++i) {
+		ASSERT_LE(pos + 8, content.GetSize());
+		unsigned type, length, trailing;
+		memcpy(&type, content.GetPointer() + pos, 4);
+		memcpy(&length, content.GetPointer() + pos + 4, 4);
+		EXPECT_EQ(expectedTypes[i], type);
+		ASSERT_EQ(0u, length % 4);
+		ASSERT_LE(pos + length, (unsigned)content.GetSize());
+		memcpy(&trailing, content.GetPointer() + pos + length - 4, 4);
+		EXPECT_EQ(length, trailing);
+		lengths[i] = length;
+		pos += length;
+	}
+	EXPECT_EQ(content.GetSize(), pos);
+	// 28 byte block header + 20 IP + 20 TCP + 4 TPKT + 101 payload padded + trailing length
+	EXPECT_EQ(28u + 148u + 4u, lengths[2]);
+	// the second packet carries the call as a comment
+	const PString comment = "call 3 11111111-1111-1111-1111-111111111111";
+	EXPECT_EQ(lengths[2] + 4 + 44 + 4, lengths[3]);
+	EXPECT_EQ(0, memcmp(content.GetPointer() + pos - lengths[3] + 28 + 148 + 4, (const char *)comment, comment.GetLength()));
+}
+
+TEST_F(CaptureTest, FileRotation) {
+	const PDirectory dir = PDirectory().GetPath() + "capturetest";
+	dir.Create();
+	PcapWriter * writer = new PcapWriter();
+	writer->SetLimits(dir, "test-", 2000, 2);
+
+	CapturedPacket packet;
+	packet.m_protocol = CapturedPacketInfo::UDP;
+	packet.m_tpkt = false;
+	packet.m_callNo = 0;
+	packet.m_time = 1000000;
+	packet.m_srcIP = PIPSocket::Address("10.0.0.1");
+	packet.m_dstIP = PIPSocket::Address("10.0.0.2");
+	packet.m_srcPort = 5000;
+	packet.m_dstPort = 6000;
+	packet.m_len = packet.m_origLen = 172;
+	memset(packet.m_data, 0, packet.m_len);
+	// a new file is started once 24 byte file header + n * (16 + 28 + 172) >= 2000, so each file holds 10 packets
+	for (unsigned i = 0; i < 25; ++i)
+		EXPECT_TRUE(writer->Write(packet));
+	EXPECT_EQ(3u, writer->GetFilesStarted());
+
+	PFile last(writer->GetFileName(), PFile::ReadOnly);
+	EXPECT_EQ(24 + 5 * (16 + 28 + 172), last.GetLength());
+	last.Close();
+	delete writer;
+
+	// only the newest 2 files are kept
+	unsigned files = 0;
+	PDirectory entries(dir);
+	if (entries.Open()) {
+		do {
+			if (entries.GetEntryName().Find("test-") == 0) {
+				++files;
+				PFile::Remove(dir + entries.GetEntryName());
+			}
+		} while (entries.Next());
+	}
+	EXPECT_EQ(2u, files);
+	PDirectory::Remove(dir);
+}
+
+}  // namespace
@@ -0,0 +1,193 @@
+//////////////////////////////////////////////////////////////////
+//
+// cfgsnapshot.h
+//
+// Typed configuration snapshots that are rebuilt on reload and
+// published with an atomic pointer swap, and the atomic helpers
+// they are built on
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef CFGSNAPSHOT_H
+#define CFGSNAPSHOT_H "@(#) $Id$"
+
+#include <list>
+#include <utility>
+#include <ptlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/// publish a pointer, all stores before this call become visible to readers of the pointer
+inline void * GkAtomicExchangePointer(void * volatile * target, void * value)
+{
+#if defined(_WIN32)
+	return InterlockedExchangePointer((PVOID volatile *)target, value);
+#elif defined(__ATOMIC_ACQ_REL)
+	return __atomic_exchange_n(target, value, __ATOMIC_ACQ_REL);
+#else
+	__sync_synchronize();
+	return __sync_lock_test_and_set(target, value);
+#endif
+}
+
+/// read a pointer published with GkAtomicExchangePointer()
+inline void * GkAtomicLoadPointer(void * volatile const * source)
+{
+#if defined(_WIN32)
+	void * p = *source;	// volatile reads have acquire semantics with MSVC
+	return p;
+#elif defined(__ATOMIC_ACQUIRE)
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+#else
+	void * p = *source;
+	__sync_synchronize();
+	return p;
+#endif
+}
+
+/// read a counter written by another thread, later reads can't be moved before it
+inline unsigned GkAtomicLoad(volatile const unsigned * source)
+{
+#if defined(_WIN32)
+	unsigned v = *source;	// volatile reads have acquire semantics with MSVC
+	return v;
+#elif defined(__ATOMIC_ACQUIRE)
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+#else
+	unsigned v = *source;
+	__sync_synchronize();
+	return v;
+#endif
+}
+
+/// write a counter, all earlier stores become visible before it
+inline void GkAtomicStore(volatile unsigned * target, unsigned value)
+{
+#if defined(_WIN32)
+	*target = value;	// volatile writes have release semantics with MSVC
+#elif defined(__ATOMIC_RELEASE)
+	__atomic_store_n(target, value, __ATOMIC_RELEASE);
+#else
+	__sync_synchronize();
+	*target = value;
+#endif
+}
+
+/// write a value that readers only need to see eventually, no ordering with other stores
+inline void GkAtomicStoreRelaxed(volatile unsigned * target, unsigned value)
+{
+#if defined(__ATOMIC_RELAXED)
+	__atomic_store_n(target, value, __ATOMIC_RELAXED);
+#else
+	*target = value;	// aligned word stores don't tear
+#endif
+}
+
+/// set #target# to #value# if it still contains #expected#, @return true on success
+inline bool GkAtomicCompareAndSwap(volatile unsigned * target, unsigned expected, unsigned value)
+{
+#if defined(_WIN32)
+	return (unsigned)InterlockedCompareExchange((LONG volatile *)target, (LONG)value, (LONG)expected) == expected;
+#else
+	return __sync_bool_compare_and_swap(target, expected, value);
+#endif
+}
+
+/// @return the incremented value
+inline unsigned GkAtomicIncrement(volatile unsigned * target)
+{
+#if defined(_WIN32)
+	return (unsigned)InterlockedIncrement((LONG volatile *)target);
+#else
+	return __sync_add_and_fetch(target, 1);
+#endif
+}
+
+/// @return the decremented value
+inline unsigned GkAtomicDecrement(volatile unsigned * target)
+{
+#if defined(_WIN32)
+	return (unsigned)InterlockedDecrement((LONG volatile *)target);
+#else
+	return __sync_sub_and_fetch(target, 1);
+#endif
+}
+
+/** A typed, read-only copy of configuration values for one subsystem.
+
+    The snapshot type T must have a default constructor that sets the
+    built-in defaults and a method void Load(PConfig *) that reads its values.
+    Readers call Get() and use plain fields without taking any lock,
+    a reload builds a complete new T and swaps it in with one atomic store.
+
+    A replaced snapshot is not deleted immediately, because a reader may
+    have fetched the pointer right before the swap. It is kept for a grace
+    period that is much longer than any code path holding the pointer.
+*/
+template<class T>
+class ConfigSnapshot {
+public:
+	ConfigSnapshot() : m_current(new T) { }
+	~ConfigSnapshot()
+	{
+		delete static_cast<T *>(m_current);
+		PurgeRetired(true);
+	}
+
+	/// @return the currently active snapshot, never NULL
+	const T * Get() const { return static_cast<const T *>(GkAtomicLoadPointer(&m_current)); }
+	const T * operator->() const { return Get(); }
+
+	/// build a new snapshot from the config and make it the current one
+	void Reload(PConfig * cfg)
+	{
+		T * snapshot = new T;
+		snapshot->Load(cfg);
+		Publish(snapshot);
+	}
+
+	/// make #snapshot# the current one, takes ownership
+	void Publish(T * snapshot)
+	{
+		PWaitAndSignal lock(m_retiredMutex);
+		T * old = static_cast<T *>(GkAtomicExchangePointer(&m_current, snapshot));
+		m_retired.push_back(std::make_pair(old, PTime()));
+		PurgeRetired(false);
+	}
+
+protected:
+	void PurgeRetired(bool all)
+	{
+		const PTime now;
+		typename std::list<std::pair<T *, PTime> >::iterator i = m_retired.begin();
+		while (i != m_retired.end()) {
+			if (all || (now - i->second).GetSeconds() >= GracePeriod) {
+				delete i->first;
+				i = m_retired.erase(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	enum { GracePeriod = 60 };	// seconds
+
+	void * volatile m_current;
+	std::list<std::pair<T *, PTime> > m_retired;
+	PMutex m_retiredMutex;
+
+private:
+	ConfigSnapshot(const ConfigSnapshot &);
+	ConfigSnapshot & operator=(const ConfigSnapshot &);
+};
+
+#endif // CFGSNAPSHOT_H
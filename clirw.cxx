@@ -151,11 +151,75 @@ struct DoubleIpRule_greater : public std::binary_function<CLIRewrite::DoubleIpRu
 		return false;
 	}
 };
+
+/// the first rule for a prefix that matches, of the rules found so far
+struct FirstRewriteRule {
+	FirstRewriteRule(const CLIRewrite::RewriteRules & rules, const char * number, PINDEX first)
+		: m_rules(rules), m_numberLen(strlen(number)), m_first(first) { }
+
+	void operator()(const PString &, const std::vector<PINDEX> & positions, int matchLen)
+	{
+		for (unsigned i = 0; i < positions.size() && positions[i] < m_first; ++i)
+			if (m_rules[positions[i]].m_rewriteType != CLIRewrite::RewriteRule::NumberToNumber
+					|| m_numberLen == (unsigned)matchLen) {
+				m_first = positions[i];
+				break;
+			}
+	}
+
+	const CLIRewrite::RewriteRules & m_rules;
+	unsigned m_numberLen;
+	PINDEX m_first;
+};
 } /* namespace */
 
+CLIRewrite::PrefixIndex::PrefixIndex(const RewriteRules & rules) : m_firstAny(P_MAX_INDEX)
+{
+	std::map<std::string, std::vector<PINDEX> > prefixes[3];
+	for (unsigned i = 0; i < rules.size(); ++i) {
+		const RewriteRule & rule = rules[i];
+		// a rule without screening and CLIs is never used, '!' prefixes never match
+		if ((rule.m_screeningType == RewriteRule::NoScreening && rule.m_cli.empty())
+				|| (!rule.m_prefix.empty() && rule.m_prefix[0] == '!'))
+			continue;
+		if (rule.m_prefix.empty()) {
+			if (m_firstAny == P_MAX_INDEX)
+				m_firstAny = i;
+		} else if (rule.m_matchType >= RewriteRule::MatchDialedNumber && rule.m_matchType <= RewriteRule::MatchCallerNumber)
+			prefixes[rule.m_matchType][rule.m_prefix].push_back(i);
+	}
+	for (unsigned t = 0; t < 3; ++t) {
+		std::map<std::string, std::vector<PINDEX> >::const_iterator i = prefixes[t].begin();
+		for (; i != prefixes[t].end(); ++i)
+			m_prefixes[t].Insert(i->first.c_str(), i->second);
+	}
+}
+
+PINDEX CLIRewrite::PrefixIndex::Find(
+	const RewriteRules & rules,
+	const char * const numbers[3]
+	) const
+{
+	PINDEX first = m_firstAny;
+	for (unsigned t = 0; t < 3; ++t)
+		if (numbers[t] != NULL && m_prefixes[t].GetSize() > 0) {
+			FirstRewriteRule match(rules, numbers[t], first);
+			m_prefixes[t].Match(numbers[t], match);
+			first = match.m_first;
+		}
+	return first;
+}
+
+PINDEX CLIRewrite::NetworkIndex::Find(const PIPSocket::Address & addr) const
+{
+	const int i = m_networks.FindFirst(addr);
+	return (i >= 0 && (PINDEX)i < m_firstAny) ? (PINDEX)i : m_firstAny;
+}
+
 CLIRewrite::CLIRewrite()
 	: m_processSourceAddress(true), m_removeH323Id(false),
-	m_CLIRPolicy(RewriteRule::IgnoreCLIR), m_sqlConn(NULL)
+	m_CLIRPolicy(RewriteRule::IgnoreCLIR), m_inboundIndex(NULL), m_outboundIndex(NULL),
+	m_sqlConn(NULL), m_sqlCache(NULL)
 {
 	PConfig * cfg = GkConfig();
 
@@ -456,7 +520,19 @@ CLIRewrite::CLIRewrite()
 		}
 		++diprule;
 	}
-	
+
+	// index the sorted rules
+	m_inboundIndex = new NetworkIndex(m_inboundRules);
+	for (unsigned i = 0; i < m_inboundRules.size(); ++i)
+		m_inboundPrefixes.push_back(new PrefixIndex(m_inboundRules[i].second));
+	m_outboundIndex = new NetworkIndex(m_outboundRules);
+	m_outboundPrefixes.resize(m_outboundRules.size());
+	for (unsigned i = 0; i < m_outboundRules.size(); ++i) {
+		m_outboundDestIndex.push_back(new NetworkIndex(m_outboundRules[i].second));
+		for (unsigned j = 0; j < m_outboundRules[i].second.size(); ++j)
+			m_outboundPrefixes[i].push_back(new PrefixIndex(m_outboundRules[i].second[j].second));
+	}
+
 	PTRACE(5, "CLIRW\t" << inboundRules << " inbound rules loaded");
 	if (PTrace::CanTrace(6)) {
 		ostream &strm = PTrace::Begin(6, __FILE__, __LINE__);
@@ -538,10 +614,26 @@ CLIRewrite::CLIRewrite()
 			m_sqlConn = NULL;
 			return;
 		}
+
+		const long cacheTimeout = cfg->GetInteger(CLIRewriteSQLSection, "CacheTimeout", 0);
+		if (cacheTimeout != 0)
+			m_sqlCache = new CacheManager(cacheTimeout);
 	}
 #endif // HAS_DATABASE
 }
 
+CLIRewrite::~CLIRewrite()
+{
+	delete m_inboundIndex;
+	DeleteObjectsInContainer(m_inboundPrefixes);
+	delete m_outboundIndex;
+	DeleteObjectsInContainer(m_outboundDestIndex);
+	for (unsigned i = 0; i < m_outboundPrefixes.size(); ++i)
+		DeleteObjectsInContainer(m_outboundPrefixes[i]);
+	delete m_sqlCache;
+	delete m_sqlConn;
+}
+
 void CLIRewrite::InRewrite(
 	SetupMsg & msg /// Q.931 Setup message to be rewritten
 	)
@@ -551,25 +643,20 @@ void CLIRewrite::InRewrite(
 
 	// apply [RewriteCLI::SQL] InboundQuery
 	if (!m_inboundQuery.IsEmpty()) {
-		SingleIpRule * rule = CLIRewrite::RunQuery(m_inboundQuery, msg);
+		SingleIpRule * rule = CLIRewrite::RunQuery(m_inboundQuery, true, msg);
 		if (rule) {
-			Rewrite(msg, *rule, true, NULL);
+			const PrefixIndex prefixes(rule->second);
+			Rewrite(msg, *rule, prefixes, true, NULL);
 			delete rule;
 		}
 	}
 
-	// find a config file rule that matches caller's IP	
-	SingleIpRules::const_iterator i = m_inboundRules.begin();
-	while (i != m_inboundRules.end())
-		if (i->first.IsAny() || (addr << i->first))
-			break;
-		else
-			++i;
-
-	if (i == m_inboundRules.end())
+	// find a config file rule that matches caller's IP
+	const PINDEX i = m_inboundIndex->Find(addr);
+	if (i == P_MAX_INDEX)
 		return;
 
-	Rewrite(msg, *i, true, NULL);
+	Rewrite(msg, m_inboundRules[i], *m_inboundPrefixes[i], true, NULL);
 }
 
 void CLIRewrite::OutRewrite(
@@ -583,41 +670,31 @@ void CLIRewrite::OutRewrite(
 
 	// apply [RewriteCLI::SQL] OutboundQuery
 	if (!m_outboundQuery.IsEmpty()) {
-		SingleIpRule * rule = CLIRewrite::RunQuery(m_inboundQuery, msg);
+		SingleIpRule * rule = CLIRewrite::RunQuery(m_outboundQuery, false, msg);
 		if (rule) {
-			Rewrite(msg, *rule, false, &authData);
+			const PrefixIndex prefixes(rule->second);
+			Rewrite(msg, *rule, prefixes, false, &authData);
 			delete rule;
 		}
 	}
 
-	// find a config file rule that matches caller's IP	
-	DoubleIpRules::const_iterator diprule = m_outboundRules.begin();
-	while (diprule != m_outboundRules.end())
-		if (diprule->first.IsAny() || (addr << diprule->first))
-			break;
-		else
-			++diprule;
-
-	if (diprule == m_outboundRules.end())
+	// find a config file rule that matches caller's IP
+	const PINDEX diprule = m_outboundIndex->Find(addr);
+	if (diprule == P_MAX_INDEX)
 		return;
 
-	// now find a rule that also matches callee's IP	
-	SingleIpRules::const_iterator siprule = diprule->second.begin();
-	while (siprule != diprule->second.end())
-		if (siprule->first.IsAny() || (destAddr << siprule->first))
-			break;
-		else
-			++siprule;
-
-	if (siprule == diprule->second.end())
+	// now find a rule that also matches callee's IP
+	const PINDEX siprule = m_outboundDestIndex[diprule]->Find(destAddr);
+	if (siprule == P_MAX_INDEX)
 		return;
 
-	Rewrite(msg, *siprule, false, &authData);
+	Rewrite(msg, m_outboundRules[diprule].second[siprule], *m_outboundPrefixes[diprule][siprule], false, &authData);
 }
 
 void CLIRewrite::Rewrite(
 	SetupMsg & msg, /// Q.931 Setup message to be rewritten
 	const SingleIpRule & ipRule,
+	const PrefixIndex & prefixes,
 	bool inbound,
 	SetupAuthData * authData
 	) const
@@ -657,86 +734,62 @@ void CLIRewrite::Rewrite(
 
 	// find ANI/CLI condition/prefix match
 	PString newcli;
-	RewriteRules::const_iterator rule = ipRule.second.begin();
-	while (rule != ipRule.second.end()) {
-		if (!rule->m_prefix.empty()) {
-			int matchLen = 0;
-			const char *number = NULL;
-			if (rule->m_matchType == RewriteRule::MatchCallerNumber)
-				number = cli;
-			else if (rule->m_matchType == RewriteRule::MatchDialedNumber)
-				number = dno;
-			else if (!inbound && rule->m_matchType == RewriteRule::MatchDestinationNumber)
-				number = cno;
-			if (number != NULL) {
-				matchLen = MatchPrefix(number, rule->m_prefix.c_str());
-				if (matchLen > 0 && rule->m_rewriteType == RewriteRule::NumberToNumber
-						&& strlen(number) != (unsigned)matchLen)
-					matchLen = 0;
-			}
-			if (matchLen <= 0) {
-				++rule;
-				continue;
-			}
-		}
-		if (rule->m_screeningType != RewriteRule::NoScreening)
-			break;
-		if (!rule->m_cli.empty()) {
-			// get the new ANI/CLI
-			newcli = rule->m_cli[rand() % rule->m_cli.size()].c_str();
-			// if this is a number range, choose the new ANI/CLI from the range
-			const PINDEX sepIndex = newcli.Find('-');
-			if (sepIndex != P_MAX_INDEX) {
-				PString lowStr(newcli.Left(sepIndex).Trim());
-				PString highStr(newcli.Mid(sepIndex + 1).Trim());
-				PUInt64 low = lowStr.AsUnsigned64();
-				PUInt64 high = highStr.AsUnsigned64();
-				PUInt64 diff = (low < high) ? (high - low) : (low - high);
-
-				int numLeadingZeros1 = 0;
-				while (numLeadingZeros1 < lowStr.GetLength()
-						&& lowStr[numLeadingZeros1] == '0')
-					++numLeadingZeros1;
-						
-				int numLeadingZeros2 = 0;
-				while (numLeadingZeros2 < highStr.GetLength()
-						&& highStr[numLeadingZeros2] == '0')
-					++numLeadingZeros2;
-				
-				if (diff >= RAND_MAX)
-					diff = PUInt64(rand());
-				else
-					diff = PUInt64(rand() % ((unsigned)diff + 1));
-					
-				diff = (low < high) ? (low + diff) : (high + diff);
-				newcli = PString(diff);
+	const char * const numbers[3] = { dno, inbound ? NULL : (const char *)cno, cli };
+	const PINDEX r = prefixes.Find(ipRule.second, numbers);
+	if (r == P_MAX_INDEX)
+		return;
 
-				if (lowStr.GetLength() == highStr.GetLength() && (numLeadingZeros1 > 0 || numLeadingZeros2 > 0)) {
-					while (newcli.GetLength() < highStr.GetLength())
-						newcli = PString("0") + newcli;
-				}
+	const RewriteRules::const_iterator rule = ipRule.second.begin() + r;
+	if (rule->m_screeningType == RewriteRule::NoScreening) {
+		// get the new ANI/CLI
+		newcli = rule->m_cli[rand() % rule->m_cli.size()].c_str();
+		// if this is a number range, choose the new ANI/CLI from the range
+		const PINDEX sepIndex = newcli.Find('-');
+		if (sepIndex != P_MAX_INDEX) {
+			PString lowStr(newcli.Left(sepIndex).Trim());
+			PString highStr(newcli.Mid(sepIndex + 1).Trim());
+			PUInt64 low = lowStr.AsUnsigned64();
+			PUInt64 high = highStr.AsUnsigned64();
+			PUInt64 diff = (low < high) ? (high - low) : (low - high);
+
+			int numLeadingZeros1 = 0;
+			while (numLeadingZeros1 < lowStr.GetLength()
+					&& lowStr[numLeadingZeros1] == '0')
+				++numLeadingZeros1;
+					
+			int numLeadingZeros2 = 0;
+			while (numLeadingZeros2 < highStr.GetLength()
+					&& highStr[numLeadingZeros2] == '0')
+				++numLeadingZeros2;
+			
+			if (diff >= RAND_MAX)
+				diff = PUInt64(rand());
+			else
+				diff = PUInt64(rand() % ((unsigned)diff + 1));
+				
+			diff = (low < high) ? (low + diff) : (high + diff);
+			newcli = PString(diff);
 
-				PTRACE(5, "CLIRW\t" << (inbound ? "Inbound" : "Outbound")
-					<< " CLI range rewrite target is '" << newcli << "' selected by the rule "
-					<< rule->AsString()
-					);
-			}
-			if (rule->m_rewriteType == RewriteRule::PrefixToPrefix
-					&& rule->m_matchType == RewriteRule::MatchCallerNumber) {
-				PString unused;
-				newcli = RewriteString(cli, rule->m_prefix.c_str(), newcli, unused);
+			if (lowStr.GetLength() == highStr.GetLength() && (numLeadingZeros1 > 0 || numLeadingZeros2 > 0)) {
+				while (newcli.GetLength() < highStr.GetLength())
+					newcli = PString("0") + newcli;
 			}
 
 			PTRACE(5, "CLIRW\t" << (inbound ? "Inbound" : "Outbound")
-				<< " CLI rewrite to '" << newcli << "' by the rule " << rule->AsString()
+				<< " CLI range rewrite target is '" << newcli << "' selected by the rule "
+				<< rule->AsString()
 				);
-			break;
 		}
-		++rule;
-	}
+		if (rule->m_rewriteType == RewriteRule::PrefixToPrefix
+				&& rule->m_matchType == RewriteRule::MatchCallerNumber) {
+			PString unused;
+			newcli = RewriteString(cli, rule->m_prefix.c_str(), newcli, unused);
+		}
 
-	if (rule == ipRule.second.end())
-		return;
+		PTRACE(5, "CLIRW\t" << (inbound ? "Inbound" : "Outbound")
+			<< " CLI rewrite to '" << newcli << "' by the rule " << rule->AsString()
+			);
+	}
 
 	bool isTerminal = false;	
 	if (authData && authData->m_call) {
@@ -879,7 +932,7 @@ void CLIRewrite::Rewrite(
 	}
 }
 
-CLIRewrite::SingleIpRule * CLIRewrite::RunQuery(const PString & query, const SetupMsg & msg)
+CLIRewrite::SingleIpRule * CLIRewrite::RunQuery(const PString & query, bool inbound, const SetupMsg & msg)
 {
 #if HAS_DATABASE
 	GkSQLResult::ResultRow resultRow;
@@ -901,43 +954,66 @@ CLIRewrite::SingleIpRule * CLIRewrite::RunQuery(const PString & query, const Set
 	}
 	params["cli"] = cli;
 
-	GkSQLResult * result = m_sqlConn->ExecuteQuery(query, params, -1);
-	if (result == NULL) {
-		PTRACE(2, CLIRewriteSQLSection << ": query failed - timeout or fatal error");
-		SNMP_TRAP(4, SNMPError, Database, PString(CLIRewriteSQLSection) + " query failed");
-		return NULL;
-	}
+	// the result only depends on the parameters, a row is cached as '=' + CLI
+	// (the CLI may be empty), an empty value means the query returned no rows
+	const PString cacheKey = PString(inbound ? "in" : "out") + ";" + params["callerip"] + ";" + called + ";" + cli;
+	PString newCLI;
+	PString cached;
+	if (m_sqlCache && m_sqlCache->Retrieve(cacheKey, cached)) {
+		if (cached.IsEmpty()) {
+			PTRACE(5, CLIRewriteSQLSection << "\tCached result : no rows");
+			return NULL;
+		}
+		newCLI = cached.Mid(1);
+		PTRACE(5, CLIRewriteSQLSection << "\tCached result : " << newCLI);
+	} else {
+		GkSQLResult * result = m_sqlConn->ExecuteQuery(query, params, -1);
+		if (result == NULL) {
+			PTRACE(2, CLIRewriteSQLSection << ": query failed - timeout or fatal error");
+			SNMP_TRAP(4, SNMPError, Database, PString(CLIRewriteSQLSection) + " query failed");
+			return NULL;
+		}
+
+		if (!result->IsValid()) {
+			PTRACE(2, CLIRewriteSQLSection << ": query failed (" << result->GetErrorCode()
+				<< ") - " << result->GetErrorMessage());
+			SNMP_TRAP(4, SNMPError, Database, PString(CLIRewriteSQLSection) + " query failed");
+			delete result;
+			return NULL;
+		}
 
-	if (!result->IsValid()) {
-		PTRACE(2, CLIRewriteSQLSection << ": query failed (" << result->GetErrorCode()
-			<< ") - " << result->GetErrorMessage());
-		SNMP_TRAP(4, SNMPError, Database, PString(CLIRewriteSQLSection) + " query failed");
+		if (result->GetNumRows() != 1) {
+			PTRACE(3, CLIRewriteSQLSection << ": query returned no rows");
+			if (m_sqlCache)
+				m_sqlCache->Save(cacheKey, PString::Empty());
+			delete result;
+			return NULL;
+		} else if (result->GetNumFields() < 1) {
+			PTRACE(2, CLIRewriteSQLSection << ": bad query - no columns found in the result set");
+			delete result;
+			return NULL;
+		} else if (!result->FetchRow(resultRow) || resultRow.empty()) {
+			PTRACE(2, CLIRewriteSQLSection << ": query failed - could not fetch the result row");
+			SNMP_TRAP(4, SNMPError, Database, PString(CLIRewriteSQLSection) + " query failed");
+			delete result;
+			return NULL;
+		}
+		newCLI = resultRow[0].first;
+		PTRACE(5, CLIRewriteSQLSection << "\tQuery result : " << newCLI);
+		if (m_sqlCache)
+			m_sqlCache->Save(cacheKey, "=" + newCLI);
 		delete result;
-		return NULL;
 	}
-	
-	if (result->GetNumRows() != 1)
-		PTRACE(3, CLIRewriteSQLSection << ": query returned no rows");
-	else if (result->GetNumFields() < 1)
-		PTRACE(2, CLIRewriteSQLSection << ": bad query - no columns found in the result set");
-	else if (!result->FetchRow(resultRow) || resultRow.empty()) {
-		PTRACE(2, CLIRewriteSQLSection << ": query failed - could not fetch the result row");
-		SNMP_TRAP(4, SNMPError, Database, PString(CLIRewriteSQLSection) + " query failed");
-	} else {
-		PString newCLI = resultRow[0].first;
-		PTRACE(5, CLIRewriteSQLSection << "\tQuery result : " << newCLI);
 
-		RewriteRules rules;
-		RewriteRule rule;
-		//if ((result->GetNumFields() == 1)
+	RewriteRules rules;
+	RewriteRule rule;
+	//if ((result->GetNumFields() == 1)
 //		rule.m_manualCLIR = CLIRPassthrough;
 //		rule.m_CLIRPolicy = IgnoreCLIR;
-		rule.m_cli.push_back(newCLI);
-		rules.push_back(rule);
-		delete result;
-		return new SingleIpRule(addr, rules);
-	}
-	delete result;
-#endif // HAS_DATABASE
+	rule.m_cli.push_back((const char *)newCLI);
+	rules.push_back(rule);
+	return new SingleIpRule(addr, rules);
+#else
 	return NULL;
+#endif // HAS_DATABASE
 }
@@ -19,6 +19,7 @@
 #include <string>
 #include <vector>
 #include "Toolkit.h"
+#include "prefixtrie.h"
 
 struct SetupAuthData;
 class SignalingMsg;
@@ -26,6 +27,7 @@ template <class> class H225SignalingMsg;
 class H225_Setup_UUIE;
 typedef H225SignalingMsg<H225_Setup_UUIE> SetupMsg;
 class GkSQLConnection;
+class CacheManager;
 
 /// Perform Calling-Party-Number-IE/Setup-UUIE.sourceAddress rewritting
 class CLIRewrite {
@@ -89,7 +91,56 @@ public:
 	typedef std::pair<NetworkAddress, SingleIpRules> DoubleIpRule;
 	typedef std::vector<DoubleIpRule> DoubleIpRules;
 
+	/** The rules of one IP rule in a trie of prefixes per match type.
+	    Finds the rule a scan of the sorted rules would take first,
+	    without testing every prefix.
+	*/
+	class PrefixIndex {
+	public:
+		PrefixIndex(const RewriteRules & rules);
+
+		/** @return	the position of the first rule that matches, P_MAX_INDEX if none
+		*/
+		PINDEX Find(
+			const RewriteRules & rules, /// the rules the index was built for
+			const char * const numbers[3] /// dialed, destination and caller number (RewriteRule::MatchType), NULL if not available
+			) const;
+
+	private:
+		PrefixIndex(const PrefixIndex &);
+		PrefixIndex & operator=(const PrefixIndex &);
+
+		PrefixTrie<std::vector<PINDEX> > m_prefixes[3]; /// rule positions by match type and prefix
+		PINDEX m_firstAny; /// the first rule without a prefix
+	};
+
+	/// finds the first entry of the sorted IP rules that matches an address
+	class NetworkIndex {
+	public:
+		template <class IpRules>
+		NetworkIndex(const IpRules & rules) : m_firstAny(P_MAX_INDEX)
+		{
+			for (unsigned i = 0; i < rules.size(); ++i)
+				if (rules[i].first.IsAny()) {
+					if (m_firstAny == P_MAX_INDEX)
+						m_firstAny = i;
+				} else
+					m_networks.Add(rules[i].first, i);
+		}
+
+		/// @return	the position of the first rule that matches, P_MAX_INDEX if none
+		PINDEX Find(const PIPSocket::Address & addr) const;
+
+	private:
+		NetworkIndex(const NetworkIndex &);
+		NetworkIndex & operator=(const NetworkIndex &);
+
+		NetworkTree m_networks;
+		PINDEX m_firstAny; /// the first "any" rule
+	};
+
 	CLIRewrite();
+	~CLIRewrite();
 
 	/// Rewrite CLI before any Setup message processing, like auth & routing
 	void InRewrite(
@@ -109,12 +160,13 @@ protected:
 	void Rewrite(
 		SetupMsg &msg, /// Q.931 Setup message to be rewritten
 		const SingleIpRule &ipRule, /// rule to use for rewrite
+		const PrefixIndex &prefixes, /// index of the #ipRule# rules
 		bool inbound, /// rule type
 		SetupAuthData *authData /// additional data for outbound rules
 		) const;
 
 	// process inbound or outbound SQL queries and return a rule
-	SingleIpRule * RunQuery(const PString & query, const SetupMsg & msg);
+	SingleIpRule * RunQuery(const PString & query, bool inbound, const SetupMsg & msg);
 
 	CLIRewrite(const CLIRewrite &);
 	CLIRewrite & operator=(const CLIRewrite &);
@@ -122,6 +174,11 @@ protected:
 private:
 	SingleIpRules m_inboundRules; /// a set of inbound CLI/ANI rewrite rules
 	DoubleIpRules m_outboundRules; /// a set of outbound CLI/ANI rewrite rules
+	NetworkIndex * m_inboundIndex; /// caller's IP to m_inboundRules
+	std::vector<PrefixIndex *> m_inboundPrefixes; /// for each of m_inboundRules
+	NetworkIndex * m_outboundIndex; /// caller's IP to m_outboundRules
+	std::vector<NetworkIndex *> m_outboundDestIndex; /// callee's IP, for each of m_outboundRules
+	std::vector<std::vector<PrefixIndex *> > m_outboundPrefixes; /// for each callee rule of m_outboundRules
 	bool m_processSourceAddress; /// true to rewrite numbers in sourceAddress Setup-UUIE
 	bool m_removeH323Id; /// true to put in the sourceAddress Setup-UUIE field only rewritten ANI/CLI
 	int m_CLIRPolicy; /// how to process CLIR
@@ -130,6 +187,7 @@ private:
 	GkSQLConnection * m_sqlConn;
 	PString m_inboundQuery;
 	PString m_outboundQuery;
+	CacheManager * m_sqlCache; /// query results, NULL if CacheTimeout=0
 };
 
 #endif
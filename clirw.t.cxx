@@ -0,0 +1,193 @@
+/*
+ * clirw.t.cxx
+ *
+ * unit tests for clirw.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include "clirw.h"
+#include "h323util.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+typedef CLIRewrite::RewriteRule RewriteRule;
+
+class CLIRewriteTest : public ::testing::Test {
+protected:
+	CLIRewriteTest() { }
+
+	// the order of the rules after loading, as in clirw.cxx
+	struct RewriteRuleGreater {
+		bool operator()(const RewriteRule & e1, const RewriteRule & e2) const
+		{
+			long long int diff = e1.m_matchType - e2.m_matchType;
+			if (diff != 0)
+				return diff < 0;
+			diff = e1.m_prefix.length() - e2.m_prefix.length();
+			if (diff != 0)
+				return diff > 0;
+			return e1.m_prefix.compare(e2.m_prefix) > 0;
+		}
+	};
+
+	struct IpRuleGreater {
+		bool operator()(const CLIRewrite::SingleIpRule & e1, const CLIRewrite::SingleIpRule & e2) const
+		{
+			if (e1.first.IsAny()) {
+				if (!e2.first.IsAny())
+					return false;
+			} else {
+				if (e2.first.IsAny())
+					return true;
+				int diff = e1.first.Compare(e2.first);
+				if (diff != 0)
+					return diff > 0;
+			}
+			return false;
+		}
+	};
+
+	static std::string RandomDigits(unsigned minLen, unsigned maxLen, bool wildcards)
+	{
+		std::string digits;
+		const unsigned len = minLen + rand() % (maxLen - minLen + 1);
+		for (unsigned i = 0; i < len; ++i)
+			digits += (wildcards && rand() % 8 == 0) ? ".%"[rand() % 2] : (char)('0' + rand() % 10);
+		return digits;
+	}
+
+	static RewriteRule RandomRule()
+	{
+		RewriteRule rule;
+		rule.m_matchType = rand() % 3;
+		rule.m_rewriteType = rand() % 5;
+		if (rand() % 50 == 0)
+			rule.m_prefix = "";
+		else
+			rule.m_prefix = ((rand() % 30 == 0) ? "!" : "") + RandomDigits(2, 8, true);
+		if (rand() % 10 == 0)
+			rule.m_screeningType = RewriteRule::AlwaysHide;
+		else
+			rule.m_cli.push_back(RandomDigits(4, 8, false));
+		return rule;
+	}
+
+	// the first matching rule, as CLIRewrite::Rewrite() found it by testing every rule
+	static PINDEX ScanRules(const CLIRewrite::RewriteRules & rules, const char * const numbers[3])
+	{
+		for (unsigned i = 0; i < rules.size(); ++i) {
+			const RewriteRule & rule = rules[i];
+			if (!rule.m_prefix.empty()) {
+				int matchLen = 0;
+				const char * number = numbers[rule.m_matchType];
+				if (number != NULL) {
+					matchLen = MatchPrefix(number, rule.m_prefix.c_str());
+					if (matchLen > 0 && rule.m_rewriteType == RewriteRule::NumberToNumber
+							&& strlen(number) != (unsigned)matchLen)
+						matchLen = 0;
+				}
+				if (matchLen <= 0)
+					continue;
+			}
+			if (rule.m_screeningType != RewriteRule::NoScreening || !rule.m_cli.empty())
+				return i;
+		}
+		return P_MAX_INDEX;
+	}
+};
+
+
+TEST_F(CLIRewriteTest, PrefixIndex) {
+	srand(2468);
+	CLIRewrite::RewriteRules rules;
+	for (unsigned i = 0; i < 5000; ++i)
+		rules.push_back(RandomRule());
+	std::stable_sort(rules.begin(), rules.end(), RewriteRuleGreater());
+	const CLIRewrite::PrefixIndex index(rules);
+
+	std::vector<std::string> numbers;
+	for (unsigned n = 0; n < 3 * 10000; ++n)
+		numbers.push_back(RandomDigits(4, 12, false));
+
+	PTime start;
+	std::vector<PINDEX> expected;
+	for (unsigned n = 0; n < numbers.size(); n += 3) {
+		const char * const match[3] = { numbers[n].c_str(), (n % 2) ? NULL : numbers[n + 1].c_str(), numbers[n + 2].c_str() };
+		expected.push_back(ScanRules(rules, match));
+	}
+	const PTimeInterval scanTime = PTime() - start;
+
+	start = PTime();
+	std::vector<PINDEX> results;
+	for (unsigned n = 0; n < numbers.size(); n += 3) {
+		const char * const match[3] = { numbers[n].c_str(), (n % 2) ? NULL : numbers[n + 1].c_str(), numbers[n + 2].c_str() };
+		results.push_back(index.Find(rules, match));
+	}
+	const PTimeInterval indexTime = PTime() - start;
+
+	unsigned prefixMatches = 0;
+	for (unsigned n = 0; n < results.size(); ++n) {
+		EXPECT_EQ(expected[n], results[n]) << numbers[3 * n] << " " << numbers[3 * n + 1] << " " << numbers[3 * n + 2];
+		if (results[n] != P_MAX_INDEX && !rules[results[n]].m_prefix.empty())
+			++prefixMatches;
+	}
+	EXPECT_GT(prefixMatches, results.size() / 4);
+
+	std::cout << "[          ] " << results.size() << " setups, " << rules.size() << " CLI rules: scan "
+		<< scanTime.GetMilliSeconds() << " ms, trie " << indexTime.GetMilliSeconds() << " ms" << std::endl;
+}
+
+TEST_F(CLIRewriteTest, PrefixIndexNoMatch) {
+	CLIRewrite::RewriteRules rules(2);
+	rules[0].m_prefix = "49";
+	rules[0].m_rewriteType = RewriteRule::NumberToNumber;
+	rules[0].m_cli.push_back("123");
+	rules[1].m_prefix = "!4";
+	rules[1].m_cli.push_back("456");
+	const CLIRewrite::PrefixIndex index(rules);
+	const char * const numbers[3] = { "4911", "", "" };
+	EXPECT_EQ(P_MAX_INDEX, index.Find(rules, numbers));
+	const char * const exact[3] = { "49", "", "" };
+	EXPECT_EQ(0, index.Find(rules, exact));
+}
+
+TEST_F(CLIRewriteTest, NetworkIndex) {
+	srand(1357);
+	CLIRewrite::SingleIpRules ipRules;
+	for (unsigned i = 0; i < 2000; ++i) {
+		const PString net = PString(PString::Unsigned, 10 + rand() % 2) + "." + PString(PString::Unsigned, rand() % 8)
+			+ "." + PString(PString::Unsigned, rand() % 256) + ".0/" + PString(PString::Unsigned, 8 + rand() % 17);
+		ipRules.push_back(CLIRewrite::SingleIpRule(NetworkAddress(net), CLIRewrite::RewriteRules()));
+	}
+	std::stable_sort(ipRules.begin(), ipRules.end(), IpRuleGreater());
+
+	for (int withAny = 0; withAny < 2; ++withAny) {
+		if (withAny)
+			ipRules.push_back(CLIRewrite::SingleIpRule(NetworkAddress(), CLIRewrite::RewriteRules()));
+		const CLIRewrite::NetworkIndex index(ipRules);
+		for (unsigned n = 0; n < 5000; ++n) {
+			const PIPSocket::Address addr((BYTE)(10 + rand() % 3), (BYTE)(rand() % 8), (BYTE)(rand() % 256), (BYTE)(rand() % 256));
+			PINDEX expected = P_MAX_INDEX;
+			for (unsigned i = 0; i < ipRules.size(); ++i)
+				if (ipRules[i].first.IsAny() || (addr << ipRules[i].first)) {
+					expected = i;
+					break;
+				}
+			EXPECT_EQ(expected, index.Find(addr)) << addr;
+		}
+	}
+}
+
+}  // namespace
@@ -294,6 +294,11 @@
     #define HAS_DES_ECB 1
 #endif
 
+#if (H323PLUS_VER >= 1268 && defined(H323_H235))
+    // H235CryptoEngine can en-/decrypt into a caller supplied buffer
+    #define HAS_H235_INPLACE_CRYPTO 1
+#endif
+
 
 
 //////////////////////////////////////////////////////////////////
@@ -0,0 +1,298 @@
+//////////////////////////////////////////////////////////////////
+//
+// sigdecode.cxx
+//
+// Decode the RAS, Q.931 and H.245 messages in the pcapng files
+// written by the status port command CaptureSignaling
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#include <ptlib.h>
+#include <ptlib/pprocess.h>
+#include <ptlib/sockets.h>
+#include <h225.h>
+#include <h245.h>
+#include <q931.h>
+
+namespace {
+
+const unsigned PcapMagic = 0xa1b2c3d4;
+const unsigned PcapNGSectionHeader = 0x0a0d0d0a;
+const unsigned PcapNGInterfaceDescription = 1;
+const unsigned PcapNGEnhancedPacket = 6;
+const unsigned LinkTypeEthernet = 1;
+const unsigned LinkTypeRaw = 101;
+const unsigned MaxRecordLength = 262144;	// larger packets or blocks only come from corrupt files
+
+inline unsigned GetWord(const BYTE * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+inline unsigned GetHost32(const BYTE * p)
+{
+	unsigned value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// one packet from a pcap or pcapng file
+struct Record {
+	PInt64 m_time;	// microseconds
+	PBYTEArray m_data;
+	PINDEX m_origLen;
+	PString m_comment;
+};
+
+// reads pcap files and pcapng files in host byte order, as written by GnuGk
+class CaptureReader {
+public:
+	CaptureReader() : m_pcapNG(false), m_linkType(LinkTypeRaw) { }
+
+	bool Open(const PFilePath & name)
+	{
+		if (!m_file.Open(name, PFile::ReadOnly))
+			return false;
+		BYTE header[24];
+		if (!m_file.Read(header, sizeof(header)) || m_file.GetLastReadCount() != sizeof(header))
+			return false;
+		if (GetHost32(header) == PcapMagic) {
+			m_linkType = GetHost32(header + 20);
+			return true;
+		}
+		if (GetHost32(header) == PcapNGSectionHeader) {
+			m_pcapNG = true;
+			return m_file.SetPosition(GetHost32(header + 4));
+		}
+		return false;
+	}
+
+	unsigned GetLinkType() const { return m_linkType; }
+
+	bool Next(Record & record)
+	{
+		if (!m_pcapNG) {
+			BYTE header[16];
+			if (!ReadFully(header, sizeof(header)))
+				return false;
+			record.m_time = (PInt64)GetHost32(header) * 1000000 + GetHost32(header + 4);
+			record.m_origLen = GetHost32(header + 12);
+			record.m_comment = PString::Empty();
+			const unsigned capturedLen = GetHost32(header + 8);
+			if (capturedLen > MaxRecordLength)
+				return false;	// corrupt file
+			record.m_data.SetSize(capturedLen);
+			return ReadFully(record.m_data.GetPointer(), record.m_data.GetSize());
+		}
+		for (;;) {
+			BYTE header[8];
+			if (!ReadFully(header, sizeof(header)))
+				return false;
+			const unsigned type = GetHost32(header);
+			const unsigned length = GetHost32(header + 4);
+			if (length < 12 || (length % 4) != 0 || length > MaxRecordLength)
+				return false;
+			PBYTEArray body(length - 8);
+			if (!ReadFully(body.GetPointer(), body.GetSize()))
+				return false;
+			if (type == PcapNGInterfaceDescription) {
+				WORD linkType;
+				memcpy(&linkType, body, sizeof(linkType));
+				m_linkType = linkType;
+				continue;
+			}
+			if (type != PcapNGEnhancedPacket)
+				continue;	// other block types aren't written by GnuGk
+			// the fixed fields and the packet data must fit in front of the trailing block length
+			const unsigned end = (unsigned)body.GetSize() - 4;
+			if (end < 20)
+				return false;
+			const BYTE * p = body;
+			record.m_time = ((PInt64)GetHost32(p + 4) << 32) | GetHost32(p + 8);
+			const unsigned capturedLen = GetHost32(p + 12);
+			if (capturedLen > end - 20)
+				return false;
+			record.m_origLen = GetHost32(p + 16);
+			record.m_data = PBYTEArray(p + 20, capturedLen);
+			record.m_comment = PString::Empty();
+			// options follow the padded packet data
+			unsigned pos = 20 + ((capturedLen + 3) & ~3u);
+			while (pos + 4 <= end) {
+				WORD option[2];	// code, length
+				memcpy(option, p + pos, sizeof(option));
+				const unsigned code = option[0];
+				const unsigned optionLen = option[1];
+				if (code == 0 || optionLen > end - pos - 4)
+					break;
+				if (code == 1)
+					record.m_comment = PString((const char *)p + pos + 4, optionLen);
+				pos += 4 + ((optionLen + 3) & ~3u);
+			}
+			return true;
+		}
+	}
+
+protected:
+	bool ReadFully(void * buf, PINDEX len)
+	{
+		return len == 0 || (m_file.Read(buf, len) && m_file.GetLastReadCount() == len);
+	}
+
+	PFile m_file;
+	bool m_pcapNG;
+	unsigned m_linkType;
+};
+
+void PrintRAS(const BYTE * data, PINDEX len)
+{
+	PPER_Stream strm(data, len);
+	H225_RasMessage ras;
+	if (ras.Decode(strm))
+		cout << setprecision(2) << ras << '\n';
+	else
+		cout << "Invalid RAS message\n";
+}
+
+void PrintTPKT(const BYTE * data, PINDEX len)
+{
+	// one TPKT per segment in captures written by GnuGk, but be tolerant
+	while (len >= 4) {
+		const PINDEX tpktLen = GetWord(data + 2);
+		if (data[0] != 3 || tpktLen < 4 || tpktLen > len) {
+			cout << "Truncated or invalid TPKT\n";
+			return;
+		}
+		const BYTE * msg = data + 4;
+		const PINDEX msgLen = tpktLen - 4;
+		if (msgLen > 0 && msg[0] == 0x08) {	// Q.931 protocol discriminator
+			Q931 q931;
+			if (!q931.Decode(PBYTEArray(msg, msgLen))) {
+				cout << "Invalid Q.931 message\n";
+			} else {
+				cout << setprecision(2) << q931 << '\n';
+				if (q931.HasIE(Q931::UserUserIE)) {
+					H225_H323_UserInformation uuie;
+					PPER_Stream strm(q931.GetIE(Q931::UserUserIE));
+					if (uuie.Decode(strm))
+						cout << setprecision(2) << uuie << '\n';
+					else
+						cout << "Invalid UUIE\n";
+				}
+			}
+		} else if (msgLen > 0) {
+			PPER_Stream strm(msg, msgLen);
+			H245_MultimediaSystemControlMessage h245;
+			if (h245.Decode(strm))
+				cout << setprecision(2) << h245 << '\n';
+			else
+				cout << "Invalid H.245 message\n";
+		}
+		data += tpktLen;
+		len -= tpktLen;
+	}
+}
+
+void PrintPacket(const Record & record, unsigned linkType)
+{
+	const BYTE * ip = record.m_data;
+	PINDEX len = record.m_data.GetSize();
+	if (linkType == LinkTypeEthernet) {
+		if (len < 14)
+			return;
+		ip += 14;
+		len -= 14;
+	} else if (linkType != LinkTypeRaw) {
+		return;
+	}
+	if (len < 20)
+		return;
+
+	PIPSocket::Address srcIP, dstIP;
+	unsigned protocol, ipHeaderLen;
+	if ((ip[0] >> 4) == 4) {
+		ipHeaderLen = (ip[0] & 0x0f) * 4;
+		protocol = ip[9];
+		srcIP = PIPSocket::Address(ip[12], ip[13], ip[14], ip[15]);
+		dstIP = PIPSocket::Address(ip[16], ip[17], ip[18], ip[19]);
+	} else if ((ip[0] >> 4) == 6 && len >= 40) {
+		ipHeaderLen = 40;
+		protocol = ip[6];
+		srcIP = PIPSocket::Address(16, ip + 8);
+		dstIP = PIPSocket::Address(16, ip + 24);
+	} else {
+		return;
+	}
+	if ((PINDEX)ipHeaderLen + ((protocol == 6) ? 20 : 8) > len)
+		return;
+	const BYTE * transport = ip + ipHeaderLen;
+	const WORD srcPort = (WORD)GetWord(transport);
+	const WORD dstPort = (WORD)GetWord(transport + 2);
+	const unsigned transportHeaderLen = (protocol == 6) ? (transport[12] >> 4) * 4 : 8;
+	if ((PINDEX)(ipHeaderLen + transportHeaderLen) > len)
+		return;
+	const BYTE * payload = transport + transportHeaderLen;
+	const PINDEX payloadLen = len - ipHeaderLen - transportHeaderLen;
+
+	const PTime time(record.m_time / 1000000, record.m_time % 1000000);
+	cout << time.AsString("yyyy/MM/dd hh:mm:ss.uuu") << ' '
+		<< srcIP << ':' << srcPort << " -> " << dstIP << ':' << dstPort;
+	if (!record.m_comment.IsEmpty())
+		cout << ' ' << record.m_comment;
+	cout << '\n';
+	if (record.m_origLen > record.m_data.GetSize()) {
+		cout << "Truncated message, " << record.m_origLen << " bytes\n\n";
+		return;
+	}
+	if (protocol == 17)
+		PrintRAS(payload, payloadLen);
+	else if (protocol == 6)
+		PrintTPKT(payload, payloadLen);
+	cout << endl;
+}
+
+} // end namespace
+
+class SigDecode : public PProcess
+{
+	PCLASSINFO(SigDecode, PProcess)
+public:
+	SigDecode() : PProcess("GNU", "sigdecode", 1, 0, ReleaseCode, 0) { }
+	void Main();
+};
+
+PCREATE_PROCESS(SigDecode)
+
+void SigDecode::Main()
+{
+	PArgList & args = GetArguments();
+	args.Parse("c-call:h-help.");
+	if (args.HasOption('h') || args.GetCount() == 0) {
+		cout << "Usage: " << GetName() << " [-c <call number>] <capture file> ...\n"
+				"Decode the RAS, Q.931 and H.245 messages captured with the status port command CaptureSignaling\n"
+				"   -c --call   only show the messages of this call\n";
+		return;
+	}
+	const PString callFilter = args.HasOption('c') ? "call " + args.GetOptionString('c') + " " : PString::Empty();
+
+	for (PINDEX i = 0; i < args.GetCount(); ++i) {
+		CaptureReader reader;
+		if (!reader.Open(args[i])) {
+			cerr << "Can't read " << args[i] << endl;
+			SetTerminationValue(1);
+			continue;
+		}
+		Record record;
+		while (reader.Next(record)) {
+			if (!callFilter.IsEmpty() && record.m_comment.Find(callFilter) != 0)
+				continue;
+			PrintPacket(record, reader.GetLinkType());
+		}
+	}
+}
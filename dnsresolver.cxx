@@ -0,0 +1,982 @@
+//////////////////////////////////////////////////////////////////
+//
+// dnsresolver.cxx
+//
+// Caching DNS client for the routing policies, which doesn't block
+// the signaling threads longer than the configured timeout
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "config.h"
+#include <ptlib.h>
+#include <ptlib/sockets.h>
+#include <ptclib/random.h>
+#if P_DNS
+#include <ptclib/pdns.h>
+#include <ptclib/enum.h>
+#endif
+#include <algorithm>
+#include "gk_const.h"
+#include "h323util.h"
+#include "Toolkit.h"
+#include "job.h"
+#include "dnsresolver.h"
+
+namespace {
+
+const WORD DNSDefaultPort = 53;
+const WORD ClassIN = 1;
+const WORD FlagResponse = 0x8000;
+const WORD FlagTruncated = 0x0200;
+const WORD FlagRecursionDesired = 0x0100;
+const unsigned HeaderSize = 12;
+const unsigned MaxNameLength = 255;
+const unsigned MaxCompressionJumps = 32;
+const unsigned MaxNAPTRRewrites = 5;	// non-terminal ENUM and RDS rules followed
+const unsigned ReceiveInterval = 100;	// ms
+const unsigned QuerySockets = 16;
+const unsigned PortAttempts = 10;	// random ports tried before the OS picks one
+
+inline unsigned GetWord(const BYTE * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+inline unsigned GetDWord(const BYTE * p)
+{
+	return (GetWord(p) << 16) | GetWord(p + 2);
+}
+
+// read a <character-string>
+bool ReadString(const BYTE * data, PINDEX end, PINDEX & pos, PString & str)
+{
+	if (pos >= end || pos + 1 + data[pos] > end)
+		return false;
+	str = PString((const char *)data + pos + 1, data[pos]);
+	pos += 1 + data[pos];
+	return true;
+}
+
+// SRV targets of the same priority in the order of a weighted random selection (RFC 2782)
+void SortSRV(std::vector<DNSRecord> & records)
+{
+	std::vector<DNSRecord> sorted;
+	while (!records.empty()) {
+		WORD priority = records.front().m_priority;
+		for (std::vector<DNSRecord>::const_iterator r = records.begin(); r != records.end(); ++r)
+			priority = std::min(priority, r->m_priority);
+		for (;;) {
+			unsigned total = 0;
+			for (std::vector<DNSRecord>::const_iterator r = records.begin(); r != records.end(); ++r)
+				if (r->m_priority == priority)
+					total += r->m_weight;
+			const unsigned pick = total ? PRandom::Number() % (total + 1) : 0;
+			unsigned sum = 0;
+			std::vector<DNSRecord>::iterator r = records.begin();
+			std::vector<DNSRecord>::iterator chosen = records.end();
+			for (; r != records.end(); ++r) {
+				if (r->m_priority != priority)
+					continue;
+				sum += r->m_weight;
+				if (chosen == records.end() || sum >= pick) {
+					chosen = r;
+					if (sum >= pick)
+						break;
+				}
+			}
+			if (chosen == records.end())
+				break;
+			sorted.push_back(*chosen);
+			records.erase(chosen);
+		}
+	}
+	records.swap(sorted);
+}
+
+bool NAPTRLess(const DNSRecord & a, const DNSRecord & b)
+{
+	return (a.m_order < b.m_order) || (a.m_order == b.m_order && a.m_preference < b.m_preference);
+}
+
+// the user and the domain of an URL like h323:user@domain
+void SplitURL(const PString & url, PString & user, PString & domain)
+{
+	PString rest = url;
+	const PINDEX colon = rest.Find(':');
+	if (colon != P_MAX_INDEX && rest.Find('@') != P_MAX_INDEX && colon < rest.Find('@'))
+		rest = rest.Mid(colon + 1);
+	else if (colon != P_MAX_INDEX && rest.Find('@') == P_MAX_INDEX && !IsIPAddress(rest))
+		rest = rest.Mid(colon + 1);
+	const PINDEX at = rest.Find('@');
+	if (at != P_MAX_INDEX) {
+		user = rest.Left(at);
+		domain = rest.Mid(at + 1);
+	} else {
+		user = PString::Empty();
+		domain = rest;
+	}
+}
+
+// the receiver of the answers, runs while the process runs
+class DNSReceiverJob : public RegularJob {
+public:
+	DNSReceiverJob() { SetName("DNSResolver"); Execute(); }
+
+	virtual void Exec()
+	{
+		DNSResolver::Instance()->Receive(ReceiveInterval);
+	}
+};
+
+} // end namespace
+
+
+// class DNSMessage
+bool DNSMessage::BuildQuery(WORD id, const PString & name, WORD type, PBYTEArray & query)
+{
+	PString qname = name;
+	if (qname.Right(1) == ".")
+		qname = qname.Left(qname.GetLength() - 1);
+	if (qname.IsEmpty() || qname.GetLength() > (PINDEX)MaxNameLength - 2)
+		return false;
+
+	query.SetSize(HeaderSize + qname.GetLength() + 2 + 4);
+	BYTE * p = query.GetPointer();
+	memset(p, 0, HeaderSize);
+	p[0] = (BYTE)(id >> 8);
+	p[1] = (BYTE)id;
+	p[2] = (BYTE)(FlagRecursionDesired >> 8);
+	p[5] = 1;	// one question
+	PINDEX pos = HeaderSize;
+	const PStringArray labels = qname.Tokenise(".", true);
+	for (PINDEX i = 0; i < labels.GetSize(); ++i) {
+		const PINDEX len = labels[i].GetLength();
+		if (len == 0 || len > 63)
+			return false;
+		p[pos++] = (BYTE)len;
+		memcpy(p + pos, (const char *)labels[i], len);
+		pos += len;
+	}
+	p[pos++] = 0;
+	p[pos++] = (BYTE)(type >> 8);
+	p[pos++] = (BYTE)type;
+	p[pos++] = 0;
+	p[pos++] = (BYTE)ClassIN;
+	return true;
+}
+
+bool DNSMessage::ReadName(const BYTE * data, PINDEX len, PINDEX & pos, PString & name)
+{
+	name = PString::Empty();
+	PINDEX p = pos;
+	bool jumped = false;
+	unsigned jumps = 0;
+	for (;;) {
+		if (p >= len)
+			return false;
+		const unsigned label = data[p];
+		if ((label & 0xc0) == 0xc0) {	// compression pointer
+			if (p + 1 >= len || ++jumps > MaxCompressionJumps)
+				return false;
+			if (!jumped)
+				pos = p + 2;
+			jumped = true;
+			p = ((label & 0x3f) << 8) | data[p + 1];
+			continue;
+		}
+		if ((label & 0xc0) != 0)
+			return false;
+		if (label == 0) {
+			if (!jumped)
+				pos = p + 1;
+			return true;
+		}
+		if (p + 1 + (PINDEX)label > len)
+			return false;
+		if (!name.IsEmpty())
+			name += ".";
+		name += PString((const char *)data + p + 1, label);
+		if (name.GetLength() > (PINDEX)MaxNameLength)
+			return false;
+		p += 1 + label;
+	}
+}
+
+bool DNSMessage::Parse(const BYTE * data, PINDEX len)
+{
+	m_answers.clear();
+	m_negativeTTL = 0;
+	if (len < (PINDEX)HeaderSize)
+		return false;
+	m_id = (WORD)GetWord(data);
+	const unsigned flags = GetWord(data + 2);
+	if ((flags & FlagResponse) == 0)
+		return false;
+	m_truncated = (flags & FlagTruncated) != 0;
+	m_rcode = flags & 0x0f;
+	const unsigned questions = GetWord(data + 4);
+	const unsigned answers = GetWord(data + 6);
+	const unsigned authorities = GetWord(data + 8);
+	if (questions != 1)
+		return false;
+
+	PINDEX pos = HeaderSize;
+	if (!ReadName(data, len, pos, m_questionName) || pos + 4 > len)
+		return false;
+	m_questionType = (WORD)GetWord(data + pos);
+	pos += 4;
+
+	for (unsigned i = 0; i < answers + authorities; ++i) {
+		DNSRecord record;
+		if (!ReadName(data, len, pos, record.m_name) || pos + 10 > len)
+			return m_truncated;	// a truncated answer may end anywhere
+		record.m_type = (WORD)GetWord(data + pos);
+		record.m_ttl = GetDWord(data + pos + 4) & 0x7fffffff;
+		const PINDEX rdlen = GetWord(data + pos + 8);
+		pos += 10;
+		const PINDEX end = pos + rdlen;
+		if (end > len)
+			return m_truncated;
+		PINDEX rpos = pos;
+		pos = end;
+
+		if (i >= answers) {
+			// the SOA of the authority section tells how long a negative answer may be cached
+			PString mname, rname;
+			if (record.m_type == DNSRecord::SOA
+				&& ReadName(data, end, rpos, mname) && ReadName(data, end, rpos, rname) && rpos + 20 <= end)
+				m_negativeTTL = std::min(record.m_ttl, GetDWord(data + rpos + 16));
+			continue;
+		}
+		if (record.m_type != m_questionType)
+			continue;	// CNAMEs have been followed by the server
+		switch (record.m_type) {
+			case DNSRecord::A:
+				if (rdlen != 4)
+					return false;
+				record.m_address = PIPSocket::Address(data[rpos], data[rpos + 1], data[rpos + 2], data[rpos + 3]);
+				break;
+			case DNSRecord::AAAA:
+				if (rdlen != 16)
+					return false;
+				record.m_address = PIPSocket::Address(16, data + rpos);
+				break;
+			case DNSRecord::SRV:
+				if (rdlen < 7)
+					return false;
+				record.m_priority = (WORD)GetWord(data + rpos);
+				record.m_weight = (WORD)GetWord(data + rpos + 2);
+				record.m_port = (WORD)GetWord(data + rpos + 4);
+				rpos += 6;
+				if (!ReadName(data, len, rpos, record.m_target))
+					return false;
+				break;
+			case DNSRecord::NAPTR:
+				if (rdlen < 7)
+					return false;
+				record.m_order = (WORD)GetWord(data + rpos);
+				record.m_preference = (WORD)GetWord(data + rpos + 2);
+				rpos += 4;
+				if (!ReadString(data, end, rpos, record.m_flags)
+					|| !ReadString(data, end, rpos, record.m_service)
+					|| !ReadString(data, end, rpos, record.m_regexp)
+					|| !ReadName(data, len, rpos, record.m_target))
+					return false;
+				break;
+			default:
+				break;
+		}
+		m_answers.push_back(record);
+	}
+	return true;
+}
+
+
+// class DNSCache
+DNSCache::DNSCache() : m_maxEntries(0), m_maxTTL(0), m_maxNegativeTTL(0), m_hits(0), m_misses(0)
+{
+}
+
+void DNSCache::SetLimits(unsigned maxEntries, unsigned maxTTL, unsigned maxNegativeTTL)
+{
+	PWaitAndSignal lock(m_mutex);
+	m_maxEntries = maxEntries;
+	m_maxTTL = maxTTL;
+	m_maxNegativeTTL = maxNegativeTTL;
+	while (m_entries.size() > m_maxEntries) {
+		m_entries.erase(m_lru.back());
+		m_lru.pop_back();
+	}
+}
+
+bool DNSCache::Find(const PString & name, WORD type, std::vector<DNSRecord> & records, time_t now)
+{
+	PWaitAndSignal lock(m_mutex);
+	std::map<PString, Entry>::iterator it = m_entries.find(PString(type) + ":" + name.ToLower());
+	if (it == m_entries.end() || now >= it->second.m_expires) {
+		if (it != m_entries.end()) {
+			m_lru.erase(it->second.m_lru);
+			m_entries.erase(it);
+		}
+		++m_misses;
+		return false;
+	}
+	m_lru.splice(m_lru.begin(), m_lru, it->second.m_lru);
+	records = it->second.m_records;
+	++m_hits;
+	return true;
+}
+
+void DNSCache::Store(const PString & name, WORD type, const std::vector<DNSRecord> & records, unsigned negativeTTL, time_t now)
+{
+	PWaitAndSignal lock(m_mutex);
+	unsigned ttl = records.empty() ? std::min(negativeTTL, m_maxNegativeTTL) : m_maxTTL;
+	for (std::vector<DNSRecord>::const_iterator r = records.begin(); r != records.end(); ++r)
+		ttl = std::min(ttl, r->m_ttl);
+	if (m_maxEntries == 0 || ttl == 0)
+		return;
+	const PString key = PString(type) + ":" + name.ToLower();
+	std::map<PString, Entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end()) {
+		while (m_entries.size() >= m_maxEntries && !m_lru.empty()) {
+			m_entries.erase(m_lru.back());
+			m_lru.pop_back();
+		}
+		it = m_entries.insert(std::make_pair(key, Entry())).first;
+		m_lru.push_front(key);
+		it->second.m_lru = m_lru.begin();
+	} else
+		m_lru.splice(m_lru.begin(), m_lru, it->second.m_lru);
+	it->second.m_records = records;
+	it->second.m_expires = now + ttl;
+}
+
+void DNSCache::Clear()
+{
+	PWaitAndSignal lock(m_mutex);
+	m_entries.clear();
+	m_lru.clear();
+}
+
+unsigned DNSCache::GetSize() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_entries.size();
+}
+
+
+// a thread waiting for a query
+struct DNSResolver::Waiter {
+	Waiter() : m_done(false), m_success(false) { }
+
+	PSyncPoint m_sync;
+	bool m_done;
+	bool m_success;
+	std::vector<DNSRecord> m_records;
+};
+
+// class DNSResolver
+DNSResolver::DNSResolver() : Singleton<DNSResolver>("DNSResolver"),
+	m_timeout(2000), m_socketVersion(0), m_receiverStarted(false),
+	m_queriesSent(0), m_coalesced(0), m_timeouts(0), m_tcpQueries(0)
+{
+	m_enumDomains.AppendString("e164.arpa");
+	m_cache.SetLimits(10000, 86400, 300);
+}
+
+DNSResolver::~DNSResolver()
+{
+	// the receiver job is stopped with all other jobs before the singletons are deleted
+	PWaitAndSignal lock(m_mutex);
+	const std::vector<DNSRecord> none;
+	while (!m_pending.empty())
+		Complete(m_pending.begin()->second, false, none);
+	for (std::vector<QuerySocket>::iterator s = m_sockets.begin(); s != m_sockets.end(); ++s)
+		delete s->m_socket;
+}
+
+void DNSResolver::LoadConfig()
+{
+	PConfig * cfg = GkConfig();
+	std::vector<IPAndPortAddress> servers;
+	PStringArray serverList = cfg->GetString(RoutedSec, "DNSServers", "").Tokenise(",; \t", false);
+	if (serverList.GetSize() == 1 && (serverList[0] *= "system")) {
+		serverList.SetSize(0);
+#ifndef _WIN32
+		PTextFile resolvConf("/etc/resolv.conf", PFile::ReadOnly);
+		PString line;
+		while (resolvConf.IsOpen() && resolvConf.ReadLine(line)) {
+			const PStringArray tokens = line.Trim().Tokenise(" \t", false);
+			if (tokens.GetSize() >= 2 && tokens[0] == "nameserver")
+				serverList.AppendString(tokens[1]);
+		}
+#endif
+		if (serverList.GetSize() == 0)
+			PTRACE(1, "DNS\tError: No name servers found in the system configuration");
+	}
+	for (PINDEX i = 0; i < serverList.GetSize(); ++i) {
+		PIPSocket::Address ip;
+		WORD port = 0;
+		if (GetTransportAddress(serverList[i], DNSDefaultPort, ip, port) && ip.IsValid())
+			servers.push_back(IPAndPortAddress(ip, port));
+		else
+			PTRACE(1, "DNS\tError: Invalid DNS server " << serverList[i]);
+	}
+
+	m_timeout = std::max(cfg->GetInteger(RoutedSec, "DNSTimeout", 2000), 100L);
+	m_cache.SetLimits(std::max(cfg->GetInteger(RoutedSec, "DNSCacheSize", 10000), 0L),
+		std::max(cfg->GetInteger(RoutedSec, "DNSMaxTTL", 86400), 0L),
+		std::max(cfg->GetInteger(RoutedSec, "DNSMaxNegativeTTL", 300), 0L));
+	{
+		PWaitAndSignal lock(m_mutex);
+		m_enumDomains = cfg->GetString(RoutedSec, "ENUMservers", "e164.arpa").Tokenise(",", false);
+		m_rdsDomains = cfg->GetString(RoutedSec, "RDSservers", "").Tokenise(",", false);
+	}
+	SetServers(servers);
+}
+
+void DNSResolver::SetServers(const std::vector<IPAndPortAddress> & servers)
+{
+	PWaitAndSignal lock(m_mutex);
+	m_servers.clear();
+	for (std::vector<IPAndPortAddress>::const_iterator s = servers.begin(); s != servers.end(); ++s) {
+		// all queries use the sockets opened for the first server
+		const unsigned version = !m_sockets.empty() ? m_socketVersion
+			: (m_servers.empty() ? s->GetIP().GetVersion() : m_servers.front().GetIP().GetVersion());
+		if (s->GetIP().GetVersion() != version) {
+			PTRACE(1, "DNS\tError: DNS server " << s->AsString() << " must use IPv" << version);
+			continue;
+		}
+		m_servers.push_back(*s);
+	}
+	m_cache.Clear();
+	if (m_servers.empty()) {
+		// nobody is left to answer the queries in flight
+		const std::vector<DNSRecord> none;
+		while (!m_pending.empty())
+			Complete(m_pending.begin()->second, false, none);
+		PTRACE(3, "DNS\tUsing the system resolver");
+		return;
+	}
+	PTRACE(3, "DNS\tResolving with " << m_servers.size() << " server(s), first " << m_servers.front().AsString()
+		<< " timeout " << m_timeout << " ms");
+	StartReceiver();
+}
+
+bool DNSResolver::IsEnabled() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return !m_servers.empty() && !m_sockets.empty();
+}
+
+PUDPSocket * DNSResolver::OpenSocket(unsigned version)
+{
+	const PIPSocket::Address any = (version == 6) ? PIPSocket::Address("::") : PIPSocket::Address(0, 0, 0, 0);
+	PUDPSocket * socket = new PUDPSocket();
+	socket->SetReadTimeout(0);	// only read after a select
+	for (unsigned i = 0; i < PortAttempts; ++i)
+		if (socket->Listen(any, 5, (WORD)(1024 + PRandom::Number() % (65536 - 1024))))
+			return socket;
+	if (socket->Listen(any))
+		return socket;
+	PTRACE(1, "DNS\tError: Can't open a DNS socket: " << socket->GetErrorText());
+	delete socket;
+	return NULL;
+}
+
+void DNSResolver::StartReceiver()
+{
+	if (m_sockets.empty()) {
+		const unsigned version = m_servers.front().GetIP().GetVersion();
+		for (unsigned i = 0; i < QuerySockets; ++i) {
+			QuerySocket s = { OpenSocket(version), false, 0 };
+			if (s.m_socket == NULL)
+				break;
+			m_sockets.push_back(s);
+		}
+		if (m_sockets.empty()) {
+			m_servers.clear();
+			return;
+		}
+		m_socketVersion = version;
+	}
+	if (!m_receiverStarted) {
+		m_receiverStarted = true;
+		new DNSReceiverJob();
+	}
+}
+
+PString DNSResolver::MakeKey(const PString & name, WORD type)
+{
+	return PString(type) + ":" + name;
+}
+
+bool DNSResolver::Query(const PString & name, WORD type, std::vector<DNSRecord> & records)
+{
+	records.clear();
+	PString qname = name.Trim().ToLower();
+	if (qname.Right(1) == ".")
+		qname = qname.Left(qname.GetLength() - 1);
+	if (m_cache.Find(qname, type, records, time(NULL))) {
+		PTRACE(5, "DNS\tCached answer for " << qname << " type " << type << ": " << records.size() << " record(s)");
+		return !records.empty();
+	}
+
+	const PString key = MakeKey(qname, type);
+	Waiter waiter;
+	unsigned timeout;
+	{
+		PWaitAndSignal lock(m_mutex);
+		if (m_servers.empty() || m_sockets.empty())
+			return false;
+		timeout = m_timeout;
+		std::map<PString, PendingQuery *>::iterator it = m_pending.find(key);
+		PendingQuery * query = NULL;
+		if (it != m_pending.end()) {
+			query = it->second;
+			++m_coalesced;
+		} else {
+			WORD id;
+			do {
+				id = (WORD)PRandom::Number();
+			} while (m_pendingByID.find(id) != m_pendingByID.end());
+			query = new PendingQuery();
+			if (!DNSMessage::BuildQuery(id, qname, type, query->m_query)) {
+				PTRACE(2, "DNS\tInvalid name " << qname);
+				delete query;
+				return false;
+			}
+			query->m_key = key;
+			query->m_name = qname;
+			query->m_type = type;
+			query->m_id = id;
+			// a socket that hasn't been used since it was bound, if there is one
+			const unsigned start = PRandom::Number() % m_sockets.size();
+			query->m_socket = start;
+			for (unsigned i = 0; i < m_sockets.size(); ++i)
+				if (!m_sockets[(start + i) % m_sockets.size()].m_used) {
+					query->m_socket = (start + i) % m_sockets.size();
+					break;
+				}
+			m_sockets[query->m_socket].m_used = true;
+			++m_sockets[query->m_socket].m_pending;
+			query->m_server = 0;
+			query->m_attempts = 0;
+			query->m_deadline = PTime() + PTimeInterval(timeout);
+			query->m_tcp = false;
+			m_pending[key] = query;
+			m_pendingByID[id] = query;
+			SendQuery(*query);
+		}
+		query->m_waiters.push_back(&waiter);
+	}
+
+	// the receiver completes the query at its deadline at the latest
+	waiter.m_sync.Wait(timeout + ReceiveInterval * 5);
+
+	PWaitAndSignal lock(m_mutex);
+	if (!waiter.m_done) {
+		std::map<PString, PendingQuery *>::iterator it = m_pending.find(key);
+		if (it != m_pending.end())
+			it->second->m_waiters.remove(&waiter);
+		return false;
+	}
+	records.swap(waiter.m_records);
+	return waiter.m_success && !records.empty();
+}
+
+void DNSResolver::SendQuery(PendingQuery & query)
+{
+	if (m_servers.empty())
+		return;	// SetServers() has completed the query
+	const IPAndPortAddress & server = m_servers[query.m_server % m_servers.size()];
+	++query.m_attempts;
+	++m_queriesSent;
+	// retransmit twice within the timeout, each time to the next server
+	query.m_retransmit = PTime() + PTimeInterval(std::max(m_timeout / 3, ReceiveInterval));
+	PUDPSocket * socket = m_sockets[query.m_socket].m_socket;
+	if (!socket->WriteTo(query.m_query, query.m_query.GetSize(), server.GetIP(), server.GetPort()))
+		PTRACE(2, "DNS\tError sending query to " << server.AsString() << ": " << socket->GetErrorText(PSocket::LastWriteError));
+	else
+		PTRACE(5, "DNS\tQuery " << query.m_id << " for " << query.m_name << " type " << query.m_type << " sent to " << server.AsString());
+}
+
+void DNSResolver::Receive(unsigned ms)
+{
+	PSocket::SelectList readable;
+	{
+		PWaitAndSignal lock(m_mutex);
+		RotateSockets();
+		for (std::vector<QuerySocket>::const_iterator s = m_sockets.begin(); s != m_sockets.end(); ++s)
+			readable.Append(s->m_socket);
+	}
+	if (readable.IsEmpty()) {
+		PThread::Sleep(ms);
+		return;
+	}
+
+	// the sockets are only replaced by this thread
+	if (PSocket::Select(readable, PTimeInterval(ms)) == PSocket::NoError) {
+		BYTE buffer[DNSMessage::MaxUDPSize * 8];
+		for (PINDEX i = 0; i < readable.GetSize(); ++i) {
+			PUDPSocket & socket = (PUDPSocket &)readable[i];
+			PIPSocket::Address fromIP;
+			WORD fromPort = 0;
+			if (!socket.ReadFrom(buffer, sizeof(buffer), fromIP, fromPort))
+				continue;
+			DNSMessage response;
+			if (response.Parse(buffer, socket.GetLastReadCount()))
+				OnResponse(response, &socket, fromIP, fromPort);
+			else
+				PTRACE(3, "DNS\tInvalid message from " << AsString(fromIP, fromPort));
+		}
+	}
+
+	PWaitAndSignal lock(m_mutex);
+	const PTime now;
+	const std::vector<DNSRecord> none;
+	std::map<PString, PendingQuery *>::iterator it = m_pending.begin();
+	while (it != m_pending.end()) {
+		PendingQuery * query = (it++)->second;
+		if (now >= query->m_deadline) {
+			++m_timeouts;
+			PTRACE(2, "DNS\tTimeout for " << query->m_name << " type " << query->m_type << " after " << query->m_attempts << " attempt(s)");
+			Complete(query, false, none);
+		} else if (!query->m_tcp && now >= query->m_retransmit) {
+			++query->m_server;
+			SendQuery(*query);
+		}
+	}
+}
+
+void DNSResolver::OnResponse(const DNSMessage & response, const PUDPSocket * socket, const PIPSocket::Address & fromIP, WORD fromPort)
+{
+	PWaitAndSignal lock(m_mutex);
+	std::map<WORD, PendingQuery *>::iterator it = m_pendingByID.find(response.GetID());
+	bool fromServer = false;
+	for (std::vector<IPAndPortAddress>::const_iterator s = m_servers.begin(); s != m_servers.end(); ++s)
+		if (s->GetIP() == fromIP && s->GetPort() == fromPort)
+			fromServer = true;
+	if (it == m_pendingByID.end() || !fromServer
+		|| m_sockets[it->second->m_socket].m_socket != socket
+		|| !(response.GetQuestionName().ToLower() == it->second->m_name)
+		|| response.GetQuestionType() != it->second->m_type) {
+		PTRACE(3, "DNS\tUnexpected answer " << response.GetID() << " from " << AsString(fromIP, fromPort));
+		return;
+	}
+	PendingQuery * query = it->second;
+	if (response.IsTruncated()) {
+		if (!query->m_tcp) {
+			query->m_tcp = true;
+			++m_tcpQueries;
+			PTRACE(4, "DNS\tAnswer for " << query->m_name << " truncated, retrying with TCP");
+			CreateJob(this, &DNSResolver::QueryTCP, query->m_key, "DNSQueryTCP");
+		}
+		return;
+	}
+	HandleAnswer(query, response);
+}
+
+void DNSResolver::HandleAnswer(PendingQuery * query, const DNSMessage & response)
+{
+	if (response.GetRCode() == DNSMessage::NoError || response.GetRCode() == DNSMessage::NameError) {
+		const std::vector<DNSRecord> & records = response.GetAnswers();
+		m_cache.Store(query->m_name, query->m_type, records, response.GetNegativeTTL(), time(NULL));
+		PTRACE(5, "DNS\tAnswer for " << query->m_name << " type " << query->m_type << ": " << records.size() << " record(s)");
+		Complete(query, !records.empty(), records);
+	} else if (query->m_attempts < m_servers.size()) {
+		// server failure or refused, ask the next server right away
+		PTRACE(3, "DNS\tError " << response.GetRCode() << " for " << query->m_name << ", trying the next server");
+		query->m_tcp = false;
+		++query->m_server;
+		SendQuery(*query);
+	} else {
+		PTRACE(2, "DNS\tError " << response.GetRCode() << " for " << query->m_name << " from all servers");
+		Complete(query, false, std::vector<DNSRecord>());
+	}
+}
+
+void DNSResolver::Complete(PendingQuery * query, bool success, const std::vector<DNSRecord> & records)
+{
+	for (std::list<Waiter *>::iterator w = query->m_waiters.begin(); w != query->m_waiters.end(); ++w) {
+		(*w)->m_records = records;
+		(*w)->m_success = success;
+		(*w)->m_done = true;
+		(*w)->m_sync.Signal();
+	}
+	--m_sockets[query->m_socket].m_pending;
+	m_pendingByID.erase(query->m_id);
+	m_pending.erase(query->m_key);
+	delete query;
+}
+
+void DNSResolver::RotateSockets()
+{
+	for (std::vector<QuerySocket>::iterator s = m_sockets.begin(); s != m_sockets.end(); ++s) {
+		if (!s->m_used || s->m_pending > 0)
+			continue;
+		// late answers to the old port are dropped by the OS
+		PUDPSocket * socket = OpenSocket(m_socketVersion);
+		if (socket != NULL) {
+			delete s->m_socket;
+			s->m_socket = socket;
+		}
+		s->m_used = false;
+	}
+}
+
+void DNSResolver::QueryTCP(PString key)
+{
+	PBYTEArray request;
+	IPAndPortAddress server;
+	WORD id;
+	unsigned timeout;
+	{
+		PWaitAndSignal lock(m_mutex);
+		std::map<PString, PendingQuery *>::iterator it = m_pending.find(key);
+		if (it == m_pending.end() || m_servers.empty())
+			return;
+		const PendingQuery * query = it->second;
+		request = PBYTEArray(query->m_query, query->m_query.GetSize());
+		server = m_servers[query->m_server % m_servers.size()];
+		id = query->m_id;
+		timeout = m_timeout;
+	}
+
+	PTCPSocket socket(server.GetPort());
+	socket.SetReadTimeout(timeout);
+	socket.SetWriteTimeout(timeout);
+	BYTE length[2] = { (BYTE)(request.GetSize() >> 8), (BYTE)request.GetSize() };
+	DNSMessage response;
+	bool ok = socket.Connect(server.GetIP())
+		&& socket.Write(length, sizeof(length)) && socket.Write(request, request.GetSize())
+		&& socket.ReadBlock(length, sizeof(length));
+	if (ok) {
+		PBYTEArray buffer(GetWord(length));
+		ok = socket.ReadBlock(buffer.GetPointer(), buffer.GetSize())
+			&& response.Parse(buffer, buffer.GetSize()) && response.GetID() == id;
+	}
+	if (!ok)
+		PTRACE(2, "DNS\tTCP query to " << server.AsString() << " failed: " << socket.GetErrorText());
+
+	PWaitAndSignal lock(m_mutex);
+	std::map<PString, PendingQuery *>::iterator it = m_pending.find(key);
+	if (it == m_pending.end() || it->second->m_id != id)
+		return;	// timed out meanwhile
+	if (ok)
+		HandleAnswer(it->second, response);
+	else
+		Complete(it->second, false, std::vector<DNSRecord>());
+}
+
+bool DNSResolver::LookupAddress(const PString & host, PIPSocket::Address & addr)
+{
+	if (IsIPAddress(host)) {
+		addr = PIPSocket::Address(host);
+		return addr.IsValid();
+	}
+	if (!IsEnabled())
+		return PIPSocket::GetHostAddress(host, addr) && addr.IsValid();
+
+	std::vector<DNSRecord> records;
+	if (!Query(host, DNSRecord::A, records) && Toolkit::Instance()->IsIPv6Enabled())
+		Query(host, DNSRecord::AAAA, records);
+	if (records.empty())
+		return false;
+	addr = records.front().m_address;
+	return true;
+}
+
+bool DNSResolver::LookupSRV(const PString & url, const PString & service, PStringList & result)
+{
+	if (!IsEnabled()) {
+#if P_DNS
+		return PDNS::LookupSRV(url, service, result);
+#else
+		return false;
+#endif
+	}
+
+	PString user, domain;
+	SplitURL(url, user, domain);
+	if (!user.IsEmpty())
+		user += "@";
+	std::vector<DNSRecord> records;
+	if (domain.IsEmpty() || !Query(service + domain, DNSRecord::SRV, records))
+		return false;
+	SortSRV(records);
+	for (std::vector<DNSRecord>::const_iterator r = records.begin(); r != records.end(); ++r) {
+		PIPSocket::Address addr;
+		if (r->m_target.IsEmpty() || r->m_target == ".")
+			continue;	// service not available at this domain
+		if (LookupAddress(r->m_target, addr))
+			result.AppendString(user + AsString(addr, r->m_port));
+		else
+			PTRACE(3, "DNS\tCan't resolve SRV target " << r->m_target);
+	}
+	return result.GetSize() > 0;
+}
+
+PString DNSResolver::ApplyNAPTRRegexp(const PString & regexp, const PString & subject)
+{
+	// delim-char ERE delim-char replacement delim-char flags
+	if (regexp.GetLength() < 3)
+		return PString::Empty();
+	const char delim = regexp[0];
+	const PINDEX mid = regexp.Find(delim, 1);
+	const PINDEX last = (mid == P_MAX_INDEX) ? P_MAX_INDEX : regexp.Find(delim, mid + 1);
+	if (last == P_MAX_INDEX)
+		return PString::Empty();
+	const PString replacement = regexp(mid + 1, last - 1);
+	const bool ignoreCase = regexp.Mid(last + 1).Find('i') != P_MAX_INDEX;
+	PRegularExpression re(regexp(1, mid - 1),
+		PRegularExpression::Extended | (ignoreCase ? PRegularExpression::IgnoreCase : 0));
+	PIntArray starts(10), ends(10);
+	if (re.GetErrorCode() != PRegularExpression::NoError || !re.Execute(subject, starts, ends))
+		return PString::Empty();
+
+	PString str;
+	for (PINDEX i = 0; i < replacement.GetLength(); ++i) {
+		if (replacement[i] == '\\' && i + 1 < replacement.GetLength()) {
+			const char c = replacement[++i];
+			if (isdigit(static_cast<unsigned char>(c))) {
+				const PINDEX group = c - '0';
+				if (group < starts.GetSize() && starts[group] >= 0)
+					str += subject(starts[group], ends[group] - 1);
+				continue;
+			}
+			str += c;
+		} else
+			str += replacement[i];
+	}
+	return str;
+}
+
+bool DNSResolver::ENUMLookup(const PString & e164, const PString & service, PString & result)
+{
+	if (!IsEnabled()) {
+#if P_DNS
+		return PDNS::ENUMLookup(e164, service, result);
+#else
+		return false;
+#endif
+	}
+
+	PString digits;
+	for (PINDEX i = 0; i < e164.GetLength(); ++i)
+		if (isdigit(static_cast<unsigned char>(e164[i])))
+			digits += e164[i];
+	if (digits.IsEmpty())
+		return false;
+	const PString subject = "+" + digits;
+	PString reversed;
+	for (PINDEX i = digits.GetLength(); i > 0; --i)
+		reversed += PString(digits[i - 1]) + ".";
+
+	PStringArray domains;
+	{
+		PWaitAndSignal lock(m_mutex);
+		domains = m_enumDomains;
+		domains.MakeUnique();
+	}
+	for (PINDEX d = 0; d < domains.GetSize(); ++d) {
+		PString name = reversed + domains[d];
+		for (unsigned rewrites = 0; rewrites < MaxNAPTRRewrites; ++rewrites) {
+			std::vector<DNSRecord> records;
+			if (!Query(name, DNSRecord::NAPTR, records))
+				break;
+			std::stable_sort(records.begin(), records.end(), NAPTRLess);
+			PString next;
+			for (std::vector<DNSRecord>::const_iterator r = records.begin(); r != records.end(); ++r) {
+				if (r->m_flags.IsEmpty() && !r->m_target.IsEmpty() && r->m_target != ".") {
+					if (next.IsEmpty())
+						next = r->m_target;	// non-terminal rule
+					continue;
+				}
+				if (r->m_flags.Find('u') == P_MAX_INDEX && r->m_flags.Find('U') == P_MAX_INDEX)
+					continue;
+				if (r->m_service.ToUpper().Find(service.ToUpper()) == P_MAX_INDEX)
+					continue;
+				const PString uri = ApplyNAPTRRegexp(r->m_regexp, subject);
+				if (!uri.IsEmpty()) {
+					result = uri;
+					return true;
+				}
+			}
+			if (next.IsEmpty())
+				break;
+			name = next;
+		}
+	}
+	return false;
+}
+
+bool DNSResolver::RDSLookup(const PString & url, const PString & service, PStringList & result)
+{
+	if (!IsEnabled()) {
+#if hasRDS
+		return PDNS::RDSLookup(url, service, result);
+#else
+		return false;
+#endif
+	}
+
+	PString user, domain;
+	SplitURL(url, user, domain);
+	if (domain.IsEmpty())
+		return false;
+	PStringArray names;
+	names.AppendString(domain);
+	{
+		PWaitAndSignal lock(m_mutex);
+		for (PINDEX i = 0; i < m_rdsDomains.GetSize(); ++i)
+			names.AppendString(domain + "." + m_rdsDomains[i]);
+	}
+	const PString prefix = user.IsEmpty() ? PString::Empty() : user + "@";
+	for (PINDEX n = 0; n < names.GetSize(); ++n) {
+		std::vector<DNSRecord> records;
+		if (!Query(names[n], DNSRecord::NAPTR, records))
+			continue;
+		std::stable_sort(records.begin(), records.end(), NAPTRLess);
+		for (std::vector<DNSRecord>::const_iterator r = records.begin(); r != records.end(); ++r) {
+			if (!(r->m_service *= service) || r->m_target.IsEmpty() || r->m_target == ".")
+				continue;
+			if (r->m_flags *= "s") {
+				std::vector<DNSRecord> srv;
+				if (Query(r->m_target, DNSRecord::SRV, srv)) {
+					SortSRV(srv);
+					for (std::vector<DNSRecord>::const_iterator s = srv.begin(); s != srv.end(); ++s) {
+						PIPSocket::Address addr;
+						if (LookupAddress(s->m_target, addr))
+							result.AppendString(prefix + AsString(addr, s->m_port));
+					}
+				}
+			} else if (r->m_flags *= "a") {
+				PIPSocket::Address addr;
+				if (LookupAddress(r->m_target, addr))
+					result.AppendString(prefix + AsString(addr, GK_DEF_UNICAST_RAS_PORT));
+			}
+		}
+		if (result.GetSize() > 0)
+			return true;
+	}
+	return false;
+}
+
+PString DNSResolver::PrintStatistics() const
+{
+	PWaitAndSignal lock(m_mutex);
+	if (m_servers.empty())
+		return PString::Empty();
+	return "DNS cache: " + PString(m_cache.GetSize()) + " entries, hits " + PString(m_cache.GetHits())
+		+ ", misses " + PString(m_cache.GetMisses()) + ", queries " + PString(m_queriesSent)
+		+ ", coalesced " + PString(m_coalesced) + ", TCP " + PString(m_tcpQueries)
+		+ ", timeouts " + PString(m_timeouts) + "\r\n";
+}
@@ -0,0 +1,250 @@
+//////////////////////////////////////////////////////////////////
+//
+// dnsresolver.h
+//
+// Caching DNS client for the routing policies, which doesn't block
+// the signaling threads longer than the configured timeout
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef DNSRESOLVER_H
+#define DNSRESOLVER_H "@(#) $Id$"
+
+#include <map>
+#include <list>
+#include <vector>
+#include "singleton.h"
+#include "h323util.h"
+
+/// one resource record of a DNS answer
+struct DNSRecord {
+	enum Type {
+		A = 1,
+		CNAME = 5,
+		SOA = 6,
+		AAAA = 28,
+		SRV = 33,
+		NAPTR = 35
+	};
+
+	DNSRecord() : m_type(0), m_ttl(0), m_priority(0), m_weight(0), m_port(0), m_order(0), m_preference(0) { }
+
+	PString m_name;
+	WORD m_type;
+	unsigned m_ttl;
+	PIPSocket::Address m_address;	// A, AAAA
+	PString m_target;	// SRV target, NAPTR replacement, CNAME
+	WORD m_priority;	// SRV
+	WORD m_weight;
+	WORD m_port;
+	WORD m_order;	// NAPTR
+	WORD m_preference;
+	PString m_flags;
+	PString m_service;
+	PString m_regexp;
+};
+
+/// encodes DNS queries and decodes the responses (RFC 1035)
+class DNSMessage {
+public:
+	enum {
+		MaxUDPSize = 512,
+		// response codes
+		NoError = 0,
+		ServerFailure = 2,
+		NameError = 3
+	};
+
+	DNSMessage() : m_id(0), m_truncated(false), m_rcode(0), m_questionType(0), m_negativeTTL(0) { }
+
+	/// build a recursive query for one name
+	static bool BuildQuery(WORD id, const PString & name, WORD type, PBYTEArray & query);
+
+	/// @return	false if the message isn't a valid response
+	bool Parse(const BYTE * data, PINDEX len);
+
+	WORD GetID() const { return m_id; }
+	bool IsTruncated() const { return m_truncated; }
+	unsigned GetRCode() const { return m_rcode; }
+	const PString & GetQuestionName() const { return m_questionName; }
+	WORD GetQuestionType() const { return m_questionType; }
+	/// TTL for a negative answer from the SOA record of the authority section (RFC 2308), 0 if none
+	unsigned GetNegativeTTL() const { return m_negativeTTL; }
+	/// the answers of the requested type
+	const std::vector<DNSRecord> & GetAnswers() const { return m_answers; }
+
+protected:
+	static bool ReadName(const BYTE * data, PINDEX len, PINDEX & pos, PString & name);
+
+	WORD m_id;
+	bool m_truncated;
+	unsigned m_rcode;
+	PString m_questionName;
+	WORD m_questionType;
+	unsigned m_negativeTTL;
+	std::vector<DNSRecord> m_answers;
+};
+
+/** Answers by name and type, positive and negative, for as long as their
+    TTL says. The least recently used entries are evicted when the cache
+    is full. Thread safe.
+*/
+class DNSCache {
+public:
+	DNSCache();
+
+	/// @param maxEntries	0 disables the cache
+	void SetLimits(unsigned maxEntries, unsigned maxTTL, unsigned maxNegativeTTL);
+
+	/** @return	true if an answer is cached, #records# is empty for a negative answer
+	*/
+	bool Find(const PString & name, WORD type, std::vector<DNSRecord> & records, time_t now);
+	/// store the answer, with no records as a negative answer with #negativeTTL#
+	void Store(const PString & name, WORD type, const std::vector<DNSRecord> & records, unsigned negativeTTL, time_t now);
+	void Clear();
+
+	unsigned GetSize() const;
+	unsigned GetHits() const { return m_hits; }
+	unsigned GetMisses() const { return m_misses; }
+
+protected:
+	struct Entry {
+		std::vector<DNSRecord> m_records;
+		time_t m_expires;
+		std::list<PString>::iterator m_lru;
+	};
+
+	unsigned m_maxEntries;
+	unsigned m_maxTTL;
+	unsigned m_maxNegativeTTL;
+	std::map<PString, Entry> m_entries;	// by type and lower case name
+	std::list<PString> m_lru;	// most recently used first
+	unsigned m_hits;
+	unsigned m_misses;
+	mutable PMutex m_mutex;
+};
+
+/** DNS client used by the DNS, ENUM, SRV and RDS routing policies
+    instead of the blocking system resolver.
+
+    Queries are sent without waiting for other answers and told apart by
+    their random ID and source port: each query uses an unused socket of a
+    small pool, which the receiver replaces after the query with a socket
+    bound to another random port. The sockets are only shared by
+    concurrent queries when more are pending than the pool has. A single receiver
+    job reads the answers, retransmits to the next server and fails the
+    queries that reach their timeout. Truncated answers are repeated over
+    TCP. A thread that asks for a name which is already being looked up
+    waits for that query instead of sending another one.
+
+    If no servers are configured ([RoutedMode] DNSServers=), the lookup
+    functions use the PTLib resolver as before.
+*/
+class DNSResolver : public Singleton<DNSResolver> {
+public:
+	DNSResolver();
+	virtual ~DNSResolver();
+
+	/// read the servers, timeouts and cache size from [RoutedMode]
+	void LoadConfig();
+
+	/// set the servers directly, empty disables the resolver
+	void SetServers(const std::vector<IPAndPortAddress> & servers);
+	void SetTimeout(unsigned ms) { m_timeout = ms; }
+	DNSCache & GetCache() { return m_cache; }
+
+	bool IsEnabled() const;
+
+	/** Look up the records of one type, waits at most for the query timeout.
+	    @return	false if the name doesn't exist, has no such records or the servers didn't answer
+	*/
+	bool Query(const PString & name, WORD type, std::vector<DNSRecord> & records);
+
+	/// resolve a host name or IP literal, IPv4 first
+	bool LookupAddress(const PString & host, PIPSocket::Address & addr);
+
+	/** SRV lookup for an URL like h323:user@domain, see PDNS::LookupSRV()
+	    @return	user@ip:port for every target in priority order
+	*/
+	bool LookupSRV(const PString & url, const PString & service, PStringList & result);
+
+	/// ENUM lookup (RFC 6116) of an E.164 number with the [RoutedMode] ENUMservers domains
+	bool ENUMLookup(const PString & e164, const PString & service, PString & result);
+
+	/** RDS lookup (H.225 Annex O) of the domain of an URL: NAPTR records of the service
+	    point to SRV records or to a host with the RAS port
+	    @return	user@ip:port of the located gatekeepers
+	*/
+	bool RDSLookup(const PString & url, const PString & service, PStringList & result);
+
+	/// receive the answers and handle the timeouts for #ms# milliseconds, called by the receiver job
+	void Receive(unsigned ms);
+
+	/// one status port line, empty if disabled
+	PString PrintStatistics() const;
+
+protected:
+	struct Waiter;
+
+	struct PendingQuery {
+		PString m_key;
+		PString m_name;
+		WORD m_type;
+		WORD m_id;
+		PBYTEArray m_query;
+		unsigned m_socket;	// index in m_sockets
+		unsigned m_server;	// index of the server the query was sent to last
+		unsigned m_attempts;
+		PTime m_deadline;
+		PTime m_retransmit;
+		bool m_tcp;	// the UDP answer was truncated
+		std::list<Waiter *> m_waiters;
+	};
+
+	struct QuerySocket {
+		PUDPSocket * m_socket;
+		bool m_used;	// replace it when it has no pending queries
+		unsigned m_pending;
+	};
+
+	/// a socket bound to a random port
+	static PUDPSocket * OpenSocket(unsigned version);
+	/// replace the used sockets without pending queries, only called by the receiver, m_mutex must be held
+	void RotateSockets();
+	void SendQuery(PendingQuery & query);
+	void OnResponse(const DNSMessage & response, const PUDPSocket * socket, const PIPSocket::Address & fromIP, WORD fromPort);
+	/// cache the answer and complete the query, or ask the next server, m_mutex must be held
+	void HandleAnswer(PendingQuery * query, const DNSMessage & response);
+	/// complete the query, signal the waiting threads and delete it, m_mutex must be held
+	void Complete(PendingQuery * query, bool success, const std::vector<DNSRecord> & records);
+	void QueryTCP(PString key);
+	void StartReceiver();
+
+	static PString MakeKey(const PString & name, WORD type);
+	static PString ApplyNAPTRRegexp(const PString & regexp, const PString & subject);
+
+	std::vector<IPAndPortAddress> m_servers;
+	PStringArray m_enumDomains;
+	PStringArray m_rdsDomains;
+	unsigned m_timeout;	// ms
+	DNSCache m_cache;
+	std::vector<QuerySocket> m_sockets;	// only replaced by the receiver, which reads them without a lock
+	unsigned m_socketVersion;	// all servers must use the same IP version
+	bool m_receiverStarted;
+	std::map<PString, PendingQuery *> m_pending;	// by name and type
+	std::map<WORD, PendingQuery *> m_pendingByID;
+	unsigned m_queriesSent;
+	unsigned m_coalesced;
+	unsigned m_timeouts;
+	unsigned m_tcpQueries;
+	mutable PMutex m_mutex;
+};
+
+#endif // DNSRESOLVER_H
@@ -0,0 +1,484 @@
+/*
+ * dnsresolver.t.cxx
+ *
+ * unit tests for dnsresolver.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include "dnsresolver.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+void PutWord(PBYTEArray & msg, unsigned value)
+{
+	const PINDEX pos = msg.GetSize();
+	msg.SetSize(pos + 2);
+	msg[pos] = (BYTE)(value >> 8);
+	msg[pos + 1] = (BYTE)value;
+}
+
+void PutDWord(PBYTEArray & msg, unsigned value)
+{
+	PutWord(msg, value >> 16);
+	PutWord(msg, value & 0xffff);
+}
+
+void PutBytes(PBYTEArray & msg, const void * data, PINDEX len)
+{
+	const PINDEX pos = msg.GetSize();
+	msg.SetSize(pos + len);
+	memcpy(msg.GetPointer() + pos, data, len);
+}
+
+void PutName(PBYTEArray & msg, const PString & name)
+{
+	const PStringArray labels = name.Tokenise(".", false);
+	for (PINDEX i = 0; i < labels.GetSize(); ++i) {
+		const BYTE len = (BYTE)labels[i].GetLength();
+		PutBytes(msg, &len, 1);
+		PutBytes(msg, (const char *)labels[i], len);
+	}
+	PutBytes(msg, "", 1);
+}
+
+void PutString(PBYTEArray & msg, const PString & str)
+{
+	const BYTE len = (BYTE)str.GetLength();
+	PutBytes(msg, &len, 1);
+	PutBytes(msg, (const char *)str, len);
+}
+
+// the rdata of the stub server's records
+PBYTEArray AData(const char * ip)
+{
+	PBYTEArray data;
+	const PIPSocket::Address addr(ip);
+	for (PINDEX i = 0; i < 4; ++i) {
+		const BYTE b = addr[i];
+		PutBytes(data, &b, 1);
+	}
+	return data;
+}
+
+PBYTEArray SRVData(unsigned priority, unsigned weight, unsigned port, const PString & target)
+{
+	PBYTEArray data;
+	PutWord(data, priority);
+	PutWord(data, weight);
+	PutWord(data, port);
+	PutName(data, target);
+	return data;
+}
+
+PBYTEArray NAPTRData(unsigned order, unsigned preference, const PString & flags, const PString & service,
+	const PString & regexp, const PString & replacement)
+{
+	PBYTEArray data;
+	PutWord(data, order);
+	PutWord(data, preference);
+	PutString(data, flags);
+	PutString(data, service);
+	PutString(data, regexp);
+	PutName(data, replacement);
+	return data;
+}
+
+// a DNS server on the loopback interface with configured answers, UDP and TCP
+class StubDNSServer : public PThread {
+	PCLASSINFO(StubDNSServer, PThread)
+public:
+	struct Answer {
+		Answer() : m_rcode(0), m_ttl(60), m_negativeTTL(0), m_delay(0), m_truncate(false), m_drop(false) { }
+		std::vector<PBYTEArray> m_records;
+		unsigned m_rcode;
+		unsigned m_ttl;
+		unsigned m_negativeTTL;	// SOA minimum for negative answers, 0 for no SOA
+		unsigned m_delay;	// ms
+		bool m_truncate;	// answer UDP queries with the TC flag
+		bool m_drop;	// never answer
+	};
+
+	StubDNSServer() : PThread(10000, NoAutoDeleteThread), m_running(true), m_tcpQueries(0)
+	{
+		m_tcp.Listen(PIPSocket::Address("127.0.0.1"), 5, 0);
+		m_tcp.SetReadTimeout(50);
+		m_udp.Listen(PIPSocket::Address("127.0.0.1"), 0, m_tcp.GetPort());
+		m_udp.SetReadTimeout(50);
+		Resume();
+	}
+
+	~StubDNSServer()
+	{
+		m_running = false;
+		WaitForTermination();
+	}
+
+	WORD GetPort() const { return m_tcp.GetPort(); }
+
+	void SetAnswer(const PString & name, WORD type, const Answer & answer)
+	{
+		PWaitAndSignal lock(m_mutex);
+		m_answers[PString(type) + ":" + name] = answer;
+	}
+
+	unsigned GetQueries(const PString & name, WORD type) const
+	{
+		PWaitAndSignal lock(m_mutex);
+		std::map<PString, unsigned>::const_iterator it = m_queries.find(PString(type) + ":" + name);
+		return it != m_queries.end() ? it->second : 0;
+	}
+
+	unsigned GetTCPQueries() const
+	{
+		PWaitAndSignal lock(m_mutex);
+		return m_tcpQueries;
+	}
+
+	virtual void Main()
+	{
+		BYTE buffer[1024];
+		while (m_running) {
+			PIPSocket::Address ip;
+			WORD port;
+			PBYTEArray response;
+			if (m_udp.ReadFrom(buffer, sizeof(buffer), ip, port)
+				&& Respond(buffer, m_udp.GetLastReadCount(), false, response))
+				m_udp.WriteTo(response, response.GetSize(), ip, port);
+
+			PTCPSocket client;
+			if (client.Accept(m_tcp)) {
+				client.SetReadTimeout(1000);
+				BYTE length[2];
+				if (client.ReadBlock(length, 2) && client.ReadBlock(buffer, (length[0] << 8) | length[1])
+					&& Respond(buffer, (length[0] << 8) | length[1], true, response)) {
+					length[0] = (BYTE)(response.GetSize() >> 8);
+					length[1] = (BYTE)response.GetSize();
+					client.Write(length, 2);
+					client.Write(response, response.GetSize());
+				}
+			}
+		}
+	}
+
+protected:
+	bool Respond(const BYTE * query, PINDEX len, bool tcp, PBYTEArray & response)
+	{
+		// the question of a query built by DNSMessage::BuildQuery()
+		PINDEX pos = 12;
+		PString name;
+		while (pos < len && query[pos] != 0) {
+			if (!name.IsEmpty())
+				name += ".";
+			name += PString((const char *)query + pos + 1, query[pos]);
+			pos += 1 + query[pos];
+		}
+		const PINDEX questionEnd = pos + 5;
+		if (questionEnd > len)
+			return false;
+		const WORD type = (WORD)((query[pos + 1] << 8) | query[pos + 2]);
+
+		Answer answer;
+		{
+			PWaitAndSignal lock(m_mutex);
+			const PString key = PString(type) + ":" + name;
+			++m_queries[key];
+			if (tcp)
+				++m_tcpQueries;
+			std::map<PString, Answer>::const_iterator it = m_answers.find(key);
+			if (it != m_answers.end())
+				answer = it->second;
+			else
+				answer.m_rcode = DNSMessage::NameError;
+		}
+		if (answer.m_drop)
+			return false;
+		if (answer.m_delay)
+			PThread::Sleep(answer.m_delay);
+
+		const bool truncate = answer.m_truncate && !tcp;
+		response = PBYTEArray(query, questionEnd);
+		response[2] = (BYTE)(0x81 | (truncate ? 0x02 : 0));	// response, recursion desired
+		response[3] = (BYTE)(0x80 | answer.m_rcode);	// recursion available
+		const unsigned answers = truncate ? 0 : answer.m_records.size();
+		response[6] = 0;
+		response[7] = (BYTE)answers;
+		response[9] = (BYTE)((answers == 0 && answer.m_negativeTTL) ? 1 : 0);
+		for (unsigned i = 0; i < answers; ++i) {
+			PutWord(response, 0xc00c);	// the name of the question
+			PutWord(response, type);
+			PutWord(response, 1);
+			PutDWord(response, answer.m_ttl);
+			PutWord(response, answer.m_records[i].GetSize());
+			PutBytes(response, answer.m_records[i], answer.m_records[i].GetSize());
+		}
+		if (response[9]) {
+			PBYTEArray soa;
+			PutName(soa, "ns.test");
+			PutName(soa, "admin.test");
+			for (unsigned i = 0; i < 4; ++i)
+				PutDWord(soa, 3600);
+			PutDWord(soa, answer.m_negativeTTL);
+			PutWord(response, 0xc00c);
+			PutWord(response, DNSRecord::SOA);
+			PutWord(response, 1);
+			PutDWord(response, 3600);
+			PutWord(response, soa.GetSize());
+			PutBytes(response, soa, soa.GetSize());
+		}
+		return true;
+	}
+
+	PUDPSocket m_udp;
+	PTCPSocket m_tcp;
+	volatile bool m_running;
+	std::map<PString, Answer> m_answers;
+	std::map<PString, unsigned> m_queries;
+	unsigned m_tcpQueries;
+	mutable PMutex m_mutex;
+};
+
+// queries the resolver from a second thread
+class QueryThread : public PThread {
+	PCLASSINFO(QueryThread, PThread)
+public:
+	QueryThread(const PString & name) : PThread(10000, NoAutoDeleteThread), m_name(name), m_found(false) { Resume(); }
+
+	virtual void Main()
+	{
+		std::vector<DNSRecord> records;
+		m_found = DNSResolver::Instance()->Query(m_name, DNSRecord::A, records);
+	}
+
+	PString m_name;
+	bool m_found;
+};
+
+class DNSResolverTest : public ::testing::Test {
+protected:
+	DNSResolverTest()
+	{
+		std::vector<IPAndPortAddress> servers;
+		servers.push_back(IPAndPortAddress(PIPSocket::Address("127.0.0.1"), server.GetPort()));
+		DNSResolver::Instance()->SetTimeout(600);
+		DNSResolver::Instance()->SetServers(servers);
+	}
+
+	~DNSResolverTest()
+	{
+		DNSResolver::Instance()->SetServers(std::vector<IPAndPortAddress>());
+	}
+
+	StubDNSServer server;
+};
+
+
+TEST_F(DNSResolverTest, Message) {
+	PBYTEArray query;
+	ASSERT_TRUE(DNSMessage::BuildQuery(0x1234, "_h323ls._udp.example.com.", DNSRecord::SRV, query));
+	EXPECT_EQ(12 + 26 + 4, query.GetSize());
+	EXPECT_EQ(0x12, query[0]);
+	EXPECT_EQ(0x34, query[1]);
+	EXPECT_EQ(0x01, query[2]);	// recursion desired
+	EXPECT_EQ(7, query[12]);
+	EXPECT_EQ(0, memcmp((const BYTE *)query + 13, "_h323ls", 7));
+	EXPECT_FALSE(DNSMessage::BuildQuery(1, "bad..name", DNSRecord::A, query));
+
+	// a response with compressed names
+	PBYTEArray response;
+	DNSMessage::BuildQuery(0x1234, "_h323ls._udp.example.com", DNSRecord::SRV, response);
+	response[2] = 0x81;
+	response[7] = 2;
+	PutWord(response, 0xc00c);
+	PutWord(response, DNSRecord::SRV);
+	PutWord(response, 1);
+	PutDWord(response, 300);
+	PutWord(response, 6 + 6);
+	PutWord(response, 10);
+	PutWord(response, 20);
+	PutWord(response, 1719);
+	PutBytes(response, "\x03gk1\xc0\x19", 6);	// gk1.example.com
+	PutWord(response, 0xc00c);
+	PutWord(response, DNSRecord::SRV);
+	PutWord(response, 1);
+	PutDWord(response, 60);
+	PutWord(response, 6 + 1);
+	PutWord(response, 20);
+	PutWord(response, 0);
+	PutWord(response, 1720);
+	PutBytes(response, "", 1);
+
+	DNSMessage msg;
+	ASSERT_TRUE(msg.Parse(response, response.GetSize()));
+	EXPECT_EQ(0x1234, msg.GetID());
+	EXPECT_FALSE(msg.IsTruncated());
+	EXPECT_EQ((unsigned)DNSMessage::NoError, msg.GetRCode());
+	EXPECT_EQ("_h323ls._udp.example.com", msg.GetQuestionName());
+	ASSERT_EQ(2u, msg.GetAnswers().size());
+	EXPECT_EQ(10, msg.GetAnswers()[0].m_priority);
+	EXPECT_EQ(20, msg.GetAnswers()[0].m_weight);
+	EXPECT_EQ(1719, msg.GetAnswers()[0].m_port);
+	EXPECT_EQ(300u, msg.GetAnswers()[0].m_ttl);
+	EXPECT_EQ("gk1.example.com", msg.GetAnswers()[0].m_target);
+	EXPECT_TRUE(msg.GetAnswers()[1].m_target.IsEmpty());
+
+	// a compression loop is rejected
+	response[response.GetSize() - 1] = 0xc0;
+	response.SetSize(response.GetSize() + 1);
+	response[response.GetSize() - 1] = (BYTE)(response.GetSize() - 2);
+	response[response.GetSize() - 9] = 8;	// rdlength
+	EXPECT_FALSE(msg.Parse(response, response.GetSize()));
+	// queries aren't responses
+	EXPECT_FALSE(msg.Parse(query, query.GetSize()));
+}
+
+TEST_F(DNSResolverTest, Cache) {
+	DNSCache cache;
+	cache.SetLimits(2, 3600, 30);
+	std::vector<DNSRecord> records(1);
+	records[0].m_ttl = 60;
+	records[0].m_address = PIPSocket::Address("192.168.1.1");
+	cache.Store("gk.example.com", DNSRecord::A, records, 0, 1000);
+	EXPECT_TRUE(cache.Find("GK.example.com", DNSRecord::A, records, 1059));
+	EXPECT_EQ(1u, records.size());
+	EXPECT_FALSE(cache.Find("gk.example.com", DNSRecord::AAAA, records, 1059));
+	EXPECT_FALSE(cache.Find("gk.example.com", DNSRecord::A, records, 1060));
+
+	// negative answers with the SOA TTL up to the limit
+	records.clear();
+	cache.Store("none.example.com", DNSRecord::A, records, 600, 1000);
+	EXPECT_TRUE(cache.Find("none.example.com", DNSRecord::A, records, 1029));
+	EXPECT_TRUE(records.empty());
+	EXPECT_FALSE(cache.Find("none.example.com", DNSRecord::A, records, 1030));
+	cache.Store("nosoa.example.com", DNSRecord::A, records, 0, 1000);
+	EXPECT_FALSE(cache.Find("nosoa.example.com", DNSRecord::A, records, 1000));
+
+	// the least recently used entry is evicted
+	records.resize(1);
+	records[0].m_ttl = 60;
+	cache.Store("a.example.com", DNSRecord::A, records, 0, 2000);
+	cache.Store("b.example.com", DNSRecord::A, records, 0, 2000);
+	EXPECT_TRUE(cache.Find("a.example.com", DNSRecord::A, records, 2001));
+	cache.Store("c.example.com", DNSRecord::A, records, 0, 2001);
+	EXPECT_EQ(2u, cache.GetSize());
+	EXPECT_FALSE(cache.Find("b.example.com", DNSRecord::A, records, 2002));
+	EXPECT_TRUE(cache.Find("a.example.com", DNSRecord::A, records, 2002));
+}
+
+TEST_F(DNSResolverTest, QueryAndCache) {
+	ASSERT_TRUE(DNSResolver::Instance()->IsEnabled());
+	StubDNSServer::Answer answer;
+	answer.m_records.push_back(AData("10.1.2.3"));
+	server.SetAnswer("gk.example.com", DNSRecord::A, answer);
+	StubDNSServer::Answer nxdomain;
+	nxdomain.m_rcode = DNSMessage::NameError;
+	nxdomain.m_negativeTTL = 30;
+	server.SetAnswer("none.example.com", DNSRecord::A, nxdomain);
+
+	PIPSocket::Address addr;
+	EXPECT_TRUE(DNSResolver::Instance()->LookupAddress("gk.example.com", addr));
+	EXPECT_EQ(PIPSocket::Address("10.1.2.3"), addr);
+	EXPECT_TRUE(DNSResolver::Instance()->LookupAddress("gk.example.com.", addr));
+	EXPECT_EQ(1u, server.GetQueries("gk.example.com", DNSRecord::A));
+
+	std::vector<DNSRecord> records;
+	EXPECT_FALSE(DNSResolver::Instance()->Query("none.example.com", DNSRecord::A, records));
+	EXPECT_FALSE(DNSResolver::Instance()->Query("none.example.com", DNSRecord::A, records));
+	EXPECT_EQ(1u, server.GetQueries("none.example.com", DNSRecord::A));
+
+	EXPECT_TRUE(DNSResolver::Instance()->LookupAddress("192.168.1.1", addr));
+	EXPECT_EQ(PIPSocket::Address("192.168.1.1"), addr);
+}
+
+TEST_F(DNSResolverTest, Coalescing) {
+	StubDNSServer::Answer answer;
+	answer.m_records.push_back(AData("10.1.2.4"));
+	answer.m_delay = 200;
+	server.SetAnswer("slow.example.com", DNSRecord::A, answer);
+
+	QueryThread other("slow.example.com");
+	PThread::Sleep(50);
+	std::vector<DNSRecord> records;
+	EXPECT_TRUE(DNSResolver::Instance()->Query("slow.example.com", DNSRecord::A, records));
+	other.WaitForTermination();
+	EXPECT_TRUE(other.m_found);
+	EXPECT_EQ(1u, server.GetQueries("slow.example.com", DNSRecord::A));
+	ASSERT_EQ(1u, records.size());
+	EXPECT_EQ(PIPSocket::Address("10.1.2.4"), records[0].m_address);
+}
+
+TEST_F(DNSResolverTest, Timeout) {
+	StubDNSServer::Answer answer;
+	answer.m_drop = true;
+	server.SetAnswer("lost.example.com", DNSRecord::A, answer);
+
+	const PTime start;
+	std::vector<DNSRecord> records;
+	EXPECT_FALSE(DNSResolver::Instance()->Query("lost.example.com", DNSRecord::A, records));
+	const PTimeInterval elapsed = PTime() - start;
+	EXPECT_GE(elapsed.GetMilliSeconds(), 550);
+	EXPECT_LE(elapsed.GetMilliSeconds(), 1100);
+	// retransmitted within the timeout, failures aren't cached
+	EXPECT_EQ(3u, server.GetQueries("lost.example.com", DNSRecord::A));
+	answer.m_drop = false;
+	answer.m_records.push_back(AData("10.1.2.5"));
+	server.SetAnswer("lost.example.com", DNSRecord::A, answer);
+	EXPECT_TRUE(DNSResolver::Instance()->Query("lost.example.com", DNSRecord::A, records));
+}
+
+TEST_F(DNSResolverTest, ServersRemovedWhilePending) {
+	StubDNSServer::Answer answer;
+	answer.m_drop = true;
+	server.SetAnswer("orphan.example.com", DNSRecord::A, answer);
+
+	const PTime start;
+	QueryThread pending("orphan.example.com");
+	PThread::Sleep(50);
+	DNSResolver::Instance()->SetServers(std::vector<IPAndPortAddress>());
+	pending.WaitForTermination();
+	EXPECT_FALSE(pending.m_found);
+	EXPECT_LT((PTime() - start).GetMilliSeconds(), 500);
+	EXPECT_FALSE(DNSResolver::Instance()->IsEnabled());
+	// the receiver keeps running past the retransmit time without servers
+	PThread::Sleep(400);
+}
+
+TEST_F(DNSResolverTest, TCPFallback) {
+	StubDNSServer::Answer answer;
+	for (unsigned i = 0; i < 3; ++i)
+		answer.m_records.push_back(SRVData(10, 0, 1719 + i, "gk.example.com"));
+	answer.m_truncate = true;
+	server.SetAnswer("_h323ls._udp.example.com", DNSRecord::SRV, answer);
+	StubDNSServer::Answer address;
+	address.m_records.push_back(AData("10.1.2.3"));
+	server.SetAnswer("gk.example.com", DNSRecord::A, address);
+
+	PStringList result;
+	EXPECT_TRUE(DNSResolver::Instance()->LookupSRV("h323:alice@example.com", "_h323ls._udp.", result));
+	EXPECT_EQ(1u, server.GetTCPQueries());
+	ASSERT_EQ(3, result.GetSize());
+	EXPECT_EQ(0, result[0].Find("alice@10.1.2.3:17"));
+}
+
+TEST_F(DNSResolverTest, ENUM) {
+	StubDNSServer::Answer answer;
+	answer.m_records.push_back(NAPTRData(100, 20, "u", "E2U+sip", "!^.*$!sip:info@example.com!", ""));
+	answer.m_records.push_back(NAPTRData(100, 10, "u", "E2U+h323", "!^\\+49(.*)$!h323:\\1@example.com!", ""));
+	server.SetAnswer("4.3.2.1.9.4.e164.arpa", DNSRecord::NAPTR, answer);
+
+	PString result;
+	EXPECT_TRUE(DNSResolver::Instance()->ENUMLookup("491234", "E2U+h323", result));
+	EXPECT_EQ("h323:1234@example.com", result);
+	EXPECT_FALSE(DNSResolver::Instance()->ENUMLookup("491234", "E2U+xmpp", result));
+	EXPECT_FALSE(DNSResolver::Instance()->ENUMLookup("495555", "E2U+h323", result));
+}
+
+} // namespace
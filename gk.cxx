@@ -42,6 +42,9 @@
 #include "gk.h"
 #include "capctrl.h"
 #include "snmp.h"
+#include "gkconfig.h"
+#include "rwlock.h"
+#include "dnsresolver.h"
 
 #ifdef HAS_LIBSSH
 #include "libssh/libssh.h"
@@ -261,6 +264,7 @@ const char * KnownConfigEntries[][2] = {
 	{ "Gatekeeper::Main", "FourtyTwo" },	// obsolete
 	{ "Gatekeeper::Main", "GrantAllBRQ" },
 	{ "Gatekeeper::Main", "Home" },
+	{ "Gatekeeper::Main", "IncrementalReload" },
 #ifdef HAS_OLM
 	{ "Gatekeeper::Main", "LicenseFile" },
 #endif
@@ -494,8 +498,12 @@ const char * KnownConfigEntries[][2] = {
 #endif
 	{ "Proxy", "CachePortDetection" },
 	{ "Proxy", "CachePortDetectionDuration" },
+	{ "Proxy", "CaptureDirectory" },
+	{ "Proxy", "CaptureMaxFileSize" },
+	{ "Proxy", "CaptureMaxFiles" },
 	{ "Proxy", "CheckH46019KeepAlivePT" },
 	{ "Proxy", "Enable" },
+	{ "Proxy", "EnableMediaQuality" },
 	{ "Proxy", "EnableRTCPStats" },
 	{ "Proxy", "EnableRTPMute" },
 	{ "Proxy", "ExplicitRoutes" },
@@ -506,10 +514,16 @@ const char * KnownConfigEntries[][2] = {
 	{ "Proxy", "IgnoreSignaledPublicH239IPsFrom" },
 #endif
 	{ "Proxy", "InternalNetwork" },
+	{ "Proxy", "IPFIXActiveTimeout" },
+	{ "Proxy", "IPFIXCollector" },
+	{ "Proxy", "IPFIXEnterpriseNumber" },
+	{ "Proxy", "IPFIXIdleTimeout" },
+	{ "Proxy", "IPFIXObservationDomain" },
 #ifdef HAS_H46018
 	{ "Proxy", "LegacyPortDetection" },
 	{ "Proxy", "PortDetectionTimeout" },
 #endif
+	{ "Proxy", "MediaQualityFeedInterval" },
 	{ "Proxy", "ProxyAlways" },
 	{ "Proxy", "ProxyForNAT" },
 	{ "Proxy", "ProxyForSameNAT" },
@@ -519,8 +533,11 @@ const char * KnownConfigEntries[][2] = {
 	{ "Proxy", "RTPInactivityTimeout" },
 	{ "Proxy", "RTPMultiplexing" },
 	{ "Proxy", "RTPMultiplexPort" },
+	{ "Proxy", "RTPMultiplexReaders" },
 	{ "Proxy", "RTCPMultiplexPort" },
+	{ "Proxy", "RTCPStatsSampling" },
 	{ "Proxy", "RTPPortRange" },
+	{ "Proxy", "RTPSocketPoolSize" },
 	{ "Proxy", "RemoveMCInFastStartTransmitOffer" },
 	{ "Proxy", "RestrictRTPSources" },
 	{ "Proxy", "SearchBothSidesOnCLC" },
@@ -577,6 +594,7 @@ const char * KnownConfigEntries[][2] = {
 	{ "RasSrv::LRQFeatures", "AcceptForwardedLRQ" },
 	{ "RasSrv::LRQFeatures", "AcceptNonNeighborLCF" },
 	{ "RasSrv::LRQFeatures", "AcceptNonNeighborLRQ" },
+	{ "RasSrv::LRQFeatures", "AdaptiveNeighborTimeout" },
 	{ "RasSrv::LRQFeatures", "AlwaysForwardLRQ" },
 #ifdef HAS_LANGUAGE
 	{ "RasSrv::LRQFeatures", "EnableLanguageRouting" },
@@ -587,12 +605,15 @@ const char * KnownConfigEntries[][2] = {
 	{ "RasSrv::LRQFeatures", "LoopDetection" },
 	{ "RasSrv::LRQFeatures", "LoopDetectionExpireTime" },
 	{ "RasSrv::LRQFeatures", "LoopDetectionReprocessLCFs" },
+	{ "RasSrv::LRQFeatures", "LossyNeighborHoldoff" },
 	{ "RasSrv::LRQFeatures", "LRQPingInterval" },
+	{ "RasSrv::LRQFeatures", "MinNeighborTimeout" },
 	{ "RasSrv::LRQFeatures", "NeighborTimeout" },
 	{ "RasSrv::LRQFeatures", "PingAlias" },
 	{ "RasSrv::LRQFeatures", "SendLRQPing" },
 	{ "RasSrv::LRQFeatures", "SendRetries" },
 	{ "RasSrv::LRQFeatures", "SendRIP" },
+	{ "RasSrv::LRQFeatures", "SkipLossyNeighbor" },
 	{ "RasSrv::RRQFeatures", "AcceptEndpointIdentifier" },
 	{ "RasSrv::RRQFeatures", "AcceptGatewayPrefixes" },
 	{ "RasSrv::RRQFeatures", "AcceptMCUPrefixes" },
@@ -644,6 +665,11 @@ const char * KnownConfigEntries[][2] = {
 	{ "RoutedMode", "DisableH245Tunneling" },
 	{ "RoutedMode", "DisableRetryChecks" },
 	{ "RoutedMode", "DisableSettingUDPSourceIP" },
+	{ "RoutedMode", "DNSCacheSize" },
+	{ "RoutedMode", "DNSMaxNegativeTTL" },
+	{ "RoutedMode", "DNSMaxTTL" },
+	{ "RoutedMode", "DNSServers" },
+	{ "RoutedMode", "DNSTimeout" },
 	{ "RoutedMode", "DropCallsByReleaseComplete" },
 	{ "RoutedMode", "ENUMservers" },
 	{ "RoutedMode", "EnableGnuGkTcpKeepAlive" },
@@ -683,6 +709,9 @@ const char * KnownConfigEntries[][2] = {
 	{ "RoutedMode", "GnuGkTcpKeepAliveMethodH245" },
 #if defined(HAS_H235_MEDIA) && defined (HAS_SETTOKENLENGTH)
 	{ "RoutedMode", "H235HalfCallMaxTokenLength" },
+#endif
+#ifdef HAS_H235_MEDIA
+	{ "RoutedMode", "H235KeyPoolSize" },
 #endif
 	{ "RoutedMode", "H225DiffServ" },
 	{ "RoutedMode", "H245DiffServ" },
@@ -768,6 +797,11 @@ const char * KnownConfigEntries[][2] = {
 	{ "Routing::Forwarding", "Username" },
 #if defined (P_HTTP) || defined (HAS_LIBCURL)
 	{ "Routing::Http", "Body" },
+	{ "Routing::Http", "CacheKey" },
+	{ "Routing::Http", "CacheNegativeTTL" },
+	{ "Routing::Http", "CacheSize" },
+	{ "Routing::Http", "CacheStaleTime" },
+	{ "Routing::Http", "CacheTTL" },
 	{ "Routing::Http", "ContentType" },
 	{ "Routing::Http", "DeleteRegex" },
 	{ "Routing::Http", "ErrorRegex" },
@@ -779,6 +813,11 @@ const char * KnownConfigEntries[][2] = {
 	{ "Routing::Http", "URL" },
 #endif // P_HTTP
 #ifdef HAS_LUA
+	{ "Routing::Lua", "CacheKey" },
+	{ "Routing::Lua", "CacheNegativeTTL" },
+	{ "Routing::Lua", "CacheSize" },
+	{ "Routing::Lua", "CacheStaleTime" },
+	{ "Routing::Lua", "CacheTTL" },
 	{ "Routing::Lua", "Script" },
 	{ "Routing::Lua", "ScriptFile" },
 #endif
@@ -797,7 +836,12 @@ const char * KnownConfigEntries[][2] = {
 	{ "Routing::SRV", "ConvertURLs" },
 	{ "Routing::SRV", "ResolveNonLocalLRQ" },
 #ifdef HAS_DATABASE
+	{ "Routing::Sql", "CacheKey" },
+	{ "Routing::Sql", "CacheNegativeTTL" },
+	{ "Routing::Sql", "CacheSize" },
+	{ "Routing::Sql", "CacheStaleTime" },
 	{ "Routing::Sql", "CacheTimeout" },
+	{ "Routing::Sql", "CacheTTL" },
 	{ "Routing::Sql", "ConnectTimeout" },
 	{ "Routing::Sql", "Database" },
 	{ "Routing::Sql", "Driver" },
@@ -1200,16 +1244,56 @@ void GnuGkToSyslog::Output(PSystemLog::Level level, const char * msg)
 #endif
 
 
+namespace {
+
+// reload all subsystems after the Toolkit has read the new config
+void RunReloadSteps(ConfigReloader & reloader)
+{
+	// sections that were already re-read by Toolkit::ReloadConfig()
+	reloader.Claim("Gatekeeper::Main,LogFile,RasSrv::RewriteE164,RasSrv::GWRewriteE164,RasSrv::RewriteAlias,"
+		"RasSrv::AssignedAlias,RasSrv::AssignedGatekeeper,RasSrv::AlternateGatekeeper,ModeSelection,ModeVendorSelection,"
+		"RewriteCLI*,CapacityControl,PortNotifications,H225toQ931,GkQoSMonitor,GkPresence::*,AssignedAliases::*,"
+		"AssignedGatekeepers::*,AlternateGatekeepers::*,AssignedLanguage::*,SNMP,TLS,Proxy");
+
+	reloader.Run("CallTable", "Gatekeeper::Main,CallTable,RoutedMode,Proxy", CallTable::Instance(), &CallTable::LoadConfig);
+	reloader.Run("RegistrationTable", "Gatekeeper::Main,RasSrv::PermanentEndpoints,RasSrv::GWPrefixes,RasSrv::RRQFeatures,EP::*,RoutedMode,Proxy",
+		RegistrationTable::Instance(), &RegistrationTable::LoadConfig);
+	reloader.Run("PrefixCapacity", "Gatekeeper::Main,RasSrv::GWPrefixes,EP::*", CallTable::Instance(), &CallTable::UpdatePrefixCapacityCounters);
+
+	// don't put this in LoadConfig()
+	reloader.Run("RoutedMode", "Gatekeeper::Main,RoutedMode", RasServer::Instance(), &RasServer::SetRoutedMode);
+	reloader.Run("ENUMServers", "Gatekeeper::Main,RoutedMode,Routing::ENUM", RasServer::Instance(), &RasServer::SetENUMServers);
+	reloader.Run("RDSServers", "Gatekeeper::Main,RoutedMode,Routing::RDS", RasServer::Instance(), &RasServer::SetRDSServers);
+	reloader.Run("DNSResolver", "Gatekeeper::Main,RoutedMode", DNSResolver::Instance(), &DNSResolver::LoadConfig);
+
+	RasServer::Instance()->LoadConfig(reloader);
+
+	reloader.Run("StatusPort", "Gatekeeper::Main,GkStatus::*", GkStatus::Instance(), &GkStatus::LoadConfig);
+}
+
+} // end of anonymous namespace
+
 void ReloadHandler()
 {
 	Gatekeeper::ReopenLogFile();
 
 	// only one thread must do this
 	if (ReloadMutex.Wait(0)) {
+		// fingerprint the current config, to find out what the reload changes
+		ConfigSectionDigest oldDigest;
+		bool incremental = false;
+		{
+			ReadLock cfglock(ConfigReloadMutex);
+			incremental = Toolkit::AsBool(GkConfig()->GetString("IncrementalReload", "0"));
+			if (incremental)
+				ConfigChanges::Digest(GkConfig(), oldDigest);
+		}
+
 		/*
 		** Enter critical Section
 		*/
 		ConfigReloadMutex.StartWrite();
+		PTime toolkitStart;
 
 		/*
 		** Force reloading config
@@ -1221,35 +1305,49 @@ void ReloadHandler()
 
 		SoftPBX::TimeToLive = GkConfig()->GetInteger("TimeToLive", SoftPBX::TimeToLive);
 
-		/*
-		** Update all gateway prefixes
-		*/
-
-		CallTable::Instance()->LoadConfig();
-		RegistrationTable::Instance()->LoadConfig();
-		CallTable::Instance()->UpdatePrefixCapacityCounters();
-
-		// don't put this in LoadConfig()
-		RasServer::Instance()->SetRoutedMode();
-
-		// Load ENUM servers
-		RasServer::Instance()->SetENUMServers();
-
-		// Load RDS servers
-		RasServer::Instance()->SetRDSServers();
-
-		RasServer::Instance()->LoadConfig();
-
-		GkStatus::Instance()->LoadConfig();
-
 		Gatekeeper::EnableLogFileRotation();
 
-		ConfigReloadMutex.EndWrite();
+		PString report = "Toolkit=" + PString(PString::Unsigned, (long)(PTime() - toolkitStart).GetMilliSeconds()) + "ms";
+
+		// the switch must be on in the old and the new config
+		incremental = incremental && Toolkit::AsBool(GkConfig()->GetString("IncrementalReload", "0"));
+		ConfigSectionDigest newDigest;
+		if (incremental)
+			ConfigChanges::Digest(GkConfig(), newDigest);
+		const ConfigChanges changes(oldDigest, newDigest);
+
+		if (incremental && !changes.Affects("Gatekeeper::Main")) {
+			// each step takes the lock on its own, calls only wait for the subsystem being reloaded
+			ConfigReloadMutex.EndWrite();
+			PTRACE(3, "GK\tIncremental reload, changed sections: " << changes.AsString());
+
+			// decide before any step runs, so no subsystem is reloaded twice
+			ConfigReloader claims(&changes, NULL, true);
+			RunReloadSteps(claims);
+			if (claims.AllChangesClaimed()) {
+				ConfigReloader reloader(&changes, &ConfigReloadMutex);
+				RunReloadSteps(reloader);
+				report += " " + reloader.GetReport();
+			} else {
+				PTRACE(2, "GK\tChanged sections not covered by an incremental step, doing a full reload");
+				ConfigReloader fullReloader(NULL, &ConfigReloadMutex);
+				RunReloadSteps(fullReloader);
+				report += " " + fullReloader.GetReport();
+			}
+		} else {
+			ConfigReloader reloader;
+			RunReloadSteps(reloader);
+			report += " " + reloader.GetReport();
+
+			ConfigReloadMutex.EndWrite();
+		}
 
 		/*
 		** Don't disengage current calls!
 		*/
 		PTRACE(3, "GK\tCarry on current calls.");
+		PTRACE(3, "GK\tReload: " << report);
+		GkStatus::Instance()->SignalStatus("Reload: " + report + "\r\n");
 
 		SNMP_TRAP(3, SNMPInfo, General, "Full config reloaded");
 
@@ -1949,6 +2047,8 @@ void Gatekeeper::Main()
 	// Load RDS servers
 	RasSrv->SetRDSServers();
 
+	DNSResolver::Instance()->LoadConfig();
+
 #ifdef HAS_SNMP
 	if (Toolkit::Instance()->IsSNMPEnabled() && SelectSNMPImplementation() == "PTLib")
 		SNMP_TRAP(1, SNMPInfo, General, "GnuGk started");	// when NOT registering as agent, send started trap here already
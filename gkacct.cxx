@@ -31,6 +31,7 @@
 #include "gktimer.h"
 #include "snmp.h"
 #include "gkacct.h"
+#include "ProxyChannel.h"
 
 using std::find;
 using std::vector;
@@ -128,6 +129,29 @@ GkAcctLogger::Status GkAcctLogger::Log(
 	return (evt & m_enabledEvents & m_supportedEvents) ? m_defaultStatus : Next;
 }
 
+namespace {
+
+// loss, jitter and (for audio) MOS measured by the RTP relay, empty if not measured
+void SetupMediaQualityParams(std::map<PString, PString> & params, PINDEX callNo, WORD sessionID,
+	bool fromCaller, const PString & prefix)
+{
+	RTPStreamQuality quality;
+	if (GetProxyConfig()->m_enableMediaQuality
+		&& MediaQualityMonitor::Instance()->GetQuality(callNo, sessionID, fromCaller, quality)) {
+		params[prefix + "-loss"] = PString(PString::Printf, "%.2f", quality.GetLossPercent());
+		params[prefix + "-jitter"] = PString(quality.GetJitter());
+		if (sessionID == RTP_Session::DefaultAudioSessionID)
+			params[prefix + "-mos"] = PString(PString::Printf, "%.2f", quality.GetMOS());
+	} else {
+		params[prefix + "-loss"] = "";
+		params[prefix + "-jitter"] = "";
+		if (sessionID == RTP_Session::DefaultAudioSessionID)
+			params[prefix + "-mos"] = "";
+	}
+}
+
+} // end namespace
+
 void GkAcctLogger::SetupAcctParams(
 	/// CDR parameters (name => value) associations
 	std::map<PString, PString> & params,
@@ -268,6 +292,11 @@ void GkAcctLogger::SetupAcctParams(
         encryption = "Off";
 	params["encryption"] = encryption;
 
+	SetupMediaQualityParams(params, call->GetCallNumber(), RTP_Session::DefaultAudioSessionID, true, "caller-audio");
+	SetupMediaQualityParams(params, call->GetCallNumber(), RTP_Session::DefaultAudioSessionID, false, "callee-audio");
+	SetupMediaQualityParams(params, call->GetCallNumber(), RTP_Session::DefaultVideoSessionID, true, "caller-video");
+	SetupMediaQualityParams(params, call->GetCallNumber(), RTP_Session::DefaultVideoSessionID, false, "callee-video");
+
 	params["codec"] = call->GetCallerAudioCodec();  // deprecated
     params["media-oip"] = addr.AsString(); // deprecated
 }
@@ -14,6 +14,7 @@
  */
 
 #include <ptlib.h>
+#include <ptclib/cypher.h>
 #include "gkconfig.h"
 
 GatekeeperConfig::GatekeeperConfig(
@@ -128,3 +129,143 @@ long GatekeeperConfig::GetInteger(const PString & section, const PString & key,
 	else
 		return m_chainedConfig->GetInteger(section, key, dflt);
 }
+
+ConfigChanges::ConfigChanges(const ConfigSectionDigest & oldDigest, const ConfigSectionDigest & newDigest)
+{
+	ConfigSectionDigest::const_iterator o = oldDigest.begin();
+	ConfigSectionDigest::const_iterator n = newDigest.begin();
+	while (o != oldDigest.end() || n != newDigest.end()) {
+		if (n == newDigest.end() || (o != oldDigest.end() && o->first < n->first)) {
+			m_changed.insert(o->first);	// section removed
+			++o;
+		} else if (o == oldDigest.end() || n->first < o->first) {
+			m_changed.insert(n->first);	// section added
+			++n;
+		} else {
+			if (o->second != n->second)
+				m_changed.insert(o->first);
+			++o;
+			++n;
+		}
+	}
+}
+
+void ConfigChanges::Digest(PConfig * cfg, ConfigSectionDigest & digest)
+{
+	digest.clear();
+	if (cfg == NULL)
+		return;
+#ifdef hasPConfigArray
+	const PStringArray sections = cfg->GetSections();
+#else
+	const PStringList sections = cfg->GetSections();
+#endif
+	for (PINDEX i = 0; i < sections.GetSize(); ++i) {
+		// sort the keys, dictionary order isn't stable between config instances
+		const PStringToString kv = cfg->GetAllKeyValues(sections[i]);
+		std::map<PString, PString> sorted;
+		for (PINDEX j = 0; j < kv.GetSize(); ++j)
+			sorted[kv.GetKeyAt(j)] = kv.GetDataAt(j);
+		PString flat;
+		for (std::map<PString, PString>::const_iterator it = sorted.begin(); it != sorted.end(); ++it)
+			flat += it->first + "=" + it->second + "\n";
+		digest[sections[i]] = PMessageDigest5::Encode(flat);
+	}
+}
+
+bool ConfigChanges::Matches(const PString & pattern, const PString & section)
+{
+	if (pattern.Right(1) == "*")
+		return section.Left(pattern.GetLength() - 1) == pattern.Left(pattern.GetLength() - 1);
+	return section == pattern;
+}
+
+bool ConfigChanges::Affects(const PString & sections) const
+{
+	const PStringArray names = sections.Tokenise(",", false);
+	for (PINDEX i = 0; i < names.GetSize(); ++i) {
+		const PString name = names[i].Trim();
+		if (name.IsEmpty())
+			continue;
+		for (std::set<PString>::const_iterator it = m_changed.begin(); it != m_changed.end(); ++it)
+			if (Matches(name, *it))
+				return true;
+	}
+	return false;
+}
+
+bool ConfigChanges::CoveredBy(const std::set<PString> & claimed) const
+{
+	for (std::set<PString>::const_iterator it = m_changed.begin(); it != m_changed.end(); ++it) {
+		bool covered = false;
+		for (std::set<PString>::const_iterator c = claimed.begin(); c != claimed.end() && !covered; ++c)
+			covered = Matches(*c, *it);
+		if (!covered) {
+			PTRACE(3, "CONFIG\tChanged section [" << *it << "] isn't handled by an incremental reload step");
+			return false;
+		}
+	}
+	return true;
+}
+
+PString ConfigChanges::AsString() const
+{
+	PString result;
+	for (std::set<PString>::const_iterator it = m_changed.begin(); it != m_changed.end(); ++it) {
+		if (!result.IsEmpty())
+			result += ", ";
+		result += *it;
+	}
+	return result;
+}
+
+ConfigReloader::ConfigReloader(const ConfigChanges * changes, PReadWriteMutex * stepLock, bool claimOnly)
+	: m_changes(changes), m_stepLock(stepLock), m_claimOnly(claimOnly)
+{
+}
+
+void ConfigReloader::Claim(const PString & sections)
+{
+	const PStringArray names = sections.Tokenise(",", false);
+	for (PINDEX i = 0; i < names.GetSize(); ++i) {
+		const PString name = names[i].Trim();
+		if (!name.IsEmpty())
+			m_claimed.insert(name);
+	}
+}
+
+bool ConfigReloader::BeginStep(const char * name, const PString & sections)
+{
+	Claim(sections);
+	if (m_claimOnly)
+		return false;
+	if (m_changes != NULL && !m_changes->Affects(sections)) {
+		if (!m_skipped.IsEmpty())
+			m_skipped += ",";
+		m_skipped += name;
+		return false;
+	}
+	if (m_stepLock)
+		m_stepLock->StartWrite();
+	m_stepStart = PTime();
+	return true;
+}
+
+void ConfigReloader::EndStep(const char * name)
+{
+	const PTimeInterval duration = PTime() - m_stepStart;
+	if (m_stepLock)
+		m_stepLock->EndWrite();
+	PTRACE(4, "CONFIG\tReloaded " << name << " in " << duration.GetMilliSeconds() << " ms");
+	if (!m_report.IsEmpty())
+		m_report += " ";
+	m_report += PString(name) + "=" + PString(PString::Unsigned, (long)duration.GetMilliSeconds()) + "ms";
+}
+
+PString ConfigReloader::GetReport() const
+{
+	PString report = m_report;
+	if (!m_skipped.IsEmpty())
+		report += " skipped=" + m_skipped;
+	return report;
+}
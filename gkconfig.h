@@ -18,6 +18,8 @@
 #define GKCONFIG_H "@(#) $Id$"
 
 #include "config.h"
+#include <map>
+#include <set>
 
 class GatekeeperConfig : public PConfig
 {
@@ -159,4 +161,124 @@ private:
 	PConfig* m_chainedConfig;
 };
 
+/// fingerprint of every config section (section name -> digest of its keys and values)
+typedef std::map<PString, PString> ConfigSectionDigest;
+
+/** The set of config sections that differ between two versions of the config.
+    Used on reload to skip subsystems whose sections did not change.
+*/
+class ConfigChanges
+{
+public:
+	ConfigChanges(
+		const ConfigSectionDigest & oldDigest, /// sections before the reload
+		const ConfigSectionDigest & newDigest /// sections after the reload
+		);
+
+	/** Calculate the fingerprint of all sections in a config. */
+	static void Digest(
+		PConfig * cfg, /// config to fingerprint
+		ConfigSectionDigest & digest /// output: section fingerprints
+		);
+
+	/** @return
+	    true if at least one of the given sections has changed (was added, removed or modified).
+	    #sections# is a comma separated list of section names, a trailing '*' matches
+	    all sections starting with the given prefix (eg. "EP::*").
+	*/
+	bool Affects(
+		const PString & sections
+		) const;
+
+	/// @return	true if no section has changed
+	bool IsEmpty() const { return m_changed.empty(); }
+
+	/// @return	a comma separated list of changed sections (for logging)
+	PString AsString() const;
+
+	/** @return
+	    true if every changed section matches one of the section patterns in #claimed#.
+	*/
+	bool CoveredBy(
+		const std::set<PString> & claimed
+		) const;
+
+private:
+	static bool Matches(const PString & pattern, const PString & section);
+
+	std::set<PString> m_changed;
+};
+
+/** Runs the reload steps of the individual subsystems.
+
+    With a ConfigChanges object a step is skipped when none of its sections
+    has changed, without one every step is run (full reload). If a lock is
+    passed, it is taken for writing separately for each step, so signaling
+    threads only wait for the subsystem that is currently being reloaded.
+    The duration of each step is recorded for the status port.
+
+    A reloader that only claims runs no step, it collects the sections of
+    all steps to decide whether an incremental reload covers every change
+    before anything is reloaded.
+*/
+class ConfigReloader
+{
+public:
+	ConfigReloader(
+		const ConfigChanges * changes = NULL, /// NULL = reload everything
+		PReadWriteMutex * stepLock = NULL, /// lock to take for each step
+		bool claimOnly = false /// only collect the sections, don't run the steps
+		);
+
+	/// run #step# on #obj# if one of #sections# has changed
+	template<class T>
+	void Run(const char * name, const PString & sections, T * obj, void (T::*step)())
+	{
+		if (obj == NULL) {
+			Claim(sections);
+			return;
+		}
+		if (!BeginStep(name, sections))
+			return;
+		(obj->*step)();
+		EndStep(name);
+	}
+
+	/// run function #step# if one of #sections# has changed
+	void Run(const char * name, const PString & sections, void (*step)())
+	{
+		if (!BeginStep(name, sections))
+			return;
+		(*step)();
+		EndStep(name);
+	}
+
+	/// declare sections that are read on use and don't need a reload step
+	void Claim(const PString & sections);
+
+	/// @return	true if all changed sections belong to at least one step
+	bool AllChangesClaimed() const { return m_changes == NULL || m_changes->CoveredBy(m_claimed); }
+
+	/// @return	true if this is a full reload
+	bool IsFullReload() const { return m_changes == NULL; }
+
+	/// @return	true if the steps are only claimed, not run
+	bool IsClaimOnly() const { return m_claimOnly; }
+
+	/// @return	a one line summary of the steps run, their durations and the skipped steps
+	PString GetReport() const;
+
+private:
+	bool BeginStep(const char * name, const PString & sections);
+	void EndStep(const char * name);
+
+	const ConfigChanges * m_changes;
+	PReadWriteMutex * m_stepLock;
+	bool m_claimOnly;
+	std::set<PString> m_claimed;
+	PTime m_stepStart;
+	PString m_report;
+	PString m_skipped;
+};
+
 #endif // GKCONFIG_H
@@ -0,0 +1,135 @@
+/*
+ * gkconfig.t.cxx
+ *
+ * unit tests for gkconfig.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include <ptlib.h>
+#include "gkconfig.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// takes the lock for reading once
+class ReaderThread : public PThread {
+	PCLASSINFO(ReaderThread, PThread)
+public:
+	ReaderThread(PReadWriteMutex & lock) : PThread(10000, NoAutoDeleteThread), m_lock(lock) { Resume(); }
+
+	virtual void Main()
+	{
+		m_lock.StartRead();
+		m_lock.EndRead();
+	}
+
+protected:
+	PReadWriteMutex & m_lock;
+};
+
+// a subsystem that counts its reloads
+struct Subsystem {
+	Subsystem() : m_runs(0) { }
+	void Reload() { ++m_runs; }
+	unsigned m_runs;
+};
+
+class ConfigReloadTest : public ::testing::Test {
+protected:
+	ConfigReloadTest()
+	{
+		m_oldDigest["Gatekeeper::Main"] = "1";
+		m_oldDigest["RoutedMode"] = "2";
+		m_oldDigest["EP::1234"] = "3";
+		m_oldDigest["Proxy"] = "4";
+		m_newDigest = m_oldDigest;
+	}
+
+	ConfigSectionDigest m_oldDigest;
+	ConfigSectionDigest m_newDigest;
+	Subsystem m_subsystem;
+};
+
+
+TEST_F(ConfigReloadTest, Changes) {
+	EXPECT_TRUE(ConfigChanges(m_oldDigest, m_newDigest).IsEmpty());
+
+	m_newDigest["RoutedMode"] = "changed";
+	m_newDigest.erase("Proxy");
+	m_newDigest["EP::5678"] = "added";
+	const ConfigChanges changes(m_oldDigest, m_newDigest);
+	EXPECT_FALSE(changes.IsEmpty());
+	EXPECT_EQ("EP::5678, Proxy, RoutedMode", changes.AsString());
+	EXPECT_TRUE(changes.Affects("RoutedMode"));
+	EXPECT_TRUE(changes.Affects("Proxy"));
+	EXPECT_TRUE(changes.Affects("Gatekeeper::Main, EP::*"));
+	EXPECT_FALSE(changes.Affects("Gatekeeper::Main"));
+	EXPECT_FALSE(changes.Affects("EP::1234,GkStatus::*"));
+	EXPECT_FALSE(changes.Affects(""));
+
+	std::set<PString> claimed;
+	claimed.insert("RoutedMode");
+	claimed.insert("Proxy");
+	EXPECT_FALSE(changes.CoveredBy(claimed));
+	claimed.insert("EP::*");
+	EXPECT_TRUE(changes.CoveredBy(claimed));
+}
+
+TEST_F(ConfigReloadTest, SkipSteps) {
+	m_newDigest["RoutedMode"] = "changed";
+	const ConfigChanges changes(m_oldDigest, m_newDigest);
+	ConfigReloader reloader(&changes);
+	EXPECT_FALSE(reloader.IsFullReload());
+	reloader.Run("A", "Gatekeeper::Main,RoutedMode", &m_subsystem, &Subsystem::Reload);
+	reloader.Run("B", "Proxy", &m_subsystem, &Subsystem::Reload);
+	reloader.Run("C", "EP::*", &m_subsystem, &Subsystem::Reload);
+	EXPECT_EQ(1u, m_subsystem.m_runs);
+	EXPECT_TRUE(reloader.GetReport().Find("skipped=B,C") != P_MAX_INDEX);
+	EXPECT_TRUE(reloader.AllChangesClaimed());
+
+	ConfigReloader fullReloader;
+	EXPECT_TRUE(fullReloader.IsFullReload());
+	fullReloader.Run("A", "Gatekeeper::Main,RoutedMode", &m_subsystem, &Subsystem::Reload);
+	fullReloader.Run("B", "Proxy", &m_subsystem, &Subsystem::Reload);
+	EXPECT_EQ(3u, m_subsystem.m_runs);
+	EXPECT_TRUE(fullReloader.AllChangesClaimed());
+}
+
+TEST_F(ConfigReloadTest, ClaimOnly) {
+	m_newDigest["RoutedMode"] = "changed";
+	m_newDigest["GkStatus::Filtering"] = "added";
+	const ConfigChanges changes(m_oldDigest, m_newDigest);
+	ConfigReloader claims(&changes, NULL, true);
+	EXPECT_TRUE(claims.IsClaimOnly());
+	claims.Run("A", "Gatekeeper::Main,RoutedMode", &m_subsystem, &Subsystem::Reload);
+	claims.Run("B", "Proxy", &m_subsystem, &Subsystem::Reload);
+	EXPECT_EQ(0u, m_subsystem.m_runs);
+	// [GkStatus::Filtering] isn't read by any step
+	EXPECT_FALSE(claims.AllChangesClaimed());
+	claims.Claim("GkStatus::*");
+	EXPECT_TRUE(claims.AllChangesClaimed());
+}
+
+TEST_F(ConfigReloadTest, NullObjectReleasesLock) {
+	m_newDigest["RoutedMode"] = "changed";
+	const ConfigChanges changes(m_oldDigest, m_newDigest);
+	PReadWriteMutex lock;
+	ConfigReloader reloader(&changes, &lock);
+	reloader.Run("A", "RoutedMode", (Subsystem *)NULL, &Subsystem::Reload);
+	reloader.Run("B", "RoutedMode", &m_subsystem, &Subsystem::Reload);
+	EXPECT_EQ(1u, m_subsystem.m_runs);
+	EXPECT_TRUE(reloader.AllChangesClaimed());
+
+	ReaderThread reader(lock);
+	EXPECT_TRUE(reader.WaitForTermination(5000));
+}
+
+}  // namespace
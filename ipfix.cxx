@@ -0,0 +1,479 @@
+//////////////////////////////////////////////////////////////////
+//
+// ipfix.cxx
+//
+// Export of the relayed RTP flows as IPFIX records
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "config.h"
+#include <ptlib.h>
+#include <ptlib/sockets.h>
+#include "gk_const.h"
+#include "h323util.h"
+#include "Toolkit.h"
+#include "job.h"
+#include "ipfix.h"
+
+namespace {
+
+const WORD IPFIXVersion = 10;
+const WORD IPFIXDefaultPort = 4739;
+const WORD TemplateSetID = 2;
+const unsigned SetHeaderSize = 4;
+const WORD EnterpriseBit = 0x8000;
+const BYTE ProtocolUDP = 17;
+
+// IANA information elements
+enum {
+	octetDeltaCount = 1,
+	packetDeltaCount = 2,
+	protocolIdentifier = 4,
+	sourceTransportPort = 7,
+	sourceIPv4Address = 8,
+	destinationTransportPort = 11,
+	destinationIPv4Address = 12,
+	sourceIPv6Address = 27,
+	destinationIPv6Address = 28,
+	flowEndReason = 136,
+	flowStartSeconds = 150,
+	flowEndSeconds = 151,
+	postNATSourceIPv4Address = 225,
+	postNATDestinationIPv4Address = 226,
+	postNAPTSourceTransportPort = 227,
+	postNAPTDestinationTransportPort = 228,
+	postNATSourceIPv6Address = 281,
+	postNATDestinationIPv6Address = 282
+};
+
+struct TemplateField {
+	WORD m_id;	// EnterpriseBit set for the enterprise specific elements
+	WORD m_length;	// 0: the length of an address
+};
+
+// the same order as the values in IPFIXMessageBuilder::Add()
+const TemplateField Fields[] = {
+	{ octetDeltaCount, 8 },
+	{ packetDeltaCount, 8 },
+	{ flowStartSeconds, 4 },
+	{ flowEndSeconds, 4 },
+	{ protocolIdentifier, 1 },
+	{ flowEndReason, 1 },
+	{ sourceIPv4Address, 0 },
+	{ sourceTransportPort, 2 },
+	{ destinationIPv4Address, 0 },
+	{ destinationTransportPort, 2 },
+	{ postNATSourceIPv4Address, 0 },
+	{ postNAPTSourceTransportPort, 2 },
+	{ postNATDestinationIPv4Address, 0 },
+	{ postNAPTDestinationTransportPort, 2 },
+	{ EnterpriseBit | IPFIXMessageBuilder::CallNumberElement, 4 },
+	{ EnterpriseBit | IPFIXMessageBuilder::CallIdentifierElement, 16 },
+	{ EnterpriseBit | IPFIXMessageBuilder::SessionIDElement, 2 }
+};
+const unsigned NumFields = sizeof(Fields) / sizeof(Fields[0]);
+
+WORD FieldID(const TemplateField & field, bool ipv6)
+{
+	if (!ipv6)
+		return field.m_id;
+	switch (field.m_id) {
+		case sourceIPv4Address: return sourceIPv6Address;
+		case destinationIPv4Address: return destinationIPv6Address;
+		case postNATSourceIPv4Address: return postNATSourceIPv6Address;
+		case postNATDestinationIPv4Address: return postNATDestinationIPv6Address;
+		default: return field.m_id;
+	}
+}
+
+unsigned RecordSize(bool ipv6)
+{
+	unsigned size = 0;
+	for (unsigned i = 0; i < NumFields; ++i)
+		size += Fields[i].m_length ? Fields[i].m_length : (ipv6 ? 16 : 4);
+	return size;
+}
+
+// one template for both legs, mixed IPv4 and IPv6 flows use the IPv6 template with mapped addresses
+bool IsIPv6Record(const IPFIXFlowRecord & record)
+{
+	return record.m_srcIP.GetVersion() == 6 || record.m_dstIP.GetVersion() == 6
+		|| record.m_postNATSrcIP.GetVersion() == 6 || record.m_postNATDstIP.GetVersion() == 6;
+}
+
+} // end namespace
+
+// class IPFIXFlowTable
+IPFIXFlowTable::IPFIXFlowTable() : m_numFlows(0)
+{
+	for (unsigned i = 0; i < MaxChunks; ++i)
+		m_counters[i] = NULL;
+}
+
+IPFIXFlowTable::~IPFIXFlowTable()
+{
+	for (unsigned i = 0; i < MaxChunks; ++i)
+		delete[] m_counters[i];
+}
+
+unsigned IPFIXFlowTable::Allocate(const FlowKey & key, time_t now)
+{
+	PWaitAndSignal lock(m_mutex);
+	unsigned slot;
+	if (!m_freeSlots.empty()) {
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	} else {
+		slot = (unsigned)m_flows.size();
+		if (slot / ChunkSize >= MaxChunks) {
+			PTRACE(1, "IPFIX\tError: Too many flows for the export");
+			return NoSlot;
+		}
+		if (m_counters[slot / ChunkSize] == NULL) {
+			Counters * chunk = new Counters[ChunkSize];
+			GkAtomicExchangePointer((void * volatile *)&m_counters[slot / ChunkSize], (void *)chunk);
+		}
+		m_flows.push_back(FlowInfo());
+	}
+	FlowInfo & flow = m_flows[slot];
+	flow.m_key = key;
+	flow.m_used = true;
+	flow.m_released = false;
+	flow.m_packets = flow.m_octets = 0;
+	flow.m_start = (unsigned)now;	// the first packet is counted right away
+	flow.m_lastReport = (unsigned)now;
+	Counters & c = m_counters[slot / ChunkSize][slot % ChunkSize];
+	GkAtomicStore(&c.m_packets, 0);
+	GkAtomicStore(&c.m_octets, 0);
+	GkAtomicStore(&c.m_lastPacket, (unsigned)now);
+	++m_numFlows;
+	return slot;
+}
+
+void IPFIXFlowTable::Release(unsigned slot)
+{
+	if (slot == NoSlot)
+		return;
+	PWaitAndSignal lock(m_mutex);
+	m_flows[slot].m_released = true;
+}
+
+void IPFIXFlowTable::Collect(time_t now, unsigned activeTimeout, unsigned idleTimeout, std::vector<IPFIXFlowRecord> & records)
+{
+	PWaitAndSignal lock(m_mutex);
+	const unsigned t = (unsigned)now;
+	for (unsigned slot = 0; slot < m_flows.size(); ++slot) {
+		FlowInfo & flow = m_flows[slot];
+		if (!flow.m_used)
+			continue;
+		const Counters & c = m_counters[slot / ChunkSize][slot % ChunkSize];
+		const unsigned packets = GkAtomicLoad(&c.m_packets);
+		const unsigned octets = GkAtomicLoad(&c.m_octets);
+		// the end of a flow is always reported, even without packets since the last record
+		if (packets != flow.m_packets || flow.m_released) {
+			if (flow.m_start == 0)
+				flow.m_start = std::min(GkAtomicLoad(&c.m_lastPacket), t);	// first seen in this round
+			BYTE reason = 0;
+			if (flow.m_released)
+				reason = IPFIXFlowRecord::EndOfFlow;
+			else if ((int)(t - GkAtomicLoad(&c.m_lastPacket)) >= (int)idleTimeout)
+				reason = IPFIXFlowRecord::IdleTimeout;
+			else if ((int)(t - flow.m_lastReport) >= (int)activeTimeout)
+				reason = IPFIXFlowRecord::ActiveTimeout;
+			if (reason != 0) {
+				AddRecord(flow, c, packets, octets, reason, records);
+				flow.m_lastReport = t;
+			}
+		}
+		if (flow.m_released) {
+			flow.m_used = false;
+			m_freeSlots.push_back(slot);
+			--m_numFlows;
+		}
+	}
+}
+
+void IPFIXFlowTable::AddRecord(FlowInfo & flow, const Counters & c, unsigned packets, unsigned octets, BYTE reason, std::vector<IPFIXFlowRecord> & records)
+{
+	const FlowKey & key = flow.m_key;
+	IPFIXFlowRecord record;
+	record.m_srcIP = key.m_srcIP;
+	record.m_srcPort = key.m_srcPort;
+	record.m_dstIP = key.m_dstIP;
+	record.m_dstPort = key.m_dstPort;
+	record.m_postNATSrcIP = key.m_postNATSrcIP;
+	record.m_postNATSrcPort = key.m_postNATSrcPort;
+	record.m_postNATDstIP = key.m_postNATDstIP;
+	record.m_postNATDstPort = key.m_postNATDstPort;
+	record.m_end = GkAtomicLoad(&c.m_lastPacket);
+	record.m_start = std::min(flow.m_start, record.m_end);
+	// the counters wrap around, the difference is right as long as it's read more often than it wraps
+	record.m_packets = packets - flow.m_packets;
+	record.m_octets = octets - flow.m_octets;
+	record.m_endReason = reason;
+	record.m_callNo = key.m_callNo;
+	memcpy(record.m_callID, key.m_callID, sizeof(record.m_callID));
+	record.m_sessionID = key.m_sessionID;
+	records.push_back(record);
+
+	flow.m_packets = packets;
+	flow.m_octets = octets;
+	flow.m_start = 0;
+}
+
+
+// class IPFIXMessageBuilder
+const unsigned IPFIXMessageBuilder::DefaultEnterpriseNumber = 32473;	// RFC 5612 documentation number, set your own
+
+IPFIXMessageBuilder::IPFIXMessageBuilder(unsigned observationDomain, unsigned enterpriseNumber)
+	: m_observationDomain(observationDomain), m_enterpriseNumber(enterpriseNumber),
+	  m_message(MaxMessageSize), m_size(0), m_setStart(0), m_setTemplate(0), m_records(0)
+{
+}
+
+void IPFIXMessageBuilder::Put16(unsigned value)
+{
+	m_message[m_size++] = (BYTE)(value >> 8);
+	m_message[m_size++] = (BYTE)value;
+}
+
+void IPFIXMessageBuilder::Put32(unsigned value)
+{
+	Put16(value >> 16);
+	Put16(value & 0xffff);
+}
+
+void IPFIXMessageBuilder::Put64(PUInt64 value)
+{
+	Put32((unsigned)(value >> 32));
+	Put32((unsigned)value);
+}
+
+void IPFIXMessageBuilder::PutAddress(const PIPSocket::Address & addr, bool ipv6)
+{
+	PIPSocket::Address ip = addr;
+	UnmapIPv4Address(ip);
+	if (ipv6 && ip.GetVersion() == 4) {
+		// IPv4-mapped IPv6 address
+		for (unsigned i = 0; i < 10; ++i)
+			Put8(0);
+		Put8(0xff);
+		Put8(0xff);
+	}
+	const unsigned len = (ip.GetVersion() == 6) ? 16 : 4;
+	for (unsigned i = 0; i < len; ++i)
+		Put8(ip[i]);
+}
+
+void IPFIXMessageBuilder::Begin(unsigned exportTime, unsigned sequence, bool withTemplates)
+{
+	m_size = 0;
+	m_setTemplate = 0;
+	m_records = 0;
+	Put16(IPFIXVersion);
+	Put16(0);	// length, set by End()
+	Put32(exportTime);
+	Put32(sequence);
+	Put32(m_observationDomain);
+	if (withTemplates) {
+		m_setStart = m_size;
+		Put16(TemplateSetID);
+		Put16(0);
+		AddTemplate(false);
+		AddTemplate(true);
+		m_setTemplate = TemplateSetID;
+		CloseSet();
+	}
+}
+
+void IPFIXMessageBuilder::AddTemplate(bool ipv6)
+{
+	Put16(ipv6 ? IPv6TemplateID : IPv4TemplateID);
+	Put16(NumFields);
+	for (unsigned i = 0; i < NumFields; ++i) {
+		const TemplateField & field = Fields[i];
+		Put16(FieldID(field, ipv6));
+		Put16(field.m_length ? field.m_length : (ipv6 ? 16 : 4));
+		if (field.m_id & EnterpriseBit)
+			Put32(m_enterpriseNumber);
+	}
+}
+
+void IPFIXMessageBuilder::CloseSet()
+{
+	if (m_setTemplate == 0)
+		return;
+	const unsigned len = m_size - m_setStart;
+	m_message[m_setStart + 2] = (BYTE)(len >> 8);
+	m_message[m_setStart + 3] = (BYTE)len;
+	m_setTemplate = 0;
+}
+
+bool IPFIXMessageBuilder::Add(const IPFIXFlowRecord & record)
+{
+	const bool ipv6 = IsIPv6Record(record);
+	const unsigned templateID = ipv6 ? IPv6TemplateID : IPv4TemplateID;
+	const unsigned needed = RecordSize(ipv6) + ((m_setTemplate != templateID) ? SetHeaderSize : 0);
+	if (m_size + needed > MaxMessageSize)
+		return false;
+	if (m_setTemplate != templateID) {
+		CloseSet();
+		m_setStart = m_size;
+		Put16(templateID);
+		Put16(0);
+		m_setTemplate = templateID;
+	}
+	Put64(record.m_octets);
+	Put64(record.m_packets);
+	Put32(record.m_start);
+	Put32(record.m_end);
+	Put8(ProtocolUDP);
+	Put8(record.m_endReason);
+	PutAddress(record.m_srcIP, ipv6);
+	Put16(record.m_srcPort);
+	PutAddress(record.m_dstIP, ipv6);
+	Put16(record.m_dstPort);
+	PutAddress(record.m_postNATSrcIP, ipv6);
+	Put16(record.m_postNATSrcPort);
+	PutAddress(record.m_postNATDstIP, ipv6);
+	Put16(record.m_postNATDstPort);
+	Put32((unsigned)record.m_callNo);
+	for (unsigned i = 0; i < sizeof(record.m_callID); ++i)
+		Put8(record.m_callID[i]);
+	Put16(record.m_sessionID);
+	++m_records;
+	return true;
+}
+
+void IPFIXMessageBuilder::End()
+{
+	CloseSet();
+	m_message[2] = (BYTE)(m_size >> 8);
+	m_message[3] = (BYTE)m_size;
+}
+
+
+// class IPFIXSender
+IPFIXSender::IPFIXSender()
+	: m_collectorPort(0), m_sequence(0), m_messagesSent(0), m_lastTemplates(0)
+{
+}
+
+bool IPFIXSender::SetCollector(const PString & collector)
+{
+	PIPSocket::Address ip;
+	WORD port = 0;
+	if (!collector.IsEmpty() && !GetTransportAddress(collector, IPFIXDefaultPort, ip, port))
+		return false;
+	if (ip == m_collectorIP && port == m_collectorPort)
+		return true;
+	m_collectorIP = ip;
+	m_collectorPort = port;
+	m_socket.Close();
+	m_lastTemplates = 0;	// a new collector needs the templates
+	if (port != 0) {
+		const PIPSocket::Address any = (ip.GetVersion() == 6) ? PIPSocket::Address("::") : PIPSocket::Address(0, 0, 0, 0);
+		if (!m_socket.Listen(any)) {
+			PTRACE(1, "IPFIX\tError: Can't open the socket for collector " << AsString(ip, port));
+			m_collectorPort = 0;
+			return false;
+		}
+	}
+	return true;
+}
+
+void IPFIXSender::Send(const std::vector<IPFIXFlowRecord> & records, time_t now)
+{
+	if (!HasCollector())
+		return;
+	const bool withTemplates = (now - m_lastTemplates >= TemplateRefresh);
+	if (records.empty() && !withTemplates)
+		return;
+	if (withTemplates)
+		m_lastTemplates = now;
+	m_builder.Begin((unsigned)now, m_sequence, withTemplates);
+	for (std::vector<IPFIXFlowRecord>::const_iterator i = records.begin(); i != records.end(); ++i) {
+		if (!m_builder.Add(*i)) {
+			SendMessage();
+			m_builder.Begin((unsigned)now, m_sequence, false);
+			m_builder.Add(*i);
+		}
+	}
+	SendMessage();
+}
+
+void IPFIXSender::SendMessage()
+{
+	m_builder.End();
+	if (!m_socket.WriteTo(m_builder.GetData(), m_builder.GetSize(), m_collectorIP, m_collectorPort)) {
+		PTRACE(3, "IPFIX\tCan't send to collector " << AsString(m_collectorIP, m_collectorPort)
+			<< ": " << m_socket.GetErrorText(PSocket::LastWriteError));
+	} else {
+		++m_messagesSent;
+	}
+	// the sequence counts the records exported, even if the message got lost
+	m_sequence += m_builder.GetRecordCount();
+}
+
+namespace {
+
+// builds and sends the records once per second
+class IPFIXExportJob : public RegularJob {
+public:
+	IPFIXExportJob() { SetName("IPFIXExporter"); Execute(); }
+
+	virtual void Exec()
+	{
+		IPFIXExporter::Instance()->Export();
+		Wait(1000);
+	}
+};
+
+} // end namespace
+
+// class IPFIXExporter
+IPFIXExporter::IPFIXExporter() : Singleton<IPFIXExporter>("IPFIXExporter"),
+	m_enabled(0), m_activeTimeout(60), m_idleTimeout(15), m_exportStarted(false)
+{
+}
+
+void IPFIXExporter::LoadConfig()
+{
+	PConfig * cfg = GkConfig();
+	PWaitAndSignal lock(m_exportMutex);
+	const PString collector = cfg->GetString(ProxySection, "IPFIXCollector", "");
+	if (!m_sender.SetCollector(collector)) {
+		PTRACE(1, "IPFIX\tError: Invalid IPFIXCollector " << collector);
+		m_sender.SetCollector("");
+	}
+	m_activeTimeout = std::max(cfg->GetInteger(ProxySection, "IPFIXActiveTimeout", 60), 1L);
+	m_idleTimeout = std::max(cfg->GetInteger(ProxySection, "IPFIXIdleTimeout", 15), 1L);
+	m_sender.GetBuilder().SetObservationDomain(cfg->GetInteger(ProxySection, "IPFIXObservationDomain", 0));
+	m_sender.GetBuilder().SetEnterpriseNumber(cfg->GetInteger(ProxySection, "IPFIXEnterpriseNumber", IPFIXMessageBuilder::DefaultEnterpriseNumber));
+	// flows that already count keep their slots until their sockets release them
+	GkAtomicStore(&m_enabled, m_sender.HasCollector() ? 1 : 0);
+	if (m_sender.HasCollector()) {
+		PTRACE(3, "IPFIX\tExporting RTP flows to " << m_sender.GetCollector()
+			<< " active timeout " << m_activeTimeout << "s idle timeout " << m_idleTimeout << 's');
+		if (!m_exportStarted) {
+			new IPFIXExportJob();
+			m_exportStarted = true;
+		}
+	}
+}
+
+void IPFIXExporter::Export()
+{
+	PWaitAndSignal lock(m_exportMutex);
+	const time_t now = time(NULL);
+	m_records.clear();
+	m_flows.Collect(now, m_activeTimeout, m_idleTimeout, m_records);
+	m_sender.Send(m_records, now);
+}
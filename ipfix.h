@@ -0,0 +1,259 @@
+//////////////////////////////////////////////////////////////////
+//
+// ipfix.h
+//
+// Export of the relayed RTP flows as IPFIX records
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef IPFIX_H
+#define IPFIX_H "@(#) $Id$"
+
+#include <vector>
+#include "Toolkit.h"
+#include "h323util.h"
+#include "cfgsnapshot.h"
+
+/// one IPFIX data record: the packets of one direction of a relayed media session
+struct IPFIXFlowRecord {
+	enum EndReason {	// flowEndReason (IE 136)
+		IdleTimeout = 1,
+		ActiveTimeout = 2,
+		EndOfFlow = 3,
+		ForcedEnd = 4
+	};
+
+	PIPSocket::Address m_srcIP;	// the sending endpoint
+	PIPSocket::Address m_dstIP;	// the gatekeeper address the packets arrived at
+	WORD m_srcPort;
+	WORD m_dstPort;
+	PIPSocket::Address m_postNATSrcIP;	// the gatekeeper address the packets were forwarded from
+	PIPSocket::Address m_postNATDstIP;	// the receiving endpoint
+	WORD m_postNATSrcPort;
+	WORD m_postNATDstPort;
+	unsigned m_start;	// time_t of the first packet in the record
+	unsigned m_end;	// time_t of the last packet in the record
+	PUInt64 m_octets;
+	PUInt64 m_packets;
+	BYTE m_endReason;
+	PINDEX m_callNo;
+	BYTE m_callID[16];	// GUID of the call
+	WORD m_sessionID;
+};
+
+/** Packet and byte counters of the relayed flows.
+
+    The relay thread that owns a flow counts its packets with Count()
+    without any lock, every counter has a single writer. The exporter
+    thread calls Collect() to turn the counter changes into records,
+    applying the active and idle timeouts. Released flows keep their
+    slot until their final record has been collected, so a packet that
+    is still in flight is counted for the right flow.
+*/
+class IPFIXFlowTable {
+public:
+	enum { NoSlot = 0xffffffff };
+
+	/// what is known about a flow when it starts
+	struct FlowKey {
+		PIPSocket::Address m_srcIP, m_dstIP, m_postNATSrcIP, m_postNATDstIP;
+		WORD m_srcPort, m_dstPort, m_postNATSrcPort, m_postNATDstPort;
+		PINDEX m_callNo;
+		BYTE m_callID[16];
+		WORD m_sessionID;
+	};
+
+	IPFIXFlowTable();
+	~IPFIXFlowTable();
+
+	/** Start counting a flow
+	    @return	the slot of the flow, NoSlot if the table is full
+	*/
+	unsigned Allocate(const FlowKey & key, time_t now);
+	/// the flow ended, its final record is produced by the next Collect(), NoSlot is ignored
+	void Release(unsigned slot);
+
+	/// count a relayed packet, called by the relay thread of the flow without any lock
+	void Count(unsigned slot, unsigned octets, time_t now)
+	{
+		if (slot == NoSlot)
+			return;
+		Counters & c = m_counters[slot / ChunkSize][slot % ChunkSize];
+		GkAtomicStoreRelaxed(&c.m_packets, c.m_packets + 1);
+		GkAtomicStoreRelaxed(&c.m_octets, c.m_octets + octets);
+		GkAtomicStoreRelaxed(&c.m_lastPacket, (unsigned)now);
+	}
+
+	/** Add a record for every flow that ended, that has been silent for #idleTimeout#
+	    or that wasn't reported for #activeTimeout# seconds, flows without new packets
+	    are skipped unless they ended. Released flows are removed.
+	*/
+	void Collect(time_t now, unsigned activeTimeout, unsigned idleTimeout, std::vector<IPFIXFlowRecord> & records);
+
+	unsigned GetNumFlows() const { PWaitAndSignal lock(m_mutex); return m_numFlows; }
+
+protected:
+	enum {
+		ChunkSize = 4096,
+		MaxChunks = 256
+	};
+
+	struct Counters {
+		volatile unsigned m_packets;	// wrap around, only the differences are used
+		volatile unsigned m_octets;
+		volatile unsigned m_lastPacket;	// time_t
+	};
+
+	struct FlowInfo {
+		FlowKey m_key;
+		bool m_used;
+		bool m_released;
+		unsigned m_packets;	// counter values at the last record
+		unsigned m_octets;
+		unsigned m_start;	// first packet of the current record, 0 if none since the last record
+		unsigned m_lastReport;
+	};
+
+	void AddRecord(FlowInfo & flow, const Counters & c, unsigned packets, unsigned octets, BYTE reason, std::vector<IPFIXFlowRecord> & records);
+
+	Counters * m_counters[MaxChunks];	// allocated on demand, never freed before the table
+	std::vector<FlowInfo> m_flows;	// by slot
+	std::vector<unsigned> m_freeSlots;
+	unsigned m_numFlows;
+	mutable PMutex m_mutex;	// never taken by the relay threads
+
+private:
+	IPFIXFlowTable(const IPFIXFlowTable &);
+	IPFIXFlowTable & operator=(const IPFIXFlowTable &);
+};
+
+/** Builds IPFIX messages (RFC 7011) for the flow records, with one
+    template for IPv4 and one for IPv6 flows. The call of a flow is
+    sent in enterprise specific information elements.
+*/
+class IPFIXMessageBuilder {
+public:
+	enum {
+		MaxMessageSize = 1400,	// stay below the path MTU
+		IPv4TemplateID = 256,
+		IPv6TemplateID = 257,
+		// enterprise specific information elements
+		CallNumberElement = 1,	// unsigned32
+		CallIdentifierElement = 2,	// octetArray, 16 bytes
+		SessionIDElement = 3	// unsigned16
+	};
+
+	IPFIXMessageBuilder(unsigned observationDomain = 0, unsigned enterpriseNumber = DefaultEnterpriseNumber);
+
+	void SetObservationDomain(unsigned domain) { m_observationDomain = domain; }
+	void SetEnterpriseNumber(unsigned number) { m_enterpriseNumber = number; }
+
+	/// start a new message, with the template sets if #withTemplates# is set
+	void Begin(unsigned exportTime, unsigned sequence, bool withTemplates);
+	/// @return	false if the record doesn't fit into the message any more
+	bool Add(const IPFIXFlowRecord & record);
+	/// set the length fields, the message may be sent afterwards
+	void End();
+
+	const BYTE * GetData() const { return &m_message[0]; }
+	unsigned GetSize() const { return m_size; }
+	unsigned GetRecordCount() const { return m_records; }
+
+	static const unsigned DefaultEnterpriseNumber;
+
+protected:
+	void AddTemplate(bool ipv6);
+	void CloseSet();
+	void Put8(BYTE value) { m_message[m_size++] = value; }
+	void Put16(unsigned value);
+	void Put32(unsigned value);
+	void Put64(PUInt64 value);
+	void PutAddress(const PIPSocket::Address & addr, bool ipv6);
+
+	unsigned m_observationDomain;
+	unsigned m_enterpriseNumber;
+	std::vector<BYTE> m_message;
+	unsigned m_size;
+	unsigned m_setStart;	// offset of the open data set
+	unsigned m_setTemplate;	// template of the open data set, 0 if none
+	unsigned m_records;
+};
+
+/** Sends the records to a collector over UDP.
+    The templates are repeated periodically, as required for UDP transport.
+*/
+class IPFIXSender {
+public:
+	IPFIXSender();
+
+	/// @return	false if the collector address is invalid
+	bool SetCollector(const PString & collector);
+	bool HasCollector() const { return m_collectorPort != 0; }
+	PString GetCollector() const { return HasCollector() ? AsString(m_collectorIP, m_collectorPort) : PString::Empty(); }
+	IPFIXMessageBuilder & GetBuilder() { return m_builder; }
+
+	/// send the records in as many messages as needed
+	void Send(const std::vector<IPFIXFlowRecord> & records, time_t now);
+
+	unsigned GetMessagesSent() const { return m_messagesSent; }
+	unsigned GetRecordsSent() const { return m_sequence; }
+
+protected:
+	enum { TemplateRefresh = 60 };	// seconds
+
+	void SendMessage();
+
+	PIPSocket::Address m_collectorIP;
+	WORD m_collectorPort;
+	PUDPSocket m_socket;
+	IPFIXMessageBuilder m_builder;
+	unsigned m_sequence;	// data records sent
+	unsigned m_messagesSent;
+	time_t m_lastTemplates;
+};
+
+/** Per-flow accounting of the relayed RTP and RTCP, exported as IPFIX
+    records to the collector set with [Proxy] IPFIXCollector.
+
+    The UDPProxySocket counts into its flows' slots while it forwards,
+    the export thread builds and sends the records once per second.
+*/
+class IPFIXExporter : public Singleton<IPFIXExporter> {
+public:
+	IPFIXExporter();
+
+	/// read the collector and timeouts from [Proxy], start the export thread if needed
+	void LoadConfig();
+
+	bool IsEnabled() const { return GkAtomicLoad(&m_enabled) != 0; }
+
+	/// @return	the slot for a new flow, NoSlot if the export is disabled
+	unsigned Allocate(const IPFIXFlowTable::FlowKey & key)
+	{
+		return IsEnabled() ? m_flows.Allocate(key, time(NULL)) : (unsigned)IPFIXFlowTable::NoSlot;
+	}
+	void Release(unsigned slot) { m_flows.Release(slot); }
+	void Count(unsigned slot, unsigned octets, time_t now) { m_flows.Count(slot, octets, now); }
+
+	/// build and send the records that are due, called by the export thread
+	void Export();
+
+protected:
+	volatile unsigned m_enabled;
+	IPFIXFlowTable m_flows;
+	IPFIXSender m_sender;
+	unsigned m_activeTimeout;
+	unsigned m_idleTimeout;
+	bool m_exportStarted;
+	std::vector<IPFIXFlowRecord> m_records;
+	mutable PMutex m_exportMutex;	// never taken by the relay threads
+};
+
+#endif // IPFIX_H
@@ -0,0 +1,271 @@
+/*
+ * ipfix.t.cxx
+ *
+ * unit tests for ipfix.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include "ipfix.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class IPFIXTest : public ::testing::Test {
+protected:
+	IPFIXTest()
+	{
+		key.m_srcIP = PIPSocket::Address("10.0.0.1");
+		key.m_srcPort = 5000;
+		key.m_dstIP = PIPSocket::Address("192.168.1.1");
+		key.m_dstPort = 20000;
+		key.m_postNATSrcIP = PIPSocket::Address("192.168.1.1");
+		key.m_postNATSrcPort = 20000;
+		key.m_postNATDstIP = PIPSocket::Address("10.0.0.2");
+		key.m_postNATDstPort = 6000;
+		key.m_callNo = 42;
+		for (unsigned i = 0; i < sizeof(key.m_callID); ++i)
+			key.m_callID[i] = (BYTE)i;
+		key.m_sessionID = 1;
+	}
+
+	static unsigned Get16(const BYTE * p) { return (p[0] << 8) | p[1]; }
+	static unsigned Get32(const BYTE * p) { return (Get16(p) << 16) | Get16(p + 2); }
+	static PUInt64 Get64(const BYTE * p) { return ((PUInt64)Get32(p) << 32) | Get32(p + 4); }
+
+	IPFIXFlowTable::FlowKey key;
+};
+
+
+TEST_F(IPFIXTest, FlowTimeouts) {
+	IPFIXFlowTable table;
+	std::vector<IPFIXFlowRecord> records;
+	const unsigned slot = table.Allocate(key, 1000);
+	ASSERT_NE((unsigned)IPFIXFlowTable::NoSlot, slot);
+	EXPECT_EQ(1u, table.GetNumFlows());
+
+	// nothing to report before the active timeout
+	for (unsigned i = 0; i < 50; ++i)
+		table.Count(slot, 172, 1000 + i / 10);
+	table.Collect(1005, 60, 15, records);
+	EXPECT_TRUE(records.empty());
+
+	// active timeout
+	table.Count(slot, 172, 1060);
+	table.Collect(1060, 60, 15, records);
+	ASSERT_EQ(1u, records.size());
+	EXPECT_EQ(IPFIXFlowRecord::ActiveTimeout, records[0].m_endReason);
+	EXPECT_EQ(51u, records[0].m_packets);
+	EXPECT_EQ(51u * 172, records[0].m_octets);
+	EXPECT_EQ(1000u, records[0].m_start);
+	EXPECT_EQ(1060u, records[0].m_end);
+	EXPECT_TRUE(records[0].m_srcIP == key.m_srcIP);
+	EXPECT_TRUE(records[0].m_postNATDstIP == key.m_postNATDstIP);
+	EXPECT_EQ(42, records[0].m_callNo);
+
+	// idle timeout, only the new packets are reported
+	records.clear();
+	table.Count(slot, 100, 1061);
+	table.Collect(1062, 60, 15, records);
+	EXPECT_TRUE(records.empty());
+	table.Collect(1076, 60, 15, records);
+	ASSERT_EQ(1u, records.size());
+	EXPECT_EQ(IPFIXFlowRecord::IdleTimeout, records[0].m_endReason);
+	EXPECT_EQ(1u, records[0].m_packets);
+	EXPECT_EQ(100u, records[0].m_octets);
+
+	// a silent flow isn't reported again
+	records.clear();
+	table.Collect(1200, 60, 15, records);
+	EXPECT_TRUE(records.empty());
+
+	// the final record is collected after the release, then the slot is free
+	table.Count(slot, 200, 1201);
+	table.Release(slot);
+	table.Count(slot, 200, 1201);	// still in flight
+	table.Collect(1202, 60, 15, records);
+	ASSERT_EQ(1u, records.size());
+	EXPECT_EQ(IPFIXFlowRecord::EndOfFlow, records[0].m_endReason);
+	EXPECT_EQ(2u, records[0].m_packets);
+	EXPECT_EQ(0u, table.GetNumFlows());
+	EXPECT_EQ(slot, table.Allocate(key, 1300));
+}
+
+TEST_F(IPFIXTest, EndOfSilentFlow) {
+	IPFIXFlowTable table;
+	std::vector<IPFIXFlowRecord> records;
+	const unsigned slot = table.Allocate(key, 1000);
+	table.Count(slot, 172, 1000);
+	table.Collect(1020, 60, 15, records);
+	ASSERT_EQ(1u, records.size());
+	EXPECT_EQ(IPFIXFlowRecord::IdleTimeout, records[0].m_endReason);
+
+	// no packets since the last record, the end is reported anyway
+	records.clear();
+	table.Release(slot);
+	table.Collect(1030, 60, 15, records);
+	ASSERT_EQ(1u, records.size());
+	EXPECT_EQ(IPFIXFlowRecord::EndOfFlow, records[0].m_endReason);
+	EXPECT_EQ(0u, records[0].m_packets);
+	EXPECT_EQ(0u, records[0].m_octets);
+	EXPECT_EQ(1000u, records[0].m_end);
+	EXPECT_EQ(0u, table.GetNumFlows());
+}
+
+TEST_F(IPFIXTest, CounterWrap) {
+	IPFIXFlowTable table;
+	std::vector<IPFIXFlowRecord> records;
+	const unsigned slot = table.Allocate(key, 1000);
+	// 3 GB in one round, then another 3 GB: the 32 bit octet counter wraps
+	for (unsigned i = 0; i < 3; ++i)
+		table.Count(slot, 1024 * 1024 * 1024, 1000);
+	table.Collect(1060, 60, 15, records);
+	for (unsigned i = 0; i < 3; ++i)
+		table.Count(slot, 1024 * 1024 * 1024, 1100);
+	table.Collect(1120, 60, 15, records);
+	ASSERT_EQ(2u, records.size());
+	EXPECT_EQ(PUInt64(3) * 1024 * 1024 * 1024, records[0].m_octets);
+	EXPECT_EQ(PUInt64(3) * 1024 * 1024 * 1024, records[1].m_octets);
+}
+
+TEST_F(IPFIXTest, Message) {
+	IPFIXMessageBuilder builder(7, 32473);
+	IPFIXFlowRecord record;
+	record.m_srcIP = key.m_srcIP;
+	record.m_srcPort = key.m_srcPort;
+	record.m_dstIP = key.m_dstIP;
+	record.m_dstPort = key.m_dstPort;
+	record.m_postNATSrcIP = key.m_postNATSrcIP;
+	record.m_postNATSrcPort = key.m_postNATSrcPort;
+	record.m_postNATDstIP = key.m_postNATDstIP;
+	record.m_postNATDstPort = key.m_postNATDstPort;
+	record.m_start = 1000;
+	record.m_end = 1060;
+	record.m_packets = 3000;
+	record.m_octets = 516000;
+	record.m_endReason = IPFIXFlowRecord::ActiveTimeout;
+	record.m_callNo = key.m_callNo;
+	memcpy(record.m_callID, key.m_callID, sizeof(record.m_callID));
+	record.m_sessionID = key.m_sessionID;
+
+	builder.Begin(2000, 5, true);
+	EXPECT_TRUE(builder.Add(record));
+	builder.End();
+	const BYTE * msg = builder.GetData();
+	const unsigned size = builder.GetSize();
+	ASSERT_GE(size, 16u);
+	EXPECT_EQ(10u, Get16(msg));
+	EXPECT_EQ(size, Get16(msg + 2));
+	EXPECT_EQ(2000u, Get32(msg + 4));
+	EXPECT_EQ(5u, Get32(msg + 8));
+	EXPECT_EQ(7u, Get32(msg + 12));
+
+	// template set with the IPv4 and IPv6 templates, then one data set
+	const BYTE * set = msg + 16;
+	EXPECT_EQ(2u, Get16(set));
+	const unsigned templateLen = Get16(set + 2);
+	EXPECT_EQ(256u, Get16(set + 4));
+	EXPECT_EQ(17u, Get16(set + 6));
+	const BYTE * data = set + templateLen;
+	ASSERT_LE((unsigned)(data - msg) + 4, size);
+	EXPECT_EQ(256u, Get16(data));
+	EXPECT_EQ(4u + 72u, Get16(data + 2));
+	EXPECT_EQ(size, (unsigned)(data - msg) + Get16(data + 2));
+	const BYTE * r = data + 4;
+	EXPECT_EQ(516000u, Get64(r));
+	EXPECT_EQ(3000u, Get64(r + 8));
+	EXPECT_EQ(1000u, Get32(r + 16));
+	EXPECT_EQ(1060u, Get32(r + 20));
+	EXPECT_EQ(17u, r[24]);
+	EXPECT_EQ((unsigned)IPFIXFlowRecord::ActiveTimeout, r[25]);
+	EXPECT_EQ(10u, r[26]);	// 10.0.0.1
+	EXPECT_EQ(1u, r[29]);
+	EXPECT_EQ(5000u, Get16(r + 30));
+	EXPECT_EQ(6000u, Get16(r + 48));
+	EXPECT_EQ(42u, Get32(r + 50));
+	EXPECT_EQ(0, memcmp(r + 54, key.m_callID, 16));
+	EXPECT_EQ(1u, Get16(r + 70));
+
+	// an IPv6 leg switches to the IPv6 template with mapped IPv4 addresses
+	record.m_postNATDstIP = PIPSocket::Address("2001:db8::1");
+	builder.Begin(2000, 6, false);
+	EXPECT_TRUE(builder.Add(record));
+	builder.End();
+	EXPECT_EQ(16u + 4 + 120, builder.GetSize());
+	EXPECT_EQ(257u, Get16(builder.GetData() + 16));
+	EXPECT_EQ(0xffffu, Get16(builder.GetData() + 20 + 26 + 10));
+
+	// the message is full below the MTU
+	builder.Begin(2000, 7, false);
+	unsigned added = 0;
+	while (builder.Add(record))
+		++added;
+	builder.End();
+	EXPECT_EQ(added, builder.GetRecordCount());
+	EXPECT_LE(builder.GetSize(), (unsigned)IPFIXMessageBuilder::MaxMessageSize);
+	EXPECT_EQ((IPFIXMessageBuilder::MaxMessageSize - 16 - 4) / 120, (int)added);
+}
+
+TEST_F(IPFIXTest, Collector) {
+	PUDPSocket collector;
+	ASSERT_TRUE(collector.Listen(PIPSocket::Address("127.0.0.1")));
+	collector.SetReadTimeout(1000);
+
+	IPFIXSender sender;
+	ASSERT_TRUE(sender.SetCollector("127.0.0.1:" + PString(collector.GetPort())));
+
+	IPFIXFlowTable table;
+	std::vector<IPFIXFlowRecord> records;
+	const unsigned numFlows = 50;
+	for (unsigned i = 0; i < numFlows; ++i) {
+		key.m_srcPort = (WORD)(5000 + i);
+		const unsigned slot = table.Allocate(key, 1000);
+		table.Count(slot, 172, 1000);
+		table.Release(slot);
+	}
+	table.Collect(1001, 60, 15, records);
+	ASSERT_EQ(numFlows, records.size());
+	sender.Send(records, 1001);
+	EXPECT_EQ(numFlows, sender.GetRecordsSent());
+
+	// the first message has the templates, the records are split to stay below the MTU
+	BYTE buffer[2048];
+	unsigned received = 0, messages = 0;
+	unsigned sequence = 0;
+	while (received < numFlows && collector.Read(buffer, sizeof(buffer))) {
+		const unsigned len = collector.GetLastReadCount();
+		ASSERT_GE(len, 16u);
+		EXPECT_EQ(10u, Get16(buffer));
+		EXPECT_EQ(len, Get16(buffer + 2));
+		EXPECT_EQ(sequence, Get32(buffer + 8));
+		unsigned pos = 16;
+		unsigned inMessage = 0;
+		while (pos + 4 <= len) {
+			const unsigned setID = Get16(buffer + pos);
+			const unsigned setLen = Get16(buffer + pos + 2);
+			ASSERT_GE(setLen, 4u);
+			if (messages == 0 && pos == 16) {
+				EXPECT_EQ(2u, setID);
+			}
+			if (setID == 256)
+				inMessage += (setLen - 4) / 72;
+			pos += setLen;
+		}
+		EXPECT_EQ(len, pos);
+		received += inMessage;
+		sequence += inMessage;
+		++messages;
+	}
+	EXPECT_EQ(numFlows, received);
+	EXPECT_GT(messages, 1u);
+	EXPECT_EQ(messages, sender.GetMessagesSent());
+}
+
+} // namespace
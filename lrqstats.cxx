@@ -0,0 +1,161 @@
+//////////////////////////////////////////////////////////////////
+//
+// lrqstats.cxx
+//
+// Round trip times and losses of the LRQs sent to a neighbor,
+// used to wait only as long as the neighbors usually need
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "config.h"
+#include <ptlib.h>
+#include "lrqstats.h"
+
+namespace {
+
+const unsigned MaxBackoff = 8;	// the timeout is still limited by NeighborTimeout
+
+} // end namespace
+
+
+LRQStatistics::LRQStatistics()
+	: m_adaptive(false), m_minTimeout(100), m_lossThreshold(3), m_lossHoldoff(30),
+	m_srtt(-1), m_rttvar(0), m_lossRate(0), m_lostInRow(0), m_backoff(1)
+{
+}
+
+void LRQStatistics::SetLimits(bool adaptive, int minTimeout, unsigned lossThreshold, unsigned lossHoldoff)
+{
+	PWaitAndSignal lock(m_mutex);
+	m_adaptive = adaptive;
+	m_minTimeout = minTimeout;
+	m_lossThreshold = lossThreshold;
+	m_lossHoldoff = lossHoldoff;
+}
+
+void LRQStatistics::OnAnswer(const PTimeInterval & rtt)
+{
+	const int r = (int)rtt.GetMilliSeconds();
+	PWaitAndSignal lock(m_mutex);
+	if (m_srtt < 0) {
+		m_srtt = r;
+		m_rttvar = r / 2;
+	} else {
+		// RFC 6298 with alpha = 1/8 and beta = 1/4
+		m_rttvar = (3 * m_rttvar + ((m_srtt > r) ? m_srtt - r : r - m_srtt)) / 4;
+		m_srtt = (7 * m_srtt + r) / 8;
+	}
+	m_lossRate -= m_lossRate / 8;
+	m_lostInRow = 0;
+	m_backoff = 1;
+}
+
+void LRQStatistics::OnUnmatchedAnswer()
+{
+	PWaitAndSignal lock(m_mutex);
+	// the neighbor is there, but the timeout stays backed off until a sample shows its round trip time
+	m_lossRate -= m_lossRate / 8;
+	m_lostInRow = 0;
+}
+
+void LRQStatistics::OnLoss()
+{
+	PWaitAndSignal lock(m_mutex);
+	m_lossRate += (1000 - m_lossRate) / 8;
+	++m_lostInRow;
+	if (m_backoff < MaxBackoff)
+		m_backoff *= 2;
+	m_lastLoss = PTime();
+}
+
+int LRQStatistics::GetTimeout(int timeout) const
+{
+	PWaitAndSignal lock(m_mutex);
+	if (!m_adaptive || m_srtt < 0)
+		return timeout;
+	int rto = m_srtt + 4 * m_rttvar;
+	if (rto < m_minTimeout)
+		rto = m_minTimeout;
+	rto *= m_backoff;
+	return (rto < timeout) ? rto : timeout;
+}
+
+bool LRQStatistics::IsLossy() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_adaptive && m_lossThreshold > 0 && m_lostInRow >= m_lossThreshold
+		&& (PTime() - m_lastLoss).GetSeconds() < (PInt64)m_lossHoldoff;
+}
+
+int LRQStatistics::GetSmoothedRTT() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return m_srtt;
+}
+
+unsigned LRQStatistics::GetLossRate() const
+{
+	PWaitAndSignal lock(m_mutex);
+	return (m_lossRate + 5) / 10;
+}
+
+PString LRQStatistics::AsString() const
+{
+	PWaitAndSignal lock(m_mutex);
+	PStringStream strm;
+	if (m_srtt < 0)
+		strm << "srtt=- ";
+	else
+		strm << "srtt=" << m_srtt << "ms rttvar=" << m_rttvar << "ms ";
+	strm << "loss=" << (m_lossRate + 5) / 10 << "% lost in a row=" << m_lostInRow;
+	if (m_backoff > 1)
+		strm << " backoff=" << m_backoff;
+	return strm;
+}
+
+
+// class LRQMeasurement
+void LRQMeasurement::OnSent()
+{
+	m_sent = PTime();
+	++m_transmissions;
+	m_measured = false;
+}
+
+void LRQMeasurement::SetTimeout(int timeout)
+{
+	m_timeout = m_stats->GetTimeout(timeout);
+}
+
+void LRQMeasurement::ExtendTimeout(int delay)
+{
+	if (delay > m_timeout)
+		m_timeout = delay;
+}
+
+void LRQMeasurement::OnAnswer()
+{
+	if (m_measured)
+		return;
+	m_measured = true;
+	if (m_transmissions == 1)
+		m_stats->OnAnswer(PTime() - m_sent);
+	else
+		m_stats->OnUnmatchedAnswer();
+}
+
+bool LRQMeasurement::CheckLoss()
+{
+	if (m_measured || (PTime() - m_sent).GetMilliSeconds() < m_timeout)
+		return false;
+	m_measured = true;
+	m_stats->OnLoss();
+	return true;
+}
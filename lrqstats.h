@@ -0,0 +1,125 @@
+//////////////////////////////////////////////////////////////////
+//
+// lrqstats.h
+//
+// Round trip times and losses of the LRQs sent to a neighbor,
+// used to wait only as long as the neighbors usually need
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef LRQSTATS_H
+#define LRQSTATS_H "@(#) $Id$"
+
+#include <ptlib.h>
+
+/** Round trip times and losses of the LRQs to one neighbor. The timeout
+    for the next LRQ is derived from the smoothed round trip time and its
+    variation as in RFC 6298 and doubled after each loss until there is a
+    new sample. A neighbor that didn't answer the last LRQs is skipped
+    until a holdoff time has passed. Thread safe.
+*/
+class LRQStatistics {
+public:
+	LRQStatistics();
+
+	/** @param adaptive	false keeps the configured timeout and never skips the neighbor
+	    @param minTimeout	lower bound of the adaptive timeout in ms
+	    @param lossThreshold	number of lost LRQs in a row to skip the neighbor, 0 never skips it
+	    @param lossHoldoff	seconds after the last loss the neighbor is skipped
+	*/
+	void SetLimits(bool adaptive, int minTimeout, unsigned lossThreshold, unsigned lossHoldoff);
+
+	/// an answer (LCF, LRJ or RIP) to an LRQ that was sent once
+	void OnAnswer(const PTimeInterval & rtt);
+	/// an answer to an LRQ that was sent again, which isn't a round trip sample
+	void OnUnmatchedAnswer();
+	/// no answer within the timeout
+	void OnLoss();
+
+	/// @return	the timeout in ms for the next LRQ, at most #timeout#, which is also used until there are samples
+	int GetTimeout(int timeout) const;
+	/// @return	true if the last LRQs were lost and the holdoff hasn't passed yet
+	bool IsLossy() const;
+
+	/// @return	the smoothed round trip time in ms, -1 if there are no samples
+	int GetSmoothedRTT() const;
+	/// @return	the smoothed share of lost LRQs in percent
+	unsigned GetLossRate() const;
+
+	PString AsString() const;
+
+protected:
+	bool m_adaptive;
+	int m_minTimeout;
+	unsigned m_lossThreshold;
+	unsigned m_lossHoldoff;
+	int m_srtt;	// ms, -1 if no samples
+	int m_rttvar;
+	unsigned m_lossRate;	// 1/1000
+	unsigned m_lostInRow;
+	unsigned m_backoff;	// factor of the timeout since the last sample
+	PTime m_lastLoss;
+	mutable PMutex m_mutex;
+};
+
+/** The LRQ of a request to one neighbor. An LRQ without answer is sent
+    again with the same sequence number, so an answer after that can't be
+    told apart from a late answer to the first one: as in Karn's algorithm,
+    only answers to LRQs that were sent once are round trip samples.
+    Used by LRQRequester with its lock held.
+*/
+class LRQMeasurement {
+public:
+	LRQMeasurement(LRQStatistics & stats) : m_stats(&stats), m_transmissions(0), m_timeout(0), m_measured(false) { }
+
+	/// the LRQ was sent, again if it was sent before
+	void OnSent();
+	/// wait at most #timeout# ms after the last transmission, less if the neighbor is usually faster
+	void SetTimeout(int timeout);
+	/// the neighbor asked to wait #delay# ms (RIP)
+	void ExtendTimeout(int delay);
+	/// @return	the timeout in ms after the last transmission
+	int GetTimeout() const { return m_timeout; }
+
+	/// an answer from the neighbor, only the first one of each transmission is counted
+	void OnAnswer();
+	/** count a loss if the last transmission wasn't answered within the timeout
+	    @return	true if it was counted
+	*/
+	bool CheckLoss();
+
+protected:
+	LRQStatistics * m_stats;
+	PTime m_sent;	// the last transmission
+	unsigned m_transmissions;
+	int m_timeout;
+	bool m_measured;	// the answer or loss of the last transmission is in the statistics
+};
+
+/** How long to wait for the answers to LRQs that were sent to several
+    neighbors at the same time. #first# to #last# iterate over the
+    requests in priority order, the #second# of each has the
+    LRQMeasurement #m_lrq# of its neighbor and #m_reply#, which is set
+    when the neighbor confirmed. Only the neighbors before the first confirmation
+    could give a better answer, so the others aren't waited for.
+
+    @return	the time in ms after the LRQs were sent, 0 if the best possible answer is there
+*/
+template <class Iterator>
+int GetLRQRoundTimeout(Iterator first, Iterator last)
+{
+	int timeout = 0;
+	for (; first != last && !first->second.m_reply; ++first)
+		if (first->second.m_lrq.GetTimeout() > timeout)
+			timeout = first->second.m_lrq.GetTimeout();
+	return timeout;
+}
+
+#endif // LRQSTATS_H
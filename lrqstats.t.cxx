@@ -0,0 +1,308 @@
+/*
+ * lrqstats.t.cxx
+ *
+ * unit tests for lrqstats.cxx
+ *
+ * Copyright (c) 2021, Jan Willamowius
+ *
+ * This work is published under the GNU Public License version 2 (GPLv2)
+ * see file COPYING for details.
+ * We also explicitly grant the right to link this code
+ * with the OpenH323/H323Plus and OpenSSL library.
+ *
+ */
+
+#include "config.h"
+#include "lrqstats.h"
+#include "gtest/gtest.h"
+#include <map>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+// a neighbor on the loopback interface that answers each LRQ after a delay
+class StubNeighbor : public PThread {
+	PCLASSINFO(StubNeighbor, PThread)
+public:
+	/// @param drop	0 answers every LRQ, 1 none, 2 every other one
+	StubNeighbor(unsigned delay, unsigned drop)
+		: PThread(10000, NoAutoDeleteThread), m_delay(delay), m_drop(drop), m_received(0), m_running(true)
+	{
+		m_socket.Listen(PIPSocket::Address("127.0.0.1"), 0, 0);
+		m_socket.SetReadTimeout(20);
+		Resume();
+	}
+
+	~StubNeighbor()
+	{
+		m_running = false;
+		WaitForTermination();
+	}
+
+	WORD GetPort() const { return m_socket.GetPort(); }
+
+	virtual void Main()
+	{
+		while (m_running) {
+			BYTE seq[2];
+			PIPSocket::Address ip;
+			WORD port;
+			if (!m_socket.ReadFrom(seq, sizeof(seq), ip, port))
+				continue;
+			++m_received;
+			if (m_drop == 1 || (m_drop == 2 && m_received % 2 == 0))
+				continue;
+			PThread::Sleep(m_delay);
+			m_socket.WriteTo(seq, sizeof(seq), ip, port);
+		}
+	}
+
+protected:
+	PUDPSocket m_socket;
+	unsigned m_delay;	// ms
+	unsigned m_drop;
+	unsigned m_received;
+	volatile bool m_running;
+};
+
+class LRQStatisticsTest : public ::testing::Test {
+protected:
+	LRQStatisticsTest() : m_seq(0)
+	{
+		m_socket.Listen(PIPSocket::Address("127.0.0.1"), 0, 0);
+	}
+
+	~LRQStatisticsTest()
+	{
+		for (unsigned i = 0; i < m_neighbors.size(); ++i)
+			delete m_neighbors[i];
+	}
+
+	struct Request {
+		Request(LRQStatistics & stats) : m_reply(false), m_lrq(stats) { }
+		bool m_reply;
+		LRQMeasurement m_lrq;
+	};
+
+	/** One call: an LRQ to every neighbor that isn't skipped, with the
+	    neighbor's position as priority. The answers and timeouts go to the
+	    LRQMeasurement of each request in the order LRQRequester::Process()
+	    and OnTimeout() pass them, the LRQs are sent again with the same
+	    sequence number if no neighbor answered within the round timeout.
+	    @return	the neighbor with the best answer, -1 if none
+	*/
+	int Call(std::vector<LRQStatistics> & stats, int timeout, unsigned retries = 0)
+	{
+		const BYTE seq[2] = { (BYTE)(++m_seq >> 8), (BYTE)m_seq };
+		typedef std::multimap<int, Request> Queue;
+		Queue requests;
+		for (unsigned i = 0; i < m_neighbors.size(); ++i) {
+			if (stats[i].IsLossy())
+				continue;
+			Send(seq, i);
+			requests.insert(std::make_pair((int)i, Request(stats[i])))->second.m_lrq.OnSent();
+		}
+		for (Queue::iterator r = requests.begin(); r != requests.end(); ++r)
+			r->second.m_lrq.SetTimeout(timeout);
+
+		PTime roundStart;
+		for (;;) {
+			const int wait = GetLRQRoundTimeout(requests.begin(), requests.end());
+			if (wait == 0)
+				break;	// the best answer is there
+			const PInt64 elapsed = (PTime() - roundStart).GetMilliSeconds();
+			if (wait > elapsed) {
+				m_socket.SetReadTimeout((int)(wait - elapsed));
+				BYTE reply[2];
+				PIPSocket::Address ip;
+				WORD port;
+				if (!m_socket.ReadFrom(reply, sizeof(reply), ip, port) || reply[0] != seq[0] || reply[1] != seq[1])
+					continue;	// a timeout or a late answer to an earlier call
+				for (Queue::iterator r = requests.begin(); r != requests.end(); ++r)
+					if (m_neighbors[r->first]->GetPort() == port) {
+						r->second.m_reply = true;
+						r->second.m_lrq.OnAnswer();
+					}
+				continue;
+			}
+			bool answered = false;
+			for (Queue::iterator r = requests.begin(); r != requests.end(); ++r) {
+				r->second.m_lrq.CheckLoss();
+				answered = answered || r->second.m_reply;
+			}
+			if (answered || retries-- == 0)
+				break;
+			for (Queue::iterator r = requests.begin(); r != requests.end(); ++r) {
+				Send(seq, r->first);
+				r->second.m_lrq.OnSent();
+				r->second.m_lrq.SetTimeout(timeout);
+			}
+			roundStart = PTime();
+		}
+
+		for (Queue::iterator r = requests.begin(); r != requests.end(); ++r)
+			if (r->second.m_reply)
+				return r->first;
+		return -1;
+	}
+
+	void Send(const BYTE * seq, unsigned neighbor)
+	{
+		m_socket.WriteTo(seq, 2, PIPSocket::Address("127.0.0.1"), m_neighbors[neighbor]->GetPort());
+	}
+
+	PUDPSocket m_socket;
+	WORD m_seq;
+	std::vector<StubNeighbor *> m_neighbors;
+};
+
+
+TEST_F(LRQStatisticsTest, AdaptiveTimeout) {
+	LRQStatistics stats;
+	stats.SetLimits(true, 50, 3, 30);
+	EXPECT_EQ(500, stats.GetTimeout(500));
+	EXPECT_EQ(-1, stats.GetSmoothedRTT());
+	for (unsigned i = 0; i < 20; ++i)
+		stats.OnAnswer(PTimeInterval(20));
+	EXPECT_EQ(20, stats.GetSmoothedRTT());
+	EXPECT_EQ(50, stats.GetTimeout(500));	// the minimum
+	stats.OnAnswer(PTimeInterval(200));
+	EXPECT_GT(stats.GetTimeout(500), 100);
+	EXPECT_LE(stats.GetTimeout(500), 500);
+	EXPECT_EQ(80, stats.GetTimeout(80));
+
+	stats.SetLimits(false, 50, 3, 30);
+	EXPECT_EQ(500, stats.GetTimeout(500));
+}
+
+TEST_F(LRQStatisticsTest, Backoff) {
+	LRQStatistics stats;
+	stats.SetLimits(true, 50, 0, 30);
+	for (unsigned i = 0; i < 20; ++i)
+		stats.OnAnswer(PTimeInterval(20));
+	EXPECT_EQ(50, stats.GetTimeout(1000));
+	stats.OnLoss();
+	EXPECT_EQ(100, stats.GetTimeout(1000));
+	stats.OnLoss();
+	EXPECT_EQ(200, stats.GetTimeout(1000));
+	EXPECT_EQ(150, stats.GetTimeout(150));
+	// an answer to a repeated LRQ doesn't end the backoff
+	stats.OnUnmatchedAnswer();
+	EXPECT_EQ(200, stats.GetTimeout(1000));
+	for (unsigned i = 0; i < 10; ++i)
+		stats.OnLoss();
+	EXPECT_EQ(400, stats.GetTimeout(1000));
+	stats.OnAnswer(PTimeInterval(20));
+	EXPECT_EQ(50, stats.GetTimeout(1000));
+}
+
+TEST_F(LRQStatisticsTest, Measurement) {
+	LRQStatistics stats;
+	stats.SetLimits(true, 50, 3, 30);
+	LRQMeasurement lrq(stats);
+	lrq.OnSent();
+	lrq.SetTimeout(500);
+	EXPECT_EQ(500, lrq.GetTimeout());
+	lrq.ExtendTimeout(800);
+	EXPECT_EQ(800, lrq.GetTimeout());
+	EXPECT_FALSE(lrq.CheckLoss());
+	lrq.OnAnswer();
+	EXPECT_GE(stats.GetSmoothedRTT(), 0);
+	EXPECT_LT(stats.GetSmoothedRTT(), 500);
+
+	// the answer could belong to either LRQ, so it's no sample
+	LRQStatistics retransmitted;
+	retransmitted.SetLimits(true, 50, 3, 30);
+	LRQMeasurement lost(retransmitted);
+	lost.OnSent();
+	lost.SetTimeout(0);
+	EXPECT_TRUE(lost.CheckLoss());
+	EXPECT_FALSE(lost.CheckLoss());
+	lost.OnSent();
+	lost.SetTimeout(500);
+	lost.OnAnswer();
+	lost.OnAnswer();
+	EXPECT_EQ(-1, retransmitted.GetSmoothedRTT());
+	EXPECT_TRUE(retransmitted.AsString().Find("lost in a row=0") != P_MAX_INDEX);
+	EXPECT_FALSE(lost.CheckLoss());
+}
+
+TEST_F(LRQStatisticsTest, Loss) {
+	LRQStatistics stats;
+	stats.SetLimits(true, 50, 3, 30);
+	stats.OnLoss();
+	stats.OnLoss();
+	EXPECT_FALSE(stats.IsLossy());
+	stats.OnLoss();
+	EXPECT_TRUE(stats.IsLossy());
+	EXPECT_GT(stats.GetLossRate(), 20u);
+	stats.OnAnswer(PTimeInterval(10));
+	EXPECT_FALSE(stats.IsLossy());
+
+	stats.SetLimits(true, 50, 0, 30);
+	for (unsigned i = 0; i < 10; ++i)
+		stats.OnLoss();
+	EXPECT_FALSE(stats.IsLossy());
+	stats.SetLimits(false, 50, 3, 30);
+	EXPECT_FALSE(stats.IsLossy());
+}
+
+TEST_F(LRQStatisticsTest, RoundTimeout) {
+	LRQStatistics stats;
+	std::multimap<int, Request> requests;
+	EXPECT_EQ(0, GetLRQRoundTimeout(requests.begin(), requests.end()));
+	requests.insert(std::make_pair(1, Request(stats)))->second.m_lrq.SetTimeout(300);
+	requests.insert(std::make_pair(2, Request(stats)))->second.m_lrq.SetTimeout(100);
+	Request & last = requests.insert(std::make_pair(3, Request(stats)))->second;
+	last.m_lrq.SetTimeout(500);
+	EXPECT_EQ(500, GetLRQRoundTimeout(requests.begin(), requests.end()));
+	// only the neighbors that could beat a confirmation count
+	last.m_reply = true;
+	EXPECT_EQ(300, GetLRQRoundTimeout(requests.begin(), requests.end()));
+	requests.begin()->second.m_reply = true;
+	EXPECT_EQ(0, GetLRQRoundTimeout(requests.begin(), requests.end()));
+}
+
+TEST_F(LRQStatisticsTest, Neighbors) {
+	// in priority order: a dead neighbor, one that loses every other LRQ, two slower ones and another dead one
+	m_neighbors.push_back(new StubNeighbor(0, 1));
+	m_neighbors.push_back(new StubNeighbor(5, 2));
+	m_neighbors.push_back(new StubNeighbor(20, 0));
+	m_neighbors.push_back(new StubNeighbor(10, 0));
+	m_neighbors.push_back(new StubNeighbor(0, 1));
+	const int timeout = 200;
+	const unsigned calls = 10;
+
+	PTimeInterval times[2];
+	for (int adaptive = 0; adaptive < 2; ++adaptive) {
+		std::vector<LRQStatistics> stats(m_neighbors.size());
+		for (unsigned i = 0; i < stats.size(); ++i)
+			stats[i].SetLimits(adaptive != 0, 60, 3, 30);
+		const PTime start;
+		for (unsigned n = 0; n < calls; ++n) {
+			const int best = Call(stats, timeout);
+			// the same answer as when waiting for all neighbors
+			EXPECT_TRUE(best == 1 || best == 2) << n;
+		}
+		times[adaptive] = PTime() - start;
+		EXPECT_EQ(adaptive != 0, stats[0].IsLossy());
+		EXPECT_EQ(adaptive != 0, stats[4].IsLossy());
+		EXPECT_FALSE(stats[1].IsLossy());
+		EXPECT_LT(stats[1].GetSmoothedRTT(), timeout);
+	}
+
+	std::cout << "[          ] " << calls << " calls to " << m_neighbors.size() << " neighbors: fixed timeout "
+		<< times[0].GetMilliSeconds() << " ms, adaptive " << times[1].GetMilliSeconds() << " ms" << std::endl;
+}
+
+TEST_F(LRQStatisticsTest, Retransmission) {
+	// each answer comes after the LRQ was sent again
+	m_neighbors.push_back(new StubNeighbor(80, 0));
+	std::vector<LRQStatistics> stats(1);
+	stats[0].SetLimits(true, 10, 0, 30);
+	Call(stats, 50, 2);
+	EXPECT_EQ(-1, stats[0].GetSmoothedRTT());
+}
+
+}  // namespace
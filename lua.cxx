@@ -247,6 +247,7 @@ void LuaPolicy::LoadConfig(const PString & instance)
 		return;
 	}
 
+	LoadCacheConfig();
 	m_active = true;
 }
 
@@ -0,0 +1,151 @@
+//////////////////////////////////////////////////////////////////
+//
+// prefixtrie.h
+//
+// Trie of alias prefixes with the wildcards of MatchPrefix()
+//
+// Copyright (c) 2021, Jan Willamowius
+//
+// This work is published under the GNU Public License version 2 (GPLv2)
+// see file COPYING for details.
+// We also explicitly grant the right to link this code
+// with the OpenH323/H323Plus and OpenSSL library.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef PREFIXTRIE_H
+#define PREFIXTRIE_H "@(#) $Id$"
+
+#include <map>
+#include "stl_supp.h"
+
+/** Prefixes in the syntax of MatchPrefix(): '.' and '%' match any
+    character, a leading '!' makes it a negative match. The prefixes are
+    added once when the configuration is loaded, a lookup walks the alias
+    once and only branches at the wildcards, instead of trying every prefix.
+    Not thread safe, rebuild it under the lock that protects the config.
+*/
+template <class T>
+class PrefixTrie {
+public:
+	PrefixTrie() : m_root(new Node), m_negative(new Node), m_size(0) { }
+	~PrefixTrie() { delete m_root; delete m_negative; }
+
+	void Clear()
+	{
+		delete m_root;
+		delete m_negative;
+		m_root = new Node;
+		m_negative = new Node;
+		m_size = 0;
+	}
+
+	/// @return	false if the prefix is already there, the old value is kept
+	bool Insert(const PString & prefix, const T & value)
+	{
+		const bool negative = (prefix[0] == '!');
+		Node * node = negative ? m_negative : m_root;
+		for (const char * c = (const char *)prefix + (negative ? 1 : 0); *c != 0; ++c) {
+			Node * & child = node->m_children[*c];
+			if (child == NULL)
+				child = new Node;
+			node = child;
+		}
+		if (node->m_terminal)
+			return false;
+		node->m_terminal = true;
+		node->m_prefix = prefix;
+		node->m_value = value;
+		++m_size;
+		return true;
+	}
+
+	/** Call #visitor(prefix, value, matchLength)# for every prefix that
+	    matches the alias, in no particular order. #matchLength# is the
+	    result of MatchPrefix(), negative for a '!' prefix.
+	*/
+	template <class Visitor>
+	void Match(const char * alias, Visitor & visitor) const
+	{
+		if (alias == NULL)
+			return;
+		Match(m_root, alias, 0, false, visitor);
+		Match(m_negative, alias, 0, true, visitor);
+	}
+
+	/** Find the longest match, of equally long matches the greatest prefix,
+	    like a reverse walk over a map sorted by pstr_prefix_lesser.
+	    @param negative	also take '!' prefixes, as a test for MatchPrefix() != 0 does
+	    @return	false if no prefix matches
+	*/
+	bool FindLongest(const char * alias, T & value, bool negative = false) const
+	{
+		LongestMatch longest;
+		if (alias != NULL) {
+			Match(m_root, alias, 0, false, longest);
+			if (negative)
+				Match(m_negative, alias, 0, true, longest);
+		}
+		if (longest.m_value == NULL)
+			return false;
+		value = *longest.m_value;
+		return true;
+	}
+
+	unsigned GetSize() const { return m_size; }
+
+private:
+	PrefixTrie(const PrefixTrie &);
+	PrefixTrie & operator=(const PrefixTrie &);
+
+	struct Node {
+		Node() : m_terminal(false), m_value() { }
+		~Node() { DeleteObjectsInMap(m_children); }
+
+		std::map<char, Node *> m_children;
+		bool m_terminal;
+		PString m_prefix;
+		T m_value;
+	};
+
+	template <class Visitor>
+	static void Match(const Node * node, const char * alias, int depth, bool negative, Visitor & visitor)
+	{
+		// an empty prefix or a single '!' doesn't match anything
+		if (node->m_terminal && depth > 0)
+			visitor(node->m_prefix, node->m_value, negative ? -depth : depth);
+		if (*alias == 0 || node->m_children.empty())
+			return;
+		typename std::map<char, Node *>::const_iterator child;
+		if (*alias != '.' && *alias != '%') {
+			child = node->m_children.find(*alias);
+			if (child != node->m_children.end())
+				Match(child->second, alias + 1, depth + 1, negative, visitor);
+		}
+		child = node->m_children.find('.');
+		if (child != node->m_children.end())
+			Match(child->second, alias + 1, depth + 1, negative, visitor);
+		child = node->m_children.find('%');
+		if (child != node->m_children.end())
+			Match(child->second, alias + 1, depth + 1, negative, visitor);
+	}
+
+	struct LongestMatch {
+		LongestMatch() : m_prefix(NULL), m_value(NULL) { }
+		void operator()(const PString & prefix, const T & value, int)
+		{
+			if (m_prefix == NULL || pstr_prefix_lesser()(*m_prefix, prefix)) {
+				m_prefix = &prefix;
+				m_value = &value;
+			}
+		}
+		const PString * m_prefix;
+		const T * m_value;
+	};
+
+	Node * m_root;
+	Node * m_negative;	// the '!' prefixes, without the '!'
+	unsigned m_size;
+};
+
+#endif // PREFIXTRIE_H